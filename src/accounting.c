@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "accounting.h"
+#include "log.h"
+
+#include <string.h>
+
+// keys of the counters, after the prefix
+static const char *gbAccountingStatNames[GB_ACCOUNTING_STATS] = {
+	"items", "bytes", "hits", "misses", "evicted", "expired"
+};
+
+int gbAccountingCreate( gbServer *server, const char *prefixes ){
+	gbAccounting *accounting = zcalloc( sizeof(gbAccounting) );
+	gbAccountedPrefix *prefix = NULL;
+	const char *p = prefixes, *end = NULL;
+	size_t len;
+	int i;
+
+	server->accounting = accounting;
+
+	if( prefixes == NULL )
+		return GB_OK;
+
+	accounting->prefixes = zcalloc( sizeof(gbAccountedPrefix) * GB_ACCOUNTING_MAX_PREFIXES );
+
+	while( *p ){
+		end = strchr( p, ',' );
+		len = end ? (size_t)( end - p ) : strlen( p );
+
+		if( len == 0 || len > GB_ACCOUNTING_PREFIX_MAX ){
+			gbLog( ERROR, "Accounting prefixes must be from 1 to %d bytes long.", GB_ACCOUNTING_PREFIX_MAX );
+			return GB_ERR;
+		}
+		else if( accounting->nprefixes == GB_ACCOUNTING_MAX_PREFIXES ){
+			gbLog( ERROR, "At most %d accounting prefixes can be tracked.", GB_ACCOUNTING_MAX_PREFIXES );
+			return GB_ERR;
+		}
+
+		prefix = &accounting->prefixes[ accounting->nprefixes++ ];
+
+		memcpy( prefix->prefix, p, len );
+		prefix->len = len;
+
+		for( i = 0; i < GB_ACCOUNTING_STATS; ++i ){
+			sprintf( prefix->names[i], "prefix_%.*s_%s", (int)len, p, gbAccountingStatNames[i] );
+		}
+
+		if( end == NULL )
+			break;
+
+		p = end + 1;
+	}
+
+	return GB_OK;
+}
+
+void gbAccountingDestroy( gbServer *server ){
+	if( server->accounting ){
+		if( server->accounting->prefixes )
+			zfree( server->accounting->prefixes );
+
+		zfree( server->accounting );
+		server->accounting = NULL;
+	}
+}
+
+int gbAccountingPrefixOf( gbServer *server, byte_t *key, size_t klen ){
+	gbAccountedPrefix *prefix = NULL;
+	size_t longest = 0;
+	int i, found = 0;
+
+	// a handful of prefixes is the common case, a linear scan is cheaper
+	// than anything smarter
+	for( i = 0; i < server->accounting->nprefixes; ++i ){
+		prefix = &server->accounting->prefixes[i];
+
+		if( prefix->len <= klen && prefix->len > longest && prefix->prefix[0] == key[0] && memcmp( prefix->prefix, key, prefix->len ) == 0 ){
+			longest = prefix->len;
+			found	= i + 1;
+		}
+	}
+
+	return found;
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __ACCOUNTING_H__
+#define __ACCOUNTING_H__
+
+#include "net.h"
+
+/*
+ * Memory and access counters of the key prefixes listed by the
+ * accounting_prefixes configuration, so that tenants sharing an instance
+ * by prefix can be told apart.
+ *
+ * Items are accounted to the longest tracked prefix of their key when
+ * they are put in the tree and remember its index, every counter is
+ * updated as items are created, changed and destroyed, never by walking
+ * the tree. The bytes of a prefix are the memory of its values plus the
+ * tree memory each of its keys took when it was inserted.
+ */
+
+// maximum number of tracked prefixes, an item keeps its one in a byte
+#define GB_ACCOUNTING_MAX_PREFIXES 255
+// longest tracked prefix
+#define GB_ACCOUNTING_PREFIX_MAX   64
+// number of counters of each prefix, reported by OP_PSTATS
+#define GB_ACCOUNTING_STATS		   6
+
+typedef struct
+{
+	byte_t		  prefix[GB_ACCOUNTING_PREFIX_MAX];
+	size_t		  len;
+	// items stored and bytes they take
+	unsigned long items;
+	unsigned long bytes;
+	// GET and BGET keys found and not found
+	unsigned long hits;
+	unsigned long misses;
+	// items evicted to free memory and removed because their TTL expired
+	unsigned long evicted;
+	unsigned long expired;
+	// keys of the counters in the OP_PSTATS replies
+	char		  names[GB_ACCOUNTING_STATS][GB_ACCOUNTING_PREFIX_MAX + 16];
+}
+gbAccountedPrefix;
+
+typedef struct gbAccounting
+{
+	gbAccountedPrefix *prefixes;
+	int				   nprefixes;
+}
+gbAccounting;
+
+// the tracked prefix of an accounted item
+#define gbAccountingOfItem( server, item ) ( &(server)->accounting->prefixes[ (item)->prefix - 1 ] )
+
+/*
+ * Parse the comma separated list of prefixes, which may be NULL to track
+ * none. Returns GB_ERR if a prefix is empty or too long, or if there are
+ * too many of them.
+ */
+int  gbAccountingCreate( gbServer *server, const char *prefixes );
+void gbAccountingDestroy( gbServer *server );
+/*
+ * Index plus one of the longest tracked prefix of the key, 0 if the key
+ * doesn't start with any.
+ */
+int  gbAccountingPrefixOf( gbServer *server, byte_t *key, size_t klen );
+
+#endif
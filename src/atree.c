@@ -28,66 +28,337 @@
  */
 #include "atree.h"
 
-// This is O(N) since the at->nodes array is not sorted.
+#ifdef __SSE2__
+#	include <emmintrin.h>
+#endif
+
+/*
+ * Children of a node are stored sorted by byte value inside a single block:
+ *
+ * 	[ child 0 ][ child 1 ] ... [ child N - 1 ][ key area ]
+ *
+ * The key area layout depends on the number of children:
+ *
+ * 	N <= AT_NODE4  : the bytes of the children, linearly scanned.
+ * 	N <= AT_NODE16 : the bytes of the children, compared 16 at a time with SSE2.
+ * 	N >  AT_NODE16 : a 256 bytes index mapping a byte to the slot of its child.
+ *
+ * This way a lookup costs the same regardless of the node fan-out.
+ */
+#define AT_NODE4  4
+#define AT_NODE16 16
+
+#define at_keys_size( n ) ( (n) <= AT_NODE4 ? AT_NODE4 : (n) <= AT_NODE16 ? AT_NODE16 : 256 )
+#define at_block_size( n ) ( sizeof(atree_t) * (n) + at_keys_size(n) )
+#define at_keys( at ) ( (unsigned char *)( (at)->nodes + (at)->n_nodes ) )
+
+// Memory used by the nodes of all the trees of the thread.
+static __thread size_t at_used_memory = 0;
+
+#define at_incr_mem( p ) at_used_memory += zmalloc_size( p )
+#define at_decr_mem( p ) at_used_memory -= zmalloc_size( p )
+
+size_t at_memory_used(){
+	return at_used_memory;
+}
+
+// Handler of the memory the trees of the thread give back, NULL to free it.
+static __thread at_free_handler at_free_hook = NULL;
+
+void at_set_free_handler( at_free_handler handler ){
+	at_free_hook = handler;
+}
+
+static void at_release( void *p ){
+	if( at_free_hook )
+		at_free_hook( p );
+	else
+		zfree( p );
+}
+
+// Replace the compressed path of the node with 'len' bytes from 'path'.
+static void at_set_path( atree_t *at, unsigned char *path, size_t len ){
+	unsigned char *old = at->path;
+
+	at->path = NULL;
+	at->plen = len;
+
+	// 'path' could point inside the old one, so free it only after the copy
+	if( len ){
+		at->path = zmemdup( path, len );
+		at_incr_mem( at->path );
+	}
+
+	if( old ){
+		at_decr_mem( old );
+		at_release( old );
+	}
+}
+
 static anode_t *at_find_next_node( atree_t *at, unsigned char ascii ){
-	int n = at->n_nodes;
-	atree_t *node = NULL;
+	int n = at->n_nodes, i;
+	unsigned char *keys;
 
-	while( --n >= 0 ){
-		node = at->nodes + n;
-		if( node->ascii == ascii ){
-			return node;
+	if( n == 0 )
+		return NULL;
+
+	keys = at_keys(at);
+
+	if( n <= AT_NODE4 ){
+		for( i = 0; i < n; ++i ){
+			if( keys[i] == ascii )
+				return at->nodes + i;
+		}
+	}
+	else if( n <= AT_NODE16 ){
+#ifdef __SSE2__
+		int bitfield = _mm_movemask_epi8
+		(
+			_mm_cmpeq_epi8( _mm_set1_epi8( ascii ), _mm_loadu_si128( (__m128i *)keys ) )
+		)
+		& ( ( 1 << n ) - 1 );
+
+		if( bitfield )
+			return at->nodes + __builtin_ctz(bitfield);
+#else
+		for( i = 0; i < n; ++i ){
+			if( keys[i] == ascii )
+				return at->nodes + i;
 		}
+#endif
+	}
+	else {
+		// the index could be stale for bytes without a child, so double check it
+		i = keys[ascii];
+		if( i < n && at->nodes[i].ascii == ascii )
+			return at->nodes + i;
 	}
 
 	return NULL;
 }
 
+// Rebuild the key area of the node from its children.
+static void at_index_rebuild( atree_t *at ){
+	int i, n = at->n_nodes;
+	unsigned char *keys = at_keys(at);
+
+	if( n <= AT_NODE16 ){
+		for( i = 0; i < n; ++i ){
+			keys[i] = at->nodes[i].ascii;
+		}
+	}
+	else {
+		memset( keys, 0x00, 256 );
+		for( i = 0; i < n; ++i ){
+			keys[ at->nodes[i].ascii ] = i;
+		}
+	}
+}
+
+// Allocate a new child for the given byte keeping the children sorted.
+static anode_t *at_add_child( atree_t *at, unsigned char ascii ){
+	int n = at->n_nodes, pos = 0;
+	anode_t *node;
+
+	while( pos < n && at->nodes[pos].ascii < ascii ){
+		++pos;
+	}
+
+	if( at->nodes )
+		at_decr_mem( at->nodes );
+
+	// the old block could still be read by other threads, so it's copied
+	if( at_free_hook ){
+		anode_t *old = at->nodes;
+
+		at->nodes = zmalloc( at_block_size( n + 1 ) );
+		if( old ){
+			memcpy( at->nodes, old, sizeof(atree_t) * pos );
+			memcpy( at->nodes + pos + 1, old + pos, sizeof(atree_t) * ( n - pos ) );
+			at_release( old );
+		}
+	}
+	else {
+		at->nodes = zrealloc( at->nodes, at_block_size( n + 1 ) );
+		// the old key area is overwritten here, it will be rebuilt anyway
+		memmove( at->nodes + pos + 1, at->nodes + pos, sizeof(atree_t) * ( n - pos ) );
+	}
+
+	at_incr_mem( at->nodes );
+
+	node = at->nodes + pos;
+
+	node->ascii   = ascii;
+	node->marker  =
+	node->nodes   = NULL;
+	node->n_nodes = 0;
+	node->count   = 0;
+	node->path    = NULL;
+	node->plen    = 0;
+
+	++at->n_nodes;
+
+	at_index_rebuild( at );
+
+	return node;
+}
+
+/*
+ * Split the compressed path of the node after 'len' bytes, the rest of
+ * the path, the marker and the children are moved to a new single child.
+ */
+static void at_split( atree_t *at, size_t len ){
+	atree_t child = *at;
+
+	child.ascii = at->path[len];
+	child.path  = NULL;
+	child.plen  = 0;
+
+	at_set_path( &child, at->path + len + 1, at->plen - len - 1 );
+	at_set_path( at, at->path, len );
+
+	at->marker  = NULL;
+	at->n_nodes = 1;
+	at->nodes   = zmalloc( at_block_size(1) );
+	at_incr_mem( at->nodes );
+
+	at->nodes[0] = child;
+
+	at_index_rebuild( at );
+}
+
 void *at_insert( atree_t *at, unsigned char *key, int len, void *value ){
-	anode_t *parent = at, *node = NULL;
-	size_t i;
-	char ascii;
-	unsigned short current_size;
+	anode_t *parent = at, *node = at;
+	size_t i = 0, j, left;
+	void *old;
 
-	for( i = 0; i < len; ++i ){
-		ascii = key[i];
-		node  = at_find_next_node( parent, ascii );
+	if( value == NULL )
+		return at_remove( at, key, len );
+
+	// replacing an object doesn't change the counters
+	node = at_find_node( at, key, len );
+	if( node && node->marker ){
+		old = node->marker;
+		node->marker = value;
+
+		return old;
+	}
+
+	// a new object, every node of its chain gets one more
+	node = at;
+	++at->count;
+
+	while( i < len ){
+		node = at_find_next_node( parent, key[i] );
 		if( node == NULL ){
 			/*
-			 * Allocate, initialize and append a new node.
-			 *
-			 * NOTE: As a future optimization, the parent->nodes new array
-			 * will be quick-sorted on every reallocation, so the search with
-			 * at_find_next_node would be O(log N) instead of O(N).
+			 * Chains of single child nodes are compressed, so the
+			 * whole tail of the key goes inside the new node path.
 			 */
-			current_size  = parent->n_nodes;
-			parent->nodes = zrealloc( parent->nodes, sizeof(atree_t) * ++parent->n_nodes );
-			node		  = parent->nodes + current_size;
+			node = at_add_child( parent, key[i] );
+			left = len - i - 1;
 
-			node->ascii   = ascii;
-			node->marker  =
-			node->nodes   = NULL;
-			node->n_nodes = 0;
+			at_set_path( node, key + i + 1, left < AT_MAX_PATH ? left : AT_MAX_PATH );
 		}
+		else {
+			// follow the compressed path as long as it matches the key
+			for( j = 0; j < node->plen && i + 1 + j < len && node->path[j] == key[i + 1 + j]; ++j );
+
+			if( j < node->plen ){
+				at_split( node, j );
+			}
+		}
+
+		++node->count;
 
+		i 	  += 1 + node->plen;
 		parent = node;
 	}
 
-	void *old = node->marker;
     node->marker = value;
 
-	return old;
+	return NULL;
 }
 
 atree_t *at_find_node( atree_t *at, unsigned char *key, int len ){
 	anode_t *node = at;
 	int i = 0;
 
-	do{
-		// Find next node ad continue.
+	while( i < len && node ){
+		// Find next node and continue.
 		node = at_find_next_node( node, key[i++] );
+		if( node && node->plen ){
+			// the whole compressed path must match
+			if( len - i < node->plen || memcmp( node->path, key + i, node->plen ) != 0 )
+				return NULL;
+
+			i += node->plen;
+		}
+	}
+
+	return node;
+}
+
+// Check that the tree is still at the version a lock free lookup started from.
+#define at_changed( version, start ) ( __atomic_thread_fence( __ATOMIC_ACQUIRE ), __atomic_load_n( (version), __ATOMIC_RELAXED ) != (start) )
+
+void *at_find_shared( atree_t *at, unsigned char *key, int len, const unsigned long *version, unsigned long start ){
+	anode_t *child;
+	atree_t node = *at;
+	int i = 0;
+
+	/*
+	 * The fields of each node are copied and checked against the version
+	 * before following its path or children, so a pointer and the length
+	 * it comes with always belong to the same version of the tree, the
+	 * memory they point to is kept around by whoever retires it.
+	 */
+	for( ;; ){
+		if( at_changed( version, start ) )
+			return AT_RETRY;
+
+		// the whole compressed path must match
+		if( node.plen ){
+			if( len - i < node.plen || memcmp( node.path, key + i, node.plen ) != 0 )
+				break;
+
+			i += node.plen;
+		}
+
+		if( i == len )
+			return node.marker;
+
+		if( ( child = at_find_next_node( &node, key[i++] ) ) == NULL )
+			break;
+
+		node = *child;
+	}
+
+	// what was read could have been changed meanwhile
+	return at_changed( version, start ) ? AT_RETRY : NULL;
+}
+
+/*
+ * Find the node containing the last byte of 'prefix', which could be
+ * in the middle of its compressed path, and the key offset of its first byte.
+ */
+static anode_t *at_find_prefix_node( atree_t *at, unsigned char *prefix, int len, int *level ){
+	anode_t *node = at;
+	int i = 0, j;
+
+	*level = -1;
+
+	while( i < len && node ){
+		*level = i;
+
+		node = at_find_next_node( node, prefix[i++] );
+		if( node && node->plen ){
+			for( j = 0; j < node->plen && i < len; ++j, ++i ){
+				if( node->path[j] != prefix[i] )
+					return NULL;
+			}
+		}
 	}
-	while( --len && node );
 
 	return node;
 }
@@ -107,114 +378,546 @@ void at_recurse( atree_t *at, at_recurse_handler handler, void *data, size_t lev
 	handler( at, level, data );
 
 	for( i = 0; i < at->n_nodes; ++i ){
-		at_recurse( at->nodes + i, handler, data, level + 1 );
+		at_recurse( at->nodes + i, handler, data, level + 1 + at->plen );
 	}
 }
 
-struct at_search_data {
-	llist_t **keys;
-	llist_t **values;
-	char    *current;
-	size_t   total;
-};
+// Remove the child at the given slot, shrinking the children block.
+static void at_del_child( atree_t *at, int pos ){
+	int n = at->n_nodes - 1;
 
-static void at_search_recursive_handler(anode_t *node, size_t level, void *data){
-	struct at_search_data *search = data;
+	at_decr_mem( at->nodes );
 
-	search->current[ level ] = node->ascii;
+	if( n == 0 ){
+		at->n_nodes = 0;
+		at_release( at->nodes );
+		at->nodes = NULL;
+	}
+	// the old block could still be read by other threads, so it's copied
+	else if( at_free_hook ){
+		anode_t *old = at->nodes;
+
+		at->nodes = zmalloc( at_block_size(n) );
+		memcpy( at->nodes, old, sizeof(atree_t) * pos );
+		memcpy( at->nodes + pos, old + pos + 1, sizeof(atree_t) * ( n - pos ) );
+		at->n_nodes = n;
+		at_incr_mem( at->nodes );
+
+		at_index_rebuild( at );
+		at_release( old );
+	}
+	else {
+		memmove( at->nodes + pos, at->nodes + pos + 1, sizeof(atree_t) * ( n - pos ) );
 
-	// found a value
-	if( node->marker != NULL ){
-		++search->total;
-		search->current[ level + 1 ] = '\0';
+		at->n_nodes = n;
+		at->nodes = zrealloc( at->nodes, at_block_size(n) );
+		at_incr_mem( at->nodes );
 
-		ll_append( *search->keys,   zstrdup( search->current ) );
-		ll_append( *search->values, node->marker );
+		at_index_rebuild( at );
 	}
 }
 
-size_t at_search( atree_t *at, unsigned char *prefix, int len, int maxkeylen, llist_t **keys, llist_t **values ) {
-	struct at_search_data searchdata;
+/*
+ * Fix the given child of 'at' after its marker or its children changed:
+ * a child without marker and children gets removed, a child without marker
+ * and a single child gets merged with it.
+ *
+ * Returns 1 if the child was removed from 'at', otherwise 0.
+ */
+static int at_prune_child( atree_t *at, anode_t *node ){
+	if( node->marker != NULL )
+		return 0;
 
-	searchdata.keys    = keys;
-	searchdata.values  = values;
-	searchdata.current = alloca( maxkeylen );
-	searchdata.total   = 0;
+	else if( node->n_nodes == 0 ){
+		at_set_path( node, NULL, 0 );
+		at_del_child( at, node - at->nodes );
 
-	anode_t *start = at_find_node( at, prefix, len );
+		return 1;
+	}
+	else if( node->n_nodes == 1 && node->plen + 1 + node->nodes->plen <= AT_MAX_PATH ){
+		atree_t *child = node->nodes;
+		size_t plen = node->plen + 1 + child->plen;
+		unsigned char *path = zmalloc( plen );
 
-	if( start ){
-		strncpy( searchdata.current, (char *)prefix, len );
+		memcpy( path, node->path, node->plen );
+		path[ node->plen ] = child->ascii;
+		memcpy( path + node->plen + 1, child->path, child->plen );
 
-		at_recurse( start, at_search_recursive_handler, &searchdata, len - 1 );
+		at_set_path( node, path, plen );
+		at_set_path( child, NULL, 0 );
+
+		zfree( path );
+
+		node->marker  = child->marker;
+		node->n_nodes = child->n_nodes;
+		node->nodes   = child->nodes;
+
+		at_decr_mem( child );
+		at_release( child );
 	}
 
-	return searchdata.total;
+	return 0;
 }
 
-struct at_search_nodes_data {
-	llist_t **keys;
-	llist_t **nodes;
-	char    *current;
-	size_t   total;
-};
+static void *at_remove_recursive( atree_t *at, unsigned char *key, int len ){
+	anode_t *node;
+	void *retn;
 
-static void at_search_nodes_recursive_handler(anode_t *node, size_t level, void *data){
-	struct at_search_nodes_data *search = data;
+	if( len == 0 ){
+		retn = at->marker;
+		at->marker = NULL;
 
-	search->current[ level ] = node->ascii;
+		if( retn )
+			--at->count;
 
-	// found a value
-	if( node->marker != NULL ){
-		++search->total;
-		search->current[ level + 1 ] = '\0';
+		return retn;
+	}
+
+	node = at_find_next_node( at, key[0] );
+	if( node == NULL || len - 1 < node->plen || memcmp( node->path, key + 1, node->plen ) != 0 )
+		return NULL;
 
-		ll_append( *search->keys,  zstrdup( search->current ) );
-		ll_append( *search->nodes, node );
+	retn = at_remove_recursive( node, key + 1 + node->plen, len - 1 - node->plen );
+	if( retn ){
+		--at->count;
+		// reclaim the branch if it's now dead
+		at_prune_child( at, node );
 	}
+
+	return retn;
 }
 
-size_t at_search_nodes( atree_t *at, unsigned char *prefix, int len, int maxkeylen, llist_t **keys, llist_t **nodes ){
-	struct at_search_nodes_data searchdata;
+void *at_remove( atree_t *at, unsigned char *key, int len ){
+	/*
+	 * End of the chain, if e_marker is NULL this chain is not complete,
+	 * therefore 'key' does not map any alive object.
+	 */
+	return at_remove_recursive( at, key, len );
+}
 
-	searchdata.keys    = keys;
-	searchdata.nodes   = nodes;
-	searchdata.current = alloca( maxkeylen );
-	searchdata.total   = 0;
+size_t at_count( atree_t *at, unsigned char *prefix, int len ){
+	int level;
+	anode_t *node = at_find_prefix_node( at, prefix, len, &level );
 
-	anode_t *start = at_find_node( at, prefix, len );
+	return node ? node->count : 0;
+}
 
-	if( start ){
-		strncpy( searchdata.current, (char *)prefix, len );
+static void at_iterator_push( at_iterator_t *it, anode_t *node, size_t level, int write ){
+	at_frame_t *frame;
 
-		at_recurse( start, at_search_nodes_recursive_handler, &searchdata, len - 1 );
+	if( it->depth == it->ssize ){
+		it->ssize = it->ssize ? it->ssize * 2 : 16;
+		it->stack = zrealloc( it->stack, sizeof(at_frame_t) * it->ssize );
 	}
 
-	return searchdata.total;
+	frame = it->stack + it->depth++;
+
+	frame->node = node;
+	frame->next = -1;
+	frame->klen = level;
+
+	if( write ){
+		frame->klen += 1 + node->plen;
+
+		if( frame->klen > it->ksize ){
+			it->ksize = frame->klen * 2;
+			it->key	  = zrealloc( it->key, it->ksize );
+		}
+
+		it->key[level] = node->ascii;
+		memcpy( it->key + level + 1, node->path, node->plen );
+	}
 }
 
-void *at_remove( atree_t *at, unsigned char *key, int len ){
+int at_iterator_seek( at_iterator_t *it, atree_t *at, unsigned char *prefix, int len ){
 	anode_t *node = at;
-	int i = 0;
+	int i = 0, j;
 
-	do{
-		// Find next link ad continue.
-		node = at_find_next_node( node, key[i++] );
+	it->depth	= 0;
+	it->base	= 0;
+	it->node	= NULL;
+	it->klen	= 0;
+	it->removed = 0;
+
+	/*
+	 * The whole chain from the root down to the prefix node is kept on the
+	 * stack, this way removing an object can update all of its counters.
+	 */
+	at_iterator_push( it, at, 0, 0 );
+
+	while( i < len ){
+		node = at_find_next_node( node, prefix[i] );
+		if( node == NULL ){
+			it->depth = 0;
+			return 0;
+		}
+
+		for( j = 0; j < node->plen && i + 1 + j < len; ++j ){
+			if( node->path[j] != prefix[i + 1 + j] ){
+				it->depth = 0;
+				return 0;
+			}
+		}
+
+		at_iterator_push( it, node, i, 1 );
+
+		i += 1 + node->plen;
 	}
-	while( --len && node );
+
+	it->base = it->depth - 1;
+
+	return 1;
+}
+
+// index of the first child of 'node' whose byte is not less than 'ascii'
+static int at_lower_child( anode_t *node, unsigned char ascii ){
+	int lo = 0, hi = node->n_nodes, mid;
+
+	// the key area is no sorted list above AT_NODE16, the children always are
+	while( lo < hi ){
+		mid = ( lo + hi ) / 2;
+
+		if( node->nodes[mid].ascii < ascii )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+int at_iterator_seek_after( at_iterator_t *it, atree_t *at, unsigned char *prefix, int len, unsigned char *after, int alen ){
+	at_frame_t *frame;
+	anode_t *child;
+	int i, j, cmp;
+	size_t klen;
+
+	if( at_iterator_seek( it, at, prefix, len ) == 0 )
+		return 0;
+
+	else if( alen == 0 )
+		return 1;
+
+	frame = it->stack + it->depth - 1;
+	klen  = frame->klen < (size_t)alen ? frame->klen : (size_t)alen;
+	cmp   = memcmp( it->key, after, klen );
+
+	// every key of the prefix node sorts after 'after'
+	if( cmp > 0 || ( cmp == 0 && frame->klen > (size_t)alen ) )
+		return 1;
+
+	// or before it
+	else if( cmp < 0 ){
+		frame->next = frame->node->n_nodes;
+		return 1;
+	}
+
 	/*
-	 * End of the chain, if e_marker is NULL this chain is not complete,
-	 * therefore 'key' does not map any alive object.
+	 * The key of the top frame is a prefix of 'after', the node is marked
+	 * as visited and its children sorting before 'after' as well, going
+	 * down the one it could still be in.
 	 */
-	if( node && node->marker ){
-		void *retn = node->marker;
+	for( ;; ){
+		frame = it->stack + it->depth - 1;
+		klen  = frame->klen;
+
+		if( klen == (size_t)alen ){
+			frame->next = 0;
+			return 1;
+		}
 
-		node->marker = NULL;
+		i = frame->next = at_lower_child( frame->node, after[klen] );
+		if( i == frame->node->n_nodes )
+			return 1;
 
-		return retn;
+		child = frame->node->nodes + i;
+		if( child->ascii != after[klen] )
+			return 1;
+
+		for( j = 0, cmp = 0; j < child->plen && klen + 1 + j < (size_t)alen && cmp == 0; ++j ){
+			cmp = (int)child->path[j] - (int)after[klen + 1 + j];
+		}
+
+		if( cmp < 0 ){
+			++frame->next;
+			return 1;
+		}
+		// 'after' ends inside the path or sorts before it
+		else if( cmp > 0 || klen + 1 + child->plen > (size_t)alen )
+			return 1;
+
+		at_iterator_push( it, child, klen, 1 );
 	}
-	else
+}
+
+anode_t *at_iterator_next( at_iterator_t *it ){
+	at_frame_t *frame, *parent;
+
+	while( it->depth > it->base ){
+		frame = it->stack + it->depth - 1;
+
+		// first time we see this node
+		if( frame->next < 0 ){
+			frame->next = 0;
+
+			if( frame->node->marker != NULL ){
+				it->node = frame->node;
+				it->klen = frame->klen;
+
+				return it->node;
+			}
+		}
+		else if( frame->next < frame->node->n_nodes ){
+			// 'frame' could be moved by the push
+			at_iterator_push( it, frame->node->nodes + frame->next, frame->klen, 1 );
+		}
+		else {
+			// done with this subtree, reclaim it if it's dead
+			if( --it->depth ){
+				parent = it->stack + it->depth - 1;
+
+				if( at_prune_child( parent->node, frame->node ) == 0 && it->depth > it->base )
+					++parent->next;
+			}
+		}
+	}
+
+	// the chain above the prefix node could be dead too now
+	while( it->depth > 1 ){
+		frame = it->stack + --it->depth;
+
+		at_prune_child( frame[-1].node, frame->node );
+	}
+
+	it->depth = 0;
+	it->node  = NULL;
+	it->klen  = 0;
+
+	return NULL;
+}
+
+void *at_iterator_remove( at_iterator_t *it ){
+	void *old = NULL;
+	size_t i;
+
+	if( it->node && it->node->marker ){
+		old = it->node->marker;
+		it->node->marker = NULL;
+
+		for( i = 0; i < it->depth; ++i ){
+			--it->stack[i].node->count;
+		}
+
+		++it->removed;
+	}
+
+	return old;
+}
+
+void at_iterator_free( at_iterator_t *it ){
+	if( it->stack )
+		zfree( it->stack );
+
+	if( it->key )
+		zfree( it->key );
+
+	at_init_iterator( *it );
+}
+
+struct at_compact_data {
+	at_cursor_t *cursor;
+	size_t       budget;
+	int          stopped;
+};
+
+static void at_cursor_reserve( at_cursor_t *cursor, size_t size ){
+	if( size > cursor->size ){
+		cursor->size = size * 2;
+		cursor->key  = zrealloc( cursor->key, cursor->size );
+	}
+}
+
+anode_t *at_select( atree_t *at, size_t rank, at_cursor_t *key ){
+	anode_t *node = at, *child;
+	size_t level = 0;
+	int i;
+
+	if( rank >= at->count )
 		return NULL;
+
+	while( node->marker == NULL || rank > 0 ){
+		if( node->marker )
+			--rank;
+
+		// the counters tell which child holds the object of that rank
+		for( i = 0; i < node->n_nodes && rank >= node->nodes[i].count; ++i ){
+			rank -= node->nodes[i].count;
+		}
+
+		if( i == node->n_nodes )
+			return NULL;
+
+		child = node->nodes + i;
+
+		at_cursor_reserve( key, level + 1 + child->plen );
+
+		key->key[level] = child->ascii;
+		memcpy( key->key + level + 1, child->path, child->plen );
+
+		level += 1 + child->plen;
+		node   = child;
+	}
+
+	key->len = level;
+
+	return node;
+}
+
+/*
+ * Compact the subtree of 'at', whose key is in the first 'level' bytes of the
+ * cursor buffer, resuming from the cursor key if 'seek' is set.
+ */
+static void at_compact_recursive( atree_t *at, size_t level, struct at_compact_data *compact, int seek ){
+	at_cursor_t *cursor = compact->cursor;
+	anode_t *node;
+	int i = 0, next;
+
+	if( seek && level < cursor->len ){
+		// skip the children we already compacted
+		while( i < at->n_nodes && at->nodes[i].ascii < cursor->key[level] ){
+			++i;
+		}
+	}
+	else if( compact->budget-- == 0 ){
+		// out of budget, resume from this node next time
+		cursor->len     = level;
+		compact->stopped = 1;
+		return;
+	}
+
+	for( ; i < at->n_nodes; ){
+		node = at->nodes + i;
+		next = seek && level < cursor->len &&
+			   node->ascii == cursor->key[level] &&
+               cursor->len - level - 1 >= node->plen &&
+			   memcmp( node->path, cursor->key + level + 1, node->plen ) == 0;
+
+		at_cursor_reserve( cursor, level + 1 + node->plen );
+
+		cursor->key[level] = node->ascii;
+		memcpy( cursor->key + level + 1, node->path, node->plen );
+
+		at_compact_recursive( node, level + 1 + node->plen, compact, next );
+
+		if( compact->stopped )
+			return;
+
+		seek = 0;
+
+		if( at_prune_child( at, node ) == 0 )
+			++i;
+	}
+}
+
+int at_compact( atree_t *at, at_cursor_t *cursor, size_t budget ){
+	struct at_compact_data compact;
+
+	compact.cursor  = cursor;
+	compact.budget  = budget;
+	compact.stopped = 0;
+
+	at_compact_recursive( at, 0, &compact, cursor->len > 0 );
+
+	if( compact.stopped == 0 ){
+		cursor->len = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+struct at_scan_data {
+	at_cursor_t    *cursor;
+	size_t          budget;
+	int             stopped;
+	at_scan_handler handler;
+	void           *data;
+};
+
+/*
+ * Scan the subtree of 'at', whose key is in the first 'level' bytes of the
+ * cursor buffer, resuming from the cursor key if 'seek' is set.
+ */
+static void at_scan_recursive( atree_t *at, size_t level, struct at_scan_data *scan, int seek ){
+	at_cursor_t *cursor = scan->cursor;
+	anode_t *node;
+	int i = 0, next;
+
+	if( seek && level < cursor->len ){
+		// skip the children we already scanned
+		while( i < at->n_nodes && at->nodes[i].ascii < cursor->key[level] ){
+			++i;
+		}
+	}
+	else if( scan->budget-- == 0 ){
+		// out of budget, resume from this node next time
+		cursor->len   = level;
+		scan->stopped = 1;
+		return;
+	}
+	else if( at->marker )
+		scan->handler( at, cursor->key, level, scan->data );
+
+	for( ; i < at->n_nodes; ++i ){
+		node = at->nodes + i;
+		next = seek && level < cursor->len &&
+			   node->ascii == cursor->key[level] &&
+			   cursor->len - level - 1 >= node->plen &&
+			   memcmp( node->path, cursor->key + level + 1, node->plen ) == 0;
+
+		at_cursor_reserve( cursor, level + 1 + node->plen );
+
+		cursor->key[level] = node->ascii;
+		memcpy( cursor->key + level + 1, node->path, node->plen );
+
+		at_scan_recursive( node, level + 1 + node->plen, scan, next );
+
+		if( scan->stopped )
+			return;
+
+		seek = 0;
+	}
+}
+
+int at_scan( atree_t *at, at_cursor_t *cursor, size_t budget, at_scan_handler handler, void *data ){
+	struct at_scan_data scan;
+
+	scan.cursor  = cursor;
+	scan.budget  = budget;
+	scan.stopped = 0;
+	scan.handler = handler;
+	scan.data    = data;
+
+	// the cursor buffer holds the keys passed to the handler
+	at_cursor_reserve( cursor, 1 );
+
+	at_scan_recursive( at, 0, &scan, cursor->len > 0 );
+
+	if( scan.stopped == 0 ){
+		cursor->len = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+void at_cursor_free( at_cursor_t *cursor ){
+	if( cursor->key )
+		zfree( cursor->key );
+
+	cursor->key  = NULL;
+	cursor->len  =
+	cursor->size = 0;
 }
 
 void at_free( atree_t *at ){
@@ -228,15 +931,17 @@ void at_free( atree_t *at ){
 		 */
 		for( i = 0; i < n_nodes; ++i, --at->n_nodes ){
 			/*
-			 * Free this node children.
+			 * Free this node children and its compressed path.
 			 */
 			at_free( at->nodes + i );
+			at_set_path( at->nodes + i, NULL, 0 );
 		}
 
 		/*
 		 * Free the node itself.
 		 */
-		zfree( at->nodes );
+		at_decr_mem( at->nodes );
+		at_release( at->nodes );
 		at->nodes = NULL;
 	}
 }
@@ -31,11 +31,17 @@
 
 #include <stdlib.h>
 #include <string.h>
-#include "llist.h"
+#include "zmem.h"
 
 /*
- * Implementation of an n-ary tree, where each node is represented
- * by a char of a key and its children by next chars.
+ * Maximum number of bytes of a compressed path.
+ */
+#define AT_MAX_PATH 0xFFFF
+
+/*
+ * Implementation of an n-ary radix tree, where each node is represented
+ * by a char of a key and its children by next chars, chains of single
+ * child nodes are compressed into a single node path.
  */
 typedef struct _atree {
 	/*
@@ -51,7 +57,20 @@ typedef struct _atree {
 	 */
 	unsigned short n_nodes;
 	/*
-	 * Child nodes dynamic array.
+	 * Number of objects in this node and all of its descendants.
+	 */
+	unsigned int   count;
+	/*
+	 * Number of bytes following 'ascii' in this node.
+	 */
+	unsigned short plen;
+	/*
+	 * Bytes following 'ascii' in this node ( compressed path ).
+	 */
+	unsigned char *path;
+	/*
+	 * Child nodes dynamic array, sorted by byte value and followed
+	 * by the lookup key area ( see atree.c ).
 	 */
 	struct _atree *nodes;
 }
@@ -64,6 +83,9 @@ typedef atree_t anode_t;
  */
 #define at_init_tree( t )    (t).n_nodes = 0; \
 						     (t).marker  = 0; \
+						     (t).count   = 0; \
+						     (t).plen    = 0; \
+						     (t).path    = NULL; \
 						     (t).nodes   = NULL
 /*
  * Allocate and initialize a node of the tree.
@@ -75,7 +97,7 @@ typedef atree_t anode_t;
 
 /*
  * Insert 'value' inside 'at' ascii tree, mapped by
- * the given 'key' of 'len' bytes.
+ * the given 'key' of 'len' bytes, a NULL value removes the key.
  */
 void *at_insert( atree_t *at, unsigned char *key, int len, void *value );
 
@@ -87,17 +109,164 @@ atree_t *at_find_node( atree_t *at, unsigned char *key, int len );
  */
 void *at_find( atree_t *at, unsigned char *key, int len );
 
+/*
+ * Returned by at_find_shared when the tree changed during the lookup.
+ */
+#define AT_RETRY ( (void *)-1 )
+
+/*
+ * Lock free lookup for threads other than the one changing the tree,
+ * which makes '*version' odd while changing it and even when done: the
+ * lookup is valid only if the version is still 'start', taken even, at
+ * every step. The caller must keep the memory given to the free handler
+ * of the writer (see at_set_free_handler) around while reading.
+ *
+ * Returns the object, NULL if not found, or AT_RETRY.
+ */
+void *at_find_shared( atree_t *at, unsigned char *key, int len, const unsigned long *version, unsigned long start );
+
+typedef void (*at_free_handler)( void *ptr );
+/*
+ * Have the nodes and paths the trees of the calling thread don't use
+ * anymore passed to 'handler' instead of being freed, so that threads
+ * still reading them with at_find_shared can be waited for. Children
+ * blocks are then copied rather than resized in place. A NULL handler
+ * frees them right away again.
+ */
+void at_set_free_handler( at_free_handler handler );
+
 typedef void (*at_recurse_handler)(anode_t *, size_t, void *);
 
 void at_recurse( atree_t *at, at_recurse_handler handler, void *data, size_t level );
 
-size_t at_search( atree_t *at, unsigned char *prefix, int len, int maxkeylen, llist_t **keys, llist_t **values );
-size_t at_search_nodes( atree_t *at, unsigned char *prefix, int len, int maxkeylen, llist_t **keys, llist_t **nodes );
+/*
+ * Number of objects whose key starts with the given prefix, in a time
+ * proportional to the prefix length.
+ */
+size_t at_count( atree_t *at, unsigned char *prefix, int len );
+
+typedef struct {
+	// node being visited
+	anode_t *node;
+	// next child to visit, -1 if the node itself was not visited yet
+	int		 next;
+	// length of the key up to the end of this node
+	size_t   klen;
+}
+at_frame_t;
 
 /*
- * Remove the object from the tree and return its pointer.
+ * Iterator over the objects of the tree whose key starts with a given
+ * prefix, in key order. Its buffers are reused by every seek, so once
+ * warmed up it doesn't allocate anything.
+ */
+typedef struct {
+	// stack of the nodes from the root to the current one
+	at_frame_t    *stack;
+	size_t		   depth;
+	size_t		   ssize;
+	// position of the prefix node inside the stack
+	size_t		   base;
+	// key of the current object, not null terminated
+	unsigned char *key;
+	size_t		   klen;
+	size_t		   ksize;
+	// node of the current object
+	anode_t		  *node;
+	// number of objects removed by at_iterator_remove since the seek
+	size_t		   removed;
+}
+at_iterator_t;
+
+#define at_init_iterator( i ) (i).stack   = NULL; \
+							  (i).depth   = 0; \
+							  (i).ssize   = 0; \
+							  (i).base	  = 0; \
+							  (i).key	  = NULL; \
+							  (i).klen	  = 0; \
+							  (i).ksize   = 0; \
+							  (i).node	  = NULL; \
+							  (i).removed = 0
+/*
+ * Position the iterator before the first object with the given prefix,
+ * an empty prefix selects the whole tree.
+ *
+ * Returns 0 if no node matches the prefix.
+ */
+int at_iterator_seek( at_iterator_t *it, atree_t *at, unsigned char *prefix, int len );
+/*
+ * Like at_iterator_seek, but position the iterator right after the key
+ * 'after' of 'alen' bytes, so the iteration can resume from the last key
+ * returned even if it was removed meanwhile.
+ */
+int at_iterator_seek_after( at_iterator_t *it, atree_t *at, unsigned char *prefix, int len, unsigned char *after, int alen );
+/*
+ * Move to the next object and return its node, or NULL when done.
+ * The tree must not be modified during the iteration other than by
+ * replacing markers of existing nodes with non NULL ones, dead branches
+ * are reclaimed while moving.
+ */
+anode_t *at_iterator_next( at_iterator_t *it );
+/*
+ * Clear the marker of the current node and return it, updating
+ * the counters of its ancestors.
+ */
+void *at_iterator_remove( at_iterator_t *it );
+void  at_iterator_free( at_iterator_t *it );
+
+/*
+ * Get the memory used by the nodes of all the trees.
+ */
+size_t at_memory_used();
+/*
+ * Remove the object from the tree and return its pointer,
+ * the nodes left without objects are reclaimed.
  */
 void *at_remove( atree_t *at, unsigned char *key, int len );
+
+/*
+ * Position of an incremental operation on the tree, the key of
+ * the node to resume from.
+ */
+typedef struct {
+	unsigned char *key;
+	size_t		   len;
+	size_t		   size;
+}
+at_cursor_t;
+
+#define at_init_cursor( c ) (c).key  = NULL; \
+							(c).len  = 0; \
+							(c).size = 0
+
+void at_cursor_free( at_cursor_t *cursor );
+/*
+ * Find the object with the given rank in key order, its key is
+ * written inside the cursor.
+ *
+ * Returns the node of the object or NULL if the rank is out of range.
+ */
+anode_t *at_select( atree_t *at, size_t rank, at_cursor_t *key );
+/*
+ * Reclaim the nodes left without objects by markers cleared
+ * directly, visiting at most 'budget' nodes starting from the
+ * given cursor.
+ *
+ * Returns 1 if the whole tree was compacted, 0 if the cursor
+ * has been updated to resume the operation later.
+ */
+int at_compact( atree_t *at, at_cursor_t *cursor, size_t budget );
+
+typedef void (*at_scan_handler)( anode_t *node, unsigned char *key, size_t len, void *data );
+/*
+ * Call 'handler' for the objects in key order, visiting at most 'budget'
+ * nodes starting from the given cursor. The handler can replace the
+ * marker of the node with a non NULL one.
+ *
+ * Returns 1 if the whole tree was scanned, 0 if the cursor has been
+ * updated to resume the operation later.
+ */
+int at_scan( atree_t *at, at_cursor_t *cursor, size_t budget, at_scan_handler handler, void *data );
 /*
  * Free the tree nodes.
  */
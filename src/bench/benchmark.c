@@ -0,0 +1,769 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Load generator speaking the binary protocol: every thread drives its own
+ * connections, each one sending a pipeline of requests at a time and
+ * timing every request from the moment its pipeline was sent to the moment
+ * its reply was read.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "query.h"
+
+#define GB_BENCH_MAX_PIPELINE 1024
+// reply opcode, encoding and data size
+#define GB_BENCH_REPLY_HEADER ( sizeof(short) + sizeof(gbItemEncoding) + sizeof(size_t) )
+// latencies histogram, see src/metrics.h
+#define GB_BENCH_SUB_BITS	  3
+#define GB_BENCH_SUB		  ( 1 << GB_BENCH_SUB_BITS )
+#define GB_BENCH_MAX_BITS	  40
+#define GB_BENCH_BUCKETS	  ( ( GB_BENCH_MAX_BITS - GB_BENCH_SUB_BITS + 2 ) * GB_BENCH_SUB )
+// INC requests go to this many counters for each prefix
+#define GB_BENCH_COUNTERS	  16
+
+typedef struct
+{
+	const char *name;
+	short		op;
+	// share of the requests
+	unsigned int weight;
+}
+gbBenchOp;
+
+static gbBenchOp gbBenchOps[] = {
+	{ "get",   OP_GET,	 80 },
+	{ "set",   OP_SET,	 20 },
+	{ "mget",  OP_MGET,	 0 },
+	{ "count", OP_COUNT, 0 },
+	{ "inc",   OP_INC,	 0 }
+};
+
+#define GB_BENCH_OPS ( sizeof(gbBenchOps) / sizeof(gbBenchOps[0]) )
+
+typedef struct
+{
+	unsigned long long calls;
+	// REPL_ERR_NOT_FOUND replies, and the other errors
+	unsigned long long misses;
+	unsigned long long errors;
+	unsigned long long max;
+	unsigned long long histogram[GB_BENCH_BUCKETS];
+}
+gbBenchStats;
+
+typedef struct
+{
+	int		 fd;
+	// requests of the pipeline being sent
+	char	*out;
+	size_t	 osize,
+			 ocapacity;
+	// replies read and not parsed yet
+	char	*in;
+	size_t	 isize,
+			 icapacity;
+	// operations of the pipeline, in the order their replies are expected
+	int		 ops[GB_BENCH_MAX_PIPELINE];
+	int		 pending,
+			 next;
+	// time the pipeline was sent
+	unsigned long long sent;
+	// requests still to send, and the next key to fill
+	unsigned long long left;
+	unsigned long long fill;
+}
+gbBenchConn;
+
+typedef struct
+{
+	pthread_t	 thread;
+	gbBenchConn *conns;
+	int			 nconns;
+	uint64_t	 seed;
+	gbBenchStats stats[GB_BENCH_OPS];
+}
+gbBenchThread;
+
+static struct
+{
+	const char *socket;
+	const char *host;
+	int			port;
+	int			clients;
+	int			threads;
+	unsigned long long requests;
+	int			pipeline;
+	size_t		kmin, kmax;
+	size_t		vmin, vmax;
+	unsigned long long keyspace;
+	unsigned int prefixes;
+	// percent of the SET requests with a ttl, and the ttl
+	unsigned int ttlrate;
+	unsigned int ttl;
+	// fill the keyspace before the run
+	int			fill;
+	uint64_t	seed;
+	unsigned int weights;
+	// value sent by the SET requests, at most vmax bytes
+	char	   *value;
+}
+gbBench = {
+	.host	  = GB_DEFAULT_ADDRESS,
+	.port	  = GB_DEFAULT_PORT,
+	.clients  = 50,
+	.threads  = 1,
+	.requests = 100000,
+	.pipeline = 1,
+	.kmin	  = 16,
+	.kmax	  = 16,
+	.vmin	  = 64,
+	.vmax	  = 64,
+	.keyspace = 100000,
+	.prefixes = 100,
+	.fill	  = 1
+};
+
+static unsigned long long gbBenchClock( void ){
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64*
+static uint64_t gbBenchRandom( uint64_t *state ){
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+
+	return *state * 2685821657736338717ULL;
+}
+
+static size_t gbBenchRange( uint64_t *state, size_t min, size_t max ){
+	return min == max ? min : min + gbBenchRandom( state ) % ( max - min + 1 );
+}
+
+static size_t gbBenchBucket( unsigned long long v ){
+	int m;
+
+	if( v < GB_BENCH_SUB )
+		return v;
+
+	m = 63 - __builtin_clzll( v );
+	if( m > GB_BENCH_MAX_BITS )
+		return GB_BENCH_BUCKETS - 1;
+
+	return ( m - GB_BENCH_SUB_BITS + 1 ) * GB_BENCH_SUB + ( ( v >> ( m - GB_BENCH_SUB_BITS ) ) & ( GB_BENCH_SUB - 1 ) );
+}
+
+static unsigned long long gbBenchBucketTop( size_t i ){
+	int m;
+
+	if( i < GB_BENCH_SUB )
+		return i;
+
+	m = i / GB_BENCH_SUB + GB_BENCH_SUB_BITS - 1;
+
+	return ( ( GB_BENCH_SUB + i % GB_BENCH_SUB + 1ULL ) << ( m - GB_BENCH_SUB_BITS ) ) - 1;
+}
+
+static unsigned long long gbBenchPercentile( gbBenchStats *stats, double fraction ){
+	unsigned long long rank = fraction * stats->calls, seen = 0, top;
+	size_t i;
+
+	if( stats->calls == 0 )
+		return 0;
+
+	else if( rank >= stats->calls )
+		rank = stats->calls - 1;
+
+	for( i = 0; i < GB_BENCH_BUCKETS; ++i ){
+		seen += stats->histogram[i];
+
+		if( seen > rank ){
+			top = gbBenchBucketTop(i);
+			return top < stats->max ? top : stats->max;
+		}
+	}
+
+	return stats->max;
+}
+
+/*
+ * Keys are the prefix of their id, of the same width for every prefix so
+ * that each one matches keyspace / prefixes keys, followed by the id and
+ * padded to a length which only depends on the id.
+ */
+static size_t gbBenchPrefix( unsigned long long id, char *buffer ){
+	int width = snprintf( NULL, 0, "%u", gbBench.prefixes - 1 );
+
+	return sprintf( buffer, "p%0*llu:", width, id % gbBench.prefixes );
+}
+
+static size_t gbBenchKey( unsigned long long id, char *buffer ){
+	uint64_t state = id * 0x9E3779B97F4A7C15ULL + 1;
+	size_t len = gbBenchPrefix( id, buffer ),
+		   size = gbBenchRange( &state, gbBench.kmin, gbBench.kmax );
+
+	len += sprintf( buffer + len, "%llu", id / gbBench.prefixes );
+
+	while( len < size )
+		buffer[len++] = 'x';
+
+	return len;
+}
+
+static char *gbBenchReserve( char *buffer, size_t *capacity, size_t needed ){
+	if( needed > *capacity ){
+		*capacity = needed * 2;
+
+		if( ( buffer = realloc( buffer, *capacity ) ) == NULL ){
+			fprintf( stderr, "Out of memory.\n" );
+			exit(1);
+		}
+	}
+
+	return buffer;
+}
+
+// append a request for operation 'op' to the pipeline of the connection
+static void gbBenchRequest( gbBenchThread *thread, gbBenchConn *conn, int op ){
+	unsigned long long id = gbBenchRandom( &thread->seed ) % gbBench.keyspace;
+	char key[0xFFF], *p;
+	size_t klen, vlen = 0;
+	unsigned int ttl = 0;
+	short opcode = gbBenchOps[op].op;
+	int size;
+
+	if( conn->fill < gbBench.keyspace ){
+		id	 = conn->fill;
+		op	 = -1;
+		opcode = OP_SET;
+		conn->fill += gbBench.clients;
+	}
+
+	if( opcode == OP_MGET || opcode == OP_COUNT )
+		klen = gbBenchPrefix( id, key );
+
+	else if( opcode == OP_INC ){
+		klen  = gbBenchPrefix( id, key );
+		klen += sprintf( key + klen, "#%llu", id % GB_BENCH_COUNTERS );
+	}
+	else
+		klen = gbBenchKey( id, key );
+
+	if( opcode == OP_SET ){
+		vlen = gbBenchRange( &thread->seed, gbBench.vmin, gbBench.vmax );
+
+		if( gbBench.ttlrate && gbBenchRandom( &thread->seed ) % 100 < gbBench.ttlrate )
+			ttl = gbBench.ttl;
+	}
+
+	conn->out = gbBenchReserve( conn->out, &conn->ocapacity, conn->osize + sizeof(int) + sizeof(short) + 16 + klen + 1 + vlen );
+
+	p = conn->out + conn->osize + sizeof(int);
+
+	memcpy( p, &opcode, sizeof(short) );
+	p += sizeof(short);
+
+	if( opcode == OP_SET )
+		p += sprintf( p, "%u ", ttl );
+
+	memcpy( p, key, klen );
+	p += klen;
+
+	if( opcode == OP_SET ){
+		*p++ = ' ';
+		memcpy( p, gbBench.value, vlen );
+		p += vlen;
+	}
+
+	size = p - ( conn->out + conn->osize + sizeof(int) );
+	memcpy( conn->out + conn->osize, &size, sizeof(int) );
+
+	conn->osize += sizeof(int) + size;
+	conn->ops[ conn->pending++ ] = op;
+}
+
+static int gbBenchPickOp( gbBenchThread *thread ){
+	unsigned int r = gbBenchRandom( &thread->seed ) % gbBench.weights;
+	size_t i;
+
+	for( i = 0; i < GB_BENCH_OPS; ++i ){
+		if( r < gbBenchOps[i].weight )
+			return i;
+
+		r -= gbBenchOps[i].weight;
+	}
+
+	return 0;
+}
+
+static int gbBenchSend( gbBenchThread *thread, gbBenchConn *conn ){
+	size_t wrote = 0;
+	ssize_t n;
+
+	conn->osize	  =
+	conn->pending =
+	conn->next	  = 0;
+
+	while( conn->pending < gbBench.pipeline && ( conn->left || conn->fill < gbBench.keyspace ) ){
+		if( conn->fill >= gbBench.keyspace )
+			--conn->left;
+
+		gbBenchRequest( thread, conn, gbBenchPickOp( thread ) );
+	}
+
+	conn->sent = gbBenchClock();
+
+	while( wrote < conn->osize ){
+		if( ( n = write( conn->fd, conn->out + wrote, conn->osize - wrote ) ) <= 0 ){
+			if( n < 0 && errno == EINTR )
+				continue;
+
+			fprintf( stderr, "Error writing the requests : %s\n", strerror(errno) );
+			return -1;
+		}
+
+		wrote += n;
+	}
+
+	return 0;
+}
+
+// parse the complete replies read so far, returns -1 on errors
+static int gbBenchReceive( gbBenchThread *thread, gbBenchConn *conn ){
+	unsigned long long now, latency;
+	size_t done = 0, size;
+	gbBenchStats *stats;
+	short code;
+	ssize_t n;
+
+	conn->in = gbBenchReserve( conn->in, &conn->icapacity, conn->isize + 65536 );
+
+	if( ( n = read( conn->fd, conn->in + conn->isize, conn->icapacity - conn->isize ) ) <= 0 ){
+		if( n < 0 && errno == EINTR )
+			return 0;
+
+		fprintf( stderr, "Error reading the replies : %s\n", n == 0 ? "connection closed" : strerror(errno) );
+		return -1;
+	}
+
+	conn->isize += n;
+	now = gbBenchClock();
+
+	while( conn->isize - done >= GB_BENCH_REPLY_HEADER ){
+		memcpy( &size, conn->in + done + sizeof(short) + sizeof(gbItemEncoding), sizeof(size_t) );
+
+		if( conn->isize - done < GB_BENCH_REPLY_HEADER + size ){
+			conn->in = gbBenchReserve( conn->in, &conn->icapacity, GB_BENCH_REPLY_HEADER + size );
+			break;
+		}
+
+		memcpy( &code, conn->in + done, sizeof(short) );
+
+		// fill requests are not accounted
+		if( conn->ops[ conn->next ] >= 0 ){
+			stats	= &thread->stats[ conn->ops[ conn->next ] ];
+			latency = now - conn->sent;
+
+			++stats->calls;
+			++stats->histogram[ gbBenchBucket( latency ) ];
+
+			if( latency > stats->max )
+				stats->max = latency;
+
+			if( code == REPL_ERR_NOT_FOUND )
+				++stats->misses;
+
+			else if( code != REPL_OK && code != REPL_VAL && code != REPL_KVAL )
+				++stats->errors;
+		}
+
+		++conn->next;
+		done += GB_BENCH_REPLY_HEADER + size;
+	}
+
+	if( done ){
+		conn->isize -= done;
+		memmove( conn->in, conn->in + done, conn->isize );
+	}
+
+	return 0;
+}
+
+static int gbBenchConnect( void ){
+	int fd = -1, one = 1;
+
+	if( gbBench.socket ){
+		struct sockaddr_un sa;
+
+		memset( &sa, 0x00, sizeof(sa) );
+		sa.sun_family = AF_UNIX;
+		strncpy( sa.sun_path, gbBench.socket, sizeof(sa.sun_path) - 1 );
+
+		if( ( fd = socket( AF_UNIX, SOCK_STREAM, 0 ) ) < 0 || connect( fd, (struct sockaddr *)&sa, sizeof(sa) ) < 0 ){
+			fprintf( stderr, "Unable to connect to %s : %s\n", gbBench.socket, strerror(errno) );
+			exit(1);
+		}
+	}
+	else {
+		struct addrinfo hints, *res = NULL;
+		char port[16];
+
+		memset( &hints, 0x00, sizeof(hints) );
+		hints.ai_family	  = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		sprintf( port, "%d", gbBench.port );
+
+		if( getaddrinfo( gbBench.host, port, &hints, &res ) != 0 ||
+			( fd = socket( res->ai_family, res->ai_socktype, res->ai_protocol ) ) < 0 ||
+			connect( fd, res->ai_addr, res->ai_addrlen ) < 0 ){
+			fprintf( stderr, "Unable to connect to %s:%d : %s\n", gbBench.host, gbBench.port, strerror(errno) );
+			exit(1);
+		}
+
+		setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+		freeaddrinfo( res );
+	}
+
+	return fd;
+}
+
+static void *gbBenchThreadMain( void *data ){
+	gbBenchThread *thread = data;
+	struct pollfd *fds = calloc( thread->nconns, sizeof(struct pollfd) );
+	gbBenchConn *conn;
+	int i, active = thread->nconns;
+
+	for( i = 0; i < thread->nconns; ++i ){
+		fds[i].fd	  = thread->conns[i].fd;
+		fds[i].events = POLLIN;
+
+		if( gbBenchSend( thread, &thread->conns[i] ) < 0 )
+			exit(1);
+	}
+
+	while( active ){
+		if( poll( fds, thread->nconns, -1 ) < 0 ){
+			if( errno == EINTR )
+				continue;
+
+			fprintf( stderr, "Error polling the connections : %s\n", strerror(errno) );
+			exit(1);
+		}
+
+		for( i = 0; i < thread->nconns; ++i ){
+			conn = &thread->conns[i];
+
+			if( fds[i].fd < 0 || fds[i].revents == 0 )
+				continue;
+
+			else if( gbBenchReceive( thread, conn ) < 0 )
+				exit(1);
+
+			// the whole pipeline is back
+			if( conn->next == conn->pending ){
+				if( conn->left == 0 && conn->fill >= gbBench.keyspace ){
+					fds[i].fd = -1;
+					--active;
+				}
+				else if( gbBenchSend( thread, conn ) < 0 )
+					exit(1);
+			}
+		}
+	}
+
+	free( fds );
+
+	return NULL;
+}
+
+/*
+ * Run every thread until each connection sent its share of 'requests', if
+ * 'fill' is set the connections first set every key of the keyspace.
+ */
+static double gbBenchRun( gbBenchThread *threads, int fill ){
+	unsigned long long start, share = gbBench.requests / gbBench.clients;
+	int i, j, c = 0;
+
+	for( i = 0; i < gbBench.threads; ++i ){
+		for( j = 0; j < threads[i].nconns; ++j, ++c ){
+			gbBenchConn *conn = &threads[i].conns[j];
+
+			conn->left = fill ? 0 : share + ( c < (int)( gbBench.requests % gbBench.clients ) );
+			conn->fill = fill ? (unsigned long long)c : gbBench.keyspace;
+		}
+	}
+
+	start = gbBenchClock();
+
+	for( i = 0; i < gbBench.threads; ++i ){
+		if( pthread_create( &threads[i].thread, NULL, gbBenchThreadMain, &threads[i] ) != 0 ){
+			fprintf( stderr, "Unable to start the threads.\n" );
+			exit(1);
+		}
+	}
+
+	for( i = 0; i < gbBench.threads; ++i ){
+		pthread_join( threads[i].thread, NULL );
+	}
+
+	return ( gbBenchClock() - start ) / 1e9;
+}
+
+static void gbBenchReport( const char *name, gbBenchStats *stats, double elapsed ){
+	printf( "%-8s %10llu %10llu %8llu %12.2f %9.3f %9.3f %9.3f %9.3f\n",
+			name,
+			stats->calls,
+			stats->misses,
+			stats->errors,
+			stats->calls / elapsed,
+			gbBenchPercentile( stats, 0.50 ) / 1e6,
+			gbBenchPercentile( stats, 0.99 ) / 1e6,
+			gbBenchPercentile( stats, 0.999 ) / 1e6,
+			stats->max / 1e6 );
+}
+
+static void gbBenchParseRange( const char *value, size_t *min, size_t *max ){
+	unsigned long a = 0, b = 0;
+	int n = sscanf( value, "%lu-%lu", &a, &b );
+
+	if( n < 1 || a == 0 || ( n == 2 && b < a ) ){
+		fprintf( stderr, "Invalid size range '%s'.\n", value );
+		exit(1);
+	}
+
+	*min = a;
+	*max = n == 2 ? b : a;
+}
+
+static void gbBenchParseMix( char *value ){
+	char *tok, *save = NULL, *sep;
+	size_t i;
+
+	for( i = 0; i < GB_BENCH_OPS; ++i ){
+		gbBenchOps[i].weight = 0;
+	}
+
+	for( tok = strtok_r( value, ",", &save ); tok; tok = strtok_r( NULL, ",", &save ) ){
+		if( ( sep = strchr( tok, ':' ) ) == NULL ){
+			fprintf( stderr, "Invalid operation mix entry '%s'.\n", tok );
+			exit(1);
+		}
+
+		*sep = 0x00;
+
+		for( i = 0; i < GB_BENCH_OPS && strcmp( gbBenchOps[i].name, tok ); ++i );
+
+		if( i == GB_BENCH_OPS ){
+			fprintf( stderr, "Unknown operation '%s'.\n", tok );
+			exit(1);
+		}
+
+		gbBenchOps[i].weight = atoi( sep + 1 );
+	}
+}
+
+static void gbBenchHelp( char **argv, int exitcode ){
+	printf( "%s [options]\n\n", argv[0] );
+
+	printf( "  -h, --help             Print this help and exit.\n" );
+	printf( "  -s, --socket PATH      Connect to the unix socket PATH.\n" );
+	printf( "  -H, --host HOST        Connect to HOST, default %s.\n", gbBench.host );
+	printf( "  -p, --port PORT        Connect to PORT, default %d.\n", gbBench.port );
+	printf( "  -c, --clients N        Number of connections, default %d.\n", gbBench.clients );
+	printf( "  -t, --threads N        Number of threads driving the connections, default %d.\n", gbBench.threads );
+	printf( "  -n, --requests N       Total number of requests, default %llu.\n", gbBench.requests );
+	printf( "  -P, --pipeline N       Requests sent at once by each connection, default %d.\n", gbBench.pipeline );
+	printf( "  -k, --key-size N[-M]   Key size, or range of key sizes, default %zu.\n", gbBench.kmin );
+	printf( "  -v, --value-size N[-M] Value size, or range of value sizes, default %zu.\n", gbBench.vmin );
+	printf( "  -K, --keyspace N       Number of distinct keys, default %llu.\n", gbBench.keyspace );
+	printf( "  -x, --prefixes N       Number of key prefixes, MGET and COUNT match keyspace / N keys, default %u.\n", gbBench.prefixes );
+	printf( "  -T, --ttl P:S          Set a TTL of S seconds on P percent of the SET requests.\n" );
+	printf( "  -m, --mix LIST         Operations mix, default get:80,set:20 out of get, set, mget, count and inc.\n" );
+	printf( "  -f, --no-fill          Don't set every key before the run.\n" );
+	printf( "  -r, --seed N           Random seed.\n\n" );
+
+	exit(exitcode);
+}
+
+int main( int argc, char **argv ){
+	static struct option long_options[] =
+	{
+		{"help",	   no_argument,		  0, 'h'},
+		{"socket",	   required_argument, 0, 's'},
+		{"host",	   required_argument, 0, 'H'},
+		{"port",	   required_argument, 0, 'p'},
+		{"clients",	   required_argument, 0, 'c'},
+		{"threads",	   required_argument, 0, 't'},
+		{"requests",   required_argument, 0, 'n'},
+		{"pipeline",   required_argument, 0, 'P'},
+		{"key-size",   required_argument, 0, 'k'},
+		{"value-size", required_argument, 0, 'v'},
+		{"keyspace",   required_argument, 0, 'K'},
+		{"prefixes",   required_argument, 0, 'x'},
+		{"ttl",		   required_argument, 0, 'T'},
+		{"mix",		   required_argument, 0, 'm'},
+		{"no-fill",	   no_argument,		  0, 'f'},
+		{"seed",	   required_argument, 0, 'r'},
+		{0, 0, 0, 0}
+	};
+	gbBenchThread *threads = NULL;
+	gbBenchStats total;
+	double elapsed;
+	size_t i, op;
+	int c, j, t, option_index = 0;
+
+	gbBench.seed = time(NULL);
+
+	while( ( c = getopt_long( argc, argv, "hs:H:p:c:t:n:P:k:v:K:x:T:m:fr:", long_options, &option_index ) ) != -1 ){
+		switch( c ){
+			case 's': gbBench.socket   = optarg; break;
+			case 'H': gbBench.host	   = optarg; break;
+			case 'p': gbBench.port	   = atoi( optarg ); break;
+			case 'c': gbBench.clients  = atoi( optarg ); break;
+			case 't': gbBench.threads  = atoi( optarg ); break;
+			case 'n': gbBench.requests = strtoull( optarg, NULL, 10 ); break;
+			case 'P': gbBench.pipeline = atoi( optarg ); break;
+			case 'k': gbBenchParseRange( optarg, &gbBench.kmin, &gbBench.kmax ); break;
+			case 'v': gbBenchParseRange( optarg, &gbBench.vmin, &gbBench.vmax ); break;
+			case 'K': gbBench.keyspace = strtoull( optarg, NULL, 10 ); break;
+			case 'x': gbBench.prefixes = atoi( optarg ); break;
+			case 'm': gbBenchParseMix( optarg ); break;
+			case 'f': gbBench.fill	   = 0; break;
+			case 'r': gbBench.seed	   = strtoull( optarg, NULL, 10 ); break;
+			case 'T':
+				if( sscanf( optarg, "%u:%u", &gbBench.ttlrate, &gbBench.ttl ) != 2 || gbBench.ttlrate > 100 ){
+					fprintf( stderr, "Invalid TTL mix '%s'.\n", optarg );
+					exit(1);
+				}
+			break;
+			case 'h': gbBenchHelp( argv, 0 ); break;
+			default:  gbBenchHelp( argv, 1 );
+		}
+	}
+
+	for( i = 0, gbBench.weights = 0; i < GB_BENCH_OPS; ++i ){
+		gbBench.weights += gbBenchOps[i].weight;
+	}
+
+	if( gbBench.clients < 1 || gbBench.threads < 1 || gbBench.keyspace < 1 || gbBench.prefixes < 1 ||
+		gbBench.pipeline < 1 || gbBench.pipeline > GB_BENCH_MAX_PIPELINE || gbBench.weights == 0 || gbBench.kmax >= 0xF00 ){
+		fprintf( stderr, "Invalid options.\n" );
+		exit(1);
+	}
+
+	if( gbBench.threads > gbBench.clients )
+		gbBench.threads = gbBench.clients;
+
+	gbBench.value = malloc( gbBench.vmax );
+	for( i = 0; i < gbBench.vmax; ++i ){
+		gbBench.value[i] = 'a' + i % 26;
+	}
+
+	threads = calloc( gbBench.threads, sizeof(gbBenchThread) );
+
+	for( t = 0, c = 0; t < gbBench.threads; ++t ){
+		threads[t].nconns = gbBench.clients / gbBench.threads + ( t < gbBench.clients % gbBench.threads );
+		threads[t].conns  = calloc( threads[t].nconns, sizeof(gbBenchConn) );
+		threads[t].seed	  = gbBench.seed * ( t + 1 ) + 0x9E3779B97F4A7C15ULL;
+
+		for( j = 0; j < threads[t].nconns; ++j, ++c ){
+			threads[t].conns[j].fd = gbBenchConnect();
+		}
+	}
+
+	printf( "%d clients, %d threads, pipeline %d, %llu requests\n", gbBench.clients, gbBench.threads, gbBench.pipeline, gbBench.requests );
+	printf( "%llu keys of %zu-%zu bytes in %u prefixes, values of %zu-%zu bytes, %u%% of them with a %us ttl\n\n",
+			gbBench.keyspace, gbBench.kmin, gbBench.kmax, gbBench.prefixes, gbBench.vmin, gbBench.vmax, gbBench.ttlrate, gbBench.ttl );
+
+	if( gbBench.fill ){
+		elapsed = gbBenchRun( threads, 1 );
+		printf( "Keyspace filled in %.2fs, %.2f keys/s\n\n", elapsed, gbBench.keyspace / elapsed );
+	}
+
+	elapsed = gbBenchRun( threads, 0 );
+
+	printf( "%-8s %10s %10s %8s %12s %9s %9s %9s %9s\n", "op", "requests", "misses", "errors", "req/s", "p50 ms", "p99 ms", "p99.9 ms", "max ms" );
+
+	memset( &total, 0x00, sizeof(total) );
+
+	for( op = 0; op < GB_BENCH_OPS; ++op ){
+		gbBenchStats stats;
+
+		memset( &stats, 0x00, sizeof(stats) );
+
+		for( t = 0; t < gbBench.threads; ++t ){
+			gbBenchStats *ts = &threads[t].stats[op];
+
+			stats.calls	 += ts->calls;
+			stats.misses += ts->misses;
+			stats.errors += ts->errors;
+			stats.max	  = ts->max > stats.max ? ts->max : stats.max;
+
+			for( i = 0; i < GB_BENCH_BUCKETS; ++i ){
+				stats.histogram[i] += ts->histogram[i];
+			}
+		}
+
+		if( stats.calls == 0 )
+			continue;
+
+		gbBenchReport( gbBenchOps[op].name, &stats, elapsed );
+
+		total.calls	 += stats.calls;
+		total.misses += stats.misses;
+		total.errors += stats.errors;
+		total.max	  = stats.max > total.max ? stats.max : total.max;
+
+		for( i = 0; i < GB_BENCH_BUCKETS; ++i ){
+			total.histogram[i] += stats.histogram[i];
+		}
+	}
+
+	gbBenchReport( "total", &total, elapsed );
+
+	return 0;
+}
@@ -0,0 +1,494 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Microbenchmarks of the data structures the server is built on: the
+ * tree on different key corpora, lzf on values of different sizes, the
+ * lists used by the multi key operators and the allocators.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "atree.h"
+#include "llist.h"
+#include "zmem.h"
+#include "lzf.h"
+
+typedef struct
+{
+	const char *name;
+	void	  (*run)( void );
+}
+gbMicroSuite;
+
+static struct
+{
+	size_t		keys;
+	const char *filter;
+	int			csv;
+	uint64_t	seed;
+}
+gbMicro = {
+	.keys	= 200000,
+	.filter = NULL,
+	.csv	= 0,
+	.seed	= 1
+};
+
+static unsigned long long gbMicroClock( void ){
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64*
+static uint64_t gbMicroRandom( void ){
+	gbMicro.seed ^= gbMicro.seed >> 12;
+	gbMicro.seed ^= gbMicro.seed << 25;
+	gbMicro.seed ^= gbMicro.seed >> 27;
+
+	return gbMicro.seed * 2685821657736338717ULL;
+}
+
+/*
+ * Print a result, 'metric' is an optional extra measure of the case
+ * such as the memory per key or the compression ratio.
+ */
+static void gbMicroReport( const char *suite, const char *name, const char *variant, size_t ops, unsigned long long elapsed, const char *metric, double value ){
+	double nsop = ops ? (double)elapsed / ops : 0;
+
+	if( gbMicro.csv )
+		printf( "%s,%s,%s,%zu,%.2f,%s,%.2f\n", suite, name, variant, ops, nsop, metric ? metric : "", metric ? value : 0.0 );
+
+	else if( metric )
+		printf( "%-6s %-14s %-12s %10zu %12.2f ns/op %12.2f %s\n", suite, name, variant, ops, nsop, value, metric );
+
+	else
+		printf( "%-6s %-14s %-12s %10zu %12.2f ns/op\n", suite, name, variant, ops, nsop );
+}
+
+/*
+ * Key corpora, every key is a zero terminated string inside a single
+ * buffer.
+ */
+typedef struct
+{
+	const char *name;
+	char	  **keys;
+	int		   *lens;
+	char	   *data;
+	size_t		n;
+	// prefixes of about 100 keys each, for the iterator scans
+	char	  **prefixes;
+	int		   *plens;
+	size_t		nprefixes;
+}
+gbMicroCorpus;
+
+static const char gbMicroAlphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+
+static void gbMicroCorpusKey( const char *corpus, size_t i, char *key ){
+	size_t j, len;
+
+	if( strcmp( corpus, "sequential" ) == 0 )
+		sprintf( key, "key:%010zu", i );
+
+	else if( strcmp( corpus, "shared" ) == 0 )
+		sprintf( key, "app:users:profile:settings:%zu:%zu", i % 1000, i / 1000 );
+
+	else if( strcmp( corpus, "uuid" ) == 0 ){
+		uint64_t a = gbMicroRandom(), b = gbMicroRandom();
+
+		sprintf( key, "%08x-%04x-4%03x-%04x-%012llx",
+				 (unsigned)( a >> 32 ), (unsigned)( a >> 16 ) & 0xffff, (unsigned)a & 0xfff,
+				 (unsigned)( 0x8000 | ( ( b >> 48 ) & 0x3fff ) ), (unsigned long long)( b & 0xffffffffffffULL ) );
+	}
+	else {
+		len = 8 + gbMicroRandom() % 25;
+
+		for( j = 0; j < len; ++j ){
+			key[j] = gbMicroAlphabet[ gbMicroRandom() % ( sizeof(gbMicroAlphabet) - 1 ) ];
+		}
+
+		key[len] = 0x00;
+	}
+}
+
+static void gbMicroCorpusCreate( gbMicroCorpus *corpus, const char *name, size_t n ){
+	char key[128];
+	size_t i, size = 0, offset = 0;
+
+	corpus->name = name;
+	corpus->n	 = n;
+	corpus->keys = malloc( n * sizeof(char *) );
+	corpus->lens = malloc( n * sizeof(int) );
+	corpus->data = malloc( n * 64 );
+
+	for( i = 0; i < n; ++i ){
+		gbMicroCorpusKey( name, i, key );
+
+		size = strlen( key ) + 1;
+
+		memcpy( corpus->data + offset, key, size );
+		corpus->lens[i] = size - 1;
+		offset += size;
+	}
+
+	for( i = 0, offset = 0; i < n; ++i ){
+		corpus->keys[i] = corpus->data + offset;
+		offset += corpus->lens[i] + 1;
+	}
+
+	// the first bytes of sorted keys are a prefix matching about 100 of them,
+	// a sample of the keys is enough to pick them
+	corpus->nprefixes = n / 100 ? n / 100 : 1;
+	corpus->prefixes  = malloc( corpus->nprefixes * sizeof(char *) );
+	corpus->plens	  = malloc( corpus->nprefixes * sizeof(int) );
+
+	for( i = 0; i < corpus->nprefixes; ++i ){
+		size_t k = gbMicroRandom() % n;
+		int len = corpus->lens[k];
+
+		if( strcmp( name, "sequential" ) == 0 )
+			len -= 2;
+		else if( strcmp( name, "shared" ) == 0 )
+			len = strchr( corpus->keys[k] + 27, ':' ) - corpus->keys[k] + 1;
+		else {
+			// log36( n / 100 ) characters select about 100 keys
+			size_t m = n / 100;
+
+			for( len = 0; m > 1; m /= 36, ++len );
+			len = len ? len : 1;
+		}
+
+		corpus->prefixes[i] = corpus->keys[k];
+		corpus->plens[i]	= len;
+	}
+}
+
+static void gbMicroCorpusFree( gbMicroCorpus *corpus ){
+	free( corpus->keys );
+	free( corpus->lens );
+	free( corpus->data );
+	free( corpus->prefixes );
+	free( corpus->plens );
+}
+
+static void gbMicroShuffle( size_t *order, size_t n ){
+	size_t i, j, t;
+
+	for( i = 0; i < n; ++i ){
+		order[i] = i;
+	}
+
+	for( i = n - 1; i > 0; --i ){
+		j = gbMicroRandom() % ( i + 1 );
+		t = order[i]; order[i] = order[j]; order[j] = t;
+	}
+}
+
+static void gbMicroTree( void ){
+	static const char *corpora[] = { "sequential", "random", "shared", "uuid" };
+	gbMicroCorpus corpus;
+	atree_t tree;
+	at_iterator_t it;
+	size_t *order = malloc( gbMicro.keys * sizeof(size_t) );
+	size_t c, i, found, before;
+	unsigned long long start;
+	char miss[128];
+
+	for( c = 0; c < sizeof(corpora) / sizeof(corpora[0]); ++c ){
+		gbMicroCorpusCreate( &corpus, corpora[c], gbMicro.keys );
+		gbMicroShuffle( order, corpus.n );
+
+		at_init_tree( tree );
+		at_init_iterator( it );
+
+		before = at_memory_used();
+		start  = gbMicroClock();
+
+		for( i = 0; i < corpus.n; ++i ){
+			at_insert( &tree, (unsigned char *)corpus.keys[i], corpus.lens[i], corpus.keys[i] );
+		}
+
+		// keys may repeat in the random corpora
+		gbMicroReport( "atree", "insert", corpus.name, corpus.n, gbMicroClock() - start, "bytes/key", (double)( at_memory_used() - before ) / tree.count );
+
+		start = gbMicroClock();
+		for( i = 0, found = 0; i < corpus.n; ++i ){
+			found += at_find( &tree, (unsigned char *)corpus.keys[ order[i] ], corpus.lens[ order[i] ] ) != NULL;
+		}
+		gbMicroReport( "atree", "find", corpus.name, corpus.n, gbMicroClock() - start, "hits", found );
+
+		start = gbMicroClock();
+		for( i = 0, found = 0; i < corpus.n; ++i ){
+			memcpy( miss, corpus.keys[ order[i] ], corpus.lens[ order[i] ] );
+			miss[ corpus.lens[ order[i] ] - 1 ] = '#';
+
+			found += at_find( &tree, (unsigned char *)miss, corpus.lens[ order[i] ] ) != NULL;
+		}
+		gbMicroReport( "atree", "find-miss", corpus.name, corpus.n, gbMicroClock() - start, "hits", found );
+
+		// prefix scans, per key visited
+		start = gbMicroClock();
+		for( i = 0, found = 0; i < corpus.nprefixes; ++i ){
+			at_iterator_seek( &it, &tree, (unsigned char *)corpus.prefixes[i], corpus.plens[i] );
+
+			while( at_iterator_next( &it ) )
+				++found;
+		}
+		gbMicroReport( "atree", "search", corpus.name, found, gbMicroClock() - start, "keys/scan", (double)found / corpus.nprefixes );
+
+		start = gbMicroClock();
+		for( i = 0, found = 0; i < corpus.nprefixes; ++i ){
+			found += at_count( &tree, (unsigned char *)corpus.prefixes[i], corpus.plens[i] );
+		}
+		gbMicroReport( "atree", "count", corpus.name, corpus.nprefixes, gbMicroClock() - start, "keys/count", (double)found / corpus.nprefixes );
+
+		start = gbMicroClock();
+		for( i = 0; i < corpus.n; ++i ){
+			at_remove( &tree, (unsigned char *)corpus.keys[ order[i] ], corpus.lens[ order[i] ] );
+		}
+		gbMicroReport( "atree", "remove", corpus.name, corpus.n, gbMicroClock() - start, "bytes left", at_memory_used() - before );
+
+		at_iterator_free( &it );
+		at_free( &tree );
+		gbMicroCorpusFree( &corpus );
+	}
+
+	free( order );
+}
+
+// json looking records, compressible about as much as real cached objects
+static size_t gbMicroValue( char *buffer, size_t size ){
+	size_t len = 0;
+
+	while( len < size ){
+		len += snprintf( buffer + len, size - len + 1, "{\"id\":%u,\"name\":\"user%u\",\"score\":%u.%02u,\"active\":%s},",
+						 (unsigned)( gbMicroRandom() % 1000000 ), (unsigned)( gbMicroRandom() % 100000 ),
+						 (unsigned)( gbMicroRandom() % 1000 ), (unsigned)( gbMicroRandom() % 100 ),
+						 gbMicroRandom() % 2 ? "true" : "false" );
+	}
+
+	return size;
+}
+
+static void gbMicroLzf( void ){
+	static const size_t sizes[] = { 64, 256, 1024, 4096, 16384, 65536 };
+	char variant[32], *value, *compressed, *decompressed;
+	size_t s, i, size, csize = 0, iterations;
+	unsigned long long start;
+
+	for( s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s ){
+		size		 = sizes[s];
+		value		 = malloc( size + 1 );
+		compressed	 = malloc( size * 2 );
+		decompressed = malloc( size );
+		iterations	 = ( 64 << 20 ) / size;
+
+		gbMicroValue( value, size );
+		sprintf( variant, "%zu", size );
+
+		start = gbMicroClock();
+		for( i = 0; i < iterations; ++i ){
+			csize = lzf_compress( value, size, compressed, size * 2 );
+		}
+		gbMicroReport( "lzf", "compress", variant, iterations, gbMicroClock() - start, "saved %", csize ? 100.0 - csize * 100.0 / size : 0 );
+
+		start = gbMicroClock();
+		for( i = 0; i < iterations; ++i ){
+			lzf_decompress( compressed, csize, decompressed, size );
+		}
+		gbMicroReport( "lzf", "decompress", variant, iterations, gbMicroClock() - start, "MB/s", (double)size * iterations / ( ( gbMicroClock() - start ) / 1e9 ) / ( 1 << 20 ) );
+
+		if( memcmp( value, decompressed, size ) != 0 ){
+			fprintf( stderr, "lzf round trip of %zu bytes failed.\n", size );
+			exit(1);
+		}
+
+		free( value );
+		free( compressed );
+		free( decompressed );
+	}
+}
+
+/*
+ * The multi key operators append their keys and values to preallocated
+ * lists and reset them once the reply is sent.
+ */
+static void gbMicroList( void ){
+	static const size_t lengths[] = { 16, 64, 255, 1024 };
+	llist_t *list = ll_prealloc( 255 );
+	size_t l, i, r, rounds;
+	unsigned long long start;
+	char variant[32];
+
+	for( l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l ){
+		rounds = 1 + ( 1 << 20 ) / ( lengths[l] * lengths[l] / 16 + 1 );
+
+		sprintf( variant, "%zu", lengths[l] );
+
+		start = gbMicroClock();
+		for( r = 0; r < rounds; ++r ){
+			for( i = 0; i < lengths[l]; ++i ){
+				ll_append( list, (void *)( i + 1 ) );
+			}
+
+			ll_reset( list );
+		}
+		gbMicroReport( "llist", "append+reset", variant, rounds * lengths[l], gbMicroClock() - start, NULL, 0 );
+	}
+
+	ll_destroy( list );
+}
+
+static void gbMicroMemory( void ){
+	static const size_t sizes[] = { 16, 64, 256, 1024, 4096 };
+	size_t s, i, n = gbMicro.keys, *lens = malloc( n * sizeof(size_t) );
+	void **ptrs = malloc( n * sizeof(void *) ), *p;
+	unsigned long long start;
+	char variant[32];
+
+	for( s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s ){
+		sprintf( variant, "%zu", sizes[s] );
+
+		start = gbMicroClock();
+		for( i = 0; i < n; ++i ){
+			p = zmalloc( sizes[s] );
+			zfree( p );
+		}
+		gbMicroReport( "zmem", "zmalloc+zfree", variant, n, gbMicroClock() - start, NULL, 0 );
+
+		start = gbMicroClock();
+		for( i = 0; i < n; ++i ){
+			p = zslab_alloc( sizes[s] );
+			zslab_free( p, sizes[s] );
+		}
+		gbMicroReport( "zmem", "zslab", variant, n, gbMicroClock() - start, NULL, 0 );
+	}
+
+	// a population of items of mixed sizes, freed in random order
+	for( i = 0; i < n; ++i ){
+		lens[i] = 16 + gbMicroRandom() % 497;
+	}
+
+	start = gbMicroClock();
+	for( i = 0; i < n; ++i ){
+		ptrs[i] = zmalloc( lens[i] );
+	}
+	for( i = 0; i < n; ++i ){
+		size_t j = gbMicroRandom() % n;
+
+		p = ptrs[i]; ptrs[i] = ptrs[j]; ptrs[j] = p;
+	}
+	for( i = 0; i < n; ++i ){
+		zfree( ptrs[i] );
+	}
+	gbMicroReport( "zmem", "zmalloc-mixed", "16-512", n, gbMicroClock() - start, NULL, 0 );
+
+	start = gbMicroClock();
+	for( i = 0; i < n; ++i ){
+		ptrs[i] = zslab_alloc( lens[i] );
+	}
+	gbMicroReport( "zmem", "zslab-mixed", "16-512", n, gbMicroClock() - start, "bytes/object", (double)zmem_used() / n );
+
+	start = gbMicroClock();
+	for( i = 0; i < n; ++i ){
+		zslab_free( ptrs[i], lens[i] );
+	}
+	gbMicroReport( "zmem", "zslab-free", "16-512", n, gbMicroClock() - start, NULL, 0 );
+
+	zslab_release();
+
+	free( ptrs );
+	free( lens );
+}
+
+static gbMicroSuite gbMicroSuites[] = {
+	{ "atree", gbMicroTree },
+	{ "lzf",   gbMicroLzf },
+	{ "llist", gbMicroList },
+	{ "zmem",  gbMicroMemory }
+};
+
+static void gbMicroHelp( char **argv, int exitcode ){
+	printf( "%s [options]\n\n", argv[0] );
+
+	printf( "  -h, --help          Print this help and exit.\n" );
+	printf( "  -n, --keys N        Number of keys of each tree corpus and of allocations, default %zu.\n", gbMicro.keys );
+	printf( "  -s, --suite NAME    Run only the suites whose name contains NAME ( atree, lzf, llist, zmem ).\n" );
+	printf( "  -c, --csv           Print the results as comma separated values.\n" );
+	printf( "  -r, --seed N        Random seed, default %llu.\n\n", (unsigned long long)gbMicro.seed );
+
+	exit(exitcode);
+}
+
+int main( int argc, char **argv ){
+	static struct option long_options[] =
+	{
+		{"help",  no_argument,		 0, 'h'},
+		{"keys",  required_argument, 0, 'n'},
+		{"suite", required_argument, 0, 's'},
+		{"csv",	  no_argument,		 0, 'c'},
+		{"seed",  required_argument, 0, 'r'},
+		{0, 0, 0, 0}
+	};
+	size_t i;
+	int c, option_index = 0;
+
+	while( ( c = getopt_long( argc, argv, "hn:s:cr:", long_options, &option_index ) ) != -1 ){
+		switch( c ){
+			case 'n': gbMicro.keys	 = strtoull( optarg, NULL, 10 ); break;
+			case 's': gbMicro.filter = optarg; break;
+			case 'c': gbMicro.csv	 = 1; break;
+			case 'r': gbMicro.seed	 = strtoull( optarg, NULL, 10 ); break;
+			case 'h': gbMicroHelp( argv, 0 ); break;
+			default:  gbMicroHelp( argv, 1 );
+		}
+	}
+
+	if( gbMicro.keys < 100 || gbMicro.seed == 0 ){
+		fprintf( stderr, "Invalid options.\n" );
+		exit(1);
+	}
+
+	if( gbMicro.csv )
+		printf( "suite,case,variant,ops,ns_per_op,metric,value\n" );
+
+	for( i = 0; i < sizeof(gbMicroSuites) / sizeof(gbMicroSuites[0]); ++i ){
+		if( gbMicro.filter == NULL || strstr( gbMicroSuites[i].name, gbMicro.filter ) )
+			gbMicroSuites[i].run();
+	}
+
+	return 0;
+}
@@ -0,0 +1,477 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "configure.h"
+#include "codec.h"
+#include "lzf.h"
+#include "log.h"
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#include <string.h>
+#include <limits.h>
+
+typedef struct
+{
+	const char	  *name;
+	gbItemEncoding encoding;
+	// 1 if this build has it
+	byte_t		   available;
+}
+gbCodecInfo;
+
+static const gbCodecInfo gbCodecInfos[GB_CODECS] = {
+#ifdef HAVE_LZ4
+	{ "lz4",  GB_ENC_LZ4,  1 },
+#else
+	{ "lz4",  GB_ENC_LZ4,  0 },
+#endif
+	{ "lzf",  GB_ENC_LZF,  1 },
+#ifdef HAVE_ZSTD
+	{ "zstd", GB_ENC_ZSTD, 1 }
+#else
+	{ "zstd", GB_ENC_ZSTD, 0 }
+#endif
+};
+
+int gbCodecByName( const char *name ){
+	int i;
+
+	if( strcmp( name, "auto" ) == 0 )
+		return GB_CODEC_AUTO;
+
+	else if( strcmp( name, "none" ) == 0 )
+		return GB_CODEC_NONE;
+
+	for( i = 0; i < GB_CODECS; ++i ){
+		if( strcmp( name, gbCodecInfos[i].name ) == 0 )
+			return gbCodecInfos[i].available ? i : GB_ERR;
+	}
+
+	return GB_ERR;
+}
+
+const char *gbCodecName( int codec ){
+	if( codec == GB_CODEC_AUTO )
+		return "auto";
+
+	else if( codec < 0 || codec >= GB_CODECS )
+		return "none";
+
+	return gbCodecInfos[codec].name;
+}
+
+int gbCodecOfEncoding( gbItemEncoding encoding ){
+	int i;
+
+	for( i = 0; i < GB_CODECS; ++i ){
+		if( gbCodecInfos[i].encoding == encoding )
+			return i;
+	}
+
+	return GB_CODEC_NONE;
+}
+
+int gbCodecsCreate( gbServer *server, int codec, size_t prefixlen, double minrate, int dictionaries ){
+	gbCodecs *codecs = zcalloc( sizeof(gbCodecs) );
+	int i;
+
+	codecs->codec		 = codec;
+	codecs->prefixlen	 = prefixlen > GB_CODEC_PREFIX_MAX ? GB_CODEC_PREFIX_MAX : prefixlen;
+	codecs->minrate		 = minrate;
+	codecs->dictionaries = dictionaries;
+	codecs->prefixes	 = zcalloc( sizeof(gbCodecPrefix) * GB_CODEC_PREFIXES );
+
+	if( codec == GB_CODEC_AUTO ){
+		for( i = 0; i < GB_CODECS; ++i ){
+			if( gbCodecInfos[i].available )
+				codecs->candidates[ codecs->ncandidates++ ] = i;
+		}
+	}
+	else if( codec != GB_CODEC_NONE )
+		codecs->candidates[ codecs->ncandidates++ ] = codec;
+
+#ifdef HAVE_ZSTD
+	codecs->cctx = ZSTD_createCCtx();
+	codecs->dctx = ZSTD_createDCtx();
+
+	if( codecs->cctx == NULL || codecs->dctx == NULL ){
+		gbLog( ERROR, "Unable to create the zstd contexts." );
+		return GB_ERR;
+	}
+
+	// the size of the uncompressed data is already stored by the item
+	ZSTD_CCtx_setParameter( codecs->cctx, ZSTD_c_compressionLevel, GB_CODEC_ZSTD_LEVEL );
+	ZSTD_CCtx_setParameter( codecs->cctx, ZSTD_c_contentSizeFlag, 0 );
+	ZSTD_CCtx_setParameter( codecs->cctx, ZSTD_c_checksumFlag, 0 );
+#else
+	codecs->dictionaries = 0;
+#endif
+
+	server->codecs = codecs;
+
+	return GB_OK;
+}
+
+static void gbCodecPrefixReset( gbCodecs *codecs, gbCodecPrefix *p ){
+	if( p->training ){
+		zfree( p->training );
+		zfree( p->trainsizes );
+		--codecs->training;
+	}
+
+	memset( p, 0x00, sizeof(gbCodecPrefix) );
+}
+
+void gbCodecsDestroy( gbServer *server ){
+	gbCodecs *codecs = server->codecs;
+	int i;
+
+	if( codecs == NULL )
+		return;
+
+	for( i = 0; i < GB_CODEC_PREFIXES; ++i )
+		gbCodecPrefixReset( codecs, &codecs->prefixes[i] );
+
+#ifdef HAVE_ZSTD
+	for( i = 0; i < codecs->ndicts; ++i ){
+		ZSTD_freeCDict( codecs->dicts[i].cdict );
+		ZSTD_freeDDict( codecs->dicts[i].ddict );
+		zfree( codecs->dicts[i].data );
+	}
+
+	ZSTD_freeCCtx( codecs->cctx );
+	ZSTD_freeDCtx( codecs->dctx );
+#endif
+
+	zfree( codecs->prefixes );
+	zfree( codecs );
+
+	server->codecs = NULL;
+}
+
+// FNV-1a
+static unsigned int gbCodecHash( byte_t *k, size_t klen ){
+	unsigned int h = 2166136261U;
+	size_t i;
+
+	for( i = 0; i < klen; ++i )
+		h = ( h ^ k[i] ) * 16777619U;
+
+	return h;
+}
+
+// slot of the key prefix, taken over if another prefix had it
+static gbCodecPrefix *gbCodecPrefixOf( gbCodecs *codecs, byte_t *k, size_t klen ){
+	size_t len = klen < codecs->prefixlen ? klen : codecs->prefixlen;
+	gbCodecPrefix *p = &codecs->prefixes[ gbCodecHash( k, len ) % GB_CODEC_PREFIXES ];
+
+	if( p->len != len || memcmp( p->prefix, k, len ) != 0 ){
+		gbCodecPrefixReset( codecs, p );
+
+		memcpy( p->prefix, k, len );
+		p->len	 = len;
+		p->codec = GB_CODEC_NONE;
+	}
+
+	return p;
+}
+
+// the fastest codec saving enough space, GB_CODEC_NONE if none does
+static int gbCodecPick( gbCodecs *codecs, gbCodecPrefix *p ){
+	int i, c, best = GB_CODEC_NONE;
+	double rate = codecs->minrate;
+
+	for( i = 0; i < codecs->ncandidates; ++i ){
+		c = codecs->candidates[i];
+
+		if( p->samples[c] && p->rate[c] >= rate + ( best == GB_CODEC_NONE ? 0.0 : GB_CODEC_MARGIN ) ){
+			best = c;
+			rate = p->rate[c];
+		}
+	}
+
+	return best;
+}
+
+// codec to compress the next value of the prefix with
+static int gbCodecChoose( gbCodecs *codecs, gbCodecPrefix *p ){
+	unsigned long n = p->values++;
+
+	if( codecs->ncandidates == 0 )
+		return GB_CODEC_NONE;
+
+	// every candidate is measured a few times first
+	else if( n < GB_CODEC_WARMUP * codecs->ncandidates )
+		return codecs->candidates[ n % codecs->ncandidates ];
+
+	// then now and then, in case the values changed
+	else if( n % GB_CODEC_PROBE_PERIOD == 0 )
+		return codecs->candidates[ ( n / GB_CODEC_PROBE_PERIOD ) % codecs->ncandidates ];
+
+	return p->codec;
+}
+
+#ifdef HAVE_ZSTD
+static gbCodecDict *gbCodecDictById( gbCodecs *codecs, unsigned int id );
+
+/*
+ * Make a dictionary out of the 'size' bytes of 'data', which it takes the
+ * ownership of, for the prefix 'p'. Returns NULL if it can't be used.
+ */
+static gbCodecDict *gbCodecDictCreate( gbCodecs *codecs, gbCodecPrefix *p, byte_t *data, size_t size ){
+	gbCodecDict *d = &codecs->dicts[ codecs->ndicts ];
+
+	if( codecs->ndicts >= GB_CODEC_MAX_DICTS ){
+		zfree( data );
+		return NULL;
+	}
+
+	d->id	 = ZDICT_getDictID( data, size );
+	d->cdict = ZSTD_createCDict( data, size, GB_CODEC_ZSTD_LEVEL );
+	d->ddict = ZSTD_createDDict( data, size );
+
+	if( d->id == 0 || d->cdict == NULL || d->ddict == NULL ){
+		if( d->cdict ) ZSTD_freeCDict( d->cdict );
+		if( d->ddict ) ZSTD_freeDDict( d->ddict );
+
+		zfree( data );
+		return NULL;
+	}
+
+	// the raw dictionary is kept to be saved with the snapshots
+	d->data = data;
+	d->size = size;
+	d->plen = p->len;
+	memcpy( d->prefix, p->prefix, p->len );
+
+	++codecs->ndicts;
+
+	p->dict	   = d;
+	p->trained = 1;
+	// measure zstd again, with the dictionary
+	p->samples[GB_CODEC_ZSTD] = 0;
+
+	return d;
+}
+
+static void gbCodecTrain( gbServer *server, gbCodecs *codecs, gbCodecPrefix *p ){
+	byte_t *dict = zmalloc( GB_CODEC_DICT_SIZE );
+	size_t size = ZDICT_trainFromBuffer( dict, GB_CODEC_DICT_SIZE, p->training, p->trainsizes, p->ntrain );
+
+	if( ZDICT_isError( size ) ){
+		gbLog( WARNING, "Unable to train a zstd dictionary for prefix '%.*s' : %s", (int)p->len, p->prefix, ZDICT_getErrorName( size ) );
+		zfree( dict );
+	}
+	else if( gbCodecDictCreate( codecs, p, zrealloc( dict, size ), size ) )
+		gbLog( DEBUG, "Trained a %zu bytes zstd dictionary on %u values of prefix '%.*s'.", size, p->ntrain, (int)p->len, p->prefix );
+
+	zfree( p->training );
+	zfree( p->trainsizes );
+
+	p->training = NULL;
+	p->trained	= 1;
+	--codecs->training;
+}
+
+// sample the value to train the prefix dictionary, train it once enough are there
+static void gbCodecSample( gbServer *server, gbCodecs *codecs, gbCodecPrefix *p, byte_t *v, size_t vlen ){
+	if( p->trained || vlen > GB_CODEC_DICT_SAMPLE )
+		return;
+
+	if( p->training == NULL ){
+		if( codecs->ndicts + codecs->training >= GB_CODEC_MAX_DICTS )
+			return;
+
+		p->training   = zmalloc( GB_CODEC_DICT_TRAINING );
+		p->trainsizes = zmalloc( sizeof(size_t) * ( GB_CODEC_DICT_TRAINING / 64 ) );
+		p->trainsize  = 0;
+		p->ntrain	  = 0;
+		++codecs->training;
+	}
+
+	if( p->trainsize + vlen > GB_CODEC_DICT_TRAINING || p->ntrain == GB_CODEC_DICT_TRAINING / 64 ){
+		gbCodecTrain( server, codecs, p );
+		return;
+	}
+
+	memcpy( p->training + p->trainsize, v, vlen );
+	p->trainsizes[ p->ntrain++ ] = vlen;
+	p->trainsize += vlen;
+}
+
+static gbCodecDict *gbCodecDictById( gbCodecs *codecs, unsigned int id ){
+	int i;
+
+	for( i = 0; i < codecs->ndicts; ++i ){
+		if( codecs->dicts[i].id == id )
+			return &codecs->dicts[i];
+	}
+
+	return NULL;
+}
+#endif
+
+static size_t gbCodecRun( gbCodecs *codecs, gbCodecPrefix *p, int codec, byte_t *v, size_t vlen, byte_t *dst, size_t dlen ){
+	size_t size = 0;
+
+	if( codec == GB_CODEC_LZF ){
+		size = lzf_compress( v, vlen, dst, dlen );
+	}
+#ifdef HAVE_LZ4
+	else if( codec == GB_CODEC_LZ4 ){
+		if( vlen <= INT_MAX )
+			size = LZ4_compress_default( (const char *)v, (char *)dst, (int)vlen, dlen > INT_MAX ? INT_MAX : (int)dlen );
+	}
+#endif
+#ifdef HAVE_ZSTD
+	else if( codec == GB_CODEC_ZSTD ){
+		ZSTD_CCtx_refCDict( codecs->cctx, p->dict ? p->dict->cdict : NULL );
+
+		size = ZSTD_compress2( codecs->cctx, dst, dlen, v, vlen );
+		if( ZSTD_isError( size ) )
+			size = 0;
+	}
+#endif
+
+	return size;
+}
+
+size_t gbCodecCompress( gbServer *server, byte_t *k, size_t klen, byte_t *v, size_t vlen, byte_t *dst, size_t dlen, gbItemEncoding *encoding ){
+	gbCodecs *codecs = server->codecs;
+	gbCodecPrefix *p = gbCodecPrefixOf( codecs, k, klen );
+	int codec = gbCodecChoose( codecs, p );
+	size_t size = 0;
+	double rate;
+
+#ifdef HAVE_ZSTD
+	if( codecs->dictionaries )
+		gbCodecSample( server, codecs, p, v, vlen );
+#endif
+
+	if( codec == GB_CODEC_NONE ){
+		++codecs->skipped;
+		return 0;
+	}
+
+	size = gbCodecRun( codecs, p, codec, v, vlen, dst, dlen );
+	rate = size ? 100.0 - ( ( size * 100.0 ) / vlen ) : 0.0;
+
+	// recent values weight more
+	p->rate[codec] = p->samples[codec] ? p->rate[codec] * 0.75 + rate * 0.25 : rate;
+	++p->samples[codec];
+
+	if( p->values >= GB_CODEC_WARMUP * codecs->ncandidates )
+		p->codec = gbCodecPick( codecs, p );
+
+	if( size )
+		*encoding = gbCodecInfos[codec].encoding;
+
+	return size;
+}
+
+size_t gbCodecDecompress( gbServer *server, gbItem *item, byte_t *dst ){
+	size_t size = gbCompressedRawSize( item );
+
+	if( item->encoding == GB_ENC_LZF ){
+		return lzf_decompress( gbCompressedData( item ), gbCompressedSize( item ), dst, size );
+	}
+#ifdef HAVE_LZ4
+	else if( item->encoding == GB_ENC_LZ4 ){
+		int n = LZ4_decompress_safe( (const char *)gbCompressedData( item ), (char *)dst, gbCompressedSize( item ), size );
+
+		return n < 0 ? 0 : n;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	else if( item->encoding == GB_ENC_ZSTD ){
+		gbCodecs *codecs = server->codecs;
+		unsigned int id = ZSTD_getDictID_fromFrame( gbCompressedData( item ), gbCompressedSize( item ) );
+		gbCodecDict *dict = id ? gbCodecDictById( codecs, id ) : NULL;
+
+		size = dict ? ZSTD_decompress_usingDDict( codecs->dctx, dst, size, gbCompressedData( item ), gbCompressedSize( item ), dict->ddict )
+					: ZSTD_decompressDCtx( codecs->dctx, dst, size, gbCompressedData( item ), gbCompressedSize( item ) );
+
+		return ZSTD_isError( size ) ? 0 : size;
+	}
+#endif
+
+	return 0;
+}
+
+int gbCodecDictLoad( gbServer *server, byte_t *prefix, size_t plen, byte_t *data, size_t size ){
+#ifdef HAVE_ZSTD
+	gbCodecs *codecs = server->codecs;
+	gbCodecPrefix *p = NULL;
+	unsigned int id = ZDICT_getDictID( data, size );
+
+	// already loaded from the snapshot of another shard
+	if( id && gbCodecDictById( codecs, id ) )
+		return GB_OK;
+
+	else if( plen > GB_CODEC_PREFIX_MAX )
+		return GB_ERR;
+
+	p = gbCodecPrefixOf( codecs, prefix, plen );
+
+	if( p->training ){
+		zfree( p->training );
+		zfree( p->trainsizes );
+
+		p->training = NULL;
+		--codecs->training;
+	}
+
+	return gbCodecDictCreate( codecs, p, zmemdup( data, size ), size ) ? GB_OK : GB_ERR;
+#else
+	return GB_ERR;
+#endif
+}
+
+int gbCodecCanDecompress( gbServer *server, gbItemEncoding encoding, byte_t *data, size_t size ){
+	int codec = gbCodecOfEncoding( encoding );
+
+	if( codec == GB_CODEC_NONE || gbCodecInfos[codec].available == 0 || size < sizeof(size_t) )
+		return 0;
+#ifdef HAVE_ZSTD
+	else if( codec == GB_CODEC_ZSTD ){
+		unsigned int id = ZSTD_getDictID_fromFrame( data + sizeof(size_t), size - sizeof(size_t) );
+
+		return id == 0 || gbCodecDictById( server->codecs, id ) != NULL;
+	}
+#endif
+
+	return 1;
+}
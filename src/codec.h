@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include "net.h"
+
+/*
+ * Compression codecs, ordered by decreasing speed so that when two of them
+ * compress a prefix about as well the fastest one is used. LZF is always
+ * there, LZ4 and zstd when gibson is built with them.
+ */
+#define GB_CODEC_LZ4  0
+#define GB_CODEC_LZF  1
+#define GB_CODEC_ZSTD 2
+#define GB_CODECS	  3
+// values are stored as they are
+#define GB_CODEC_NONE -1
+// every prefix uses the codec which turns out to compress its values best
+#define GB_CODEC_AUTO -2
+
+// longest key prefix compression statistics are kept for
+#define GB_CODEC_PREFIX_MAX	   32
+// number of prefixes tracked by each shard, colliding ones share a slot
+#define GB_CODEC_PREFIXES	   1024
+// values every candidate codec compresses before a prefix picks one
+#define GB_CODEC_WARMUP		   4
+// once a codec is picked, one value every this many tries another one
+#define GB_CODEC_PROBE_PERIOD  64
+// a slower codec must save this many more percentage points to be picked
+#define GB_CODEC_MARGIN		   5.0
+// zstd compression level
+#define GB_CODEC_ZSTD_LEVEL	   3
+// zstd dictionaries: maximum number per shard, their size, the values
+// which are sampled to train them and how many bytes of samples
+#define GB_CODEC_MAX_DICTS	   64
+#define GB_CODEC_DICT_SIZE	   16384
+#define GB_CODEC_DICT_SAMPLE   8192
+#define GB_CODEC_DICT_TRAINING 131072
+
+typedef struct gbCodecDict
+{
+	// dictionary id, as stored in the zstd frames compressed with it
+	unsigned int id;
+	void		*cdict;
+	void		*ddict;
+	// raw dictionary and the prefix it was trained for
+	byte_t		*data;
+	size_t		 size;
+	byte_t		 prefix[GB_CODEC_PREFIX_MAX];
+	size_t		 plen;
+}
+gbCodecDict;
+
+typedef struct gbCodecPrefix
+{
+	byte_t		  prefix[GB_CODEC_PREFIX_MAX];
+	size_t		  len;
+	// number of values compressed ( or skipped ) for this prefix
+	unsigned long values;
+	// codec in use, GB_CODEC_NONE if compression isn't worth it
+	int			  codec;
+	// moving average of the percentage of space saved by each codec and
+	// number of values it was measured on
+	double		  rate[GB_CODECS];
+	unsigned int  samples[GB_CODECS];
+	// zstd dictionary trained on the values of the prefix
+	gbCodecDict  *dict;
+	// values sampled to train the dictionary, NULL when not training
+	byte_t		 *training;
+	size_t		  trainsize;
+	size_t		 *trainsizes;
+	unsigned int  ntrain;
+	// 1 once the training is over, whether it worked or not
+	byte_t		  trained;
+}
+gbCodecPrefix;
+
+typedef struct gbCodecs
+{
+	// configured codec, GB_CODEC_AUTO to pick it per prefix
+	int			   codec;
+	// codecs the prefixes can pick from
+	int			   candidates[GB_CODECS];
+	int			   ncandidates;
+	// number of key bytes making the prefix
+	size_t		   prefixlen;
+	// minimum percentage of space a prefix must save to be compressed
+	double		   minrate;
+	// 1 to train zstd dictionaries
+	byte_t		   dictionaries;
+	gbCodecPrefix *prefixes;
+	gbCodecDict	   dicts[GB_CODEC_MAX_DICTS];
+	int			   ndicts;
+	// prefixes collecting samples to train a dictionary
+	int			   training;
+	// zstd contexts, reused by every value
+	void		  *cctx;
+	void		  *dctx;
+	// values above the compression threshold stored as they are, because
+	// their prefix doesn't compress
+	unsigned long  skipped;
+	// compressed items by codec
+	unsigned long  items[GB_CODECS];
+}
+gbCodecs;
+
+// codec by name ( "auto" and "none" included ), GB_ERR if not available
+int			gbCodecByName( const char *name );
+const char *gbCodecName( int codec );
+// codec of an item encoding, GB_CODEC_NONE if it's not compressed
+int			gbCodecOfEncoding( gbItemEncoding encoding );
+
+int  gbCodecsCreate( gbServer *server, int codec, size_t prefixlen, double minrate, int dictionaries );
+void gbCodecsDestroy( gbServer *server );
+/*
+ * Compress a value into dst, which has room for dlen bytes, with the codec
+ * picked for the prefix of its key. Returns the compressed size and its
+ * encoding, or 0 if the value is to be stored as it is.
+ */
+size_t gbCodecCompress( gbServer *server, byte_t *k, size_t klen, byte_t *v, size_t vlen, byte_t *dst, size_t dlen, gbItemEncoding *encoding );
+/*
+ * Decompress the data of a compressed item into dst, which has room for
+ * gbItemValueSize bytes, returns the decompressed size.
+ */
+size_t gbCodecDecompress( gbServer *server, gbItem *item, byte_t *dst );
+/*
+ * Add a raw zstd dictionary trained for the given prefix, as saved with a
+ * snapshot. Returns GB_ERR if it can't be used or zstd is not available.
+ */
+int gbCodecDictLoad( gbServer *server, byte_t *prefix, size_t plen, byte_t *data, size_t size );
+/*
+ * 1 if the compressed data of an item with the given encoding, raw size
+ * included, can be decompressed by this build with the loaded dictionaries.
+ */
+int gbCodecCanDecompress( gbServer *server, gbItemEncoding encoding, byte_t *data, size_t size );
+
+#endif
@@ -41,9 +41,16 @@
 
 #define GB_DEFAULT_PID_FILE					  "/var/run/gibson.pid"
 
+#define GB_DEFAULT_WORKER_THREADS			  1
+#define GB_DEFAULT_SHARD_PREFIX				  4
+#define GB_DEFAULT_IO_THREADS				  0
+#define GB_DEFAULT_SHARED_READS				  1
+
 #define GBNET_DEFAULT_MAX_CLIENTS			  1024
 #define GBNET_DEFAULT_MAX_REQUEST_BUFFER_SIZE 4096 * 1024
-#define GBNET_DEFAULT_MAX_IDLE_TIME			  1
+#define GBNET_DEFAULT_MAX_IDLE_TIME			  30
+#define GBNET_DEFAULT_CLIENT_BUFFER_SIZE	  4096
+#define GBNET_DEFAULT_MAX_BUFFERS_MEMORY	  33554432
 
 #define GB_DEFAULT_MAX_ITEM_TTL 			  2592000
 
@@ -52,9 +59,25 @@
 #define GB_DEFAULT_MAX_QUERY_VALUE_SIZE       4096
 #define GB_DEFAULT_MAX_RESPONSE_SIZE          40960000
 
-#define GB_DEFAULT_GC_RATIO                   900
+#define GB_DEFAULT_EVICTION_SAMPLES           5
+#define GB_DEFAULT_EVICTION_BUDGET            1
 #define GB_DEFAULT_COMPRESSION				  40960
+#define GB_DEFAULT_COMPRESSION_CODEC		  "auto"
+#define GB_DEFAULT_COMPRESSION_PREFIX		  4
+#define GB_DEFAULT_COMPRESSION_MIN_RATE		  10
+#define GB_DEFAULT_COMPRESSION_DICTIONARIES	  1
+#define GB_DEFAULT_COMPRESSION_COLD_AGE		  0
+#define GB_DEFAULT_COMPRESSION_BUDGET		  1
+#define GB_DEFAULT_INLINE_SIZE				  128
+
+#define GB_DEFAULT_SNAPSHOT_PERIOD			  300
+
+#define GB_DEFAULT_METRICS_SAMPLING			  64
+#define GB_DEFAULT_SLOWLOG_SIZE				  128
+#define GB_DEFAULT_SLOWLOG_THRESHOLD		  10000
 
 #define GB_DEFAULT_CRON_PERIOD 				  100
+#define GB_DEFAULT_COMPACTION_BUDGET		  1
+#define GB_DEFAULT_EXPIRATION_BUDGET		  1
 
 #endif
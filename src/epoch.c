@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "epoch.h"
+#include "atree.h"
+
+#include <sched.h>
+
+/*
+ * Every thread reading another shard publishes the global epoch it entered,
+ * the epoch advances only once all of them are in the current one. Memory
+ * retired in epoch E could be still seen by the readers of E and E - 1
+ * only, so it's reclaimed as soon as the global epoch reaches E + 2.
+ */
+static unsigned long gbEpochGlobal = 1;
+
+// epoch state of the shard run by the thread, once its tree is shared
+static __thread gbEpoch *gbEpochOwn = NULL;
+
+void gbEpochCreate( gbServer *server ){
+	server->epoch = zcalloc( sizeof(gbEpoch) );
+	// odd until the shard opens its tree to the others
+	server->epoch->version	 = 1;
+	server->epoch->reclaimat = GB_EPOCH_RECLAIM_BATCH;
+}
+
+void gbEpochDestroy( gbServer *server ){
+	if( server->epoch ){
+		if( server->epoch->retired )
+			zfree( server->epoch->retired );
+
+		zfree( server->epoch );
+		server->epoch = NULL;
+	}
+}
+
+static void gbEpochFree( gbEpoch *epoch, gbRetired *entry ){
+	if( entry->slab ){
+		epoch->pending -= zslab_size( entry->ptr, entry->size );
+		zslab_free( entry->ptr, entry->size );
+	}
+	else {
+		epoch->pending -= zmalloc_size( entry->ptr );
+		zfree( entry->ptr );
+	}
+}
+
+// the epoch of what was retired since the last time, once it's unreachable
+static void gbEpochTag( gbEpoch *epoch ){
+	unsigned long global;
+
+	__atomic_thread_fence( __ATOMIC_SEQ_CST );
+	global = __atomic_load_n( &gbEpochGlobal, __ATOMIC_RELAXED );
+
+	for( ; epoch->tagged < epoch->nretired; ++epoch->tagged ){
+		epoch->retired[ epoch->tagged ].epoch = global;
+	}
+}
+
+static void gbEpochPush( gbEpoch *epoch, void *ptr, size_t size, byte_t slab ){
+	gbRetired *entry;
+
+	if( epoch->nretired == epoch->size ){
+		epoch->size	   = epoch->size ? epoch->size * 2 : GB_EPOCH_RECLAIM_BATCH;
+		epoch->retired = zrealloc( epoch->retired, sizeof(gbRetired) * epoch->size );
+	}
+
+	entry = &epoch->retired[ epoch->nretired++ ];
+
+	entry->ptr	 = ptr;
+	entry->size	 = size;
+	entry->slab	 = slab;
+	entry->epoch = 0;
+
+	epoch->pending += slab ? zslab_size( ptr, size ) : zmalloc_size( ptr );
+
+	// outside of a change it's unreachable already
+	if( epoch->writing == 0 )
+		gbEpochTag( epoch );
+}
+
+// free handler of the tree nodes
+static void gbEpochRetireNode( void *ptr ){
+	gbEpochPush( gbEpochOwn, ptr, 0, 0 );
+}
+
+void gbEpochOpen( gbServer *server ){
+	gbEpoch *epoch = server->epoch;
+
+	if( epoch == NULL )
+		return;
+
+	gbEpochOwn = epoch;
+	at_set_free_handler( gbEpochRetireNode );
+
+	__atomic_store_n( &epoch->version, epoch->version + 1, __ATOMIC_RELEASE );
+}
+
+void gbEpochClose( gbServer *server ){
+	gbEpoch *epoch = server->epoch;
+	unsigned long global, reading;
+	size_t i;
+	int shard;
+
+	if( epoch == NULL || gbEpochOwn == NULL )
+		return;
+
+	// odd for good, new readers won't even start
+	__atomic_store_n( &epoch->version, epoch->version | 1, __ATOMIC_SEQ_CST );
+	global = __atomic_load_n( &gbEpochGlobal, __ATOMIC_SEQ_CST );
+
+	// the ones which entered before could be still reading
+	for( shard = 0; shard < server->nshards; ++shard ){
+		if( shard == server->shard )
+			continue;
+
+		while( ( reading = __atomic_load_n( &server->shards[shard]->epoch->reading, __ATOMIC_SEQ_CST ) ) && reading <= global )
+			sched_yield();
+	}
+
+	at_set_free_handler( NULL );
+	gbEpochOwn = NULL;
+
+	for( i = 0; i < epoch->nretired; ++i ){
+		gbEpochFree( epoch, epoch->retired + i );
+	}
+
+	epoch->nretired =
+	epoch->tagged	= 0;
+}
+
+void gbEpochWriteBegin( gbServer *server ){
+	gbEpoch *epoch = server->epoch;
+
+	if( epoch && epoch->writing++ == 0 ){
+		__atomic_store_n( &epoch->version, epoch->version + 1, __ATOMIC_RELAXED );
+		// the changes can't be seen before the version
+		__atomic_thread_fence( __ATOMIC_RELEASE );
+	}
+}
+
+void gbEpochWriteEnd( gbServer *server ){
+	gbEpoch *epoch = server->epoch;
+
+	if( epoch && --epoch->writing == 0 ){
+		__atomic_store_n( &epoch->version, epoch->version + 1, __ATOMIC_RELEASE );
+
+		if( epoch->tagged < epoch->nretired ){
+			gbEpochTag( epoch );
+
+			if( epoch->nretired >= epoch->reclaimat )
+				gbEpochReclaim( server );
+		}
+	}
+}
+
+void gbEpochRetire( gbServer *server, void *ptr, size_t size ){
+	if( server->epoch && gbEpochOwn == server->epoch )
+		gbEpochPush( server->epoch, ptr, size, 1 );
+	else
+		zslab_free( ptr, size );
+}
+
+void gbEpochReclaim( gbServer *server ){
+	gbEpoch *epoch = server->epoch;
+	unsigned long global, reading;
+	size_t n = 0;
+	int shard;
+
+	if( epoch == NULL || epoch->tagged == 0 )
+		return;
+
+	global = __atomic_load_n( &gbEpochGlobal, __ATOMIC_SEQ_CST );
+
+	for( shard = 0; shard < server->nshards; ++shard ){
+		reading = __atomic_load_n( &server->shards[shard]->epoch->reading, __ATOMIC_SEQ_CST );
+		if( reading && reading != global )
+			break;
+	}
+
+	// if another shard moved it first the current one is reloaded
+	if( shard == server->nshards && __atomic_compare_exchange_n( &gbEpochGlobal, &global, global + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST ) )
+		++global;
+
+	while( n < epoch->tagged && epoch->retired[n].epoch + 2 <= global ){
+		gbEpochFree( epoch, epoch->retired + n++ );
+	}
+
+	if( n ){
+		memmove( epoch->retired, epoch->retired + n, sizeof(gbRetired) * ( epoch->nretired - n ) );
+
+		epoch->nretired -= n;
+		epoch->tagged	-= n;
+	}
+
+	epoch->reclaimat = epoch->nretired + GB_EPOCH_RECLAIM_BATCH;
+}
+
+void gbEpochEnter( gbServer *server ){
+	// the tree can't be read before the epoch is published
+	__atomic_store_n( &server->epoch->reading, __atomic_load_n( &gbEpochGlobal, __ATOMIC_RELAXED ), __ATOMIC_SEQ_CST );
+}
+
+void gbEpochExit( gbServer *server ){
+	__atomic_store_n( &server->epoch->reading, 0, __ATOMIC_RELEASE );
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#include "net.h"
+
+/*
+ * With shared_reads enabled a shard serves the GETs of its clients for the
+ * keys of other shards straight from their trees, without locks and
+ * without forwarding them, while every tree is still changed only by the
+ * thread of its shard:
+ *
+ *  - the owner makes the version of its tree odd while changing the tree
+ *    or its items and even again when done, a reader retries if the version
+ *    changed while it was reading and falls back to forwarding the request
+ *    if it keeps changing;
+ *  - the nodes and the items the owner stops using are retired instead of
+ *    freed, and reclaimed only once every thread which could still be
+ *    reading them moved to a later epoch.
+ */
+
+// entries retired before the owner tries to reclaim them
+#define GB_EPOCH_RECLAIM_BATCH 256
+
+typedef struct
+{
+	void		 *ptr;
+	// size the chunk was allocated from the slabs with, if 'slab'
+	size_t		  size;
+	byte_t		  slab;
+	// global epoch it was retired in
+	unsigned long epoch;
+}
+gbRetired;
+
+typedef struct gbEpoch
+{
+	// epoch the thread of the shard entered to read another shard, 0 when
+	// not reading, written by the thread and read by the others
+	unsigned long reading;
+	char		  readingpad[64 - sizeof(unsigned long)];
+	// version of the tree of the shard, odd while it's being changed
+	unsigned long version;
+	char		  versionpad[64 - sizeof(unsigned long)];
+	// nesting level of the changes in progress
+	int			  writing;
+	// memory retired and not reclaimed yet, oldest first, only the first
+	// 'tagged' entries know their epoch
+	gbRetired	 *retired;
+	size_t		  nretired;
+	size_t		  tagged;
+	size_t		  size;
+	// number of entries to reach before trying to reclaim again
+	size_t		  reclaimat;
+	// bytes taken by the retired entries
+	size_t		  pending;
+}
+gbEpoch;
+
+// bytes retired by the shard which are still allocated
+#define gbEpochPending( server ) ( (server)->epoch ? (server)->epoch->pending : 0 )
+
+// version of the tree of the shard to start reading from, odd if changing
+#define gbEpochVersion( server ) __atomic_load_n( &(server)->epoch->version, __ATOMIC_ACQUIRE )
+// whether the tree of the shard changed since the given version was read
+#define gbEpochChanged( server, v ) ( __atomic_thread_fence( __ATOMIC_ACQUIRE ), __atomic_load_n( &(server)->epoch->version, __ATOMIC_RELAXED ) != (v) )
+
+/*
+ * Allocate the epoch state of a shard before the threads start, its tree
+ * can't be read until gbEpochOpen.
+ */
+void gbEpochCreate( gbServer *server );
+void gbEpochDestroy( gbServer *server );
+/*
+ * Let the other shards read the tree, called by the thread of the shard
+ * once the tree is loaded, from now on the memory it releases is retired.
+ */
+void gbEpochOpen( gbServer *server );
+/*
+ * Stop the other shards from reading the tree, wait for the ones still
+ * doing it and free all the memory retired, called by the thread of the
+ * shard before it destroys the tree.
+ */
+void gbEpochClose( gbServer *server );
+/*
+ * Start and end a change of the tree or of its items, sections can be
+ * nested and the memory retired inside them is tagged once they're over.
+ */
+void gbEpochWriteBegin( gbServer *server );
+void gbEpochWriteEnd( gbServer *server );
+/*
+ * Release a chunk of 'size' bytes allocated with zslab_alloc, which is
+ * retired if the tree is shared or freed right away otherwise.
+ */
+void gbEpochRetire( gbServer *server, void *ptr, size_t size );
+/*
+ * Free what no reader can see anymore, trying to move to the next global
+ * epoch first.
+ */
+void gbEpochReclaim( gbServer *server );
+/*
+ * Enter the current epoch before reading the tree of another shard, and
+ * leave it when done with what was read from it.
+ */
+void gbEpochEnter( gbServer *server );
+void gbEpochExit( gbServer *server );
+
+#endif
@@ -34,6 +34,7 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <getopt.h>
+#include <pthread.h>
 #if HAVE_BACKTRACE
 #include <execinfo.h>
 #endif
@@ -41,6 +42,13 @@
 #include "net.h"
 #include "atree.h"
 #include "query.h"
+#include "shard.h"
+#include "epoch.h"
+#include "iothread.h"
+#include "codec.h"
+#include "snapshot.h"
+#include "metrics.h"
+#include "accounting.h"
 #include "config.h"
 #include "default.h"
 
@@ -51,12 +59,13 @@ static gbServer server;
 void gbReadQueryHandler( gbEventLoop *el, int fd, void *privdata, int mask );
 void gbWriteReplyHandler( gbEventLoop *el, int fd, void *privdata, int mask );
 void gbAcceptHandler(gbEventLoop *e, int fd, void *privdata, int mask);
-void gbMemoryFreeHandler( anode_t *elem, size_t level, void *data );
 int  gbServerCronHandler(struct gbEventLoop *eventLoop, long long id, void *data);
 void gbDaemonize();
 void gbProcessInit();
 void gbServerDestroy( gbServer *server );
 void gbOOM(size_t size);
+static void gbServerInitState( gbServer *server );
+static void *gbServerThread( void *data );
 
 void gbHelpMenu( char **argv, int exitcode ){
 	printf( "Gibson cache server v%s %s ( built %s )\nCopyright %s\nReleased under %s\n\n", VERSION, BUILD_GIT_BRANCH, BUILD_DATETIME, AUTHOR, LICENSE );
@@ -84,7 +93,7 @@ static void gbMemFormat( unsigned long used, char *buffer, size_t size ){
 
 int main( int argc, char **argv)
 {
-	int c, option_index = 0;
+	int c, i, option_index = 0;
 
 	static struct option long_options[] =
 	{
@@ -94,6 +103,7 @@ int main( int argc, char **argv)
 	};
 
     char *configuration = GB_DEFAULT_CONFIGURATION;
+	const char *codec;
 
     while(1){
     	c = getopt_long( argc, argv, "hc:", long_options, &option_index );
@@ -139,6 +149,15 @@ int main( int argc, char **argv)
 	  gbConfigReadInt( &server.config, "logflushrate", GB_DEFAULT_LOG_FLUSH_LEVEL )
 	);
 
+	server.nshards	   = gbConfigReadInt( &server.config, "worker_threads", GB_DEFAULT_WORKER_THREADS );
+	server.shardprefix = gbConfigReadSize( &server.config, "shard_prefix",  GB_DEFAULT_SHARD_PREFIX );
+
+	server.niothreads  = gbConfigReadInt( &server.config, "io_threads",     GB_DEFAULT_IO_THREADS );
+	server.sharedreads = gbConfigReadInt( &server.config, "shared_reads",   GB_DEFAULT_SHARED_READS );
+
+	if( server.nshards < 1 )
+		server.nshards = 1;
+
 	const char *sock = gbConfigReadString( &server.config, "unix_socket", NULL );
 	if( sock != NULL ){
 		gbLog( INFO, "Creating unix server socket on %s ...", sock );
@@ -159,7 +178,7 @@ int main( int argc, char **argv)
 
 		server.type	= TCP;
 		server.port	= port;
-		server.fd   = gbNetTcpServer( server.error, server.port, server.address );
+		server.fd   = gbNetTcpServer( server.error, server.port, server.address, server.nshards > 1 );
 	}
 
 	if( server.fd == GBNET_ERR ){
@@ -176,12 +195,18 @@ int main( int argc, char **argv)
 	server.limits.maxkeysize	  = gbConfigReadSize( &server.config, "max_key_size",      GB_DEFAULT_MAX_QUERY_KEY_SIZE );
 	server.limits.maxvaluesize	  = gbConfigReadSize( &server.config, "max_value_size",    GB_DEFAULT_MAX_QUERY_VALUE_SIZE );
 	server.limits.maxresponsesize = gbConfigReadSize( &server.config, "max_response_size", GB_DEFAULT_MAX_RESPONSE_SIZE );
+	server.limits.maxbuffersmem   = gbConfigReadSize( &server.config, "max_buffers_memory", GBNET_DEFAULT_MAX_BUFFERS_MEMORY );
+	server.limits.clientbuffer    = gbConfigReadSize( &server.config, "client_buffer_size", GBNET_DEFAULT_CLIENT_BUFFER_SIZE );
 
 	// initialize server statistics
 	server.stats.started     =
 	server.stats.time	     = time(NULL);
 	server.stats.memused     =
 	server.stats.mempeak     =
+	server.stats.memvalues   =
+	server.stats.nevicted    =
+	server.stats.memevicted  =
+	server.stats.membuffers  =
 	server.stats.firstin     =
 	server.stats.lastin      =
 	server.stats.crondone    =
@@ -203,20 +228,73 @@ int main( int argc, char **argv)
 	}
 
 	server.compression = gbConfigReadSize( &server.config, "compression",	   GB_DEFAULT_COMPRESSION );
+	server.codecprefix  = gbConfigReadSize( &server.config, "compression_prefix", GB_DEFAULT_COMPRESSION_PREFIX );
+	server.codecminrate = gbConfigReadInt( &server.config, "compression_min_rate", GB_DEFAULT_COMPRESSION_MIN_RATE );
+	server.codecdicts   = gbConfigReadInt( &server.config, "compression_dictionaries", GB_DEFAULT_COMPRESSION_DICTIONARIES );
+	server.compressage    = gbConfigReadInt( &server.config, "compression_cold_age", GB_DEFAULT_COMPRESSION_COLD_AGE );
+	server.compressbudget = gbConfigReadInt( &server.config, "compression_budget",   GB_DEFAULT_COMPRESSION_BUDGET );
+	server.compressing	  = 0;
+
+	server.snapshotfile	  = gbConfigReadString( &server.config, "snapshot_file", NULL );
+	server.snapshotperiod = gbConfigReadInt( &server.config, "snapshot_period", GB_DEFAULT_SNAPSHOT_PERIOD );
+	server.snapshotpid	  = 0;
+	server.snapshotlast	  = 0;
+
+	server.metricssampling	= gbConfigReadInt( &server.config, "metrics_sampling",	 GB_DEFAULT_METRICS_SAMPLING );
+	server.slowlogsize		= gbConfigReadSize( &server.config, "slowlog_size",		 GB_DEFAULT_SLOWLOG_SIZE );
+	server.slowlogthreshold = gbConfigReadInt( &server.config, "slowlog_threshold", GB_DEFAULT_SLOWLOG_THRESHOLD );
+
+	server.accountingprefixes = gbConfigReadString( &server.config, "accounting_prefixes", NULL );
+
+	codec = gbConfigReadString( &server.config, "compression_codec", GB_DEFAULT_COMPRESSION_CODEC );
+	if( ( server.codec = gbCodecByName( codec ) ) == GB_ERR ){
+		gbLog( ERROR, "Compression codec '%s' is unknown or was not built in.", codec );
+		exit(1);
+	}
+
+	server.inlinesize  = gbConfigReadSize( &server.config, "inline_size",	   GB_DEFAULT_INLINE_SIZE );
 	server.daemon	   = gbConfigReadInt( &server.config, "daemonize", 		   0 );
 	server.cronperiod  = gbConfigReadInt( &server.config, "cron_period", 	   GB_DEFAULT_CRON_PERIOD );
 	server.pidfile	   = gbConfigReadString( &server.config, "pidfile",        GB_DEFAULT_PID_FILE );
-    server.gc_ratio    = gbConfigReadTime( &server.config, "gc_ratio",         GB_DEFAULT_GC_RATIO );
-	server.events 	   = gbCreateEventLoop( server.limits.maxclients + 1024 );
-	server.clients 	   = ll_prealloc( server.limits.maxclients );
-	server.m_keys	   = ll_prealloc( 255 );
-	server.m_values	   = ll_prealloc( 255 );
-	server.idlecron	   = server.limits.maxidletime * 1000;
-	server.lzf_buffer  = zcalloc( server.limits.maxrequestsize );
-	server.m_buffer	   = zcalloc( server.limits.maxresponsesize );
 	server.shutdown	   = 0;
+	server.compacting  = 0;
+	server.compactbudget = gbConfigReadInt( &server.config, "compaction_budget", GB_DEFAULT_COMPACTION_BUDGET );
+	server.expirebudget  = gbConfigReadInt( &server.config, "expiration_budget", GB_DEFAULT_EXPIRATION_BUDGET );
+	server.evictsamples  = gbConfigReadInt( &server.config, "eviction_samples",  GB_DEFAULT_EVICTION_SAMPLES );
+	server.evictbudget   = gbConfigReadInt( &server.config, "eviction_budget",   GB_DEFAULT_EVICTION_BUDGET );
+	server.evicting		 = 0;
+
+	if( server.evictsamples == 0 )
+		server.evictsamples = 1;
+
+	// eviction samples are picked at random
+	srandom( server.stats.time ^ getpid() );
+
+	if( server.nshards > 1 ){
+		// every shard has its own share of the memory and of the clients
+		server.limits.maxmem /= server.nshards;
+		server.limits.maxclients /= server.nshards;
+
+		if( server.limits.maxclients < 1 )
+			server.limits.maxclients = 1;
+
+		gbShardsCreate( &server );
+
+		for( i = 1; i < server.nshards; ++i ){
+			gbServer *shard = server.shards[i];
 
-	at_init_tree( server.tree );
+			// tcp shards listen on their own socket, unix ones share it
+			if( shard->type == TCP && ( shard->fd = gbNetTcpServer( shard->error, shard->port, shard->address, 1 ) ) == GBNET_ERR ){
+				gbLog( ERROR, "Error creating server of shard %d : %s", i, shard->error );
+				exit(1);
+			}
+
+			gbNetNonBlock( NULL, shard->fd );
+		}
+
+		// connections are accepted by whichever shard gets there first
+		gbNetNonBlock( NULL, server.fd );
+	}
 
 	char reqsize[0xFF] = {0},
 		 maxmem[0xFF] = {0},
@@ -235,6 +313,9 @@ int main( int argc, char **argv)
 	gbLog( INFO, "Server starting ..." );
 	gbLog( INFO, "Git Branch       : '%s'", BUILD_GIT_BRANCH );
 	gbLog( INFO, "Multiplexing API : '%s'", aeApiName() );
+	gbLog( INFO, "Worker threads   : %d", server.nshards );
+	gbLog( INFO, "I/O threads      : %d", server.niothreads );
+	gbLog( INFO, "Shared reads     : %s", server.nshards > 1 && server.sharedreads ? "yes" : "no" );
 #if HAVE_JEMALLOC == 1
 	const char *p;
 	size_t s = sizeof(p);
@@ -248,18 +329,34 @@ int main( int argc, char **argv)
 	gbLog( INFO, "Max clients      : %d", server.limits.maxclients );
 	gbLog( INFO, "Max request size : %s", reqsize );
 	gbLog( INFO, "Max memory       : %s", maxmem );
-    gbLog( INFO, "GC Ratio         : %ds", server.gc_ratio );
 	gbLog( INFO, "Max key size     : %s", maxkey );
 	gbLog( INFO, "Max value size   : %s", maxvalue );
 	gbLog( INFO, "Max resp. size   : %s", maxrespsize );
-	gbLog( INFO, "Data LZF compr.  : %s", compr );
+	gbLog( INFO, "Data compression : %s", compr );
+	gbLog( INFO, "Compr. codec     : '%s'", gbCodecName( server.codec ) );
+	if( server.compressage > 0 )
+		gbLog( INFO, "Compr. budget    : %dms, values idle for %ds", server.compressbudget, (int)server.compressage );
+	if( server.snapshotfile )
+		gbLog( INFO, "Snapshot file    : '%s', every %ds", server.snapshotfile, server.snapshotperiod );
+	gbLog( INFO, "Metrics sampling : 1 single key request every %d", server.metricssampling );
+	gbLog( INFO, "Slowlog          : %zu entries, requests over %dus", server.slowlogsize, server.slowlogthreshold );
+	if( server.accountingprefixes )
+		gbLog( INFO, "Accounting       : '%s'", server.accountingprefixes );
 	gbLog( INFO, "Cron period      : %dms", server.cronperiod );
+	gbLog( INFO, "Compaction budget: %dms", server.compactbudget );
+	gbLog( INFO, "Expiration budget: %dms", server.expirebudget );
+	gbLog( INFO, "Eviction budget  : %dms, %d samples", server.evictbudget, server.evictsamples );
 
 	gbProcessInit();
 
-	server.cron_id = gbCreateTimeEvent( server.events, 1, gbServerCronHandler, &server, NULL );
-
-	gbCreateFileEvent( server.events, server.fd, GB_READABLE, gbAcceptHandler, &server );
+	// threads don't survive the daemonization, start them now
+	gbServerInitState( &server );
+	for( i = 1; i < server.nshards; ++i ){
+		if( pthread_create( &server.shards[i]->thread, NULL, gbServerThread, server.shards[i] ) != 0 ){
+			gbLog( ERROR, "Error starting the thread of shard %d.", i );
+			exit(1);
+		}
+	}
 
 	gbEventLoopMain( server.events );
 	gbDeleteEventLoop( server.events );
@@ -267,6 +364,67 @@ int main( int argc, char **argv)
 	return 0;
 }
 
+/*
+ * Allocate what a shard needs at runtime, in the thread running it.
+ */
+static void gbServerInitState( gbServer *server ){
+	// descriptors are shared by the process, every loop must fit all of them
+	server->events 	   = gbCreateEventLoop( server->limits.maxclients * server->nshards + 1024 );
+	server->clients    = zcalloc( sizeof( gbClient * ) * gbGetSetSize( server->events ) );
+	server->m_keys	   = ll_prealloc( 255 );
+	server->m_values   = ll_prealloc( 255 );
+	at_init_iterator( server->m_iterator );
+	server->lzf_buffer = zcalloc( server->limits.maxrequestsize );
+
+	if( gbCodecsCreate( server, server->codec, server->codecprefix, server->codecminrate, server->codecdicts ) == GB_ERR ){
+		gbLog( ERROR, "Error creating the compression codecs of shard %d.", server->shard );
+		exit(1);
+	}
+
+	gbMetricsCreate( server, server->metricssampling, server->slowlogsize, server->slowlogthreshold * 1000ULL );
+
+	if( gbAccountingCreate( server, server->accountingprefixes ) == GB_ERR ){
+		gbLog( ERROR, "Error parsing the accounting prefixes '%s'.", server->accountingprefixes );
+		exit(1);
+	}
+
+	tw_init( &server->ttlwheel, server->stats.time );
+	tw_init( &server->idlewheel, server->stats.time );
+
+	at_init_tree( server->tree );
+	at_init_cursor( server->compactcursor );
+	at_init_cursor( server->compresscursor );
+	at_init_cursor( server->evictkey );
+	at_init_cursor( server->evictsample );
+
+	gbSnapshotLoad( server );
+
+	if( server->nshards > 1 && gbShardInit( server ) == GB_ERR ){
+		gbLog( ERROR, "Unable to wait for the jobs of shard %d.", server->shard );
+		exit(1);
+	}
+
+	if( server->niothreads > 0 && gbIOThreadsCreate( server, server->niothreads ) == GB_ERR ){
+		gbLog( ERROR, "Error starting the I/O threads of shard %d.", server->shard );
+		exit(1);
+	}
+
+	server->cron_id = gbCreateTimeEvent( server->events, 1, gbServerCronHandler, server, NULL );
+
+	gbCreateFileEvent( server->events, server->fd, GB_READABLE, gbAcceptHandler, server );
+}
+
+static void *gbServerThread( void *data ){
+	gbServer *server = data;
+
+	gbServerInitState( server );
+
+	gbEventLoopMain( server->events );
+	gbDeleteEventLoop( server->events );
+
+	return NULL;
+}
+
 void gbOOM(size_t size){
     char used[0xFF] = {0},
          max[0xFF] = {0},
@@ -294,132 +452,182 @@ void gbOOM(size_t size){
     abort();
 }
 
-void gbWriteReplyHandler( gbEventLoop *el, int fd, void *privdata, int mask ) {
-    gbClient *client = privdata;
-    size_t nwrote = 0, towrite = 0;
+/*
+ * Run every complete request in the client input buffer, their replies are
+ * appended to the output buffer and written together. A request forwarded
+ * to other shards holds the next ones until its reply is there. Returns
+ * GB_ERR if the client was dropped.
+ */
+int gbClientProcessInput( gbClient *client ){
+	gbServer *server = client->server;
+	gbClientBuffer *input = &client->input;
+	int available = 0, size = 0;
 
-    if( client->status == STATUS_SENDING_REPLY ){
-		towrite = client->buffer_size - client->wrote;
-		nwrote  = write( client->fd, client->buffer + client->wrote, towrite );
+	while( client->shutdown == 0 && client->paused == 0 && client->call == NULL ){
+		available = input->size - client->read;
+		// wait for the request size
+		if( available < (int)sizeof(int) )
+			break;
 
-		if (nwrote == -1){
-			if (errno == EAGAIN){
-				nwrote = 0;
-			}
-			else{
-				gbLog( DEBUG, "Error writing to client: %s",strerror(errno));
-				gbClientDestroy(client);
-				return;
-			}
-		}
-		else if (nwrote == 0){
-			gbLog( DEBUG, "Client closed connection.");
+		memcpy( &size, input->data + client->read, sizeof(int) );
+
+		// make sure the buffer is not too big or too small ( must be at least 2 bytes to contain the opcode )
+		if( size > server->limits.maxrequestsize || size < (int)sizeof(short) ){
+			gbLog( WARNING, "Client request size %d invalid.", size );
 			gbClientDestroy(client);
-			return;
+			return GB_ERR;
+		}
+		// wait for the rest of the request, making room for it
+		else if( available < (int)sizeof(int) + size ){
+			gbClientReserveBuffer( client, input, client->read + sizeof(int) + size );
+			break;
 		}
-		else{
-			client->wrote += nwrote;
-			client->seen = client->server->stats.time;
 
-			if( client->wrote == client->buffer_size ){
-				if( client->shutdown )
-					gbClientDestroy(client);
+		client->buffer		= input->data + client->read + sizeof(int);
+		client->buffer_size = size;
+		client->read 	   += sizeof(int) + size;
 
-				else{
-					gbClientReset(client);
-					gbDeleteFileEvent( client->server->events, client->fd, GB_WRITABLE );
-				}
-			}
+		if( gbProcessQuery(client) != GB_OK ){
+			size_t sz = client->buffer_size < 255 ? client->buffer_size : 255;
 
-		}
-    }
-    else {
-    	gbLog( WARNING, "Unexpected status %d for client while sending response.", client->status );
-    	gbClientDestroy(client);
-    }
-}
+			gbLog( WARNING, "Malformed query, dropping client." );
+			gbLog( WARNING, "  Buffer size: %d opcode:%d - First %d bytes:", client->buffer_size, *(short *)&client->buffer[0], sz );
+			gbLogDumpBuffer( WARNING, client->buffer, sz );
 
-void gbReadQueryHandler( gbEventLoop *el, int fd, void *privdata, int mask ) {
-	gbClient *client = ( gbClient * )privdata;
-	gbServer *server = client->server;
-	byte_t   *p = NULL;
-	int nread, toread;
-
-	// we're still readying the buffer size from the socket
-	if( client->status == STATUS_WAITING_SIZE ){
-		toread = sizeof(int) - client->read;
-		// keep reading it
-		if( toread > 0 ){
-			p = (byte_t *)( &client->buffer_size + client->read );
+			gbClientDestroy(client);
+			return GB_ERR;
 		}
-		// we're done, start reading the buffer
-		else {
-			client->read   = 0;
-			client->status = STATUS_WAITING_BUFFER;
-			// make sure the buffer is not too big or too small ( must be at least 2 bytes to contain the opcode )
-			if( client->buffer_size > server->limits.maxrequestsize || client->buffer_size < sizeof(short) ){
-				gbLog( WARNING, "Client request size %d invalid.", client->buffer_size );
-				gbClientDestroy(client);
-				return;
-			}
-            // allocate buffer for the incoming request
-            else
-                client->buffer = zmalloc( client->buffer_size );
+
+		// the client is not reading its replies, stop reading its requests
+		if( gbClientOutputPending( client ) > server->limits.maxresponsesize ){
+			gbDeleteFileEvent( server->events, client->fd, GB_READABLE );
+			client->paused = 1;
 		}
 	}
 
-	// we are reading the buffer ( of client->buffer_size total bytes )
-	if( client->status == STATUS_WAITING_BUFFER ){
-		toread = client->buffer_size - client->read;
-		if( toread > 0 ){
-			p = client->buffer + client->read;
+	// move what is left of the input at the beginning of the buffer
+	if( client->read ){
+		input->size -= client->read;
+		if( input->size )
+			memmove( input->data, input->data + client->read, input->size );
+
+		client->read = 0;
+	}
+
+	return GB_OK;
+}
+
+/*
+ * Handle the outcome of a write to the client socket, done by the loop or
+ * by an I/O thread.
+ */
+void gbClientWriteDone( gbClient *client, ssize_t nwrote, int error ){
+	if (nwrote == -1){
+		if (error == EAGAIN){
+			nwrote = 0;
 		}
-        // nothing left to read
-		else {
-			client->read   = 0;
-			client->status = STATUS_SENDING_REPLY;
+		else{
+			gbLog( DEBUG, "Error writing to client: %s",strerror(error));
+			gbClientDestroy(client);
+			return;
 		}
 	}
+	else if (nwrote == 0){
+		gbLog( DEBUG, "Client closed connection.");
+		gbClientDestroy(client);
+		return;
+	}
+	else{
+		client->seen = client->server->stats.time;
 
-	// if we still have something to read
-	if( client->status != STATUS_SENDING_REPLY ){
-		nread = read( fd, p, toread );
-		if (nread == -1){
-			// try again, operation failed
-			if (errno == EAGAIN){
-				nread = 0;
-			}
-			else{
-				gbLog( WARNING, "Error reading from client: %s",strerror(errno));
+		if( gbClientOutputDone( client ) ){
+			if( client->shutdown )
 				gbClientDestroy(client);
-				return;
+
+			else{
+				gbClientReset(client);
+				gbDeleteFileEvent( client->server->events, client->fd, GB_WRITABLE );
+
+				// replies are gone, resume with the requests left in the input buffer
+				if( client->paused ){
+					client->paused = 0;
+
+					if( gbCreateFileEvent( client->server->events, client->fd, GB_READABLE, gbReadQueryHandler, client ) == GB_ERR ) {
+						gbLog( WARNING, "Unable to wait for client readable state." );
+						gbClientDestroy( client );
+						return;
+					}
+
+					gbClientProcessInput( client );
+				}
 			}
-		// bye bye dear client ^_^
+
+			return;
+		}
+	}
+
+	// an I/O thread wrote what the socket took, the loop writes the rest
+	if( client->server->io && gbCreateFileEvent( client->server->events, client->fd, GB_WRITABLE, gbWriteReplyHandler, client ) == GB_ERR ){
+		gbLog( WARNING, "Unable to wait for client writable state." );
+		gbClientDestroy( client );
+	}
+}
+
+void gbWriteReplyHandler( gbEventLoop *el, int fd, void *privdata, int mask ) {
+	gbClient *client = privdata;
+	ssize_t nwrote = gbClientWrite( client );
+
+	gbClientWriteDone( client, nwrote, errno );
+}
+
+/*
+ * Handle the outcome of a read from the client socket, done by the loop or
+ * by an I/O thread.
+ */
+void gbClientReadDone( gbClient *client, ssize_t nread, int error ){
+	gbClientBuffer *input = &client->input;
+
+	if (nread == -1){
+		// try again, operation failed
+		if (error == EAGAIN){
+			return;
 		}
-		else if (nread == 0){
-			gbLog( DEBUG, "Client closed connection.");
+		else{
+			gbLog( WARNING, "Error reading from client: %s",strerror(error));
 			gbClientDestroy(client);
 			return;
 		}
+	// bye bye dear client ^_^
+	}
+	else if (nread == 0){
+		gbLog( DEBUG, "Client closed connection.");
+		gbClientDestroy(client);
+		return;
 	}
 
-	client->read += nread;
+	input->size += nread;
 	client->seen = client->server->stats.time;
 
-	// process the query only if we were reading it and the request is complete
-	if( client->status == STATUS_WAITING_BUFFER && client->read == client->buffer_size ){
-		client->status = STATUS_SENDING_REPLY;
-        
-		if( gbProcessQuery(client) != GB_OK ){
-			size_t sz = client->buffer_size < 255 ? client->buffer_size : 255;
+	gbClientProcessInput( client );
+}
 
-			gbLog( WARNING, "Malformed query, dropping client." );
-			gbLog( WARNING, "  Buffer size: %d opcode:%d - First %d bytes:", client->buffer_size, *(short *)&client->buffer[0], sz );
-			gbLogDumpBuffer( WARNING, client->buffer, sz );
+void gbReadQueryHandler( gbEventLoop *el, int fd, void *privdata, int mask ) {
+	gbClient *client = ( gbClient * )privdata;
+	gbClientBuffer *input = &client->input;
+	ssize_t nread;
 
-			gbClientDestroy(client);
-		}
+	// read by the I/O threads before the loop polls again
+	if( client->server->io ){
+		gbIOQueueRead( client );
+		return;
 	}
+
+	// read as many requests as the socket has, in big chunks
+	gbClientReserveBuffer( client, input, input->size + GBNET_READ_CHUNK_SIZE );
+
+	nread = read( fd, input->data + input->size, input->capacity - input->size );
+
+	gbClientReadDone( client, nread, errno );
 }
 
 void gbAcceptHandler(gbEventLoop *e, int fd, void *privdata, int mask) {
@@ -433,12 +641,17 @@ void gbAcceptHandler(gbEventLoop *e, int fd, void *privdata, int mask) {
     	client_fd = gbNetUnixAccept( server->error, fd );
 
     if (client_fd == GB_ERR) {
+    	// another shard took the connection
+    	if( errno == EAGAIN || errno == EWOULDBLOCK )
+    		return;
+
     	gbLog( WARNING, "Error accepting client connection: %s", server->error );
         return;
     }
     else if( server->stats.nclients >= server->limits.maxclients ) {
     	close(client_fd);
     	gbLog( WARNING, "Dropping connection, current clients = %d, max = %d.", server->stats.nclients, server->limits.maxclients );
+    	return;
     }
 
     gbLog( DEBUG, "New connection from %s:%d", *client_ip ? client_ip : server->address, client_port );
@@ -453,37 +666,69 @@ void gbAcceptHandler(gbEventLoop *e, int fd, void *privdata, int mask) {
 		if( gbCreateFileEvent( e, client_fd, GB_READABLE, gbReadQueryHandler, client ) == GB_ERR ) {
 			gbLog( WARNING, "Unable to wait for client readable state." );
 			gbClientDestroy( client );
-			close(client_fd);
 			return;
 		}
 	}
 }
 
-#define GB_DEL_ITEM(s,n,i) (n)->marker = NULL; gbDestroyItem( (s), (i) )
+// number of nodes to compact between each time budget check
+#define CRON_COMPACTION_STEP 1024
+// number of items to expire between each time budget check
+#define CRON_EXPIRATION_STEP 64
 
-void gbMemoryFreeHandler( anode_t *node, size_t level, void *data ) {
-	gbServer *server = data;
-	gbItem	 *item = node->marker;
-	time_t	  eta = item ? ( server->stats.time - item->last_access_time ) : 0;
+// bytes to free below the memory limit once it's exceeded, to avoid evicting at every query
+#define EVICTION_HEADROOM( max ) ( (max) / 20 )
+
+// remove the items whose TTL is due, within the expiration time budget
+static void gbServerExpireItems( gbServer *server ){
+	long long deadline = gbMonotonicTime() + server->expirebudget * 1000;
+	tw_entry_t *entry = NULL;
+	gbExpiration *expiration = NULL;
+	gbItem *item = NULL;
+	time_t eta;
+	size_t done = 0;
+
+	while( ( entry = tw_pop( &server->ttlwheel, server->stats.time ) ) ){
+		expiration = (gbExpiration *)entry;
+		item	   = expiration->item;
+		eta		   = server->stats.time - item->time;
 
-	// item is older enough to be deleted
-	if( eta && eta >= server->gc_ratio ) {
-	    gbLog( DEBUG, "[OOM] Removing item %p since wasn't accessed from %lus.", item, eta );
-        
-        GB_DEL_ITEM( server, node, item );
+		if( eta >= item->ttl ){
+			gbLog( DEBUG, "[CRON] TTL of %ds expired for item at %p.", item->ttl, item );
+
+			at_remove( &server->tree, expiration->key, expiration->klen );
+
+			if( item->prefix )
+				++gbAccountingOfItem( server, item )->expired;
+
+			gbDestroyItem( server, item );
+		}
+		// the item time was refreshed by a lock in the meanwhile
+		else
+			gbScheduleItem( server, item, expiration->key, expiration->klen );
+
+		if( ( ++done % CRON_EXPIRATION_STEP ) == 0 && gbMonotonicTime() >= deadline )
+			break;
 	}
 }
 
-void gbHandleDeadTTLHandler( anode_t *node, size_t level, void *data ){
-	gbServer *server = data;
-	gbItem	 *item = node->marker;
-	time_t	  eta = item ? ( server->stats.time - item->time ) : 0;
+// disconnect the clients idle for too long and shrink the buffers of the others
+static void gbServerCheckClients( gbServer *server ){
+	tw_entry_t *entry = NULL;
+	gbClient *client = NULL;
+
+	while( ( entry = tw_pop( &server->idlewheel, server->stats.time ) ) ){
+		client = (gbClient *)entry;
+
+		if( server->limits.maxidletime > 0 && server->stats.time - client->seen >= server->limits.maxidletime ){
+			gbLog( DEBUG, "[CRON] Client idle for %ds, disconnecting.", server->stats.time - client->seen );
 
-	// item is older enough to be deleted
-	if( item && item->ttl > 0 && eta >= item->ttl ) {
-		gbLog( DEBUG, "[CRON] TTL of %ds expired for item at %p.", item->ttl, item );
-        
-        GB_DEL_ITEM( server, node, item );
+			gbClientDestroy( client );
+		}
+		else {
+			gbClientShrinkBuffers( client );
+			gbClientSchedule( client );
+		}
 	}
 }
 
@@ -499,42 +744,115 @@ int gbServerCronHandler(struct gbEventLoop *eventLoop, long long id, void *data)
 		 avgsize[0xFF] = {0};
 	unsigned long before = 0;
 	long deleted = 0;
+	long long deadline = 0;
+	size_t evicted = 0;
+	int done = 0;
 
 	server->stats.time = now;
 
-	// shutdown requested
-	if( server->shutdown )
+	// shutdown requested, by a signal or by the first shard
+	if( __atomic_load_n( &server->shutdown, __ATOMIC_RELAXED ) ){
 		gbServerDestroy( server );
+		// only the other shards get here, their thread ends with the loop
+		return GB_NOMORE;
+	}
 
-	CRON_EVERY( 15000 ) {
-		before = server->stats.memused;
+	// the readers of the other shards retry while the cron changes the tree
+	gbEpochWriteBegin( server );
+
+	// only the items which are due are visited
+	before = server->stats.memused;
+
+	gbServerExpireItems( server );
+
+	deleted = before - server->stats.memused;
 
-		at_recurse( &server->tree, gbHandleDeadTTLHandler, server, 0 );
+	if( deleted > 0 ){
+		gbMemFormat( deleted, freed, 0xFF );
 
-		deleted = before - server->stats.memused;
+		gbLog( DEBUG, "Freed %s of expired data, left %d items.", freed, server->stats.nitems );
+	}
+
+	// start an eviction pass, which is carried on by the next loops until its target is freed
+	if( server->evicting == 0 && server->stats.memused > server->limits.maxmem ){
+		server->evicting = server->stats.memused - server->limits.maxmem + EVICTION_HEADROOM( server->limits.maxmem );
+
+		gbMemFormat( server->evicting, freed, 0xFF );
+
+		gbLog( WARNING, "Max memory exhausted, evicting %s of least recently used data.", freed );
+	}
+
+	if( server->evicting ){
+		evicted = gbEvictItems( server, server->evicting, gbMonotonicTime() + server->evictbudget * 1000 );
 
-		if( deleted > 0 ){
-			gbMemFormat( deleted, freed, 0xFF );
+		// nothing left to evict or only locked items
+		if( evicted >= server->evicting || evicted == 0 ){
+			server->evicting = 0;
 
-			gbLog( INFO, "Freed %s of expired data, left %d items.", freed, server->stats.nitems );
+			gbLog( INFO, "Eviction done, left %d items.", server->stats.nitems );
 		}
+		else
+			server->evicting -= evicted;
 	}
 
-	CRON_EVERY( 5000 ) {
-		if( server->stats.memused > server->limits.maxmem ){
+	// reclaim the branches left dead by interrupted removals a slice at a time
+	if( server->compacting ){
+		before   = at_memory_used();
+		deadline = gbMonotonicTime() + server->compactbudget * 1000;
 
-			before = server->stats.memused;
+		do {
+			done = at_compact( &server->tree, &server->compactcursor, CRON_COMPACTION_STEP );
+		}
+		while( !done && gbMonotonicTime() < deadline );
+
+		if( before > at_memory_used() ){
+			gbMemFormat( before - at_memory_used(), freed, 0xFF );
+			gbLog( DEBUG, "[CRON] Compaction freed %s of tree nodes.", freed );
+		}
 
-			gbLog( WARNING, "Max memory exhausted, trying to free data that was accessed not in the last %ds.", server->gc_ratio );
+		if( done )
+			server->compacting = 0;
+	}
 
-			at_recurse( &server->tree, gbMemoryFreeHandler, server, 0 );
+	// look for cold values every second, compressing them a slice at a time
+	CRON_EVERY( 1000 ){
+		if( server->compressage > 0 )
+			server->compressing = 1;
+	}
 
-			gbMemFormat( before - server->stats.memused, freed,  0xFF );
+	if( server->compressing ){
+		before = server->stats.memused;
 
-			gbLog( INFO, "Freed %s, left %d items.", freed, server->stats.nitems );
+		if( gbCompressItems( server, gbMonotonicTime() + server->compressbudget * 1000 ) )
+			server->compressing = 0;
+
+		if( before > server->stats.memused ){
+			gbMemFormat( before - server->stats.memused, freed, 0xFF );
+			gbLog( DEBUG, "[CRON] Compression of cold values saved %s.", freed );
 		}
 	}
 
+	gbEpochWriteEnd( server );
+	gbEpochReclaim( server );
+
+	gbServerCheckClients( server );
+
+	// reap the snapshot saved in background or start a new one when it's due
+	CRON_EVERY( 1000 ){
+		gbSnapshotCron( server );
+	}
+
+	// requests per second of every opcode
+	CRON_EVERY( 1000 ){
+		gbMetricsCron( server );
+	}
+
+	// give back the buffer memory the proxy didn't need in the last second
+	CRON_EVERY( 1000 ){
+		if( server->proxy )
+			gbClientShrinkBuffers( server->proxy );
+	}
+
 	CRON_EVERY( 15000 ){
 		gbMemFormat( server->stats.memused, used, 0xFF );
 		gbMemFormat( server->limits.maxmem, max,  0xFF );
@@ -684,29 +1002,73 @@ void gbConfigDestroyHandler( anode_t *elem, size_t level, void *data ){
 }
 
 void gbServerDestroy( gbServer *server ){
+	int i;
+
+	// the first shard stops the others before the process exits
+	if( server->shard == 0 && server->nshards > 1 ){
+		for( i = 1; i < server->nshards; ++i )
+			__atomic_store_n( &server->shards[i]->shutdown, 1, __ATOMIC_RELAXED );
+
+		for( i = 1; i < server->nshards; ++i )
+			pthread_join( server->shards[i]->thread, NULL );
+	}
+
+	// nobody reads the tree from now on, its memory is freed right away
+	gbEpochClose( server );
+
 	if( server->clients ){
-		ll_foreach( server->clients, citem ){
-			gbClient *client = citem->data;
-			if( client ){
-				gbClientDestroy(client);
-			}
+		for( i = 0; i < gbGetSetSize( server->events ); ++i ){
+			if( server->clients[i] )
+				gbClientDestroy( server->clients[i] );
 		}
 
-		ll_destroy( server->clients );
+		zfree( server->clients );
+		server->clients = NULL;
 	}
 
+	if( server->io )
+		gbIOThreadsDestroy( server );
+
 	ll_destroy( server->m_keys );
 	ll_destroy( server->m_values );
+	at_iterator_free( &server->m_iterator );
+
+	// dictionaries are saved too
+	gbSnapshotShutdown( server );
 
-	zfree( server->m_buffer );
 	zfree( server->lzf_buffer );
 
 	at_recurse( &server->tree, gbObjectDestroyHandler, server, 0 );
-	at_recurse( &server->config, gbConfigDestroyHandler, NULL, 0 );
 
 	at_free( &server->tree );
+	// destroyed items update the counters of their codec
+	gbCodecsDestroy( server );
+	gbMetricsDestroy( server );
+	gbAccountingDestroy( server );
+	at_cursor_free( &server->compactcursor );
+	at_cursor_free( &server->compresscursor );
+	at_cursor_free( &server->evictkey );
+	at_cursor_free( &server->evictsample );
+
+	if( server->nshards > 1 )
+		gbShardDestroy( server );
+
+	// the configuration belongs to the first shard, the thread deletes the loop
+	if( server->shard > 0 ){
+		if( server->type == TCP )
+			close( server->fd );
+
+		gbStopEventLoop( server->events );
+		zslab_release();
+		return;
+	}
+
+	at_recurse( &server->config, gbConfigDestroyHandler, NULL, 0 );
 	at_free( &server->config );
 
+	if( server->nshards > 1 )
+		gbShardsFree( server );
+
 	gbDeleteTimeEvent( server->events, server->cron_id );
 	gbDeleteEventLoop( server->events );
 	gbLogFinalize();
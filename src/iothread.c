@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "iothread.h"
+#include "log.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+extern void gbWriteReplyHandler( gbEventLoop *el, int fd, void *privdata, int mask );
+extern void gbClientReadDone( gbClient *client, ssize_t nread, int error );
+extern void gbClientWriteDone( gbClient *client, ssize_t nwrote, int error );
+
+static size_t gbIOQueuePush( gbIOQueue *queue, gbClient *client ){
+	if( queue->size == queue->capacity ){
+		queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+		queue->clients  = zrealloc( queue->clients, queue->capacity * sizeof(gbClient *) );
+	}
+
+	queue->clients[ queue->size++ ] = client;
+
+	return queue->size;
+}
+
+/*
+ * Do the syscalls of one slice of the batch, nslices being the threads
+ * plus the loop.
+ */
+static void gbIOExecute( gbIOThreads *io, int slice, int nslices ){
+	gbClient *client = NULL;
+	size_t i;
+
+	for( i = slice; i < io->nclients; i += nslices ){
+		if( ( client = io->clients[i] ) == NULL )
+			continue;
+
+		if( io->op == GBIO_READ )
+			client->ioresult = read( client->fd, client->input.data + client->input.size, client->input.capacity - client->input.size );
+		else
+			client->ioresult = gbClientWrite( client );
+
+		client->ioerror = errno;
+	}
+}
+
+static void *gbIOThreadMain( void *data ){
+	gbIOWorker *worker = data;
+	gbIOThreads *io = worker->io;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock( &io->lock );
+
+	while( 1 ){
+		while( io->stop == 0 && io->batch == seen )
+			pthread_cond_wait( &io->start, &io->lock );
+
+		if( io->stop )
+			break;
+
+		seen = io->batch;
+
+		pthread_mutex_unlock( &io->lock );
+
+		gbIOExecute( io, worker->index + 1, io->nthreads + 1 );
+
+		pthread_mutex_lock( &io->lock );
+
+		if( --io->pending == 0 )
+			pthread_cond_signal( &io->done );
+	}
+
+	pthread_mutex_unlock( &io->lock );
+
+	return NULL;
+}
+
+/*
+ * Hand the batch to the threads, doing the loop share meanwhile, and wait
+ * for all of them. Small batches aren't worth waking the threads up.
+ */
+static void gbIORun( gbIOThreads *io, int op, gbClient **clients, size_t nclients ){
+	io->op		 = op;
+	io->clients	 = clients;
+	io->nclients = nclients;
+
+	if( nclients < ( io->nthreads + 1 ) * GBIO_MIN_CLIENTS_PER_THREAD ){
+		gbIOExecute( io, 0, 1 );
+		return;
+	}
+
+	pthread_mutex_lock( &io->lock );
+
+	io->pending = io->nthreads;
+	++io->batch;
+
+	pthread_cond_broadcast( &io->start );
+	pthread_mutex_unlock( &io->lock );
+
+	gbIOExecute( io, 0, io->nthreads + 1 );
+
+	pthread_mutex_lock( &io->lock );
+
+	while( io->pending )
+		pthread_cond_wait( &io->done, &io->lock );
+
+	pthread_mutex_unlock( &io->lock );
+}
+
+/*
+ * Run the clients queued so far, then the ones queued while handling them,
+ * until the queue is empty.
+ */
+static void gbIOFlush( gbServer *server, gbIOQueue *queue, int op ){
+	gbIOThreads *io = server->io;
+	gbClient *client = NULL;
+	size_t i, n;
+
+	while( ( n = queue->size ) ){
+		// the threads never allocate, make room for the reads here
+		if( op == GBIO_READ ){
+			for( i = 0; i < n; ++i ){
+				if( ( client = queue->clients[i] ) )
+					gbClientReserveBuffer( client, &client->input, client->input.size + GBNET_READ_CHUNK_SIZE );
+			}
+		}
+		else {
+			// data of the items is written by the loop, it has to release them
+			for( i = 0; i < n; ++i ){
+				client = queue->clients[i];
+
+				if( client && client->ref < client->nrefs ){
+					queue->clients[i] = NULL;
+					client->iowrite	  = 0;
+
+					if( gbCreateFileEvent( server->events, client->fd, GB_WRITABLE, gbWriteReplyHandler, client ) == GB_ERR ){
+						gbLog( WARNING, "Unable to wait for client writable state." );
+						gbClientDestroy( client );
+					}
+				}
+			}
+		}
+
+		gbIORun( io, op, queue->clients, n );
+
+		for( i = 0; i < n; ++i ){
+			if( ( client = queue->clients[i] ) == NULL )
+				continue;
+
+			queue->clients[i] = NULL;
+
+			if( op == GBIO_READ ){
+				client->ioread = 0;
+				gbClientReadDone( client, client->ioresult, client->ioerror );
+			}
+			else {
+				client->iowrite = 0;
+				gbClientWriteDone( client, client->ioresult, client->ioerror );
+			}
+		}
+
+		queue->size -= n;
+
+		memmove( queue->clients, queue->clients + n, queue->size * sizeof(gbClient *) );
+
+		for( i = 0; i < queue->size; ++i ){
+			if( ( client = queue->clients[i] ) == NULL )
+				continue;
+			else if( op == GBIO_READ )
+				client->ioread = i + 1;
+			else
+				client->iowrite = i + 1;
+		}
+	}
+}
+
+static void gbIOBeforeSleep( gbEventLoop *el, void *data ){
+	gbServer *server = data;
+
+	// requests first, their replies get written right after
+	gbIOFlush( server, &server->io->reads,  GBIO_READ );
+	gbIOFlush( server, &server->io->writes, GBIO_WRITE );
+}
+
+int gbIOThreadsCreate( gbServer *server, int nthreads ){
+	gbIOThreads *io = zcalloc( sizeof(gbIOThreads) );
+	int i;
+
+	io->nthreads = nthreads;
+	io->workers  = zcalloc( nthreads * sizeof(gbIOWorker) );
+
+	pthread_mutex_init( &io->lock, NULL );
+	pthread_cond_init( &io->start, NULL );
+	pthread_cond_init( &io->done, NULL );
+
+	server->io = io;
+
+	for( i = 0; i < nthreads; ++i ){
+		io->workers[i].io	 = io;
+		io->workers[i].index = i;
+
+		if( pthread_create( &io->workers[i].thread, NULL, gbIOThreadMain, &io->workers[i] ) != 0 ){
+			io->nthreads = i;
+			gbIOThreadsDestroy( server );
+			return GB_ERR;
+		}
+	}
+
+	gbSetBeforeSleepProc( server->events, gbIOBeforeSleep, server );
+
+	return GB_OK;
+}
+
+void gbIOThreadsDestroy( gbServer *server ){
+	gbIOThreads *io = server->io;
+	int i;
+
+	pthread_mutex_lock( &io->lock );
+
+	io->stop = 1;
+
+	pthread_cond_broadcast( &io->start );
+	pthread_mutex_unlock( &io->lock );
+
+	for( i = 0; i < io->nthreads; ++i )
+		pthread_join( io->workers[i].thread, NULL );
+
+	pthread_mutex_destroy( &io->lock );
+	pthread_cond_destroy( &io->start );
+	pthread_cond_destroy( &io->done );
+
+	zfree( io->reads.clients );
+	zfree( io->writes.clients );
+	zfree( io->workers );
+	zfree( io );
+
+	server->io = NULL;
+
+	gbSetBeforeSleepProc( server->events, NULL, NULL );
+}
+
+void gbIOQueueRead( gbClient *client ){
+	if( client->ioread == 0 )
+		client->ioread = gbIOQueuePush( &client->server->io->reads, client );
+}
+
+void gbIOQueueWrite( gbClient *client ){
+	if( client->iowrite == 0 )
+		client->iowrite = gbIOQueuePush( &client->server->io->writes, client );
+}
+
+void gbIODequeue( gbClient *client ){
+	gbIOThreads *io = client->server->io;
+
+	if( client->ioread )
+		io->reads.clients[ client->ioread - 1 ] = NULL;
+
+	if( client->iowrite )
+		io->writes.clients[ client->iowrite - 1 ] = NULL;
+
+	client->ioread	=
+	client->iowrite = 0;
+}
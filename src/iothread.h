@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __IOTHREAD_H__
+#define __IOTHREAD_H__
+
+#include <pthread.h>
+#include "net.h"
+
+/*
+ * With io_threads > 0 the sockets of the clients are read and written by a
+ * pool of threads while the loop thread keeps executing every request. The
+ * event handlers just queue their clients, then before going back to poll
+ * the loop splits the queued reads among the threads and itself, waits for
+ * them, executes the requests and does the same with the queued writes.
+ *
+ * The threads only do read(2) and writev(2) on buffers prepared by the loop,
+ * replies referencing item data are written by the loop itself.
+ */
+
+// below this many clients per thread a batch is handled by the loop alone
+#define GBIO_MIN_CLIENTS_PER_THREAD 2
+
+#define GBIO_READ  1
+#define GBIO_WRITE 2
+
+typedef struct gbIOQueue
+{
+	// slots of the clients gone meanwhile are NULL
+	gbClient **clients;
+	size_t	   size;
+	size_t	   capacity;
+}
+gbIOQueue;
+
+typedef struct gbIOWorker
+{
+	pthread_t thread;
+	struct gbIOThreads *io;
+	int		  index;
+}
+gbIOWorker;
+
+typedef struct gbIOThreads
+{
+	int		   nthreads;
+	gbIOWorker *workers;
+	pthread_mutex_t lock;
+	// signaled with a new batch and when the last thread is done with it
+	pthread_cond_t  start;
+	pthread_cond_t  done;
+	// incremented with every batch
+	unsigned long   batch;
+	// threads still working on the batch
+	int		   pending;
+	int		   stop;
+	// the batch, GBIO_READ or GBIO_WRITE for every client in it
+	int		   op;
+	gbClient **clients;
+	size_t	   nclients;
+
+	gbIOQueue  reads;
+	gbIOQueue  writes;
+}
+gbIOThreads;
+
+/*
+ * Start the pool of the server, to be called by the thread running its loop.
+ */
+int  gbIOThreadsCreate( gbServer *server, int nthreads );
+void gbIOThreadsDestroy( gbServer *server );
+/*
+ * Read from the client socket with the next batch.
+ */
+void gbIOQueueRead( gbClient *client );
+/*
+ * Write the pending replies of the client with the next batch.
+ */
+void gbIOQueueWrite( gbClient *client );
+/*
+ * Forget a client going away.
+ */
+void gbIODequeue( gbClient *client );
+
+#endif
@@ -56,7 +56,7 @@ void gbLog( gbLogLevel level, const char *format, ... ){
 		   *slevel = "???";
 	va_list ap;
 	time_t 		rawtime  = 0;
-  	struct tm * timeinfo = NULL;
+  	struct tm   timeinfo;
 
 	if( level >= __log_level ){
 		va_start( ap, format );
@@ -64,9 +64,9 @@ void gbLog( gbLogLevel level, const char *format, ... ){
 		va_end(ap);
 
 		time( &rawtime );
-  		timeinfo = localtime( &rawtime );
+  		localtime_r( &rawtime, &timeinfo );
 
-  		strftime( timestamp, 0xFF, "%m/%d/%Y %X", timeinfo );
+  		strftime( timestamp, 0xFF, "%m/%d/%Y %X", &timeinfo );
 
 		switch( level )
 		{
@@ -79,13 +79,14 @@ void gbLog( gbLogLevel level, const char *format, ... ){
 
 		fprintf( __log_fp, "[%s] [%s] %s\n", timestamp, slevel, buffer );
 
-		if( ( ++__log_counter % __log_flushrate ) == 0 )
+		// every shard thread logs
+		if( ( __atomic_add_fetch( &__log_counter, 1, __ATOMIC_RELAXED ) % __log_flushrate ) == 0 )
 			fflush(__log_fp);
     }
 }
 
 void gbLogDumpBuffer( gbLogLevel level, unsigned char *buffer, unsigned int size ){
-	char *logline = alloca( size * 3 ),
+	char *logline = alloca( size * 3 + 1 ),
 		*p = &logline[0];
 	unsigned char byte;
 	unsigned int i;
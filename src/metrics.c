@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "metrics.h"
+#include "query.h"
+#include "log.h"
+
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+static const char *gbOpNames[GB_METRICS_OPS] = {
+	[OP_SET]	 = "set",
+	[OP_TTL]	 = "ttl",
+	[OP_GET]	 = "get",
+	[OP_DEL]	 = "del",
+	[OP_INC]	 = "inc",
+	[OP_DEC]	 = "dec",
+	[OP_LOCK]	 = "lock",
+	[OP_UNLOCK]	 = "unlock",
+	[OP_MSET]	 = "mset",
+	[OP_MTTL]	 = "mttl",
+	[OP_MGET]	 = "mget",
+	[OP_MDEL]	 = "mdel",
+	[OP_MINC]	 = "minc",
+	[OP_MDEC]	 = "mdec",
+	[OP_MLOCK]	 = "mlock",
+	[OP_MUNLOCK] = "munlock",
+	[OP_COUNT]	 = "count",
+	[OP_STATS]	 = "stats",
+	[OP_PING]	 = "ping",
+	[OP_SIZEOF]	 = "sizeof",
+	[OP_MSIZEOF] = "msizeof",
+	[OP_ENCOF]	 = "encof",
+	[OP_CAPS]	 = "caps",
+	[OP_BGET]	 = "bget",
+	[OP_BSET]	 = "bset",
+	[OP_PMGET]	 = "pmget",
+	[OP_PMDEL]	 = "pmdel",
+	[OP_PSTATS]	 = "pstats"
+};
+
+// opcodes executed in a time proportional to the keys they touch
+static const short gbAlwaysTimed[] = {
+	OP_MSET, OP_MTTL, OP_MGET, OP_MDEL, OP_MINC, OP_MDEC, OP_MLOCK, OP_MUNLOCK,
+	OP_COUNT, OP_STATS, OP_MSIZEOF, OP_BGET, OP_BSET, OP_PMGET, OP_PMDEL, OP_PSTATS
+};
+
+int gbMetricsCreate( gbServer *server, unsigned int sampling, size_t slowsize, unsigned long long slowthreshold ){
+	gbMetrics *metrics = zcalloc( sizeof(gbMetrics) );
+	size_t i;
+
+	metrics->sampling	   =
+	metrics->countdown	   = sampling ? sampling : 1;
+	metrics->slowsize	   = slowsize > GB_SLOWLOG_MAX_SIZE ? GB_SLOWLOG_MAX_SIZE : slowsize;
+	metrics->slowthreshold = slowthreshold;
+	metrics->updated	   = gbMonotonicTime();
+
+	if( metrics->slowsize )
+		metrics->slowlog = zcalloc( sizeof(gbSlowlogEntry) * metrics->slowsize );
+
+	for( i = 0; i < sizeof(gbAlwaysTimed) / sizeof(gbAlwaysTimed[0]); ++i ){
+		metrics->always[ gbAlwaysTimed[i] ] = 1;
+	}
+
+	server->metrics = metrics;
+
+	return GB_OK;
+}
+
+void gbMetricsDestroy( gbServer *server ){
+	if( server->metrics ){
+		if( server->metrics->slowlog )
+			zfree( server->metrics->slowlog );
+
+		zfree( server->metrics );
+		server->metrics = NULL;
+	}
+}
+
+unsigned long long gbMetricsClock( void ){
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+	struct timeval tv;
+
+	gettimeofday( &tv, NULL );
+	return (unsigned long long)tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+#endif
+}
+
+// position of the most significant bit set, v must not be 0
+static int gbMetricsMagnitude( unsigned long long v ){
+#ifdef __GNUC__
+	return 63 - __builtin_clzll( v );
+#else
+	int m = 0;
+
+	while( v >>= 1 )
+		++m;
+
+	return m;
+#endif
+}
+
+static size_t gbMetricsBucket( unsigned long long v ){
+	int m;
+
+	if( v < GB_METRICS_SUB )
+		return v;
+
+	m = gbMetricsMagnitude( v );
+	if( m > GB_METRICS_MAX_BITS )
+		return GB_METRICS_BUCKETS - 1;
+
+	return ( m - GB_METRICS_SUB_BITS + 1 ) * GB_METRICS_SUB + ( ( v >> ( m - GB_METRICS_SUB_BITS ) ) & ( GB_METRICS_SUB - 1 ) );
+}
+
+// highest value of a bucket
+static unsigned long long gbMetricsBucketTop( size_t i ){
+	int m;
+
+	if( i < GB_METRICS_SUB )
+		return i;
+
+	m = i / GB_METRICS_SUB + GB_METRICS_SUB_BITS - 1;
+
+	return ( ( GB_METRICS_SUB + i % GB_METRICS_SUB + 1ULL ) << ( m - GB_METRICS_SUB_BITS ) ) - 1;
+}
+
+void gbMetricsRecord( gbServer *server, short op, unsigned long long duration ){
+	gbOpMetrics *metrics = &server->metrics->ops[op];
+
+	if( server->metrics->countdown == 0 )
+		server->metrics->countdown = server->metrics->sampling;
+
+	++metrics->samples;
+	++metrics->histogram[ gbMetricsBucket( duration ) ];
+
+	if( duration > metrics->maxtime )
+		metrics->maxtime = duration;
+}
+
+void gbMetricsSlowlog( gbServer *server, short op, unsigned long long duration, byte_t *key, size_t klen ){
+	gbMetrics *metrics = server->metrics;
+	gbSlowlogEntry *entry = NULL;
+
+	if( metrics->slowsize == 0 )
+		return;
+
+	entry = &metrics->slowlog[ metrics->slownext ];
+
+	entry->time		= server->stats.time;
+	entry->op		= op;
+	entry->duration = duration;
+	entry->klen		= klen > GB_SLOWLOG_KEY ? GB_SLOWLOG_KEY : klen;
+
+	memcpy( entry->key, key, entry->klen );
+
+	metrics->slownext = ( metrics->slownext + 1 ) % metrics->slowsize;
+
+	++metrics->slowcount;
+
+	gbLog( DEBUG, "[SLOWLOG] %s took %lluus.", gbMetricsOpName( op ) ? gbMetricsOpName( op ) : "?", duration / 1000 );
+}
+
+void gbMetricsCron( gbServer *server ){
+	gbMetrics *metrics = server->metrics;
+	long long now = gbMonotonicTime(),
+			  elapsed = now - metrics->updated;
+	int i;
+
+	if( elapsed <= 0 )
+		return;
+
+	for( i = 0; i < GB_METRICS_OPS; ++i ){
+		metrics->ops[i].persec	  = ( metrics->ops[i].calls - metrics->ops[i].lastcalls ) * 1000000 / elapsed;
+		metrics->ops[i].lastcalls = metrics->ops[i].calls;
+	}
+
+	metrics->updated = now;
+}
+
+unsigned long long gbMetricsPercentile( gbOpMetrics *metrics, double fraction ){
+	unsigned long long rank = fraction * metrics->samples, seen = 0, top;
+	size_t i;
+
+	if( metrics->samples == 0 )
+		return 0;
+
+	else if( rank >= metrics->samples )
+		rank = metrics->samples - 1;
+
+	for( i = 0; i < GB_METRICS_BUCKETS; ++i ){
+		seen += metrics->histogram[i];
+
+		if( seen > rank ){
+			top = gbMetricsBucketTop(i);
+			return top < metrics->maxtime ? top : metrics->maxtime;
+		}
+	}
+
+	return metrics->maxtime;
+}
+
+const char *gbMetricsOpName( short op ){
+	return op >= 0 && op < GB_METRICS_OPS ? gbOpNames[op] : NULL;
+}
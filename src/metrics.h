@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include "net.h"
+
+/*
+ * Every shard times the requests it executes and keeps, for each opcode,
+ * the number of calls, their rate, the bytes of the requests and of their
+ * replies and a log-linear histogram of the time they took, plus a bounded
+ * log of the slowest ones. Forwarded requests are accounted by the shard
+ * executing them.
+ *
+ * Reading the clock costs about as much as a whole pipelined GET, so the
+ * single key requests are timed one every 'sampling', the others, whose
+ * time grows with the keys they touch, are always timed.
+ *
+ * Histogram buckets split every power of two of nanoseconds in
+ * 2^GB_METRICS_SUB_BITS linear steps, so percentiles are within 12.5% of
+ * the real value whatever its magnitude.
+ */
+
+// opcodes with metrics, the ones from here on are not accounted
+#define GB_METRICS_OPS		 32
+#define GB_METRICS_SUB_BITS	 3
+#define GB_METRICS_SUB		 ( 1 << GB_METRICS_SUB_BITS )
+// requests of 2^( GB_METRICS_MAX_BITS + 1 ) ns ( ~36 minutes ) or more share the last bucket
+#define GB_METRICS_MAX_BITS	 40
+#define GB_METRICS_BUCKETS	 ( ( GB_METRICS_MAX_BITS - GB_METRICS_SUB_BITS + 2 ) * GB_METRICS_SUB )
+// longest slowlog and key prefix bytes kept by each entry
+#define GB_SLOWLOG_MAX_SIZE	 1024
+#define GB_SLOWLOG_KEY		 32
+
+typedef struct
+{
+	unsigned long long calls;
+	unsigned long long bytesin;
+	unsigned long long bytesout;
+	// timed calls, the ones the histogram was built on
+	unsigned long long samples;
+	// slowest call, in nanoseconds
+	unsigned long long maxtime;
+	// calls per second during the last second, and calls at its start
+	unsigned long long persec;
+	unsigned long long lastcalls;
+	unsigned long long histogram[GB_METRICS_BUCKETS];
+}
+gbOpMetrics;
+
+typedef struct
+{
+	time_t			   time;
+	short			   op;
+	unsigned long long duration;
+	byte_t			   key[GB_SLOWLOG_KEY];
+	size_t			   klen;
+}
+gbSlowlogEntry;
+
+typedef struct gbMetrics
+{
+	gbOpMetrics		ops[GB_METRICS_OPS];
+	// 1 for the opcodes timed at every call
+	byte_t			always[GB_METRICS_OPS];
+	// one single key request every 'sampling' is timed, 'countdown' is
+	// the number of them left before the next one
+	unsigned int	sampling;
+	unsigned int	countdown;
+	// monotonic time of the last rates update, in microseconds
+	long long		updated;
+	// circular log of the slowest requests, 'next' is the oldest entry once full
+	gbSlowlogEntry *slowlog;
+	size_t			slowsize;
+	size_t			slownext;
+	// number of requests ever logged
+	unsigned long long slowcount;
+	// requests taking at least these nanoseconds are logged
+	unsigned long long slowthreshold;
+}
+gbMetrics;
+
+int  gbMetricsCreate( gbServer *server, unsigned int sampling, size_t slowsize, unsigned long long slowthreshold );
+void gbMetricsDestroy( gbServer *server );
+// monotonic clock, in nanoseconds
+unsigned long long gbMetricsClock( void );
+// 1 if the request of opcode 'op' about to be executed has to be timed
+#define gbMetricsTimed( m, op ) ( (op) >= 0 && (op) < GB_METRICS_OPS && \
+								  ( (m)->always[op] || --(m)->countdown == 0 ) )
+// account a request of opcode 'op' with 'in' bytes of request and 'out' bytes of reply
+#define gbMetricsCount( m, op, in, out ) if( (op) >= 0 && (op) < GB_METRICS_OPS ){ \
+											 ++(m)->ops[op].calls; \
+											 (m)->ops[op].bytesin  += (in); \
+											 (m)->ops[op].bytesout += (out); \
+										 }
+// account the time of a timed request, in nanoseconds
+void gbMetricsRecord( gbServer *server, short op, unsigned long long duration );
+// add an entry to the slowlog, with the first bytes of the key
+void gbMetricsSlowlog( gbServer *server, short op, unsigned long long duration, byte_t *key, size_t klen );
+// called every second by the cron, update the rates
+void gbMetricsCron( gbServer *server );
+/*
+ * Upper bound of the bucket where the given fraction of the timed calls of
+ * 'op' were faster, in nanoseconds.
+ */
+unsigned long long gbMetricsPercentile( gbOpMetrics *metrics, double fraction );
+// lowercase name of the opcode, NULL if unknown
+const char *gbMetricsOpName( short op );
+
+#endif
@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ *
+ * Based on Redis network library by Salvatore Sanfilippo.
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#if HAVE_IO_URING
+
+/* The io_uring backend keeps the readiness semantics of the other
+ * backends: every monitored fd has a single one shot IORING_OP_POLL_ADD
+ * in flight, which is armed again once its completion has been handled.
+ * Multishot polls are edge triggered and would lose events whenever a
+ * handler doesn't drain its socket, so they are not used.
+ *
+ * What we gain over epoll is batching. Arming, re-arming and removing
+ * polls only queues submission entries, and the whole batch is handed to
+ * the kernel by the same io_uring_enter() that waits for completions, so
+ * a loop iteration costs a single syscall no matter how many fds changed
+ * their mask (epoll needs an epoll_ctl() for each of them).
+ *
+ * The ring is used through the raw syscalls, so there's no dependency on
+ * liburing. When the kernel has no io_uring support, or it's disabled, the
+ * epoll backend is used instead. */
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <poll.h>
+#include <endian.h>
+
+/* Use the epoll backend, under another name, as the runtime fallback. */
+#define aeApiState    aeEpollState
+#define aeApiCreate   aeEpollCreate
+#define aeApiResize   aeEpollResize
+#define aeApiFree     aeEpollFree
+#define aeApiAddEvent aeEpollAddEvent
+#define aeApiDelEvent aeEpollDelEvent
+#define aeApiPoll     aeEpollPoll
+#define aeApiName     aeEpollName
+#include "epoll.c"
+#undef aeApiState
+#undef aeApiCreate
+#undef aeApiResize
+#undef aeApiFree
+#undef aeApiAddEvent
+#undef aeApiDelEvent
+#undef aeApiPoll
+#undef aeApiName
+
+#define AE_URING_MAX_ENTRIES 4096
+/* user_data of the POLL_REMOVE entries, whose completions are ignored. */
+#define AE_URING_REMOVE      UINT64_MAX
+
+typedef struct aeUringFd {
+    /* Bumped every time the poll of this fd is removed, so completions
+     * of stale polls can be told apart and skipped. */
+    uint32_t gen;
+    /* The mask of the poll in flight and the one the loop wants. */
+    unsigned char armed;
+    unsigned char want;
+} aeUringFd;
+
+typedef struct aeApiState {
+    int ringfd;
+    void *ring;
+    size_t ringsize;
+    struct io_uring_sqe *sqes;
+    size_t sqesize;
+    /* Submission ring. */
+    unsigned *sqhead, *sqtail, *sqmask, sqentries;
+    unsigned tail, tosubmit;
+    /* Completion ring. */
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_cqe *cqes;
+
+    aeUringFd *fds;
+    /* Number of fds fired by the last aeApiPoll, they are the ones needing
+     * their poll to be armed again. */
+    int lastfired;
+} aeApiState;
+
+static pthread_once_t aeUringOnce = PTHREAD_ONCE_INIT;
+static int aeUringEnabled = 0;
+
+static int aeUringSetup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int aeUringEnter(int fd, unsigned submit, unsigned complete, unsigned flags, void *arg, size_t argsize) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, complete, flags, arg, argsize);
+}
+
+/* Check once for every loop of the process if the kernel has everything
+ * this backend relies on. */
+static void aeUringProbe(void) {
+    struct io_uring_params p;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    fd = aeUringSetup(1, &p);
+    if (fd == -1) return;
+    close(fd);
+    aeUringEnabled = (p.features & IORING_FEAT_SINGLE_MMAP) &&
+                     (p.features & IORING_FEAT_NODROP) &&
+                     (p.features & IORING_FEAT_EXT_ARG);
+}
+
+static int aeUringSubmit(aeApiState *state, unsigned complete, unsigned flags, void *arg, size_t argsize) {
+    int ret;
+
+    do {
+        ret = aeUringEnter(state->ringfd, state->tosubmit, complete, flags, arg, argsize);
+    } while (ret == -1 && errno == EINTR && complete == 0);
+    if (ret > 0) state->tosubmit -= (unsigned)ret > state->tosubmit ? state->tosubmit : (unsigned)ret;
+    return ret;
+}
+
+static struct io_uring_sqe *aeUringGetSqe(aeApiState *state) {
+    struct io_uring_sqe *sqe;
+
+    /* The ring is full, hand what we have to the kernel first. */
+    if (state->tail - __atomic_load_n(state->sqhead, __ATOMIC_ACQUIRE) >= state->sqentries)
+        aeUringSubmit(state, 0, 0, NULL, 0);
+
+    sqe = &state->sqes[state->tail & *state->sqmask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void aeUringQueue(aeApiState *state) {
+    state->tail++;
+    state->tosubmit++;
+    __atomic_store_n(state->sqtail, state->tail, __ATOMIC_RELEASE);
+}
+
+static void aeUringArm(aeApiState *state, int fd, int mask) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+    unsigned events = 0;
+
+    if (mask & GB_READABLE) events |= POLLIN;
+    if (mask & GB_WRITABLE) events |= POLLOUT;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    events = (events << 16) | (events >> 16);
+#endif
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = ((uint64_t)state->fds[fd].gen << 32) | (uint32_t)fd;
+    aeUringQueue(state);
+
+    state->fds[fd].armed = mask;
+}
+
+static void aeUringDisarm(aeApiState *state, int fd) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = ((uint64_t)state->fds[fd].gen << 32) | (uint32_t)fd;
+    sqe->user_data = AE_URING_REMOVE;
+    aeUringQueue(state);
+
+    state->fds[fd].armed = GB_NONE;
+    state->fds[fd].gen++;
+}
+
+/* Make the poll in flight for fd match the mask the loop wants. */
+static void aeUringUpdate(aeApiState *state, int fd) {
+    aeUringFd *f = &state->fds[fd];
+
+    if (f->armed == f->want) return;
+    if (f->armed != GB_NONE) aeUringDisarm(state, fd);
+    if (f->want != GB_NONE) aeUringArm(state, fd, f->want);
+}
+
+static int aeApiCreate(gbEventLoop *eventLoop) {
+    struct io_uring_params p;
+    aeApiState *state;
+    unsigned entries, i, *array;
+
+    pthread_once(&aeUringOnce, aeUringProbe);
+    if (!aeUringEnabled) return aeEpollCreate(eventLoop);
+
+    state = zcalloc(sizeof(aeApiState));
+    if (!state) return -1;
+    state->fds = zcalloc(sizeof(aeUringFd)*eventLoop->setsize);
+    if (!state->fds) {
+        zfree(state);
+        return -1;
+    }
+
+    entries = eventLoop->setsize < AE_URING_MAX_ENTRIES ? eventLoop->setsize : AE_URING_MAX_ENTRIES;
+    memset(&p, 0, sizeof(p));
+    /* Every fd can have up to three completions pending (a stale poll,
+     * its removal and the new poll), NODROP takes care of the rest. */
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    state->ringfd = aeUringSetup(entries, &p);
+    if (state->ringfd == -1) goto err;
+
+    state->ringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > state->ringsize)
+        state->ringsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    state->ring = mmap(NULL, state->ringsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                       state->ringfd, IORING_OFF_SQ_RING);
+    if (state->ring == MAP_FAILED) goto err;
+
+    state->sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL, state->sqesize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                       state->ringfd, IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        munmap(state->ring, state->ringsize);
+        goto err;
+    }
+
+    state->sqhead    = (unsigned *)((char *)state->ring + p.sq_off.head);
+    state->sqtail    = (unsigned *)((char *)state->ring + p.sq_off.tail);
+    state->sqmask    = (unsigned *)((char *)state->ring + p.sq_off.ring_mask);
+    state->sqentries = p.sq_entries;
+    state->tail      = *state->sqtail;
+    state->cqhead    = (unsigned *)((char *)state->ring + p.cq_off.head);
+    state->cqtail    = (unsigned *)((char *)state->ring + p.cq_off.tail);
+    state->cqmask    = (unsigned *)((char *)state->ring + p.cq_off.ring_mask);
+    state->cqes      = (struct io_uring_cqe *)((char *)state->ring + p.cq_off.cqes);
+
+    /* Entries are always taken in order, so the indirection array is just
+     * the identity. */
+    array = (unsigned *)((char *)state->ring + p.sq_off.array);
+    for (i = 0; i < p.sq_entries; i++) array[i] = i;
+
+    eventLoop->apidata = state;
+    return 0;
+
+err:
+    if (state->ringfd != -1) close(state->ringfd);
+    zfree(state->fds);
+    zfree(state);
+    return -1;
+}
+
+static int aeApiResize(gbEventLoop *eventLoop, int setsize) {
+    aeApiState *state;
+    int i;
+
+    if (!aeUringEnabled) return aeEpollResize(eventLoop, setsize);
+
+    state = eventLoop->apidata;
+    state->fds = zrealloc(state->fds, sizeof(aeUringFd)*setsize);
+    for (i = eventLoop->setsize; i < setsize; i++)
+        memset(&state->fds[i], 0, sizeof(aeUringFd));
+    return 0;
+}
+
+static void aeApiFree(gbEventLoop *eventLoop) {
+    aeApiState *state;
+
+    if (!aeUringEnabled) {
+        aeEpollFree(eventLoop);
+        return;
+    }
+
+    state = eventLoop->apidata;
+    munmap(state->sqes, state->sqesize);
+    munmap(state->ring, state->ringsize);
+    close(state->ringfd);
+    zfree(state->fds);
+    zfree(state);
+}
+
+static int aeApiAddEvent(gbEventLoop *eventLoop, int fd, int mask) {
+    aeApiState *state;
+
+    if (!aeUringEnabled) return aeEpollAddEvent(eventLoop, fd, mask);
+
+    state = eventLoop->apidata;
+    state->fds[fd].want = eventLoop->events[fd].mask | mask;
+    aeUringUpdate(state, fd);
+    return 0;
+}
+
+static void aeApiDelEvent(gbEventLoop *eventLoop, int fd, int delmask) {
+    aeApiState *state;
+
+    if (!aeUringEnabled) {
+        aeEpollDelEvent(eventLoop, fd, delmask);
+        return;
+    }
+
+    state = eventLoop->apidata;
+    state->fds[fd].want = eventLoop->events[fd].mask & (~delmask);
+    /* The removal is queued right away, the fd can be closed and its
+     * number reused before the next aeApiPoll. */
+    aeUringUpdate(state, fd);
+}
+
+static int aeApiPoll(gbEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned head, tail, complete = 1;
+    int j, numevents = 0;
+
+    if (!aeUringEnabled) return aeEpollPoll(eventLoop, tvp);
+
+    state = eventLoop->apidata;
+
+    /* Arm again the polls that fired during the last iteration and are
+     * still wanted. */
+    for (j = 0; j < state->lastfired; j++) {
+        int fd = eventLoop->fired[j].fd;
+
+        if (fd < eventLoop->setsize) aeUringUpdate(state, fd);
+    }
+    state->lastfired = 0;
+
+    memset(&arg, 0, sizeof(arg));
+    if (tvp) {
+        ts.tv_sec  = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec * 1000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        if (tvp->tv_sec == 0 && tvp->tv_usec == 0) complete = 0;
+    }
+
+    /* Submit the batch and wait, with a single syscall. */
+    aeUringSubmit(state, complete, IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+    head = *state->cqhead;
+    tail = __atomic_load_n(state->cqtail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cqmask];
+        int fd = (int)(uint32_t)cqe->user_data, mask = 0;
+        aeUringFd *f;
+
+        if (cqe->user_data == AE_URING_REMOVE || fd >= eventLoop->setsize) continue;
+        f = &state->fds[fd];
+        /* Completion of a poll that was removed (or replaced) already. */
+        if ((uint32_t)(cqe->user_data >> 32) != f->gen) continue;
+
+        if (cqe->res < 0) {
+            /* Let the handlers find out what's wrong with the fd. */
+            mask = f->armed;
+        } else {
+            if (cqe->res & POLLIN) mask |= GB_READABLE;
+            if (cqe->res & POLLOUT) mask |= GB_WRITABLE;
+            if (cqe->res & POLLERR) mask |= GB_WRITABLE;
+            if (cqe->res & POLLHUP) mask |= GB_WRITABLE;
+        }
+        f->armed = GB_NONE;
+        eventLoop->fired[numevents].fd = fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+    }
+    __atomic_store_n(state->cqhead, head, __ATOMIC_RELEASE);
+
+    state->lastfired = numevents;
+    return numevents;
+}
+
+char *aeApiName(void) {
+    pthread_once(&aeUringOnce, aeUringProbe);
+    return aeUringEnabled ? "io_uring" : "epoll";
+}
+#else
+void AVOID_EMPTY_UNIT_WARNING_BY_GCC_IOURING(){ }
+#endif
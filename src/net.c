@@ -35,6 +35,9 @@
 #include "lzf.h"
 #include "log.h"
 #include "query.h"
+#include "shard.h"
+#include "codec.h"
+#include "iothread.h"
 
 #include <stdio.h>
 #include <sys/time.h>
@@ -49,6 +52,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <netinet/in.h>
@@ -65,13 +69,17 @@
 #ifdef HAVE_EVPORT
 #include "mux/evport.c"
 #else
-    #ifdef HAVE_EPOLL
-    #include "mux/epoll.c"
+    #ifdef HAVE_IO_URING
+    #include "mux/iouring.c"
     #else
-        #ifdef HAVE_KQUEUE
-        #include "mux/kqueue.c"
+        #ifdef HAVE_EPOLL
+        #include "mux/epoll.c"
         #else
-        #include "mux/select.c"
+            #ifdef HAVE_KQUEUE
+            #include "mux/kqueue.c"
+            #else
+            #include "mux/select.c"
+            #endif
         #endif
     #endif
 #endif
@@ -85,12 +93,15 @@ gbEventLoop *gbCreateEventLoop(int setsize) {
     eventLoop->fired = zmalloc(sizeof(gbFiredEvent)*setsize);
     if (eventLoop->events == NULL || eventLoop->fired == NULL) goto err;
     eventLoop->setsize = setsize;
-    eventLoop->lastTime = time(NULL);
-    eventLoop->timeEventHead = NULL;
+    eventLoop->timeEvents = NULL;
+    eventLoop->timeEventsCount = 0;
+    eventLoop->timeEventsSize = 0;
+    eventLoop->timeEventFiring = NULL;
     eventLoop->timeEventNextId = 0;
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
     eventLoop->beforesleep = NULL;
+    eventLoop->beforesleepData = NULL;
     if (aeApiCreate(eventLoop) == -1) goto err;
     /* Events with mask == GB_NONE are not set. So let's initialize the
      * vector with it. */
@@ -141,6 +152,11 @@ int gbResizeSetSize(gbEventLoop *eventLoop, int setsize) {
 }
 
 void gbDeleteEventLoop(gbEventLoop *eventLoop) {
+    int i;
+
+    for (i = 0; i < eventLoop->timeEventsCount; i++)
+        zfree(eventLoop->timeEvents[i]);
+    zfree(eventLoop->timeEvents);
     aeApiFree(eventLoop);
     zfree(eventLoop->events);
     zfree(eventLoop->fired);
@@ -195,27 +211,78 @@ int gbGetFileEvents(gbEventLoop *eventLoop, int fd) {
     return fe->mask;
 }
 
-static void gbGetTime(long *seconds, long *milliseconds)
+/* Return the current time in microseconds, not affected by system clock changes. */
+long long gbMonotonicTime(void)
 {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+#else
     struct timeval tv;
 
     gettimeofday(&tv, NULL);
-    *seconds = tv.tv_sec;
-    *milliseconds = tv.tv_usec/1000;
+    return ((long long)tv.tv_sec)*1000000 + tv.tv_usec;
+#endif
 }
 
-static void gbAddMillisecondsToNow(long long milliseconds, long *sec, long *ms) {
-    long cur_sec, cur_ms, when_sec, when_ms;
+/* The time events are kept in a binary min-heap ordered by due time, so
+ * the nearest timer is always the first one and adding, firing or
+ * rescheduling a timer costs O(log n) no matter how many are registered. */
+#define GB_HEAP_PARENT(i) (((i)-1)/2)
+#define GB_HEAP_LEFT(i)   (2*(i)+1)
 
-    gbGetTime(&cur_sec, &cur_ms);
-    when_sec = cur_sec + milliseconds/1000;
-    when_ms = cur_ms + milliseconds%1000;
-    if (when_ms >= 1000) {
-        when_sec ++;
-        when_ms -= 1000;
+static void gbTimeHeapSet(gbEventLoop *eventLoop, int i, gbTimeEvent *te) {
+    eventLoop->timeEvents[i] = te;
+    te->index = i;
+}
+
+static void gbTimeHeapUp(gbEventLoop *eventLoop, int i) {
+    gbTimeEvent *te = eventLoop->timeEvents[i];
+
+    while (i > 0 && eventLoop->timeEvents[GB_HEAP_PARENT(i)]->when > te->when) {
+        gbTimeHeapSet(eventLoop, i, eventLoop->timeEvents[GB_HEAP_PARENT(i)]);
+        i = GB_HEAP_PARENT(i);
     }
-    *sec = when_sec;
-    *ms = when_ms;
+    gbTimeHeapSet(eventLoop, i, te);
+}
+
+static void gbTimeHeapDown(gbEventLoop *eventLoop, int i) {
+    gbTimeEvent *te = eventLoop->timeEvents[i];
+    int child;
+
+    while ((child = GB_HEAP_LEFT(i)) < eventLoop->timeEventsCount) {
+        if (child+1 < eventLoop->timeEventsCount &&
+            eventLoop->timeEvents[child+1]->when < eventLoop->timeEvents[child]->when)
+            child++;
+        if (eventLoop->timeEvents[child]->when >= te->when) break;
+        gbTimeHeapSet(eventLoop, i, eventLoop->timeEvents[child]);
+        i = child;
+    }
+    gbTimeHeapSet(eventLoop, i, te);
+}
+
+static void gbTimeHeapPush(gbEventLoop *eventLoop, gbTimeEvent *te) {
+    if (eventLoop->timeEventsCount == eventLoop->timeEventsSize) {
+        eventLoop->timeEventsSize = eventLoop->timeEventsSize ? eventLoop->timeEventsSize * 2 : 16;
+        eventLoop->timeEvents = zrealloc(eventLoop->timeEvents, sizeof(gbTimeEvent *)*eventLoop->timeEventsSize);
+    }
+    gbTimeHeapSet(eventLoop, eventLoop->timeEventsCount++, te);
+    gbTimeHeapUp(eventLoop, te->index);
+}
+
+static void gbTimeHeapRemove(gbEventLoop *eventLoop, gbTimeEvent *te) {
+    int i = te->index;
+    gbTimeEvent *last = eventLoop->timeEvents[--eventLoop->timeEventsCount];
+
+    te->index = -1;
+    if (last == te) return;
+    gbTimeHeapSet(eventLoop, i, last);
+    if (i > 0 && eventLoop->timeEvents[GB_HEAP_PARENT(i)]->when > last->when)
+        gbTimeHeapUp(eventLoop, i);
+    else
+        gbTimeHeapDown(eventLoop, i);
 }
 
 long long gbCreateTimeEvent(gbEventLoop *eventLoop, long long milliseconds,
@@ -228,121 +295,73 @@ long long gbCreateTimeEvent(gbEventLoop *eventLoop, long long milliseconds,
     te = zmalloc(sizeof(*te));
     if (te == NULL) return GB_ERR;
     te->id = id;
-    gbAddMillisecondsToNow(milliseconds,&te->when_sec,&te->when_ms);
+    te->when = gbMonotonicTime() + milliseconds*1000;
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    te->next = eventLoop->timeEventHead;
-    eventLoop->timeEventHead = te;
+    gbTimeHeapPush(eventLoop, te);
     return id;
 }
 
 int gbDeleteTimeEvent(gbEventLoop *eventLoop, long long id)
 {
-    gbTimeEvent *te, *prev = NULL;
+    gbTimeEvent *te = eventLoop->timeEventFiring;
+    int i;
 
-    te = eventLoop->timeEventHead;
-    while(te) {
+    /* An event deleting itself from its own handler is freed once the
+     * handler returns. */
+    if (te && te->id == id) {
+        if (te->finalizerProc)
+            te->finalizerProc(eventLoop, te->clientData);
+        te->finalizerProc = NULL;
+        te->id = -1;
+        return GB_OK;
+    }
+
+    for (i = 0; i < eventLoop->timeEventsCount; i++) {
+        te = eventLoop->timeEvents[i];
         if (te->id == id) {
-            if (prev == NULL)
-                eventLoop->timeEventHead = te->next;
-            else
-                prev->next = te->next;
+            gbTimeHeapRemove(eventLoop, te);
             if (te->finalizerProc)
                 te->finalizerProc(eventLoop, te->clientData);
             zfree(te);
             return GB_OK;
         }
-        prev = te;
-        te = te->next;
     }
     return GB_ERR; /* NO event with the specified ID found */
 }
 
-/* Search the first timer to fire.
- * This operation is useful to know how many time the select can be
- * put in sleep without to delay any event.
- * If there are no timers NULL is returned.
- */
-static gbTimeEvent *aeSearchNearestTimer(gbEventLoop *eventLoop)
-{
-    gbTimeEvent *te = eventLoop->timeEventHead;
-    gbTimeEvent *nearest = NULL;
-
-    while(te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-                (te->when_sec == nearest->when_sec &&
-                 te->when_ms < nearest->when_ms))
-            nearest = te;
-        te = te->next;
-    }
-    return nearest;
-}
-
 /* Process time events */
 static int processTimeEvents(gbEventLoop *eventLoop) {
     int processed = 0;
-    gbTimeEvent *te;
-    long long maxId;
-    time_t now = time(NULL);
-
-    /* If the system clock is moved to the future, and then set back to the
-     * right value, time events may be delayed in a random way. Often this
-     * means that scheduled operations will not be performed soon enough.
-     *
-     * Here we try to detect system clock skews, and force all the time
-     * events to be processed ASAP when this happens: the idea is that
-     * processing events earlier is less dangerous than delaying them
-     * indefinitely, and practice suggests it is. */
-    if (now < eventLoop->lastTime) {
-        te = eventLoop->timeEventHead;
-        while(te) {
-            te->when_sec = 0;
-            te = te->next;
-        }
-    }
-    eventLoop->lastTime = now;
-
-    te = eventLoop->timeEventHead;
-    maxId = eventLoop->timeEventNextId-1;
-    while(te) {
-        long now_sec, now_ms;
-        long long id;
-
-        if (te->id > maxId) {
-            te = te->next;
-            continue;
-        }
-        gbGetTime(&now_sec, &now_ms);
-        if (now_sec > te->when_sec ||
-            (now_sec == te->when_sec && now_ms >= te->when_ms))
-        {
-            int retval;
-
-            id = te->id;
-            retval = te->timeProc(eventLoop, id, te->clientData);
-            processed++;
-            /* After an event is processed our time event list may
-             * no longer be the same, so we restart from head.
-             * Still we make sure to don't process events registered
-             * by event handlers itself in order to don't loop forever.
-             * To do so we saved the max ID we want to handle.
-             *
-             * FUTURE OPTIMIZATIONS:
-             * Note that this is NOT great algorithmically. Gibson uses
-             * a single time event so it's not a problem but the right
-             * way to do this is to add the new elements on head, and
-             * to flag deleted elements in a special way for later
-             * deletion (putting references to the nodes to delete into
-             * another linked list). */
-            if (retval != GB_NOMORE) {
-                gbAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-            } else {
-                gbDeleteTimeEvent(eventLoop, id);
-            }
-            te = eventLoop->timeEventHead;
+    long long maxId = eventLoop->timeEventNextId-1;
+    long long now = gbMonotonicTime();
+
+    /* Only the events due by now and registered before this call are
+     * processed, so handlers adding or rescheduling timers with a zero
+     * delay can't keep us here forever. */
+    while (eventLoop->timeEventsCount > 0) {
+        gbTimeEvent *te = eventLoop->timeEvents[0];
+        int retval;
+
+        if (te->when > now || te->id > maxId) break;
+
+        gbTimeHeapRemove(eventLoop, te);
+        eventLoop->timeEventFiring = te;
+        retval = te->timeProc(eventLoop, te->id, te->clientData);
+        eventLoop->timeEventFiring = NULL;
+        processed++;
+
+        if (te->id == -1) {
+            /* Deleted by its own handler. */
+            zfree(te);
+        } else if (retval != GB_NOMORE) {
+            te->when = gbMonotonicTime() + (long long)retval*1000;
+            gbTimeHeapPush(eventLoop, te);
         } else {
-            te = te->next;
+            if (te->finalizerProc)
+                te->finalizerProc(eventLoop, te->clientData);
+            zfree(te);
         }
     }
     return processed;
@@ -378,24 +397,19 @@ int gbProcessEvents(gbEventLoop *eventLoop, int flags)
         gbTimeEvent *shortest = NULL;
         struct timeval tv, *tvp;
 
-        if ( ( flags & GB_TIME_EVENTS ) && !(flags & GB_DONT_WAIT))
-            shortest = aeSearchNearestTimer(eventLoop);
+        if ( ( flags & GB_TIME_EVENTS ) && !(flags & GB_DONT_WAIT) && eventLoop->timeEventsCount > 0)
+            shortest = eventLoop->timeEvents[0];
         if (shortest) {
-            long now_sec, now_ms;
+            /* Calculate the time missing for the nearest timer to fire,
+             * rounded up to the millisecond resolution of most backends
+             * so we don't wake up right before it's due. */
+            long long wait = shortest->when - gbMonotonicTime();
 
-            /* Calculate the time missing for the nearest
-             * timer to fire. */
-            gbGetTime(&now_sec, &now_ms);
+            if (wait < 0) wait = 0;
+            wait = (wait + 999) / 1000 * 1000;
             tvp = &tv;
-            tvp->tv_sec = shortest->when_sec - now_sec;
-            if (shortest->when_ms < now_ms) {
-                tvp->tv_usec = ((shortest->when_ms+1000) - now_ms)*1000;
-                tvp->tv_sec --;
-            } else {
-                tvp->tv_usec = (shortest->when_ms - now_ms)*1000;
-            }
-            if (tvp->tv_sec < 0) tvp->tv_sec = 0;
-            if (tvp->tv_usec < 0) tvp->tv_usec = 0;
+            tvp->tv_sec = wait / 1000000;
+            tvp->tv_usec = wait % 1000000;
         } else {
             /* If we have to check for events but need to return
              * ASAP because of GB_DONT_WAIT we need to set the timeout
@@ -463,7 +477,7 @@ void gbEventLoopMain(gbEventLoop *eventLoop) {
     eventLoop->stop = 0;
     while (!eventLoop->stop) {
         if (eventLoop->beforesleep != NULL)
-            eventLoop->beforesleep(eventLoop);
+            eventLoop->beforesleep(eventLoop, eventLoop->beforesleepData);
         gbProcessEvents(eventLoop, GB_ALL_EVENTS);
     }
 }
@@ -472,8 +486,9 @@ char *gbGetEventApiName(void) {
     return aeApiName();
 }
 
-void gbSetBeforeSleepProc(gbEventLoop *eventLoop, gbBeforeSleepProc *beforesleep) {
+void gbSetBeforeSleepProc(gbEventLoop *eventLoop, gbBeforeSleepProc *beforesleep, void *clientData) {
     eventLoop->beforesleep = beforesleep;
+    eventLoop->beforesleepData = clientData;
 }
 
 
@@ -758,7 +773,7 @@ static int gbNetListen(char *err, int s, struct sockaddr *sa, socklen_t len) {
     return GBNET_OK;
 }
 
-int gbNetTcpServer(char *err, int port, char *bindaddr)
+int gbNetTcpServer(char *err, int port, char *bindaddr, int reuseport)
 {
     int s;
     struct sockaddr_in sa;
@@ -766,6 +781,25 @@ int gbNetTcpServer(char *err, int port, char *bindaddr)
     if ((s = gbNetCreateSocket(err,AF_INET)) == GBNET_ERR)
         return GBNET_ERR;
 
+    /* Let more sockets listen on the same port, the kernel balances the
+     * incoming connections among them */
+#ifdef SO_REUSEPORT
+    if (reuseport) {
+        int on = 1;
+        if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+            gbNetSetError(err, "setsockopt SO_REUSEPORT: %s", strerror(errno));
+            close(s);
+            return GBNET_ERR;
+        }
+    }
+#else
+    if (reuseport) {
+        gbNetSetError(err, "SO_REUSEPORT not supported");
+        close(s);
+        return GBNET_ERR;
+    }
+#endif
+
     memset(&sa,0,sizeof(sa));
     sa.sin_family = AF_INET;
     sa.sin_port = htons(port);
@@ -901,40 +935,320 @@ void gbServerFormatUptime( gbServer *server, char *s ){
 gbClient* gbClientCreate( int fd, gbServer *server  ){
 	gbClient *client = (gbClient *)zmalloc( sizeof( gbClient ) );
 
+	memset( &client->input,  0x00, sizeof( gbClientBuffer ) );
+	memset( &client->output, 0x00, sizeof( gbClientBuffer ) );
+	memset( &client->window, 0x00, sizeof( gbClientBuffer ) );
+
 	client->fd 			= fd;
+	client->refs		= NULL;
+	client->nrefs		=
+	client->maxrefs		=
+	client->ref			= 0;
+	client->refwrote	=
+	client->refpending	=
+	client->replied		= 0;
 	client->buffer 		= NULL;
 	client->buffer_size = 0;
-	client->status		= STATUS_WAITING_SIZE;
 	client->read 		= 0;
 	client->wrote 		= 0;
+	client->paused		= 0;
 	client->server 		= server;
 	client->shutdown 	= 0;
+	client->proxy		= 0;
+	client->call		= NULL;
+	client->caps		= 0;
+	client->ioread		=
+	client->iowrite		= 0;
+	client->seen		= server->stats.time;
 
-    ll_append( server->clients, client );
+	tw_init_entry( &client->timer );
+
+	if( fd < server->events->setsize )
+		server->clients[fd] = client;
+
+	gbClientSchedule( client );
 
 	++server->stats.nclients;
 
 	return client;
 }
 
+/*
+ * A client without a socket, not counted among the connected ones, whose
+ * replies are only collected in the output buffer.
+ */
+gbClient *gbClientCreateProxy( gbServer *server ){
+	gbClient *client = (gbClient *)zmalloc( sizeof( gbClient ) );
+
+	memset( client, 0x00, sizeof( gbClient ) );
+
+	client->fd	   = -1;
+	client->server = server;
+	client->proxy  = 1;
+
+	return client;
+}
+
+static void gbClientResizeBuffer( gbClient *client, gbClientBuffer *buffer, size_t size ){
+	gbServer *server = client->server;
+
+	server->stats.membuffers -= buffer->capacity;
+
+	if( size == 0 ){
+		if( buffer->data != NULL )
+			zfree( buffer->data );
+
+		buffer->data = NULL;
+	}
+	else
+		buffer->data = (byte_t *)zrealloc( buffer->data, size );
+
+	buffer->capacity = size;
+
+	server->stats.membuffers += size;
+
+	// check again in a second if the buffer is still that big
+	if( size > server->limits.clientbuffer && client->proxy == 0 &&
+		( !tw_scheduled( &client->timer ) || client->timer.expire > server->stats.time + 1 ) )
+		tw_add( &server->idlewheel, &client->timer, server->stats.time + 1 );
+}
+
+void gbClientReserveBuffer( gbClient *client, gbClientBuffer *buffer, size_t size ){
+	if( size > buffer->capacity ){
+		// grow geometrically, replies of a pipeline are appended one by one
+		size_t grow = buffer->capacity * 2;
+
+		gbClientResizeBuffer( client, buffer, size > grow ? size : grow );
+	}
+
+	if( size > buffer->peak )
+		buffer->peak = size;
+}
+
+static void gbClientShrinkBuffer( gbClient *client, gbClientBuffer *buffer ){
+	size_t size = buffer->peak;
+
+	// never drop what is still in use
+	if( size < buffer->size )
+		size = buffer->size;
+
+	if( size < client->server->limits.clientbuffer )
+		size = client->server->limits.clientbuffer;
+
+	if( buffer->capacity > size )
+		gbClientResizeBuffer( client, buffer, size );
+
+	buffer->peak = 0;
+}
+
+void gbClientShrinkBuffers( gbClient *client ){
+	gbClientShrinkBuffer( client, &client->input );
+	gbClientShrinkBuffer( client, &client->output );
+	gbClientShrinkBuffer( client, &client->window );
+}
+
+void gbClientSchedule( gbClient *client ){
+	gbServer *server = client->server;
+	size_t limit = server->limits.clientbuffer;
+
+	if( client->input.capacity > limit || client->output.capacity > limit || client->window.capacity > limit )
+		tw_add( &server->idlewheel, &client->timer, server->stats.time + 1 );
+
+	else if( server->limits.maxidletime > 0 )
+		tw_add( &server->idlewheel, &client->timer, client->seen + server->limits.maxidletime );
+
+	else if( tw_scheduled( &client->timer ) )
+		tw_del( &server->idlewheel, &client->timer );
+}
+
+/*
+ * Called once every pending reply has been written.
+ */
 void gbClientReset( gbClient *client ){
-    if( client->buffer != NULL )
-        zfree( client->buffer );
+	gbServer *server = client->server;
 
-    client->buffer      = NULL;
-	client->buffer_size = 0;
-	client->status		= STATUS_WAITING_SIZE;
-	client->read 		= 0;
-	client->wrote 		= 0;
-	client->shutdown 	= 0;
+	client->output.size = 0;
+	client->window.size = 0;
+	client->wrote		= 0;
+	client->nrefs		=
+	client->ref			= 0;
+	client->refwrote	=
+	client->refpending	= 0;
+
+	// too much memory retained by idle clients, give these buffers back
+	if( server->stats.membuffers > server->limits.maxbuffersmem ){
+		gbClientResizeBuffer( client, &client->output, 0 );
+		gbClientResizeBuffer( client, &client->window, 0 );
+
+		if( client->input.size == 0 )
+			gbClientResizeBuffer( client, &client->input, 0 );
+	}
+}
+
+// size of a serialized key/value pair
+static size_t gbKeyValueSize( size_t klen, gbItem *item, byte_t caps ){
+	return sizeof( size_t ) + klen + sizeof( gbItemEncoding ) + sizeof( size_t ) + gbItemWireSize( item, caps );
+}
+
+// serialize a key/value pair, p must have gbKeyValueSize bytes of room
+static void gbKeyValueWrite( gbServer *server, byte_t *p, byte_t *key, size_t klen, gbItem *item, byte_t caps ){
+	gbItemEncoding encoding = gbItemWireEncoding( item, caps );
+	size_t vsize = gbItemWireSize( item, caps );
+	long num;
+
+	memcpy( p, &klen, sizeof(size_t) ); 			   p += sizeof(size_t);
+	memcpy( p, key, klen ); 						   p += klen;
+	memcpy( p, &encoding, sizeof( gbItemEncoding ) ); p += sizeof( gbItemEncoding );
+	memcpy( p, &vsize, sizeof(size_t) ); 			   p += sizeof(size_t);
+
+	if( item->encoding == GB_ENC_INLINE ){
+		memcpy( p, item->value, vsize );
+	}
+	else if( item->encoding == GB_ENC_PLAIN || gbItemPassthrough( item, caps ) ){
+		memcpy( p, item->data, vsize );
+	}
+	else if( gbItemIsCompressed( item ) ){
+		gbCodecDecompress( server, item, p );
+	}
+	else if( item->encoding == GB_ENC_NUMBER ){
+		num = (long)item->data;
+		memcpy( p, &num, vsize );
+	}
+}
+
+gbClientStream *gbClientStreamCreate( gbClient *client ){
+	gbClientStream *stream = (gbClientStream *)zmalloc( sizeof( gbClientStream ) );
+
+	memset( stream, 0x00, sizeof( gbClientStream ) );
+
+	stream->server = client->server;
+	stream->caps   = client->caps;
+
+	return stream;
+}
+
+void gbClientStreamAppend( gbClientStream *stream, byte_t *key, size_t klen, gbItem *item ){
+	size_t pair = gbKeyValueSize( klen, item, stream->caps ),
+		   // small values are copied, only the big ones are worth a reference
+		   len = gbItemWireSize( item, stream->caps ) < GBNET_ZERO_COPY_SIZE ? pair : klen,
+		   needed = sizeof( gbItem * ) + sizeof( size_t ) + len;
+	gbItem *ref = len == klen ? item : NULL;
+	byte_t *p = NULL;
+
+	if( stream->size + needed > stream->capacity ){
+		stream->capacity = stream->capacity * 2 > stream->size + needed ? stream->capacity * 2 : stream->size + needed;
+		stream->entries  = (byte_t *)zrealloc( stream->entries, stream->capacity );
+	}
+
+	p = stream->entries + stream->size;
+
+	memcpy( p, 								   &ref, sizeof( gbItem * ) );
+	memcpy( p + sizeof( gbItem * ), 		   &len, sizeof( size_t ) );
+
+	// referenced until serialized, items not in the tree are then freed
+	++item->refs;
+
+	if( ref )
+		memcpy( p + sizeof( gbItem * ) + sizeof( size_t ), key, klen );
+	else {
+		gbKeyValueWrite( stream->server, p + sizeof( gbItem * ) + sizeof( size_t ), key, klen, item, stream->caps );
+		gbReleaseItem( stream->server, item );
+	}
+
+	stream->size += needed;
+
+	++stream->elements;
+
+	stream->bytes += pair;
+}
+
+static void gbClientStreamDestroy( gbServer *server, gbClientStream *stream ){
+	gbItem *item = NULL;
+	size_t klen = 0;
+
+	// release the items of the pairs not serialized
+	for( ; stream->next < stream->size; stream->next += sizeof( gbItem * ) + sizeof( size_t ) + klen ){
+		memcpy( &item, stream->entries + stream->next, 					  sizeof( gbItem * ) );
+		memcpy( &klen, stream->entries + stream->next + sizeof( gbItem * ), sizeof( size_t ) );
+
+		if( item )
+			gbReleaseItem( server, item );
+	}
+
+	if( stream->entries )
+		zfree( stream->entries );
+
+	zfree( stream );
+}
+
+/*
+ * Serialize the next pairs of the stream into the client window, at least
+ * one pair and then as many as GBNET_STREAM_WINDOW bytes can hold.
+ */
+static void gbClientStreamFill( gbClient *client, gbClientStream *stream ){
+	gbClientBuffer *window = &client->window;
+	gbItem *item = NULL;
+	byte_t *key = NULL;
+	size_t klen = 0, needed = 0;
+
+	window->size = 0;
+
+	while( stream->next < stream->size ){
+		memcpy( &item, stream->entries + stream->next, 					  sizeof( gbItem * ) );
+		memcpy( &klen, stream->entries + stream->next + sizeof( gbItem * ), sizeof( size_t ) );
+
+		key    = stream->entries + stream->next + sizeof( gbItem * ) + sizeof( size_t );
+		// pairs without an item are serialized already
+		needed = item ? gbKeyValueSize( klen, item, stream->caps ) : klen;
+
+		if( window->size && window->size + needed > GBNET_STREAM_WINDOW )
+			break;
+
+		gbClientReserveBuffer( client, window, window->size + needed );
+
+		if( item )
+			gbKeyValueWrite( client->server, window->data + window->size, key, klen, item, stream->caps );
+		else
+			memcpy( window->data + window->size, key, klen );
+
+		window->size += needed;
+		stream->next += sizeof( gbItem * ) + sizeof( size_t ) + klen;
+
+		if( item )
+			gbReleaseItem( client->server, item );
+	}
 }
 
 void gbClientDestroy( gbClient *client ){
 	gbServer *server = client->server;
 
-	if( client->buffer != NULL ){
-		zfree( client->buffer );
-		client->buffer = NULL;
+	gbClientResizeBuffer( client, &client->input, 0 );
+	gbClientResizeBuffer( client, &client->output, 0 );
+	gbClientResizeBuffer( client, &client->window, 0 );
+
+	// drop the references of the values we won't send
+	for( ; client->ref < client->nrefs; ++client->ref ){
+		if( client->refs[client->ref].stream )
+			gbClientStreamDestroy( server, client->refs[client->ref].stream );
+		else
+			gbReleaseItem( server, client->refs[client->ref].item );
+	}
+
+	if( client->refs != NULL ){
+		zfree( client->refs );
+		client->refs = NULL;
+	}
+
+	// the replies of the other shards will find nobody waiting for them
+	if( client->call != NULL )
+		client->call->client = NULL;
+
+	if( server->io )
+		gbIODequeue( client );
+
+	if( client->proxy ){
+		zfree( client );
+		return;
 	}
 
 	if (client->fd != -1) {
@@ -943,15 +1257,11 @@ void gbClientDestroy( gbClient *client ){
 		close(client->fd);
 	}
 
-	ll_item_t *item = NULL;
-	for( item = server->clients->head; item; item = item->next ){
-		if( ll_data( gbClient *, item ) == client )
-		{
-            // do not free the list item itself
-            item->data = NULL;
-			break;
-		}
-	}
+	if( client->fd >= 0 && client->fd < server->events->setsize && server->clients[client->fd] == client )
+		server->clients[client->fd] = NULL;
+
+	if( tw_scheduled( &client->timer ) )
+		tw_del( &server->idlewheel, &client->timer );
 
 	--server->stats.nclients;
 
@@ -959,32 +1269,245 @@ void gbClientDestroy( gbClient *client ){
 	client = NULL;
 }
 
-int gbClientEnqueueData( gbClient *client, short code, gbItemEncoding encoding, byte_t *reply, size_t size, gbFileProc *proc, short shutdown ){
-	if( client->fd <= 0 ) return GB_ERR;
-
-	size_t rsize = sizeof( short )  + 		  // reply opcode
+/*
+ * Append a reply header to the client output buffer, making room for the
+ * first 'copied' bytes of its data, replies of pipelined requests pile up
+ * and are written together.
+ */
+static byte_t *gbClientAppendReply( gbClient *client, short code, gbItemEncoding encoding, size_t size, size_t copied ){
+	gbClientBuffer *output = &client->output;
+	byte_t *p = NULL;
+	size_t hsize = sizeof( short )  + 		  // reply opcode
 				   sizeof( gbItemEncoding ) + // data type
-				   sizeof( size_t ) + 		  // data length
-				   size;			  		  // data
+				   sizeof( size_t );		  // data length
 
 	// realloc only if needed
-	if( rsize > client->buffer_size ){
-        client->buffer = (byte_t *)zrealloc( client->buffer, rsize );
-    }
+	gbClientReserveBuffer( client, output, output->size + hsize + copied );
 
-	client->buffer_size = rsize;
-	client->read  		= 0;
-	client->wrote 		= 0;
-	client->shutdown 	= shutdown;
+	p = output->data + output->size;
+
+	memcpy( p, 				  					          &code, 	 sizeof( short ) );
+	memcpy( p + sizeof( short ),					      &encoding, sizeof( gbItemEncoding ) );
+	memcpy( p + sizeof( short ) + sizeof( gbItemEncoding ), &size, 	 sizeof( size_t ) );
+
+	output->size += hsize + copied;
+
+	client->replied += hsize + size;
+
+	return p + hsize;
+}
+
+static int gbClientWaitWritable( gbClient *client, int pending, gbFileProc *proc, short shutdown ){
+	if( shutdown )
+		client->shutdown = shutdown;
 
-	memcpy( client->buffer, 				  					          					&code, 	   sizeof( short ) );
-	memcpy( client->buffer + sizeof( short ),					          					&encoding, sizeof( gbItemEncoding ) );
-	memcpy( client->buffer + sizeof( short ) + sizeof( gbItemEncoding ),  				    &size, 	   sizeof( size_t ) );
-	memcpy( client->buffer + sizeof( short ) + sizeof( gbItemEncoding ) + sizeof( size_t ), reply, 	   size );
+	// the writable event is already there for the previous replies
+	if( pending || client->proxy )
+		return GB_OK;
+
+	// written by the I/O threads before the loop polls again
+	else if( client->server->io ){
+		gbIOQueueWrite( client );
+		return GB_OK;
+	}
 
 	return gbCreateFileEvent( client->server->events, client->fd, GB_WRITABLE, proc, client );
 }
 
+int gbClientEnqueueData( gbClient *client, short code, gbItemEncoding encoding, byte_t *reply, size_t size, gbFileProc *proc, short shutdown ){
+	if( client->fd <= 0 && client->proxy == 0 ) return GB_ERR;
+
+	int pending = client->output.size;
+
+	memcpy( gbClientAppendReply( client, code, encoding, size, size ), reply, size );
+
+	return gbClientWaitWritable( client, pending, proc, shutdown );
+}
+
+int gbClientEnqueueReply( gbClient *client, byte_t *reply, size_t size, gbFileProc *proc, short shutdown ){
+	gbClientBuffer *output = &client->output;
+	int pending = output->size;
+
+	gbClientReserveBuffer( client, output, output->size + size );
+
+	memcpy( output->data + output->size, reply, size );
+
+	output->size += size;
+
+	return gbClientWaitWritable( client, pending, proc, shutdown );
+}
+
+static void gbClientAddReference( gbClient *client, gbItem *item, gbClientStream *stream ){
+	gbClientReference *ref = NULL;
+
+	if( client->nrefs == client->maxrefs ){
+		client->maxrefs = client->maxrefs ? client->maxrefs * 2 : 8;
+		client->refs	= zrealloc( client->refs, client->maxrefs * sizeof( gbClientReference ) );
+	}
+
+	ref = &client->refs[ client->nrefs++ ];
+	ref->offset = client->output.size;
+	ref->item	= item;
+	ref->stream = stream;
+}
+
+/*
+ * Reply with the data of a plain item, or the compressed data of an LZF one,
+ * without copying it, the item is referenced until its data is written.
+ */
+static int gbClientEnqueueReference( gbClient *client, short code, gbItem *item, gbFileProc *proc, short shutdown ){
+	if( client->fd <= 0 ) return GB_ERR;
+
+	int pending = client->output.size;
+
+	gbClientAppendReply( client, code, gbItemPublicEncoding( item ), item->size, 0 );
+
+	gbClientAddReference( client, item, NULL );
+
+	++item->refs;
+
+	client->refpending += item->size;
+
+	return gbClientWaitWritable( client, pending, proc, shutdown );
+}
+
+int gbClientEnqueueStream( gbClient *client, gbClientStream *stream, gbFileProc *proc, short shutdown ){
+	if( client->fd <= 0 && client->proxy == 0 ){
+		gbClientStreamDestroy( client->server, stream );
+		return GB_ERR;
+	}
+
+	int pending = client->output.size;
+	size_t elements = stream->elements;
+
+	// the header and the number of elements are sent as usual, the pairs follow
+	memcpy( gbClientAppendReply( client, REPL_KVAL, GB_ENC_PLAIN, sizeof(size_t) + stream->bytes, sizeof(size_t) ), &elements, sizeof(size_t) );
+
+	// the whole reply is handed to another shard, serialize it right away
+	if( client->proxy ){
+		while( stream->next < stream->size ){
+			gbClientStreamFill( client, stream );
+			gbClientEnqueueReply( client, client->window.data, client->window.size, proc, 0 );
+		}
+
+		gbClientStreamDestroy( client->server, stream );
+
+		return gbClientWaitWritable( client, pending, proc, shutdown );
+	}
+
+	gbClientAddReference( client, NULL, stream );
+
+	client->refpending += stream->bytes;
+
+	return gbClientWaitWritable( client, pending, proc, shutdown );
+}
+
+ssize_t gbClientWrite( gbClient *client ){
+	struct iovec iov[GBNET_MAX_IOV];
+	gbClientBuffer *output = &client->output;
+	gbClientReference *ref = NULL;
+	size_t pos = client->wrote,
+		   skip = client->refwrote,
+		   chunk = 0;
+	int iovcnt = 0,
+		r = client->ref,
+		next = 0;
+	ssize_t nwrote = 0, left = 0;
+
+	// output buffer slices interleaved with the referenced values
+	while( iovcnt < GBNET_MAX_IOV ){
+		next = r < client->nrefs ? client->refs[r].offset : output->size;
+
+		if( pos < next ){
+			iov[iovcnt].iov_base = output->data + pos;
+			iov[iovcnt].iov_len  = next - pos;
+			++iovcnt;
+
+			pos = next;
+		}
+		else if( r < client->nrefs && client->refs[r].stream ){
+			// streams are written alone, a window at a time
+			if( iovcnt )
+				break;
+
+			if( client->window.size == 0 )
+				gbClientStreamFill( client, client->refs[r].stream );
+
+			iov[iovcnt].iov_base = client->window.data + skip;
+			iov[iovcnt].iov_len  = client->window.size - skip;
+			++iovcnt;
+
+			break;
+		}
+		else if( r < client->nrefs ){
+			ref = &client->refs[r++];
+
+			iov[iovcnt].iov_base = (byte_t *)ref->item->data + skip;
+			iov[iovcnt].iov_len  = ref->item->size - skip;
+			++iovcnt;
+
+			skip = 0;
+		}
+		else
+			break;
+	}
+
+	nwrote = writev( client->fd, iov, iovcnt );
+	if( nwrote <= 0 )
+		return nwrote;
+
+	// move forward, releasing the values completely written
+	for( left = nwrote; left > 0; left -= chunk ){
+		next = client->ref < client->nrefs ? client->refs[client->ref].offset : output->size;
+
+		if( client->wrote < next ){
+			chunk = next - client->wrote;
+			if( chunk > left )
+				chunk = left;
+
+			client->wrote += chunk;
+		}
+		else if( client->refs[client->ref].stream ){
+			ref   = &client->refs[client->ref];
+			chunk = client->window.size - client->refwrote;
+			if( chunk > left )
+				chunk = left;
+
+			client->refwrote   += chunk;
+			client->refpending -= chunk;
+
+			// window written, on to the next one or past the stream
+			if( client->refwrote == client->window.size ){
+				client->window.size = 0;
+				client->refwrote	= 0;
+
+				if( ref->stream->next == ref->stream->size ){
+					gbClientStreamDestroy( client->server, ref->stream );
+					++client->ref;
+				}
+			}
+		}
+		else {
+			ref   = &client->refs[client->ref];
+			chunk = ref->item->size - client->refwrote;
+			if( chunk > left )
+				chunk = left;
+
+			client->refwrote   += chunk;
+			client->refpending -= chunk;
+
+			if( client->refwrote == ref->item->size ){
+				gbReleaseItem( client->server, ref->item );
+
+				++client->ref;
+				client->refwrote = 0;
+			}
+		}
+	}
+
+	return nwrote;
+}
+
 int gbClientEnqueueCode( gbClient *client, short code, gbFileProc proc, short shutdown ){
 	byte_t zero = 0x00;
 
@@ -992,19 +1515,33 @@ int gbClientEnqueueCode( gbClient *client, short code, gbFileProc proc, short sh
 }
 
 int gbClientEnqueueItem( gbClient *client, short code, gbItem *item, gbFileProc *proc, short shutdown ){
-	if( item->encoding == GB_ENC_PLAIN ){
+	if( item->encoding == GB_ENC_INLINE ){
+		return gbClientEnqueueData( client, code, GB_ENC_PLAIN, item->value, item->size, proc, shutdown );
+	}
+	// big values of items owned by the tree are not copied
+	else if( item->encoding == GB_ENC_PLAIN && item->size >= GBNET_ZERO_COPY_SIZE && item->refs && client->proxy == 0 ){
+		return gbClientEnqueueReference( client, code, item, proc, shutdown );
+	}
+	else if( item->encoding == GB_ENC_PLAIN ){
 		return gbClientEnqueueData( client, code, GB_ENC_PLAIN, item->data, item->size, proc, shutdown );
 	}
-	else if( item->encoding == GB_ENC_LZF ){
-		size_t declen = lzf_decompress
-		(
-			item->data,
-			item->size,
-			client->server->lzf_buffer,
-			client->server->limits.maxrequestsize
-		);
-
-		return gbClientEnqueueData( client, code, GB_ENC_PLAIN, client->server->lzf_buffer, declen, proc, shutdown );
+	// sent compressed to the clients which can handle it, big ones not copied either
+	else if( gbItemPassthrough( item, client->caps ) ){
+		if( item->size >= GBNET_ZERO_COPY_SIZE && item->refs && client->proxy == 0 )
+			return gbClientEnqueueReference( client, code, item, proc, shutdown );
+
+		return gbClientEnqueueData( client, code, item->encoding, item->data, item->size, proc, shutdown );
+	}
+	// decompressed straight into the output buffer
+	else if( gbItemIsCompressed( item ) ){
+		if( client->fd <= 0 && client->proxy == 0 ) return GB_ERR;
+
+		int pending = client->output.size;
+		size_t size = gbCompressedRawSize( item );
+
+		gbCodecDecompress( client->server, item, gbClientAppendReply( client, code, GB_ENC_PLAIN, size, size ) );
+
+		return gbClientWaitWritable( client, pending, proc, shutdown );
 	}
 	else if( item->encoding == GB_ENC_NUMBER ){
 		long num = (long)item->data;
@@ -1017,67 +1554,29 @@ int gbClientEnqueueItem( gbClient *client, short code, gbItem *item, gbFileProc
 
 int gbClientEnqueueKeyValueSet( gbClient *client, size_t elements, gbFileProc *proc, short shutdown ){
 	gbServer *server = client->server;
-	gbItem *item = NULL;
-	size_t sz = sizeof(size_t),
-		   vsize = 0,
-		   space = server->limits.maxresponsesize;
-	byte_t *data = server->m_buffer,
-		   *p = data,
-		   *v = NULL;
-	gbItemEncoding encoding;
-	long num;
-
-#define CHECK_SPACE(needed) if( needed > space ){ \
-						gbLog( WARNING, "Max response size reached." ); \
-						return GBNET_ERR; \
-					}
-
-#define SAFE_MEMCPY( p, data, size ) CHECK_SPACE(size); memcpy( p, data, size ); p += size; space -= size
-
-	SAFE_MEMCPY( p, &elements, sz );
+	size_t size = sizeof(size_t);
+	byte_t *p = NULL;
+	int pending = client->output.size;
 
 	ll_foreach_2( server->m_keys, server->m_values, ki, vi ){
 		// handle expired/nulled items
 		if( vi->data != NULL ){
-			item 	 = vi->data;
-			encoding = item->encoding;
-
-			// write key size + key
-			sz = strlen( ki->data );
+			size += gbKeyValueSize( strlen( ki->data ), vi->data, client->caps );
+		}
+	}
 
-			SAFE_MEMCPY( p, &sz, sizeof(size_t) );
-			SAFE_MEMCPY( p, ki->data, sz );
+	// small sets, serialized straight into the output buffer
+	p = gbClientAppendReply( client, REPL_KVAL, GB_ENC_PLAIN, size, size );
 
-			// write value size + value
-			if( encoding == GB_ENC_PLAIN ){
-				vsize = item->size;
-				v	  = item->data;
-			}
-			else if( encoding == GB_ENC_LZF ){
-				encoding = GB_ENC_PLAIN;
-				vsize = lzf_decompress
-				(
-					item->data,
-					item->size,
-					client->server->lzf_buffer,
-					client->server->limits.maxrequestsize
-				);
-
-				v = server->lzf_buffer;
-			}
-			else if( item->encoding == GB_ENC_NUMBER ){
-				num = (long)item->data;
-				v   = (byte_t *)&num;
-				vsize = item->size;
-			}
+	memcpy( p, &elements, sizeof(size_t) );
+	p += sizeof(size_t);
 
-			SAFE_MEMCPY( p, &encoding, sizeof( gbItemEncoding ) );
-			SAFE_MEMCPY( p, &vsize,	   sizeof(size_t) );
-			SAFE_MEMCPY( p, v, 		   vsize );
+	ll_foreach_2( server->m_keys, server->m_values, kw, vw ){
+		if( vw->data != NULL ){
+			gbKeyValueWrite( server, p, kw->data, strlen( kw->data ), vw->data, client->caps );
+			p += gbKeyValueSize( strlen( kw->data ), vw->data, client->caps );
 		}
 	}
 
-	int ret = gbClientEnqueueData( client, REPL_KVAL, GB_ENC_PLAIN, data, p - data, proc, shutdown );
-
-	return ret;
+	return gbClientWaitWritable( client, pending, proc, shutdown );
 }
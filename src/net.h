@@ -33,9 +33,13 @@
 #	define __NET_H__
 
 #include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
 #include <sys/stat.h>
 #include "atree.h"
 #include "llist.h"
+#include "twheel.h"
 #include "default.h"
 
 #if defined(__sun)
@@ -71,7 +75,7 @@ struct gbEventLoop;
 typedef void gbFileProc(struct gbEventLoop *eventLoop, int fd, void *clientData, int mask);
 typedef int  gbTimeProc(struct gbEventLoop *eventLoop, long long id, void *clientData);
 typedef void gbEventFinalizerProc(struct gbEventLoop *eventLoop, void *clientData);
-typedef void gbBeforeSleepProc(struct gbEventLoop *eventLoop);
+typedef void gbBeforeSleepProc(struct gbEventLoop *eventLoop, void *clientData);
 
 /* File event structure */
 typedef struct gbFileEvent
@@ -87,12 +91,11 @@ gbFileEvent;
 typedef struct gbTimeEvent
 {
     long long id; /* time event identifier. */
-    long when_sec; /* seconds */
-    long when_ms; /* milliseconds */
+    long long when; /* monotonic time it is due, in microseconds */
+    int index; /* position in the timers heap, -1 while it is firing */
     gbTimeProc *timeProc;
     gbEventFinalizerProc *finalizerProc;
     void *clientData;
-    struct gbTimeEvent *next;
 }
 gbTimeEvent;
 
@@ -110,13 +113,16 @@ typedef struct gbEventLoop
     int maxfd;   /* highest file descriptor currently registered */
     int setsize; /* max number of file descriptors tracked */
     long long timeEventNextId;
-    time_t lastTime;     /* Used to detect system clock skew */
     gbFileEvent *events; /* Registered events */
     gbFiredEvent *fired; /* Fired events */
-    gbTimeEvent *timeEventHead;
+    gbTimeEvent **timeEvents; /* Min-heap of the time events by due time */
+    int timeEventsCount;
+    int timeEventsSize;
+    gbTimeEvent *timeEventFiring; /* Time event whose handler is running */
     int stop;
     void *apidata; /* This is used for polling API specific data */
     gbBeforeSleepProc *beforesleep;
+    void *beforesleepData;
 }
 gbEventLoop;
 
@@ -141,10 +147,14 @@ typedef struct
 	unsigned long maxkeysize;
 	// maximum size of an item value
 	unsigned long maxvaluesize;
-	// maximum size of a response
+	// maximum size of the unread replies of a client
 	unsigned long maxresponsesize;
 	// maximum size of used memory
 	unsigned long maxmem;
+	// maximum memory the idle clients buffers can retain
+	unsigned long maxbuffersmem;
+	// size each idle client buffer is shrunk to when too big
+	unsigned long clientbuffer;
 }
 gbServerLimits;
 
@@ -172,6 +182,16 @@ typedef struct
 	unsigned long memused;
 	// maximum memory peak
 	unsigned long mempeak;
+	// memory used by items and their values
+	unsigned long memvalues;
+	// number of items evicted to free memory
+	unsigned long nevicted;
+	// memory freed by evicting items
+	unsigned long memevicted;
+	// memory allocated for the clients buffers
+	unsigned long membuffers;
+	// GETs served from the tree of another shard, see epoch.h
+	unsigned long nsharedreads;
 	// average object size
 	double sizeavg;
     // average compression rate
@@ -199,59 +219,234 @@ typedef struct gbServer
 	atree_t  tree;
 	// server main file descriptor
 	int 	 fd;
-	// list of currently connected clients
-	llist_t *clients;
+	// currently connected clients indexed by descriptor, as many as the
+	// events of the loop
+	struct gbClient **clients;
 	// period in milliseconds of the cron loop
 	unsigned int cronperiod;
-	// number of milliseconds to check for dead idle clients
-	time_t   idlecron;
+	// clients scheduled by the time they become idle or their buffers are
+	// due to be shrunk
+	tw_wheel_t idlewheel;
 	// data bigger then this is going to be compressed
 	unsigned long compression;
-	// buffer used for lzf (de)compression, alloc'd only once
+	// compression codec, GB_CODEC_AUTO to pick one by key prefix
+	int codec;
+	// length of the key prefixes codecs are picked for
+	size_t codecprefix;
+	// minimum compression rate, in percent, worth storing a value compressed
+	double codecminrate;
+	// train zstd dictionaries on the values of each prefix
+	byte_t codecdicts;
+	// data up to this size is stored inline with the item header
+	unsigned long inlinesize;
+	// seconds since the last access after which values above the compression
+	// threshold are compressed by the cron, 0 to compress them on set
+	time_t compressage;
+	// 1 if a pass compressing the cold values is in progress
+	int compressing;
+	// milliseconds per cron loop compressing cold values can take
+	unsigned int compressbudget;
+	// position of the compression pass in progress
+	at_cursor_t compresscursor;
+	// buffer used for compression, alloc'd only once
 	byte_t *lzf_buffer;
+	// compression codecs and their statistics by key prefix
+	struct gbCodecs *codecs;
+	// requests metrics and slowlog of the shard
+	struct gbMetrics *metrics;
+	// one single key request every this many is timed
+	unsigned int metricssampling;
+	// entries of the slowlog and microseconds a request must take to get there
+	size_t	 slowlogsize;
+	unsigned int slowlogthreshold;
+	// counters of the tracked key prefixes and their comma separated list
+	struct gbAccounting *accounting;
+	const char *accountingprefixes;
 	// static lists used for multi-* operands
 	llist_t *m_keys;
 	llist_t *m_values;
-	// buffer used to send multi get responses
-	byte_t *m_buffer;
+	// iterator used for multi-* operands
+	at_iterator_t m_iterator;
 	// cron timed event id
 	long long cron_id;
-	// data that is not being accessed in the last 'gc_ratio' seconds get deleted if the server needs memory.	
-    time_t	 gc_ratio;
+	// number of items sampled to pick each one to evict
+	unsigned int evictsamples;
+	// milliseconds per cron loop or query the eviction of items can take
+	unsigned int evictbudget;
+	// number of bytes the eviction in progress still has to free
+	size_t	 evicting;
+	// keys of the best eviction candidate and of the last sampled item
+	at_cursor_t evictkey;
+	at_cursor_t evictsample;
 	// flag to say the server to shutdown ASAP
 	int		 shutdown;
+	// 1 if a compaction pass of the tree is in progress
+	int		 compacting;
+	// milliseconds per cron loop a compaction pass can take
+	unsigned int compactbudget;
+	// position of the compaction pass in progress
+	at_cursor_t compactcursor;
+	// items with a TTL scheduled by expiration time
+	tw_wheel_t ttlwheel;
+	// milliseconds per cron loop the expiration of items can take
+	unsigned int expirebudget;
+	// file the snapshots are saved to, NULL if disabled
+	const char *snapshotfile;
+	// seconds between background snapshots, 0 to save only on shutdown
+	unsigned int snapshotperiod;
+	// child saving the snapshot in background, 0 if none
+	pid_t	 snapshotpid;
+	// time the last snapshot was started and the last one saved was
+	time_t	 snapshotstart;
+	time_t	 snapshotlast;
 	// plain configuration instance
 	atree_t	 config;
+	// index of this shard and number of shards, each one runs in its own
+	// thread with its own event loop and tree, 1 if not threaded
+	int		 shard;
+	int		 nshards;
+	// all the shards, this one included
+	struct gbServer **shards;
+	// number of leading key bytes choosing the shard of a key
+	size_t	 shardprefix;
+	// thread running the event loop of the shard
+	pthread_t thread;
+	// jobs posted by the other shards, a lock free stack
+	struct gbShardJob *inbox;
+	// pipe waking the shard up when its inbox gets the first job
+	int		 wakeup[2];
+	// client executing the requests of the other shards
+	struct gbClient *proxy;
+	// 1 if the GETs of keys of other shards are read from their trees,
+	// whose versions and retired memory are in 'epoch', NULL otherwise
+	byte_t	 sharedreads;
+	struct gbEpoch *epoch;
+	// threads doing the socket I/O of the clients, NULL if done by the loop
+	int		 niothreads;
+	struct gbIOThreads *io;
 
 	gbServerLimits limits;
 	gbServerStats stats;
 }
 gbServer;
 
-#define STATUS_WAITING_SIZE   0x00
-#define STATUS_WAITING_BUFFER 0x01
-#define STATUS_SENDING_REPLY  0x02
+// minimum number of bytes each read from a client socket asks for
+#define GBNET_READ_CHUNK_SIZE 16384
+// plain values from this size on are written straight from the item
+#define GBNET_ZERO_COPY_SIZE  4096
+// maximum number of buffers passed to each writev
+#define GBNET_MAX_IOV		  64
+// streamed key/value pairs are serialized about this many bytes at a time
+#define GBNET_STREAM_WINDOW   65536
+
+typedef struct
+{
+	// allocated memory, kept across requests
+	byte_t *data;
+	// allocated size
+	int		capacity;
+	// number of bytes in use
+	int		size;
+	// biggest size reserved since the last shrink check
+	int		peak;
+}
+gbClientBuffer;
+
+/*
+ * Key/value pairs of a REPL_KVAL reply, the big ones serialized only when
+ * it's their turn to be written. Each entry is the referenced item followed
+ * by the key size and the key, or NULL followed by the size of the pair and
+ * the pair already serialized for values smaller than GBNET_ZERO_COPY_SIZE.
+ */
+typedef struct
+{
+	// server the referenced items belong to
+	struct gbServer *server;
+	// entries buffer
+	byte_t *entries;
+	// size of the entries and allocated size
+	size_t  size,
+			capacity;
+	// offset of the next entry to serialize
+	size_t  next;
+	// number of pairs
+	size_t  elements;
+	// size of the serialized pairs
+	size_t  bytes;
+	// capabilities of the client when the stream was created
+	byte_t  caps;
+}
+gbClientStream;
+
+/*
+ * A value written straight from an item, or a stream of pairs, right after
+ * the first 'offset' bytes of the client output buffer.
+ */
+typedef struct
+{
+	int	    offset;
+	struct gbItem *item;
+	gbClientStream *stream;
+}
+gbClientReference;
 
 typedef struct gbClient
 {
+	// next check for idleness or oversized buffers, first member so the
+	// entries popped from the idle wheel are the clients
+	tw_entry_t timer;
 	// main client file descriptor
 	int		  fd;
-	// client request/response buffer
+	// requests read from the socket, possibly more than one
+	gbClientBuffer input;
+	// replies waiting to be written to the socket
+	gbClientBuffer output;
+	// values the pending replies reference instead of copying them
+	gbClientReference *refs;
+	// number of references and allocated references
+	int		  nrefs,
+			  maxrefs;
+	// first reference not completely written yet
+	int		  ref;
+	// number of bytes of the first reference, or of the window if it is
+	// a stream, already written
+	size_t	  refwrote;
+	// pairs of the stream being sent, serialized
+	gbClientBuffer window;
+	// number of bytes of the references still to be written
+	size_t	  refpending;
+	// number of bytes of the replies enqueued so far
+	unsigned long long replied;
+	// request being processed inside the input buffer, opcode included
 	byte_t   *buffer;
-	// client request/response buffer size
+	// size of the request being processed
 	int		  buffer_size;
-	// number of bytes currently read
+	// number of input bytes already processed
 	int		  read;
-	// number of bytes currently wrote
+	// number of output bytes already written
 	int 	  wrote;
-	// client read status
-	byte_t	  status;
+	// 1 if reading is suspended until the pending replies are written
+	byte_t	  paused;
 	// last time this client was seen alive
 	time_t    seen;
 	// pointer to the main server structure
 	gbServer *server;
 	// flag to make the client disconnect after the next I/O operation
 	byte_t	  shutdown;
+	// 1 if this client executes requests of other shards, replies are
+	// only collected in the output buffer
+	byte_t	  proxy;
+	// request forwarded to other shards, no other request of the client
+	// is processed until all their replies are back
+	struct gbShardCall *call;
+	// 1 + position in the read and write queues of the I/O threads, 0 if not queued
+	size_t	  ioread;
+	size_t	  iowrite;
+	// outcome of the last read or write done by an I/O thread
+	ssize_t	  ioresult;
+	int		  ioerror;
+	// GB_CAP_* flags of what the client can handle, set with OP_CAPS
+	byte_t	  caps;
 }
 gbClient;
 
@@ -263,8 +458,15 @@ typedef unsigned char gbItemEncoding;
 #define GB_ENC_LZF    0x01
 // the item contains a number and data pointer is actually that number
 #define GB_ENC_NUMBER 0x02
+// PLAIN data stored right after the item header in the same allocation,
+// the data pointer is unused, this encoding is never sent to clients
+#define GB_ENC_INLINE 0x03
+// PLAIN but compressed data with lz4
+#define GB_ENC_LZ4    0x04
+// PLAIN but compressed data with zstd, possibly with a dictionary
+#define GB_ENC_ZSTD   0x05
 
-typedef struct
+typedef struct gbItem
 {
 	// the item buffer
 	void  		  *data;
@@ -280,9 +482,64 @@ typedef struct
 	short		   ttl;
 	// flag to lock the item
 	time_t		   lock;
+	// entry of the item inside the TTL wheel, NULL if it has no TTL
+	struct gbExpiration *expiration;
+	// references to the item, one is the tree's and each pending
+	// zero copy reply holds another one, wide enough for whatever
+	// a client can pile up below max_response_size
+	uint32_t	   refs;
+	// index plus one of the tracked prefix the item is accounted to, 0 if
+	// none, and the tree memory its key took when it was inserted
+	unsigned char  prefix;
+	unsigned short treemem;
+	// inline buffer for GB_ENC_INLINE items
+	byte_t		   value[];
 }
 __attribute__((packed)) gbItem;
 
+// the item buffer, wherever it is stored
+#define gbItemData( item ) ( (item)->encoding == GB_ENC_INLINE ? (void *)(item)->value : (item)->data )
+// the encoding of the item as seen by clients
+#define gbItemPublicEncoding( item ) ( (item)->encoding == GB_ENC_INLINE ? GB_ENC_PLAIN : (item)->encoding )
+
+#define gbItemIsCompressed( item ) ( (item)->encoding == GB_ENC_LZF || (item)->encoding == GB_ENC_LZ4 || (item)->encoding == GB_ENC_ZSTD )
+
+// compressed buffers start with the size of the uncompressed data
+#define gbCompressedRawSize( item ) ( *(size_t *)(item)->data )
+#define gbCompressedData( item )	( (byte_t *)(item)->data + sizeof(size_t) )
+#define gbCompressedSize( item )	( (item)->size - sizeof(size_t) )
+
+// size of the value as sent to clients
+#define gbItemValueSize( item ) ( gbItemIsCompressed( item ) ? gbCompressedRawSize( item ) : (item)->size )
+
+// the client decompresses GB_ENC_LZF and GB_ENC_LZ4 values by itself, they
+// are sent as stored: the size of the uncompressed data followed by the
+// compressed stream
+#define GB_CAP_LZF  0x01
+#define GB_CAP_LZ4  0x02
+// every capability this server knows
+#define GB_CAP_ALL  ( GB_CAP_LZF | GB_CAP_LZ4 )
+
+// 1 if the stored data of the item is sent as it is to clients with these caps
+#define gbItemPassthrough( item, caps ) ( ( (item)->encoding == GB_ENC_LZF && ( (caps) & GB_CAP_LZF ) ) || \
+										  ( (item)->encoding == GB_ENC_LZ4 && ( (caps) & GB_CAP_LZ4 ) ) )
+// encoding and size of the value as sent to clients with these caps
+#define gbItemWireEncoding( item, caps ) ( gbItemPassthrough( item, caps ) ? (item)->encoding : \
+										   (item)->encoding == GB_ENC_NUMBER ? GB_ENC_NUMBER : GB_ENC_PLAIN )
+#define gbItemWireSize( item, caps ) ( gbItemPassthrough( item, caps ) ? (item)->size : gbItemValueSize( item ) )
+
+typedef struct gbExpiration
+{
+	// the wheel timer, must be the first member
+	tw_entry_t entry;
+	// the expiring item
+	gbItem    *item;
+	// key of the item, to remove it from the tree
+	size_t	   klen;
+	byte_t	   key[];
+}
+gbExpiration;
+
 gbEventLoop *gbCreateEventLoop(int setsize);
 void gbDeleteEventLoop(gbEventLoop *eventLoop);
 void gbStopEventLoop(gbEventLoop *eventLoop);
@@ -292,10 +549,11 @@ int gbGetFileEvents(gbEventLoop *eventLoop, int fd);
 long long gbCreateTimeEvent(gbEventLoop *eventLoop, long long milliseconds,gbTimeProc *proc, void *clientData,gbEventFinalizerProc *finalizerProc);
 int gbDeleteTimeEvent(gbEventLoop *eventLoop, long long id);
 int gbProcessEvents(gbEventLoop *eventLoop, int flags);
+long long gbMonotonicTime(void);
 int gbWaitEvents(int fd, int mask, long long milliseconds);
 void gbEventLoopMain(gbEventLoop *eventLoop);
 char *gbGetEventApiName(void);
-void gbSetBeforeSleepProc(gbEventLoop *eventLoop, gbBeforeSleepProc *beforesleep);
+void gbSetBeforeSleepProc(gbEventLoop *eventLoop, gbBeforeSleepProc *beforesleep, void *clientData);
 int gbGetSetSize(gbEventLoop *eventLoop);
 int gbResizeSetSize(gbEventLoop *eventLoop, int setsize);
 
@@ -305,7 +563,7 @@ int gbNetUnixConnect(char *err, char *path);
 int gbNetUnixNonBlockConnect(char *err, char *path);
 int gbNetRead(int fd, char *buf, int count);
 int gbNetResolve(char *err, char *host, char *ipbuf);
-int gbNetTcpServer(char *err, int port, char *bindaddr);
+int gbNetTcpServer(char *err, int port, char *bindaddr, int reuseport);
 int gbNetUnixServer(char *err, char *path, mode_t perm);
 int gbNetTcpAccept(char *err, int serversock, char *ip, int *port);
 int gbNetUnixAccept(char *err, int serversock);
@@ -320,11 +578,49 @@ int gbNetKeepAlive(char *err, int fd, int interval);
 void gbServerFormatUptime( gbServer *server, char *s );
 
 gbClient *gbClientCreate( int fd, gbServer *server );
+gbClient *gbClientCreateProxy( gbServer *server );
 void      gbClientReset( gbClient *client );
+/*
+ * Make sure one of the client buffers can hold 'size' bytes, buffers are
+ * reused by the next requests and shrunk by gbClientShrinkBuffers.
+ */
+void	  gbClientReserveBuffer( gbClient *client, gbClientBuffer *buffer, size_t size );
+/*
+ * Shrink the client buffers down to the biggest size they needed since
+ * the last call, but not below the client_buffer_size setting.
+ */
+void	  gbClientShrinkBuffers( gbClient *client );
+/*
+ * Schedule the next check of the client on the idle wheel, when it will be
+ * idle for max_idletime seconds or, if its buffers grew bigger than the
+ * client_buffer_size setting, in one second to shrink them.
+ */
+void	  gbClientSchedule( gbClient *client );
+/*
+ * Write as much of the pending replies as possible with a single writev,
+ * values referenced by the replies are sent straight from their items.
+ * Returns what writev returned.
+ */
+ssize_t	  gbClientWrite( gbClient *client );
+
+#define gbClientOutputPending( c ) ( (c)->output.size - (c)->wrote + (c)->refpending )
+#define gbClientOutputDone( c ) ( (c)->wrote == (c)->output.size && (c)->ref == (c)->nrefs )
 int 	  gbClientEnqueueData( gbClient *client, short code, gbItemEncoding encoding, byte_t *reply, size_t size, gbFileProc *proc, short shutdown );
+/*
+ * Append replies already serialized by another client as they are.
+ */
+int 	  gbClientEnqueueReply( gbClient *client, byte_t *reply, size_t size, gbFileProc *proc, short shutdown );
 int       gbClientEnqueueCode( gbClient *client, short code, gbFileProc, short shutdown );
 int		  gbClientEnqueueItem( gbClient *client, short code, gbItem *item, gbFileProc *proc, short shutdown );
 int		  gbClientEnqueueKeyValueSet( gbClient *client, size_t elements, gbFileProc *proc, short shutdown );
+/*
+ * Build a REPL_KVAL reply one pair at a time, each item is referenced by
+ * the stream until its pair is serialized, right before being written.
+ */
+gbClientStream *gbClientStreamCreate( gbClient *client );
+void	  gbClientStreamAppend( gbClientStream *stream, byte_t *key, size_t klen, gbItem *item );
+// the client takes ownership of the stream
+int		  gbClientEnqueueStream( gbClient *client, gbClientStream *stream, gbFileProc *proc, short shutdown );
 void	  gbClientDestroy( gbClient *client );
 
 #endif
@@ -27,11 +27,18 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #include "query.h"
+#include "shard.h"
+#include "codec.h"
+#include "metrics.h"
+#include "accounting.h"
+#include "epoch.h"
 #include "log.h"
 #include "atree.h"
 #include "lzf.h"
 #include "configure.h"
 
+#include <stdint.h>
+
 #define min(a,b) ( a < b ? a : b )
 
 extern void gbWriteReplyHandler( gbEventLoop *el, int fd, void *privdata, int mask );
@@ -72,6 +79,11 @@ static gbItem *gbCreateVolatileItem( void *data, size_t size, gbItemEncoding enc
 	item->last_access_time	= 0;
 	item->ttl	   = -1;
 	item->lock	   = 0;
+	item->expiration = NULL;
+	// not owned by the tree, can't be referenced
+	item->refs	   = 0;
+	item->prefix   = 0;
+	item->treemem  = 0;
 
 	return item;
 }
@@ -86,8 +98,59 @@ static void gbDestroyVolatileItem( gbItem *item ){
 	item = NULL;
 }
 
+/*
+ * Items headers and their data are allocated from the slabs, data
+ * buffers are always 'size' bytes long, inline data is part of the
+ * header allocation.
+ */
+#define gbItemHasDataBuffer( item ) ( (item)->encoding != GB_ENC_NUMBER && (item)->encoding != GB_ENC_INLINE && (item)->data != NULL )
+#define gbItemHeaderSize( item ) ( sizeof(gbItem) + ( (item)->encoding == GB_ENC_INLINE ? (item)->size : 0 ) )
+#define gbItemDataMemory( item ) ( gbItemHasDataBuffer( item ) ? zslab_size( (item)->data, (item)->size ) : 0 )
+#define gbItemMemory( item ) ( zslab_size( item, gbItemHeaderSize( item ) ) + gbItemDataMemory( item ) )
+// size of the value as stored, compressed data only for LZF items
+#define gbItemStoredSize( item ) ( gbItemIsCompressed( item ) ? gbCompressedSize( item ) : (item)->size )
+
+// the memory of the values is accounted to the server and to their prefix
+static void gbChargeItem( gbServer *server, gbItem *item ){
+	size_t memory = gbItemMemory( item );
+
+	server->stats.memvalues += memory;
+	if( item->prefix )
+		gbAccountingOfItem( server, item )->bytes += memory;
+}
+
+static void gbUnchargeItem( gbServer *server, gbItem *item ){
+	size_t memory = gbItemMemory( item );
+
+	server->stats.memvalues -= memory;
+	if( item->prefix )
+		gbAccountingOfItem( server, item )->bytes -= memory;
+}
+
+// the memory retired for the readers of other shards is not in use anymore
+#define gbMemoryUsed( server ) ( zmem_used() - gbEpochPending( server ) )
+
+static void gbFreeItemData( gbServer *server, gbItem *item ){
+	if( gbItemHasDataBuffer( item ) ){
+		gbEpochRetire( server, item->data, item->size );
+		item->data = NULL;
+	}
+}
+
+/*
+ * GB_ENC_INLINE items get a copy of 'data' right after their header,
+ * for every other encoding data is owned by the item as it is.
+ */
 static gbItem *gbCreateItem( gbServer *server, void *data, size_t size, gbItemEncoding encoding, int ttl ) {
-	gbItem *item = ( gbItem * )zmalloc( sizeof( gbItem ) );
+	gbItem *item = NULL;
+
+	if( encoding == GB_ENC_INLINE ){
+		item = ( gbItem * )zslab_alloc( sizeof( gbItem ) + size );
+		memcpy( item->value, data, size );
+		data = NULL;
+	}
+	else
+		item = ( gbItem * )zslab_alloc( sizeof( gbItem ) );
 
 	item->data 	   = data;
 	item->size 	   = size;
@@ -96,16 +159,23 @@ static gbItem *gbCreateItem( gbServer *server, void *data, size_t size, gbItemEn
 	item->last_access_time	= server->stats.time;
 	item->ttl	   = ttl;
 	item->lock	   = 0;
+	item->expiration = NULL;
+	item->refs	   = 1;
+	item->prefix   = 0;
+	item->treemem  = 0;
 
-	if( encoding == GB_ENC_LZF ){
+	if( gbItemIsCompressed( item ) ){
 	    ++server->stats.ncompressed;
+	    ++server->codecs->items[ gbCodecOfEncoding( encoding ) ];
     }
 
+	gbChargeItem( server, item );
+
 	if( server->stats.firstin == 0 )
 		server->stats.firstin = server->stats.time;
 
 	server->stats.lastin  = server->stats.time;
-	server->stats.memused = zmem_used(); 
+	server->stats.memused = gbMemoryUsed( server );
     server->stats.sizeavg = server->stats.memused / ++server->stats.nitems;
 
 	if( server->stats.memused > server->stats.mempeak )
@@ -115,28 +185,136 @@ static gbItem *gbCreateItem( gbServer *server, void *data, size_t size, gbItemEn
 }
 
 void gbDestroyItem( gbServer *server, gbItem *item ){
-	if( item->encoding == GB_ENC_LZF ){
+	if( gbItemIsCompressed( item ) ){
 		--server->stats.ncompressed;
+		--server->codecs->items[ gbCodecOfEncoding( item->encoding ) ];
     }
 
-	if( item->encoding != GB_ENC_NUMBER && item->data != NULL ){
-		zfree( item->data );
-		item->data = NULL;
+	gbUnchargeItem( server, item );
+
+	if( item->prefix ){
+		--gbAccountingOfItem( server, item )->items;
+		gbAccountingOfItem( server, item )->bytes -= item->treemem;
 	}
 
-	zfree( item );
-	item = NULL;
+	if( item->expiration ){
+		tw_del( &server->ttlwheel, &item->expiration->entry );
+		zslab_free( item->expiration, sizeof(gbExpiration) + item->expiration->klen );
+		item->expiration = NULL;
+	}
+
+	gbReleaseItem( server, item );
 
-   	server->stats.memused = zmem_used();	
     server->stats.sizeavg = server->stats.nitems == 1 ? 0 : server->stats.memused / --server->stats.nitems;
 }
 
+gbItem *gbLoadItem( gbServer *server, byte_t *data, size_t size, gbItemEncoding encoding, int ttl ){
+	long num = 0;
+
+	if( encoding == GB_ENC_NUMBER ){
+		if( size != sizeof(long) )
+			return NULL;
+
+		memcpy( &num, data, sizeof(long) );
+
+		return gbCreateItem( server, (void *)num, sizeof(long), GB_ENC_NUMBER, ttl );
+	}
+	// compressed data stays as it is
+	else if( gbCodecOfEncoding( encoding ) != GB_CODEC_NONE ){
+		if( gbCodecCanDecompress( server, encoding, data, size ) == 0 )
+			return NULL;
+
+		return gbCreateItem( server, zslab_memdup( data, size ), size, encoding, ttl );
+	}
+	else if( encoding == GB_ENC_PLAIN || encoding == GB_ENC_INLINE ){
+		if( size <= server->inlinesize )
+			return gbCreateItem( server, data, size, GB_ENC_INLINE, ttl );
+
+		return gbCreateItem( server, zslab_memdup( data, size ), size, GB_ENC_PLAIN, ttl );
+	}
+
+	return NULL;
+}
+
+void gbReleaseItem( gbServer *server, gbItem *item ){
+	if( --item->refs == 0 ){
+		gbFreeItemData( server, item );
+
+		gbEpochRetire( server, item, gbItemHeaderSize( item ) );
+		item = NULL;
+
+		server->stats.memused = gbMemoryUsed( server );
+	}
+}
+
+static void gbAccountItem( gbServer *server, gbItem *item, int prefix, size_t treemem ){
+	gbAccountedPrefix *accounted = NULL;
+
+	item->prefix  = prefix;
+	item->treemem = treemem > 0xFFFF ? 0xFFFF : treemem;
+
+	if( prefix ){
+		accounted = gbAccountingOfItem( server, item );
+
+		++accounted->items;
+		accounted->bytes += gbItemMemory( item ) + item->treemem;
+	}
+}
+
+void gbInsertItem( gbServer *server, byte_t *key, size_t klen, gbItem *item ){
+	size_t before = at_memory_used(), after;
+	gbItem *old = at_insert( &server->tree, key, klen, item );
+
+	// the key was already there, with its prefix and tree memory
+	if( old ){
+		gbAccountItem( server, item, old->prefix, old->treemem );
+		gbDestroyItem( server, old );
+	}
+	else {
+		after = at_memory_used();
+
+		gbAccountItem( server, item, gbAccountingPrefixOf( server, key, klen ), after > before ? after - before : 0 );
+	}
+}
+
+// GET and BGET keys not found, hits are accounted by their item
+static void gbAccountMiss( gbServer *server, byte_t *key, size_t klen ){
+	int prefix = gbAccountingPrefixOf( server, key, klen );
+
+	if( prefix )
+		++server->accounting->prefixes[ prefix - 1 ].misses;
+}
+
+void gbScheduleItem( gbServer *server, gbItem *item, byte_t *key, size_t klen ){
+	gbExpiration *expiration = item->expiration;
+
+	if( item->ttl > 0 ){
+		if( expiration == NULL ){
+			expiration = zslab_alloc( sizeof(gbExpiration) + klen );
+
+			tw_init_entry( &expiration->entry );
+			expiration->item = item;
+			expiration->klen = klen;
+			memcpy( expiration->key, key, klen );
+
+			item->expiration = expiration;
+		}
+
+		tw_add( &server->ttlwheel, &expiration->entry, item->time + item->ttl );
+	}
+	else if( expiration ){
+		tw_del( &server->ttlwheel, &expiration->entry );
+		zslab_free( expiration, sizeof(gbExpiration) + expiration->klen );
+		item->expiration = NULL;
+	}
+}
+
 static int gbItemIsLocked( gbItem *item, gbServer *server, time_t eta ){
 	eta = eta == 0 ? server->stats.time - item->time : eta;
 	return ( item->lock == -1 || eta < item->lock );
 }
 
-static int gbIsNodeStillValid( anode_t *node, gbItem *item, gbServer *server, int remove ){
+static int gbIsIteratorItemStillValid( at_iterator_t *it, gbItem *item, gbServer *server ){
 	register time_t eta = server->stats.time - item->time,
                     ttl = item->ttl;
 
@@ -144,8 +322,10 @@ static int gbIsNodeStillValid( anode_t *node, gbItem *item, gbServer *server, in
 	{
 		gbLog( DEBUG, "[ACCESS] TTL of %ds expired for item at %p.", ttl, item );
 
-		if( remove )
-			node->marker = NULL;
+		at_iterator_remove( it );
+
+		if( item->prefix )
+			++gbAccountingOfItem( server, item )->expired;
 
 		gbDestroyItem( server, item );
 
@@ -162,130 +342,262 @@ static int gbIsItemStillValid( gbItem *item, gbServer *server, unsigned char *ke
 	if( ttl > 0 && eta >= ttl )
 	{
 		gbLog( DEBUG, "[ACCESS] TTL of %ds expired for item at %p.", ttl, item );
+
+		// GETs are not a change of the tree until here
+		gbEpochWriteBegin( server );
             
 		if( remove )
             at_remove( &server->tree, key, klen );
 
+		if( item->prefix )
+			++gbAccountingOfItem( server, item )->expired;
+
 		gbDestroyItem( server, item );
 
+		gbEpochWriteEnd( server );
+
 		return 0;
 	}
 
 	return 1;
 }
 
-static int gbParseKeyValue( gbServer *server, byte_t *buffer, size_t size, byte_t **key, byte_t **value, size_t *klen, size_t *vlen ){
-	register byte_t *p = buffer;
-    register size_t i = 0, end;
+// number of items to evict between each time budget check
+#define EVICTION_STEP 16
+
+size_t gbEvictItems( gbServer *server, size_t target, long long deadline ){
+	at_cursor_t swap;
+	anode_t *node = NULL;
+	gbItem *item = NULL, *best = NULL;
+	time_t score, bestscore = 0;
+	size_t freed = 0, before, done = 0;
+	unsigned int i;
+
+	while( freed < target && server->tree.count ){
+		best = NULL;
+
+		for( i = 0; i < server->evictsamples; ++i ){
+			node = at_select( &server->tree, random() % server->tree.count, &server->evictsample );
+			item = node ? node->marker : NULL;
+
+			if( item == NULL || gbItemIsLocked( item, server, 0 ) )
+				continue;
+
+			// expired items are the best candidates
+			score = item->ttl > 0 && server->stats.time - item->time >= item->ttl ? 0 : item->last_access_time;
+			if( best == NULL || score < bestscore ){
+				best	  = item;
+				bestscore = score;
+
+				swap 			    = server->evictkey;
+				server->evictkey    = server->evictsample;
+				server->evictsample = swap;
+			}
+		}
+
+		// only locked items were found, let's try the next time
+		if( best == NULL )
+			break;
+
+		gbLog( DEBUG, "[EVICT] Removing item %p accessed %lus ago.", best, server->stats.time - best->last_access_time );
+
+		before = server->stats.memused;
+
+		at_remove( &server->tree, server->evictkey.key, server->evictkey.len );
+
+		if( best->prefix )
+			++gbAccountingOfItem( server, best )->evicted;
+
+		gbDestroyItem( server, best );
+
+		if( before > server->stats.memused ){
+			freed += before - server->stats.memused;
+			server->stats.memevicted += before - server->stats.memused;
+		}
+
+		++server->stats.nevicted;
 
-    // parse the key, the end marker is the minimum among total request size and maxkeysize
-	*key = p;
-    end  = min( size, server->limits.maxkeysize );
-    while( *p != ' ' && i++ < end ){
-		++p;
+		if( ( ++done % EVICTION_STEP ) == 0 && gbMonotonicTime() >= deadline )
+			break;
 	}
 
-	*klen = p++ - *key;
-    
-    // if the value should be parsed ...
-	if( value ){
-		*value = p;
-		*vlen  = size - *klen - 1;
-		*vlen  = min( *vlen, server->limits.maxvaluesize );
+	return freed;
+}
+
+// free some memory right away if we're over the limit
+static int gbHasFreeMemory( gbServer *server ){
+	if( server->stats.memused > server->limits.maxmem ){
+		gbEvictItems( server, server->stats.memused - server->limits.maxmem, gbMonotonicTime() + server->evictbudget * 1000 );
 	}
 
-    // check if length conditions are verified
-	if( *klen <= 0 )
-		return 0;
+	return server->stats.memused <= server->limits.maxmem;
+}
 
-	else if( value && vlen <= 0 )
-		return 0;
+/*
+ * Arguments are separated by a single space, the last one takes the rest of
+ * the request. Separators are looked for with memchr, which the C library
+ * vectorizes, among the first 'end' bytes: the length of the argument is
+ * 'end' if there's none.
+ */
+static inline size_t gbParseToken( byte_t *p, size_t end ){
+	byte_t *space = memchr( p, ' ', end );
 
-	else
-		return 1;
+	return space ? (size_t)( space - p ) : end;
 }
 
-static int gbParseTtlKeyValue( gbServer *server, byte_t *buffer, size_t size, byte_t **ttl, byte_t **key, byte_t **value, size_t *ttllen, size_t *klen, size_t *vlen ){
-	register byte_t *p = buffer;
-    register size_t i = 0, end;
+// the key of single key requests, GET first
+static inline int gbParseKey( gbServer *server, byte_t *buffer, size_t size, byte_t **key, size_t *klen ){
+	*key  = buffer;
+	*klen = gbParseToken( buffer, min( size, server->limits.maxkeysize ) );
 
-    // parse the ttl value
-	*ttl = p;
-	end = min( size, server->limits.maxkeysize );
-	while( *p != ' ' && i++ < end ){
-		++p;
-	}
+	return *klen > 0;
+}
 
-	*ttllen = p++ - *ttl;
-    
-    // parse the key
-	*key = p;
-	end = min( size, server->limits.maxkeysize );
-	while( *p != ' ' && i++ < end ){
-		++p;
-	}
+static inline int gbParseKeyValue( gbServer *server, byte_t *buffer, size_t size, byte_t **key, byte_t **value, size_t *klen, size_t *vlen ){
+	if( gbParseKey( server, buffer, size, key, klen ) == 0 )
+		return 0;
 
-	*klen = p++ - *key;
+	// if the value should be parsed, the separator must be there
+	else if( value ){
+		if( *klen >= size || buffer[*klen] != ' ' )
+			return 0;
 
-    // finally parse the value if needed
-	if( value ){
-		*value = p;
-		*vlen  = size - *ttllen - *klen - 2;
-		*vlen  = min( *vlen, server->limits.maxvaluesize );
+		*value = buffer + *klen + 1;
+		*vlen  = min( size - *klen - 1, server->limits.maxvaluesize );
 	}
 
-    // check length conditions
-	if( *ttllen <= 0 )
-		return 0;
+	return 1;
+}
 
-	else if( *klen <= 0 )
-		return 0;
+// SET requests
+static inline int gbParseTtlKeyValue( gbServer *server, byte_t *buffer, size_t size, byte_t **ttl, byte_t **key, byte_t **value, size_t *ttllen, size_t *klen, size_t *vlen ){
+	*ttl	= buffer;
+	*ttllen = gbParseToken( buffer, min( size, server->limits.maxkeysize ) );
 
-	else if( value && vlen <= 0 )
+	if( *ttllen == 0 || *ttllen >= size || buffer[*ttllen] != ' ' )
 		return 0;
 
+	return gbParseKeyValue( server, buffer + *ttllen + 1, size - *ttllen - 1, key, value, klen, vlen );
+}
+
+/*
+ * Compress the value with the codec of its key prefix, returning the slab
+ * allocated data and updating 'vlen' and 'encoding', or NULL if it's not
+ * worth storing the value compressed.
+ */
+static void *gbCompressValue( gbServer *server, byte_t *k, size_t klen, byte_t *v, size_t *vlen, gbItemEncoding *encoding ){
+	size_t comprlen, needcompr = *vlen - 4; // compress at least of 4 bytes
+	double rate;
+
+	// uncompressed size first, then the compressed data
+	comprlen = gbCodecCompress( server, k, klen, v, *vlen, server->lzf_buffer + sizeof(size_t), needcompr, encoding );
+	// not enough compression, or not worth trying for this prefix
+	if( comprlen == 0 )
+		return NULL;
+
+	rate = 100.0 - ( ( comprlen * 100.0 ) / *vlen );
+
+	if( server->stats.compravg == 0 )
+		server->stats.compravg = rate;
 	else
-		return 1;
+		server->stats.compravg = ( server->stats.compravg + rate ) / 2.0;
+
+	memcpy( server->lzf_buffer, vlen, sizeof(size_t) );
+
+	*vlen = sizeof(size_t) + comprlen;
+
+	return zslab_memdup( server->lzf_buffer, *vlen );
 }
 
-static gbItem *gbSingleSet( byte_t *v, size_t vlen, byte_t *k, size_t klen, gbServer *server ){
+static gbItem *gbCreateValueItem( byte_t *k, size_t klen, byte_t *v, size_t vlen, gbServer *server ){
 	gbItemEncoding encoding = GB_ENC_PLAIN;
-	void *data = v;
-	size_t comprlen = vlen, needcompr = vlen - 4; // compress at least of 4 bytes
-	gbItem *item, *old;
+	void *data = NULL;
 
 	// should we compress ?
 	if( vlen > server->compression ){
-		comprlen = lzf_compress( v, vlen, server->lzf_buffer, needcompr );
-		// not enough compression
-		if( comprlen == 0 ){
-			encoding = GB_ENC_PLAIN;
-			data	 = zmemdup( v, vlen );
-		}
-		// succesfully compressed
-		else {
-            double rate = 100.0 - ( ( comprlen * 100.0 ) / vlen );
-
-            if( server->stats.compravg == 0 )
-                server->stats.compravg = rate;
-            else
-                server->stats.compravg = ( server->stats.compravg + rate ) / 2.0;
-
-            encoding = GB_ENC_LZF;
-			vlen 	 = comprlen;
-			data 	 = zmemdup( server->lzf_buffer, comprlen );
-		}
+		// with a cold age values are compressed later, by the cron
+		if( server->compressage == 0 )
+			data = gbCompressValue( server, k, klen, v, &vlen, &encoding );
 	}
-	else {
+	else if( vlen <= server->inlinesize ){
+		encoding = GB_ENC_INLINE;
+		data	 = v;
+	}
+
+	if( data == NULL ){
 		encoding = GB_ENC_PLAIN;
-		data = zmemdup( v, vlen );
+		data	 = zslab_memdup( v, vlen );
 	}
 
-	item = gbCreateItem( server, data, vlen, encoding, -1 );
-	old = at_insert( &server->tree, k, klen, item );
-	if( old ){
-	    gbDestroyItem( server, old );
+	return gbCreateItem( server, data, vlen, encoding, -1 );
+}
+
+// number of nodes to scan between each time budget check
+#define COMPRESSION_STEP 64
+
+/*
+ * Compress the plain value of an item which has not been accessed since the
+ * cold age. Referenced items are still being sent, so their header is moved
+ * to a new allocation and the node pointed to it.
+ */
+static void gbCompressColdItem( anode_t *node, unsigned char *key, size_t len, void *data ){
+	gbServer *server = data;
+	gbItem *item = node->marker;
+	gbItemEncoding encoding = GB_ENC_PLAIN;
+	size_t size = item->size;
+	void *value = NULL;
+
+	if( item->encoding != GB_ENC_PLAIN || item->size <= server->compression || server->stats.time - item->last_access_time < server->compressage )
+		return;
+
+	else if( ( value = gbCompressValue( server, key, len, item->data, &size, &encoding ) ) == NULL )
+		return;
+
+	gbUnchargeItem( server, item );
+
+	if( item->refs > 1 ){
+		gbItem *compressed = ( gbItem * )zslab_alloc( sizeof( gbItem ) );
+
+		memcpy( compressed, item, sizeof( gbItem ) );
+		if( compressed->expiration )
+			compressed->expiration->item = compressed;
+
+		compressed->refs = 1;
+		item->expiration = NULL;
+
+		gbReleaseItem( server, item );
+
+		node->marker = item = compressed;
+	}
+	else
+		gbFreeItemData( server, item );
+
+	item->encoding = encoding;
+	item->data	   = value;
+	item->size	   = size;
+
+	++server->stats.ncompressed;
+	++server->codecs->items[ gbCodecOfEncoding( encoding ) ];
+
+	gbChargeItem( server, item );
+	server->stats.memused = gbMemoryUsed( server );
+}
+
+int gbCompressItems( gbServer *server, long long deadline ){
+	int done = 0;
+
+	do {
+		done = at_scan( &server->tree, &server->compresscursor, COMPRESSION_STEP, gbCompressColdItem, server );
 	}
+	while( !done && gbMonotonicTime() < deadline );
+
+	return done;
+}
+
+static gbItem *gbSingleSet( byte_t *v, size_t vlen, byte_t *k, size_t klen, gbServer *server ){
+	gbItem *item = gbCreateValueItem( k, klen, v, vlen, server );
+
+	gbInsertItem( server, k, klen, item );
 
 	return item;
 }
@@ -299,7 +611,7 @@ static int gbQuerySetHandler( gbClient *client, byte_t *p ){
 	gbItem *item = NULL;
 	long ttl;
 
-	if( server->stats.memused <= server->limits.maxmem ) {
+	if( gbHasFreeMemory( server ) ) {
 		if( gbParseTtlKeyValue( server, p, client->buffer_size - sizeof(short), &t, &k, &v, &ttllen, &klen, &vlen ) ){
 			if( gbQueryParseLong( t, ttllen, &ttl ) )
 			{
@@ -312,6 +624,8 @@ static int gbQuerySetHandler( gbClient *client, byte_t *p ){
 				if( ttl > 0 ){
 					item->time = server->stats.time;
 					item->ttl  = min( server->limits.maxitemttl, ttl );
+
+					gbScheduleItem( server, item, k, klen );
 				}
 
                 return gbClientEnqueueItem( client, REPL_VAL, item, gbWriteReplyHandler, 0 );
@@ -331,37 +645,35 @@ static int gbQueryMultiSetHandler( gbClient *client, byte_t *p ){
 		   *v = NULL;
 	size_t exprlen = 0, vlen = 0;
 	gbServer *server = client->server;
+	at_iterator_t *it = &server->m_iterator;
+	anode_t *node = NULL;
 	gbItem *item = NULL;
 
-	if( server->stats.memused <= server->limits.maxmem ) {
+	if( gbHasFreeMemory( server ) ) {
 		if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, &v, &exprlen, &vlen ) ){
-			size_t found = at_search( &server->tree, expr, exprlen, server->limits.maxkeysize, &server->m_keys, &server->m_values );
-			if( found ){
-				ll_foreach_2( server->m_keys, server->m_values, ki, vi ){
-					item = vi->data;
+			size_t matched = 0, found = 0;
 
-					if( gbItemIsLocked( item, server, 0 ) )
-						--found;
+			at_iterator_seek( it, &server->tree, expr, exprlen );
+			while( ( node = at_iterator_next( it ) ) ){
+				item = node->marker;
+				++matched;
 
-					else if( gbIsItemStillValid( item, server, ki->data, strlen(ki->data), 1 ) == 0 )
-						--found;
+				if( gbItemIsLocked( item, server, 0 ) == 0 && gbIsIteratorItemStillValid( it, item, server ) ){
+					// the node is already there, just replace its item
+					node->marker = gbCreateValueItem( it->key, it->klen, v, vlen, server );
 
-					else
-						gbSingleSet( v, vlen, ki->data, strlen(ki->data), server );
-
-					// free allocated key
-					zfree( ki->data );
-					ki->data = NULL;
+					gbAccountItem( server, node->marker, item->prefix, item->treemem );
+					gbDestroyItem( server, item );
+					++found;
 				}
+			}
+
+			if( found )
+				return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
 
-				ll_reset( server->m_keys );
-				ll_reset( server->m_values );
+			else if( matched )
+				return gbClientEnqueueCode( client, REPL_ERR_LOCKED, gbWriteReplyHandler, 0 );
 
-				if( found )
-					return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
-				else
-					return gbClientEnqueueCode( client, REPL_ERR_LOCKED, gbWriteReplyHandler, 0 );
-			}
 			else
 				return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
 		}
@@ -390,6 +702,8 @@ static int gbQueryTtlHandler( gbClient *client, byte_t *p ){
 				item->time = server->stats.time;
 				item->ttl  = min( server->limits.maxitemttl, ttl );
 
+				gbScheduleItem( server, item, k, klen );
+
 				return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 0 );
 			}
 			else
@@ -407,40 +721,33 @@ static int gbQueryMultiTtlHandler( gbClient *client, byte_t *p ){
 		   *v = NULL;
 	size_t exprlen = 0, vlen = 0;
 	gbServer *server = client->server;
+	at_iterator_t *it = &server->m_iterator;
+	anode_t *node = NULL;
 	gbItem *item = NULL;
 	long ttl;
 
 	if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, &v, &exprlen, &vlen ) ){
 		if( gbQueryParseLong( v, vlen, &ttl ) )
 		{
-			size_t found = at_search( &server->tree, expr, exprlen, server->limits.maxkeysize, &server->m_keys, &server->m_values );
-			if( found ){
-				ll_foreach_2( server->m_keys, server->m_values, ki, vi ){
-					item = vi->data;
-
-					if( gbIsItemStillValid( item, server, ki->data, strlen(ki->data), 1 ) == 0 )
-						--found;
-
-					else {
-                        item->last_access_time = 
-						item->time = server->stats.time;
-                        item->ttl  = min( server->limits.maxitemttl, ttl );
-					}
-
-					// free allocated key
-					zfree( ki->data );
-					ki->data = NULL;
-				}
+			size_t found = 0;
 
-				ll_reset( server->m_keys );
-				ll_reset( server->m_values );
+			at_iterator_seek( it, &server->tree, expr, exprlen );
+			while( ( node = at_iterator_next( it ) ) ){
+				item = node->marker;
 
-				if( found )
-					return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
+				if( gbIsIteratorItemStillValid( it, item, server ) ){
+                    item->last_access_time = 
+					item->time = server->stats.time;
+                    item->ttl  = min( server->limits.maxitemttl, ttl );
 
-				else
-					return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
+					gbScheduleItem( server, item, it->key, it->klen );
+					++found;
+				}
 			}
+
+			if( found )
+				return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
+
 			else
 				return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
 		}
@@ -458,16 +765,21 @@ static int gbQueryGetHandler( gbClient *client, byte_t *p ){
 	anode_t *node = NULL;
 	gbItem *item = NULL;
 
-	if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &k, NULL, &klen, NULL ) ){
+	if( gbParseKey( server, p, client->buffer_size - sizeof(short), &k, &klen ) ){
 		node = at_find_node( &server->tree, k, klen );
-		if(node && ( item = node->marker ) && gbIsNodeStillValid( node, node->marker, server, 1 )){
-			item = node->marker;
+		if(node && ( item = node->marker ) && gbIsItemStillValid( item, server, k, klen, 1 )){
 			item->last_access_time = server->stats.time;
 
+			if( item->prefix )
+				++gbAccountingOfItem( server, item )->hits;
+
 			return gbClientEnqueueItem( client, REPL_VAL, item, gbWriteReplyHandler, 0 );
 		}
-        else
+        else {
+			gbAccountMiss( server, k, klen );
+
 		    return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
+		}
 
 	}
 	else
@@ -478,50 +790,31 @@ static int gbQueryMultiGetHandler( gbClient *client, byte_t *p ){
 	byte_t *expr = NULL;
 	size_t exprlen = 0;
 	gbServer *server = client->server;
+	at_iterator_t *it = &server->m_iterator;
+	anode_t *node = NULL;
 	gbItem *item = NULL;
 
 	if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, NULL, &exprlen, NULL ) ){
-		size_t found = at_search( &server->tree, expr, exprlen, server->limits.maxkeysize, &server->m_keys, &server->m_values );
-		if( found ){
-			ll_foreach_2( server->m_keys, server->m_values, ki, vi ){
-				item = vi->data;
-				
-				if( !item || gbIsItemStillValid( item, server, ki->data, strlen(ki->data), 1 ) == 0 ){
-					--found;
-					vi->data = NULL;
-				}
-                else
-                    item->last_access_time = server->stats.time;
-			}
+		gbClientStream *reply = NULL;
 
-			if( found ){
-				
-				int ret = gbClientEnqueueKeyValueSet( client, found, gbWriteReplyHandler, 0 );
+		at_iterator_seek( it, &server->tree, expr, exprlen );
+		while( ( node = at_iterator_next( it ) ) ){
+			item = node->marker;
 
-				ll_foreach_2( server->m_keys, server->m_values, ki, vi ){
-					// free allocated key
-					zfree( ki->data );
-					ki->data = NULL;
-				}
+			if( gbIsIteratorItemStillValid( it, item, server ) ){
+                item->last_access_time = server->stats.time;
 
-				ll_reset( server->m_keys );
-				ll_reset( server->m_values );
+				// the big pairs are serialized while the reply is being written
+				if( reply == NULL )
+					reply = gbClientStreamCreate( client );
 
-				return ret;
+				gbClientStreamAppend( reply, it->key, it->klen, item );
 			}
-			else {
-				ll_foreach_2( server->m_keys, server->m_values, ki, vi ){
-					// free allocated key
-					zfree( ki->data );
-					ki->data = NULL;
-				}
+		}
 
-				ll_reset( server->m_keys );
-				ll_reset( server->m_values );
+		if( reply )
+			return gbClientEnqueueStream( client, reply, gbWriteReplyHandler, 0 );
 
-				return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
-			}
-		}
 		else
 			return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
 	}
@@ -544,11 +837,11 @@ static int gbQueryDelHandler( gbClient *client, byte_t *p ){
 			if( gbItemIsLocked( item, server, 0 ) )
 				return gbClientEnqueueCode( client, REPL_ERR_LOCKED, gbWriteReplyHandler, 0 );
 
-			else if( gbIsNodeStillValid( node, item, server, 1 ) ){
-    			gbDestroyItem( server, item );
-
+			else if( gbIsItemStillValid( item, server, k, klen, 1 ) ){
 	    		// Remove item from tree
-		    	node->marker = NULL;
+		    	at_remove( &server->tree, k, klen );
+
+    			gbDestroyItem( server, item );
 
 			    return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 0 );
             }
@@ -564,39 +857,29 @@ static int gbQueryMultiDelHandler( gbClient *client, byte_t *p ){
 	byte_t *expr = NULL;
 	size_t exprlen = 0;
 	gbServer *server = client->server;
+	at_iterator_t *it = &server->m_iterator;
+	anode_t *node = NULL;
 	gbItem *item = NULL;
 
 	if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, NULL, &exprlen, NULL ) ){
-		size_t found = at_search_nodes( &server->tree, expr, exprlen, server->limits.maxkeysize, &server->m_keys, &server->m_values );
-		if( found ){
-			ll_foreach_2( server->m_keys, server->m_values, ki, vi ){
-				anode_t *node = vi->data;
-
-				if( node && node->marker ){
-					item = node->marker;
-
-					// locked item
-					if( gbItemIsLocked( item, server, 0 )){
-						--found;
-					}
-					else if( gbIsNodeStillValid( node, item, server, 1 ) ){
-                        node->marker = NULL;
-                        gbDestroyItem( server, item );
-                    }
-                    else
-                        --found;
-				}
+		size_t matched = 0, found = 0;
 
-				// free allocated key
-				zfree( ki->data );
-				ki->data = NULL;
-			}
+		at_iterator_seek( it, &server->tree, expr, exprlen );
+		while( ( node = at_iterator_next( it ) ) ){
+			item = node->marker;
+			++matched;
 
-			ll_reset( server->m_keys );
-			ll_reset( server->m_values );
+			// locked item
+			if( gbItemIsLocked( item, server, 0 ) == 0 && gbIsIteratorItemStillValid( it, item, server ) ){
+				at_iterator_remove( it );
+				gbDestroyItem( server, item );
+				++found;
+			}
+		}
 
+		if( matched )
 			return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
-		}
+
 		else
 			return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
 	}
@@ -604,6 +887,42 @@ static int gbQueryMultiDelHandler( gbClient *client, byte_t *p ){
 		return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
+/*
+ * Turn a plain item, which content was parsed as 'num', into a number one.
+ * Inline items can't shrink in place and referenced ones are still being
+ * sent, so their header is moved to a new allocation and the node pointed
+ * to it.
+ */
+static gbItem *gbItemToNumber( gbServer *server, anode_t *node, gbItem *item, long num ){
+	gbUnchargeItem( server, item );
+
+	if( item->encoding == GB_ENC_INLINE || item->refs > 1 ){
+		gbItem *number = ( gbItem * )zslab_alloc( sizeof( gbItem ) );
+
+		memcpy( number, item, sizeof( gbItem ) );
+		if( number->expiration )
+			number->expiration->item = number;
+
+		number->refs	 = 1;
+		item->expiration = NULL;
+
+		gbReleaseItem( server, item );
+
+		node->marker = item = number;
+	}
+	else
+		gbFreeItemData( server, item );
+
+	item->encoding = GB_ENC_NUMBER;
+	item->data	   = (void *)num;
+	item->size	   = sizeof(long);
+
+	gbChargeItem( server, item );
+	server->stats.memused = gbMemoryUsed( server );
+
+	return item;
+}
+
 static int gbQueryIncDecHandler( gbClient *client, byte_t *p, short delta ){
 	byte_t *k = NULL;
 	size_t klen = 0;
@@ -618,15 +937,12 @@ static int gbQueryIncDecHandler( gbClient *client, byte_t *p, short delta ){
 		item = node ? node->marker : NULL;
 		if( item == NULL ) {
 			item = gbCreateItem( server, (void *)1, sizeof( long ), GB_ENC_NUMBER, -1 );
-			// just reuse the node
-			if( node )
-				node->marker = item;
-			else
-				at_insert( &server->tree, k, klen, item );
+
+			gbInsertItem( server, k, klen, item );
 
 			return gbClientEnqueueItem( client, REPL_VAL, item, gbWriteReplyHandler, 0 );
 		}
-		else if( gbIsNodeStillValid( node, item, server, 1 ) == 0 ){
+		else if( gbIsItemStillValid( item, server, k, klen, 1 ) == 0 ){
 			return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
 		}
 		else {
@@ -640,19 +956,8 @@ static int gbQueryIncDecHandler( gbClient *client, byte_t *p, short delta ){
 
 				return gbClientEnqueueItem( client, REPL_VAL, item, gbWriteReplyHandler, 0 );
 			}
-			else if( item->encoding == GB_ENC_PLAIN && gbQueryParseLong( item->data, item->size, &num ) ){
-				num += delta;
-
-				if( item->data != NULL ){
-					zfree( item->data );
-					item->data = NULL;
-				}
-                
-				server->stats.memused = zmem_used();
-
-				item->encoding = GB_ENC_NUMBER;
-				item->data	   = (void *)num;
-				item->size	   = sizeof(long);
+			else if( gbItemPublicEncoding( item ) == GB_ENC_PLAIN && gbQueryParseLong( gbItemData( item ), item->size, &num ) ){
+				item = gbItemToNumber( server, node, item, num + delta );
 
 				return gbClientEnqueueItem( client, REPL_VAL, item, gbWriteReplyHandler, 0 );
 			}
@@ -668,59 +973,35 @@ static int gbQueryMultiIncDecHandler( gbClient *client, byte_t *p, short delta )
 	byte_t *expr = NULL;
 	size_t exprlen = 0;
 	gbServer *server = client->server;
+	at_iterator_t *it = &server->m_iterator;
+	anode_t *node = NULL;
 	gbItem *item = NULL;
 	long num = 0;
 
 	if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, NULL, &exprlen, NULL ) ){
-		size_t found = at_search( &server->tree, expr, exprlen, server->limits.maxkeysize, &server->m_keys, &server->m_values );
-		if( found ){
-			ll_foreach_2( server->m_keys, server->m_values, ki, vi ){
-				item = vi->data;
-			    item->last_access_time = server->stats.time;
-
-				if( gbItemIsLocked( item, server, 0 ) ){
-					--found;
-				}
-				if( gbIsItemStillValid( item, server, ki->data, strlen(ki->data), 1 ) == 0 ){
-					--found;
-				}
-				else if( item->encoding == GB_ENC_NUMBER ){
-					item->data = (void *)( (long)item->data + delta );
-				}
-				else if( item->encoding == GB_ENC_PLAIN ){
+		size_t found = 0;
 
-					if( gbQueryParseLong( item->data, item->size, &num ) )
-					{
-						num += delta;
-
-						if( item->data != NULL ){
-							zfree( item->data );
-							item->data = NULL;
-						}
+		at_iterator_seek( it, &server->tree, expr, exprlen );
+		while( ( node = at_iterator_next( it ) ) ){
+			item = node->marker;
 
-                        server->stats.memused = zmem_used();
+			if( gbItemIsLocked( item, server, 0 ) || gbIsIteratorItemStillValid( it, item, server ) == 0 )
+				continue;
 
-						item->encoding = GB_ENC_NUMBER;
-						item->data	   = (void *)num;
-						item->size	   = sizeof(long);
-					}
-					else
-						--found;
-				}
+			item->last_access_time = server->stats.time;
 
-				// free allocated key
-				zfree( ki->data );
-				ki->data = NULL;
+			if( item->encoding == GB_ENC_NUMBER ){
+				item->data = (void *)( (long)item->data + delta );
+				++found;
+			}
+			else if( gbItemPublicEncoding( item ) == GB_ENC_PLAIN && gbQueryParseLong( gbItemData( item ), item->size, &num ) ){
+				gbItemToNumber( server, node, item, num + delta );
+				++found;
 			}
-
-			ll_reset( server->m_keys );
-			ll_reset( server->m_values );
-
-			if( found )
-				return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
-			else
-				return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
 		}
+
+		if( found )
+			return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
 		else
 			return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
 	}
@@ -739,7 +1020,7 @@ static int gbQueryLockHandler( gbClient *client, byte_t *p ){
 
 	if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &k, &v, &klen, &vlen ) ){
 		node = at_find_node( &server->tree, k, klen );
-		if( node && ( item = node->marker ) && gbIsNodeStillValid( node, item, server, 1 ) )
+		if( node && ( item = node->marker ) && gbIsItemStillValid( item, server, k, klen, 1 ) )
 		{
 			if( gbQueryParseLong( v, vlen, &locktime ) )
 			{
@@ -769,38 +1050,30 @@ static int gbQueryMultiLockHandler( gbClient *client, byte_t *p ){
 		   *v = NULL;
 	size_t exprlen = 0, vlen = 0;
 	gbServer *server = client->server;
+	at_iterator_t *it = &server->m_iterator;
+	anode_t *node = NULL;
 	gbItem *item = NULL;
 	long locktime;
 
 	if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, &v, &exprlen, &vlen ) ){
 		if( gbQueryParseLong( v, vlen, &locktime ) )
 		{
-			size_t found = at_search( &server->tree, expr, exprlen, server->limits.maxkeysize, &server->m_keys, &server->m_values );
-			if( found ){
-				ll_foreach_2( server->m_keys, server->m_values, ki, vi ){
-					item = vi->data;
-
-					if( gbIsItemStillValid( item, server, ki->data, strlen(ki->data), 1 ) && gbItemIsLocked( item, server, 0 ) == 0 ){
-						item->last_access_time = 
-                        item->time = server->stats.time;
-						item->lock = locktime;
-					}
-					else
-						--found;
-
-					// free allocated key
-					zfree( ki->data );
-					ki->data = NULL;
-				}
+			size_t found = 0;
 
-				ll_reset( server->m_keys );
-				ll_reset( server->m_values );
+			at_iterator_seek( it, &server->tree, expr, exprlen );
+			while( ( node = at_iterator_next( it ) ) ){
+				item = node->marker;
 
-				if( found )
-					return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
-				else
-					return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
+				if( gbIsIteratorItemStillValid( it, item, server ) && gbItemIsLocked( item, server, 0 ) == 0 ){
+					item->last_access_time = 
+                    item->time = server->stats.time;
+					item->lock = locktime;
+					++found;
+				}
 			}
+
+			if( found )
+				return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
 			else
 				return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
 		}
@@ -820,7 +1093,7 @@ static int gbQueryUnlockHandler( gbClient *client, byte_t *p ){
 
 	if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &k, NULL, &klen, NULL ) ){
 		node = at_find_node( &server->tree, k, klen );
-		if( node && ( item = node->marker ) && gbIsNodeStillValid( node, item, server, 1 ) )
+		if( node && ( item = node->marker ) && gbIsItemStillValid( item, server, k, klen, 1 ) )
 		{
 			item->lock = 0;
 			item->last_access_time = server->stats.time;
@@ -838,34 +1111,27 @@ static int gbQueryMultiUnlockHandler( gbClient *client, byte_t *p ){
 	byte_t *expr = NULL;
 	size_t exprlen = 0;
 	gbServer *server = client->server;
+	at_iterator_t *it = &server->m_iterator;
+	anode_t *node = NULL;
 	gbItem *item = NULL;
 
 	if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, NULL, &exprlen, NULL ) ){
-		size_t found = at_search( &server->tree, expr, exprlen, server->limits.maxkeysize, &server->m_keys, &server->m_values );
-		if( found ){
-			ll_foreach_2( server->m_keys, server->m_values, ki, vi ){
-				item = vi->data;
-
-				if( gbIsItemStillValid( item, server, ki->data, strlen(ki->data), 1 ) ){
-					item->lock = 0;
-					item->last_access_time = server->stats.time;
-				}
+		size_t found = 0;
 
-				else
-					--found;
+		at_iterator_seek( it, &server->tree, expr, exprlen );
+		while( ( node = at_iterator_next( it ) ) ){
+			item = node->marker;
 
-				// free allocated key
-				zfree( ki->data );
-				ki->data = NULL;
+			if( gbIsIteratorItemStillValid( it, item, server ) ){
+				item->lock = 0;
+				item->last_access_time = server->stats.time;
+				++found;
 			}
-
-			ll_reset( server->m_keys );
-			ll_reset( server->m_values );
-
-			if( found )
-				return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
 		}
 
+		if( found )
+			return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
+
 		return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
 	}
 	else
@@ -876,27 +1142,13 @@ static int gbQueryCountHandler( gbClient *client, byte_t *p ){
 	byte_t *expr = NULL;
 	size_t exprlen = 0;
 	gbServer *server = client->server;
-	gbItem *item = NULL;
 
 	if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, NULL, &exprlen, NULL ) ){
-		size_t found = at_search( &server->tree, expr, exprlen, server->limits.maxkeysize, &server->m_keys, &server->m_values );
-		if( found ){
-			ll_foreach_2( server->m_keys, server->m_values, ki, vi ){
-				item = vi->data;
-								
-				if( !item || !gbIsItemStillValid( item, server, ki->data, strlen(ki->data), 1 ) )
-					--found;
-                else
-                    item->last_access_time = server->stats.time;
-
-				// free allocated key
-				zfree( ki->data );
-				ki->data = NULL;
-			}
-
-			ll_reset( server->m_keys );
-			ll_reset( server->m_values );
-		}
+		/*
+		 * Read from the tree counters without visiting the items, so expired
+		 * items not yet removed by the cron or by an access are counted too.
+		 */
+		size_t found = at_count( &server->tree, expr, exprlen );
 
 		return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&found, sizeof(size_t), gbWriteReplyHandler, 0 );
 	}
@@ -908,6 +1160,17 @@ static int gbQueryStatsHandler( gbClient *client, byte_t *p ){
 	gbServer *server = client->server;
 	size_t elems = 0;
     char s[0xFF] = {0};
+	// keys are not freed once the reply is sent, so they must be static
+	static char slabnames[ZSLAB_CLASSES][2][32];
+	static char opnames[GB_METRICS_OPS][8][32];
+	static char slownames[GB_SLOWLOG_MAX_SIZE][32];
+	gbMetrics *metrics = server->metrics;
+	gbOpMetrics *om = NULL;
+	gbSlowlogEntry *entry = NULL;
+	unsigned long long requests = 0, persec = 0;
+	size_t j, n;
+	char *c = NULL;
+	int i;
 
     sprintf( s, "%f", zmem_fragmentation_ratio() );
 
@@ -938,9 +1201,85 @@ static int gbQueryStatsHandler( gbClient *client, byte_t *p ){
 	APPEND_LONG_STAT( "memory_usable",          server->limits.maxmem );
 	APPEND_LONG_STAT( "memory_used",            server->stats.memused );
 	APPEND_LONG_STAT( "memory_peak", 			server->stats.mempeak );
+	APPEND_LONG_STAT( "memory_tree",            at_memory_used() );
+	APPEND_LONG_STAT( "memory_values",          server->stats.memvalues );
+	APPEND_LONG_STAT( "memory_evicted",         server->stats.memevicted );
+	APPEND_LONG_STAT( "memory_buffers",         server->stats.membuffers );
+	APPEND_LONG_STAT( "total_evicted_items",    server->stats.nevicted );
+	APPEND_LONG_STAT( "total_shared_reads",     server->stats.nsharedreads );
     APPEND_STRING_STAT( "memory_fragmentation", s );
 	APPEND_LONG_STAT( "item_size_avg",          server->stats.sizeavg );
     APPEND_LONG_STAT( "compr_rate_avg",         server->stats.compravg );
+	APPEND_STRING_STAT( "compr_codec",			gbCodecName( server->codecs->codec ) );
+	APPEND_LONG_STAT( "compr_lz4_items",		server->codecs->items[GB_CODEC_LZ4] );
+	APPEND_LONG_STAT( "compr_lzf_items",		server->codecs->items[GB_CODEC_LZF] );
+	APPEND_LONG_STAT( "compr_zstd_items",		server->codecs->items[GB_CODEC_ZSTD] );
+	APPEND_LONG_STAT( "compr_dictionaries",		server->codecs->ndicts );
+	APPEND_LONG_STAT( "compr_skipped",			server->codecs->skipped );
+	APPEND_LONG_STAT( "snapshot_in_progress",	( server->snapshotpid > 0 ) );
+	APPEND_LONG_STAT( "snapshot_last_save",		server->snapshotlast );
+
+	for( i = 0; i < ZSLAB_CLASSES; ++i ){
+		const zslab_class_t *cls = zslab_class(i);
+
+		sprintf( slabnames[i][0], "slab_%lu_pages", (unsigned long)cls->size );
+		sprintf( slabnames[i][1], "slab_%lu_used",  (unsigned long)cls->size );
+
+		APPEND_LONG_STAT( slabnames[i][0], cls->pages );
+		APPEND_LONG_STAT( slabnames[i][1], cls->used );
+	}
+
+	for( i = 0; i < GB_METRICS_OPS; ++i ){
+		requests += metrics->ops[i].calls;
+		persec	 += metrics->ops[i].persec;
+	}
+
+	APPEND_LONG_STAT( "total_requests",   requests );
+	APPEND_LONG_STAT( "requests_per_sec", persec );
+
+	for( i = 0; i < GB_METRICS_OPS; ++i ){
+		om = &metrics->ops[i];
+
+		if( om->calls == 0 || gbMetricsOpName( i ) == NULL )
+			continue;
+
+		sprintf( opnames[i][0], "op_%s_calls",	   gbMetricsOpName( i ) );
+		sprintf( opnames[i][1], "op_%s_per_sec",   gbMetricsOpName( i ) );
+		sprintf( opnames[i][2], "op_%s_bytes_in",  gbMetricsOpName( i ) );
+		sprintf( opnames[i][3], "op_%s_bytes_out", gbMetricsOpName( i ) );
+		sprintf( opnames[i][4], "op_%s_p50_ns",	   gbMetricsOpName( i ) );
+		sprintf( opnames[i][5], "op_%s_p99_ns",	   gbMetricsOpName( i ) );
+		sprintf( opnames[i][6], "op_%s_p999_ns",   gbMetricsOpName( i ) );
+		sprintf( opnames[i][7], "op_%s_max_ns",	   gbMetricsOpName( i ) );
+
+		APPEND_LONG_STAT( opnames[i][0], om->calls );
+		APPEND_LONG_STAT( opnames[i][1], om->persec );
+		APPEND_LONG_STAT( opnames[i][2], om->bytesin );
+		APPEND_LONG_STAT( opnames[i][3], om->bytesout );
+		APPEND_LONG_STAT( opnames[i][4], gbMetricsPercentile( om, 0.50 ) );
+		APPEND_LONG_STAT( opnames[i][5], gbMetricsPercentile( om, 0.99 ) );
+		APPEND_LONG_STAT( opnames[i][6], gbMetricsPercentile( om, 0.999 ) );
+		APPEND_LONG_STAT( opnames[i][7], om->maxtime );
+	}
+
+	// newest entries first, as "<time> <opcode> <microseconds> <key prefix>"
+	n = metrics->slowcount < metrics->slowsize ? metrics->slowcount : metrics->slowsize;
+
+	APPEND_LONG_STAT( "slowlog_total", metrics->slowcount );
+
+	for( i = 0; i < (int)n; ++i ){
+		entry = &metrics->slowlog[ ( metrics->slownext + metrics->slowsize - 1 - i ) % metrics->slowsize ];
+
+		sprintf( slownames[i], "slowlog_%d", i );
+		sprintf( s, "%ld %s %llu ", (long)entry->time, gbMetricsOpName( entry->op ) ? gbMetricsOpName( entry->op ) : "?", entry->duration / 1000 );
+
+		for( j = 0, c = s + strlen(s); j < entry->klen; ++j ){
+			*c++ = entry->key[j] >= 0x20 && entry->key[j] < 0x7f ? entry->key[j] : '.';
+		}
+		*c = 0x00;
+
+		APPEND_STRING_STAT( slownames[i], s );
+	}
 
 #undef APPEND_LONG_STAT
 #undef APPEND_STRING_STAT
@@ -962,6 +1301,71 @@ static int gbQueryStatsHandler( gbClient *client, byte_t *p ){
 	return ret;
 }
 
+/*
+ * Counters of the tracked prefixes, as "prefix_<prefix>_<counter>" pairs
+ * in the configuration order, REPL_ERR_NOT_FOUND if none is tracked.
+ */
+static int gbQueryPrefixStatsHandler( gbClient *client, byte_t *p ){
+	gbServer *server = client->server;
+	gbAccountedPrefix *prefix = NULL;
+	unsigned long values[GB_ACCOUNTING_STATS];
+	size_t elems = 0;
+	int i, j, ret;
+
+	if( server->accounting->nprefixes == 0 )
+		return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
+
+	for( i = 0; i < server->accounting->nprefixes; ++i ){
+		prefix = &server->accounting->prefixes[i];
+
+		values[0] = prefix->items;
+		values[1] = prefix->bytes;
+		values[2] = prefix->hits;
+		values[3] = prefix->misses;
+		values[4] = prefix->evicted;
+		values[5] = prefix->expired;
+
+		// names are owned by the prefix, only the values are freed
+		for( j = 0; j < GB_ACCOUNTING_STATS; ++j, ++elems ){
+			ll_append( server->m_keys, prefix->names[j] );
+			ll_append( server->m_values, gbCreateVolatileItem( (void *)(long)values[j], sizeof(long), GB_ENC_NUMBER ) );
+		}
+	}
+
+	ret = gbClientEnqueueKeyValueSet( client, elems, gbWriteReplyHandler, 0 );
+
+	ll_foreach( server->m_values, vi ){
+		if( vi->data != NULL ){
+			gbDestroyVolatileItem( vi->data );
+			vi->data = NULL;
+		}
+	}
+
+	ll_reset( server->m_keys );
+	ll_reset( server->m_values );
+
+	return ret;
+}
+
+/*
+ * Set what the client can handle, the flags this server doesn't know are
+ * dropped and the accepted ones are replied.
+ */
+static int gbQueryCapsHandler( gbClient *client, byte_t *p ){
+	byte_t *v = NULL;
+	size_t vlen = 0;
+	long caps = 0;
+
+	if( gbParseKeyValue( client->server, p, client->buffer_size - sizeof(short), &v, NULL, &vlen, NULL ) && gbQueryParseLong( v, vlen, &caps ) ){
+		client->caps = caps & GB_CAP_ALL;
+		caps		 = client->caps;
+
+		return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&caps, sizeof(long), gbWriteReplyHandler, 0 );
+	}
+	else
+		return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
+}
+
 static int gbQuerySizeOfHandler( gbClient *client, byte_t *p ){
 	byte_t *k = NULL;
 	size_t klen = 0;
@@ -971,12 +1375,12 @@ static int gbQuerySizeOfHandler( gbClient *client, byte_t *p ){
 
 	if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &k, NULL, &klen, NULL ) ){
 		node = at_find_node( &server->tree, k, klen );
-		if(node){
-			item = node->marker;
+		if( node && ( item = node->marker ) && gbIsItemStillValid( item, server, k, klen, 1 ) ){
 			item->last_access_time = server->stats.time;
 			
-			if( gbIsNodeStillValid( node, node->marker, server, 1 ) )
-				return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&item->size, sizeof(size_t), gbWriteReplyHandler, 0 );
+			size_t size = gbItemStoredSize( item );
+
+			return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&size, sizeof(size_t), gbWriteReplyHandler, 0 );
 		}
 		else
 			return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
@@ -989,29 +1393,26 @@ static int gbQueryMultiSizeOfHandler( gbClient *client, byte_t *p ){
 	byte_t *expr = NULL;
 	size_t exprlen = 0, msize = 0;
 	gbServer *server = client->server;
+	at_iterator_t *it = &server->m_iterator;
+	anode_t *node = NULL;
 	gbItem *item = NULL;
 
 	if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &expr, NULL, &exprlen, NULL ) ){
-		size_t found = at_search( &server->tree, expr, exprlen, server->limits.maxkeysize, &server->m_keys, &server->m_values );
-		if( found ){
-			ll_foreach_2( server->m_keys, server->m_values, ki, vi ){
-				item = vi->data;
-				item->last_access_time = server->stats.time;
-				
-				if( gbIsItemStillValid( item, server, ki->data, strlen(ki->data), 1 ) ){
-					msize += item->size;
-				}
+		size_t matched = 0;
 
-				// free allocated key
-				zfree( ki->data );
-				ki->data = NULL;
-			}
+		at_iterator_seek( it, &server->tree, expr, exprlen );
+		while( ( node = at_iterator_next( it ) ) ){
+			item = node->marker;
+			++matched;
 
-			ll_reset( server->m_keys );
-			ll_reset( server->m_values );
+			if( gbIsIteratorItemStillValid( it, item, server ) ){
+				item->last_access_time = server->stats.time;
+				msize += gbItemStoredSize( item );
+			}
+		}
 
+		if( matched )
 			return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&msize, sizeof(size_t), gbWriteReplyHandler, 0 );
-		}
 		else
 			return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
 	}
@@ -1019,6 +1420,324 @@ static int gbQueryMultiSizeOfHandler( gbClient *client, byte_t *p ){
 		return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
+/*
+ * Entry of a batch request, OP_BGET sends a list of
+ *
+ * 	[ uint32 klen ][ key ]
+ *
+ * and OP_BSET one of
+ *
+ * 	[ int32 ttl ][ uint32 klen ][ uint32 vlen ][ key ][ value ]
+ *
+ * Entries are executed in key order, so neighbouring tree paths are visited
+ * one after the other, and with the same key in request order.
+ */
+typedef struct
+{
+	byte_t *key;
+	size_t	klen;
+	byte_t *value;
+	size_t	vlen;
+	int32_t ttl;
+	size_t	index;
+}
+gbBatchEntry;
+
+/*
+ * Parse the entry at 'p', returning the position of the next one or NULL if
+ * it is malformed.
+ */
+static byte_t *gbParseBatchEntry( gbServer *server, short op, byte_t *p, byte_t *end, gbBatchEntry *entry ){
+	uint32_t klen = 0, vlen = 0;
+	int32_t ttl = 0;
+
+	if( op == OP_BSET ){
+		if( (size_t)( end - p ) < sizeof(int32_t) + 2 * sizeof(uint32_t) )
+			return NULL;
+
+		memcpy( &ttl,  p, sizeof(int32_t) );  p += sizeof(int32_t);
+		memcpy( &klen, p, sizeof(uint32_t) ); p += sizeof(uint32_t);
+		memcpy( &vlen, p, sizeof(uint32_t) ); p += sizeof(uint32_t);
+
+		if( vlen == 0 || vlen > server->limits.maxvaluesize )
+			return NULL;
+	}
+	else {
+		if( (size_t)( end - p ) < sizeof(uint32_t) )
+			return NULL;
+
+		memcpy( &klen, p, sizeof(uint32_t) ); p += sizeof(uint32_t);
+	}
+
+	if( klen == 0 || klen > server->limits.maxkeysize || (size_t)( end - p ) < (size_t)klen + vlen )
+		return NULL;
+
+	entry->key	 = p;
+	entry->klen	 = klen;
+	entry->value = p + klen;
+	entry->vlen	 = vlen;
+	entry->ttl	 = ttl;
+
+	return p + klen + vlen;
+}
+
+static int gbBatchEntryCompare( const void *a, const void *b ){
+	const gbBatchEntry *ea = a, *eb = b;
+	int cmp = memcmp( ea->key, eb->key, min( ea->klen, eb->klen ) );
+
+	if( cmp == 0 )
+		cmp = ea->klen == eb->klen ? 0 : ( ea->klen < eb->klen ? -1 : 1 );
+
+	if( cmp == 0 )
+		cmp = ea->index < eb->index ? -1 : 1;
+
+	return cmp;
+}
+
+/*
+ * Parse the whole batch and sort the entries owned by this shard, returns
+ * NULL if the request is malformed.
+ */
+static gbBatchEntry *gbParseBatch( gbClient *client, short op, byte_t *p, size_t *n ){
+	gbServer *server = client->server;
+	byte_t *end = client->buffer + client->buffer_size;
+	gbBatchEntry entry, *entries = NULL;
+	byte_t *q = p;
+	size_t count = 0;
+
+	while( q < end ){
+		if( ( q = gbParseBatchEntry( server, op, q, end, &entry ) ) == NULL )
+			return NULL;
+
+		++count;
+	}
+
+	if( count == 0 )
+		return NULL;
+
+	entries = zmalloc( sizeof(gbBatchEntry) * count );
+	count	= 0;
+
+	for( q = p; q < end; ){
+		q = gbParseBatchEntry( server, op, q, end, &entry );
+
+		// sent to every shard, each one executes the keys it owns
+		if( server->nshards > 1 && gbShardOf( server, entry.key, entry.klen ) != server->shard )
+			continue;
+
+		entry.index		 = count;
+		entries[count++] = entry;
+	}
+
+	qsort( entries, count, sizeof(gbBatchEntry), gbBatchEntryCompare );
+
+	*n = count;
+
+	return entries;
+}
+
+static int gbQueryBatchGetHandler( gbClient *client, byte_t *p ){
+	gbServer *server = client->server;
+	gbClientStream *reply = NULL;
+	gbBatchEntry *entries = NULL, *e = NULL;
+	anode_t *node = NULL;
+	gbItem *item = NULL;
+	size_t i, n = 0;
+
+	if( ( entries = gbParseBatch( client, OP_BGET, p, &n ) ) == NULL )
+		return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
+
+	for( i = 0; i < n; ++i ){
+		e = &entries[i];
+
+		// every key is replied once
+		if( i > 0 && e->klen == entries[i - 1].klen && memcmp( e->key, entries[i - 1].key, e->klen ) == 0 )
+			continue;
+
+		node = at_find_node( &server->tree, e->key, e->klen );
+		if( node && ( item = node->marker ) && gbIsItemStillValid( item, server, e->key, e->klen, 1 ) ){
+			item->last_access_time = server->stats.time;
+
+			if( item->prefix )
+				++gbAccountingOfItem( server, item )->hits;
+
+			// the big pairs are serialized while the reply is being written
+			if( reply == NULL )
+				reply = gbClientStreamCreate( client );
+
+			gbClientStreamAppend( reply, e->key, e->klen, item );
+		}
+		else
+			gbAccountMiss( server, e->key, e->klen );
+	}
+
+	zfree( entries );
+
+	if( reply )
+		return gbClientEnqueueStream( client, reply, gbWriteReplyHandler, 0 );
+
+	else
+		return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
+}
+
+static int gbQueryBatchSetHandler( gbClient *client, byte_t *p ){
+	gbServer *server = client->server;
+	gbBatchEntry *entries = NULL, *e = NULL;
+	gbItem *item = NULL;
+	size_t i, n = 0, set = 0, locked = 0;
+
+	if( gbHasFreeMemory( server ) == 0 )
+		return gbClientEnqueueCode( client, REPL_ERR_MEM, gbWriteReplyHandler, 0 );
+
+	// nothing is set if any of the entries is malformed
+	else if( ( entries = gbParseBatch( client, OP_BSET, p, &n ) ) == NULL )
+		return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
+
+	for( i = 0; i < n; ++i ){
+		e	 = &entries[i];
+		item = at_find( &server->tree, e->key, e->klen );
+
+		if( item && gbItemIsLocked( item, server, 0 ) ){
+			++locked;
+			continue;
+		}
+
+		item = gbSingleSet( e->value, e->vlen, e->key, e->klen, server );
+		if( e->ttl > 0 ){
+			item->time = server->stats.time;
+			item->ttl  = min( server->limits.maxitemttl, e->ttl );
+
+			gbScheduleItem( server, item, e->key, e->klen );
+		}
+
+		++set;
+	}
+
+	zfree( entries );
+
+	if( set || locked == 0 )
+		return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&set, sizeof(size_t), gbWriteReplyHandler, 0 );
+
+	else
+		return gbClientEnqueueCode( client, REPL_ERR_LOCKED, gbWriteReplyHandler, 0 );
+}
+
+/*
+ * Paginated prefix scans, OP_PMGET and OP_PMDEL send
+ *
+ * 	[ uint32 limit ][ uint32 plen ][ prefix ][ cursor ]
+ *
+ * where the cursor, the rest of the request, is the last key of the
+ * previous page or nothing for the first one. At most 'limit' keys after
+ * the cursor are visited, expired and locked ones included, so the work
+ * of a page is bounded whatever its content.
+ *
+ * The pairs of the page are replied in key order, the deleted ones for
+ * OP_PMDEL, followed by a pair with an empty key and the next cursor as
+ * its value if the scan is not over.
+ */
+static int gbParsePage( gbServer *server, byte_t *p, size_t size, uint32_t *limit, byte_t **prefix, size_t *plen, byte_t **cursor, size_t *clen ){
+	uint32_t len = 0;
+
+	if( size < 2 * sizeof(uint32_t) )
+		return 0;
+
+	memcpy( limit, p, sizeof(uint32_t) ); p += sizeof(uint32_t);
+	memcpy( &len,  p, sizeof(uint32_t) ); p += sizeof(uint32_t);
+
+	size -= 2 * sizeof(uint32_t);
+
+	if( *limit == 0 || len > server->limits.maxkeysize || len > size || size - len > server->limits.maxkeysize )
+		return 0;
+
+	*prefix = p;
+	*plen	= len;
+	*cursor = p + len;
+	*clen	= size - len;
+
+	return 1;
+}
+
+// the cursor pair, owned by the reply only
+static gbItem *gbCreateCursorItem( byte_t *key, size_t klen ){
+	gbItem *item = ( gbItem * )zslab_alloc( sizeof( gbItem ) + klen );
+
+	memcpy( item->value, key, klen );
+
+	item->data 	   = NULL;
+	item->size 	   = klen;
+	item->encoding = GB_ENC_INLINE;
+	item->time	   =
+	item->last_access_time = 0;
+	item->ttl	   = -1;
+	item->lock	   = 0;
+	item->expiration = NULL;
+	item->refs	   = 0;
+	item->prefix   = 0;
+	item->treemem  = 0;
+
+	return item;
+}
+
+static int gbQueryPageHandler( gbClient *client, byte_t *p, short op ){
+	gbServer *server = client->server;
+	at_iterator_t *it = &server->m_iterator;
+	gbClientStream *reply = NULL;
+	anode_t *node = NULL;
+	gbItem *item = NULL, *cursor = NULL;
+	byte_t *prefix = NULL, *after = NULL;
+	size_t plen = 0, alen = 0, visited = 0;
+	uint32_t limit = 0;
+
+	if( gbParsePage( server, p, client->buffer_size - sizeof(short), &limit, &prefix, &plen, &after, &alen ) == 0 )
+		return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
+
+	reply = gbClientStreamCreate( client );
+
+	at_iterator_seek_after( it, &server->tree, prefix, plen, after, alen );
+	while( visited < limit && ( node = at_iterator_next( it ) ) ){
+		item = node->marker;
+		++visited;
+
+		if( op == OP_PMDEL && gbItemIsLocked( item, server, 0 ) )
+			continue;
+
+		else if( gbIsIteratorItemStillValid( it, item, server ) ){
+			item->last_access_time = server->stats.time;
+
+			// the stream copies small values and keeps the big ones alive until written
+			gbClientStreamAppend( reply, it->key, it->klen, item );
+
+			if( op == OP_PMDEL ){
+				at_iterator_remove( it );
+				gbDestroyItem( server, item );
+			}
+		}
+	}
+
+	// the page is full, look ahead for one more key
+	if( visited == limit ){
+		cursor = gbCreateCursorItem( it->key, it->klen );
+
+		if( at_iterator_next( it ) ){
+			gbClientStreamAppend( reply, cursor->value, 0, cursor );
+
+			// the iteration won't reclaim the nodes it emptied, let the cron do it
+			if( it->removed )
+				server->compacting = 1;
+		}
+		else
+			zslab_free( cursor, sizeof( gbItem ) + cursor->size );
+	}
+
+	if( reply->elements )
+		return gbClientEnqueueStream( client, reply, gbWriteReplyHandler, 0 );
+
+	zfree( reply );
+
+	return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
+}
+
 static int gbQueryEncOfHandler( gbClient *client, byte_t *p ){
 	byte_t *k = NULL;
 	size_t klen = 0;
@@ -1028,89 +1747,387 @@ static int gbQueryEncOfHandler( gbClient *client, byte_t *p ){
 
 	if( gbParseKeyValue( server, p, client->buffer_size - sizeof(short), &k, NULL, &klen, NULL ) ){
 		node = at_find_node( &server->tree, k, klen );
-		if( node ){
-			item = node->marker;
+		if( node && ( item = node->marker ) && gbIsItemStillValid( item, server, k, klen, 1 ) ){
+			gbItemEncoding encoding = gbItemPublicEncoding( item );
+
 			item->last_access_time = server->stats.time; 
 			
-			if( gbIsNodeStillValid( node, node->marker, server, 1 ) ){
-				return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&item->encoding, sizeof(gbItemEncoding), gbWriteReplyHandler, 0 );
-			}
-			else
-				return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
+			return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&encoding, sizeof(gbItemEncoding), gbWriteReplyHandler, 0 );
 		}
+		else
+			return gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
 	}
 	else
 		return gbClientEnqueueCode( client, REPL_ERR, gbWriteReplyHandler, 0 );
 }
 
-int gbProcessQuery( gbClient *client ) {
+static int gbQueryIncHandler( gbClient *client, byte_t *p ){
+	return gbQueryIncDecHandler( client, p, +1 );
+}
+
+static int gbQueryDecHandler( gbClient *client, byte_t *p ){
+	return gbQueryIncDecHandler( client, p, -1 );
+}
+
+static int gbQueryMultiIncHandler( gbClient *client, byte_t *p ){
+	return gbQueryMultiIncDecHandler( client, p, +1 );
+}
 
+static int gbQueryMultiDecHandler( gbClient *client, byte_t *p ){
+	return gbQueryMultiIncDecHandler( client, p, -1 );
+}
+
+static int gbQueryPageGetHandler( gbClient *client, byte_t *p ){
+	return gbQueryPageHandler( client, p, OP_PMGET );
+}
+
+static int gbQueryPageDelHandler( gbClient *client, byte_t *p ){
+	return gbQueryPageHandler( client, p, OP_PMDEL );
+}
+
+static int gbQueryPingHandler( gbClient *client, byte_t *p ){
+	return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 0 );
+}
+
+static int gbQueryEndHandler( gbClient *client, byte_t *p ){
+	return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 1 );
+}
+
+// layout of the arguments of each opcode, see gbQueryKey
+#define GB_ARGS_NONE	0	// no key
+#define GB_ARGS_KEY		1	// key[ value]
+#define GB_ARGS_TTL_KEY	2	// ttl key value
+#define GB_ARGS_PREFIX	3	// prefix[ value]
+#define GB_ARGS_BATCH	4	// entries, see gbParseBatchEntry
+#define GB_ARGS_PAGE	5	// limit, prefix and cursor, see gbParsePage
+
+typedef struct
+{
+	int	 (*handler)( gbClient *client, byte_t *p );
+	byte_t args;
+	// 1 if every shard executes it
+	byte_t everyshard;
+}
+gbQueryOp;
+
+// opcodes go up to OP_END, the ones without a handler are unknown
+#define GB_QUERY_OPS ( OP_END + 1 )
+
+static const gbQueryOp gbQueryOps[GB_QUERY_OPS] = {
+	[OP_SET]	 = { gbQuerySetHandler,			  GB_ARGS_TTL_KEY, 0 },
+	[OP_TTL]	 = { gbQueryTtlHandler,			  GB_ARGS_KEY,	   0 },
+	[OP_GET]	 = { gbQueryGetHandler,			  GB_ARGS_KEY,	   0 },
+	[OP_DEL]	 = { gbQueryDelHandler,			  GB_ARGS_KEY,	   0 },
+	[OP_INC]	 = { gbQueryIncHandler,			  GB_ARGS_KEY,	   0 },
+	[OP_DEC]	 = { gbQueryDecHandler,			  GB_ARGS_KEY,	   0 },
+	[OP_LOCK]	 = { gbQueryLockHandler,		  GB_ARGS_KEY,	   0 },
+	[OP_UNLOCK]	 = { gbQueryUnlockHandler,		  GB_ARGS_KEY,	   0 },
+	[OP_MSET]	 = { gbQueryMultiSetHandler,	  GB_ARGS_PREFIX,  0 },
+	[OP_MTTL]	 = { gbQueryMultiTtlHandler,	  GB_ARGS_PREFIX,  0 },
+	[OP_MGET]	 = { gbQueryMultiGetHandler,	  GB_ARGS_PREFIX,  0 },
+	[OP_MDEL]	 = { gbQueryMultiDelHandler,	  GB_ARGS_PREFIX,  0 },
+	[OP_MINC]	 = { gbQueryMultiIncHandler,	  GB_ARGS_PREFIX,  0 },
+	[OP_MDEC]	 = { gbQueryMultiDecHandler,	  GB_ARGS_PREFIX,  0 },
+	[OP_MLOCK]	 = { gbQueryMultiLockHandler,	  GB_ARGS_PREFIX,  0 },
+	[OP_MUNLOCK] = { gbQueryMultiUnlockHandler,	  GB_ARGS_PREFIX,  0 },
+	[OP_COUNT]	 = { gbQueryCountHandler,		  GB_ARGS_PREFIX,  0 },
+	[OP_STATS]	 = { gbQueryStatsHandler,		  GB_ARGS_NONE,	   0 },
+	[OP_PING]	 = { gbQueryPingHandler,		  GB_ARGS_NONE,	   0 },
+	[OP_SIZEOF]	 = { gbQuerySizeOfHandler,		  GB_ARGS_KEY,	   0 },
+	[OP_MSIZEOF] = { gbQueryMultiSizeOfHandler,	  GB_ARGS_PREFIX,  0 },
+	[OP_ENCOF]	 = { gbQueryEncOfHandler,		  GB_ARGS_KEY,	   0 },
+	[OP_CAPS]	 = { gbQueryCapsHandler,		  GB_ARGS_NONE,	   0 },
+	[OP_BGET]	 = { gbQueryBatchGetHandler,	  GB_ARGS_BATCH,   0 },
+	[OP_BSET]	 = { gbQueryBatchSetHandler,	  GB_ARGS_BATCH,   0 },
+	[OP_PMGET]	 = { gbQueryPageGetHandler,		  GB_ARGS_PAGE,	   0 },
+	[OP_PMDEL]	 = { gbQueryPageDelHandler,		  GB_ARGS_PAGE,	   0 },
+	// keys of the tracked prefixes may be on every shard
+	[OP_PSTATS]	 = { gbQueryPrefixStatsHandler,	  GB_ARGS_NONE,	   1 },
+	[OP_END]	 = { gbQueryEndHandler,			  GB_ARGS_NONE,	   0 }
+};
+
+// the descriptor of a known opcode, negative ones included, NULL otherwise
+#define gbQueryOpOf( op ) ( (unsigned short)(op) < GB_QUERY_OPS && gbQueryOps[ (unsigned short)(op) ].handler ? &gbQueryOps[ (unsigned short)(op) ] : NULL )
+
+static int gbExecuteQuery( gbClient *client ) {
+	short op = *(short *)&client->buffer[0];
+	const gbQueryOp *query = gbQueryOpOf( op );
+	int ret;
+
+	if( query == NULL )
+		return GB_ERR;
+
+	// other shards could be reading the tree, see epoch.h
+	else if( op == OP_GET )
+		return query->handler( client, client->buffer + sizeof(short) );
+
+	gbEpochWriteBegin( client->server );
+
+	ret = query->handler( client, client->buffer + sizeof(short) );
+
+	gbEpochWriteEnd( client->server );
+
+	return ret;
+}
+
+// what the key parsed by gbQueryKey is
+#define GB_QUERY_NONE	0
+#define GB_QUERY_KEY	1
+#define GB_QUERY_PREFIX 2
+#define GB_QUERY_BATCH	3
+
+/*
+ * Parse the key of the request, its prefix for the multi ones, or the key
+ * of the first entry of a batch. Requests without a key and malformed ones
+ * return GB_QUERY_NONE.
+ */
+static int gbQueryKey( gbClient *client, byte_t **k, size_t *klen ){
+	gbServer *server = client->server;
 	short  op = *(short *)&client->buffer[0];
-	byte_t *p =  client->buffer + sizeof(short);
+	const gbQueryOp *query = gbQueryOpOf( op );
+	byte_t *p =  client->buffer + sizeof(short),
+		   *ttl = NULL;
+	size_t size = client->buffer_size - sizeof(short),
+		   ttllen = 0;
+
+	if( query == NULL )
+		return GB_QUERY_NONE;
+
+	switch( query->args ){
+		case GB_ARGS_TTL_KEY:
+			if( gbParseTtlKeyValue( server, p, size, &ttl, k, NULL, &ttllen, klen, NULL ) )
+				return GB_QUERY_KEY;
+		break;
+
+		case GB_ARGS_KEY:
+			if( gbParseKey( server, p, size, k, klen ) )
+				return GB_QUERY_KEY;
+		break;
+
+		case GB_ARGS_PREFIX:
+			if( gbParseKey( server, p, size, k, klen ) )
+				return GB_QUERY_PREFIX;
+		break;
+
+		case GB_ARGS_BATCH:
+		{
+			gbBatchEntry entry;
 
-	if( op == OP_GET ){
-		return gbQueryGetHandler( client, p );
-	}
-	else if( op == OP_SET ){
-		return gbQuerySetHandler( client, p );
-	}
-	else if( op == OP_TTL ){
-		return gbQueryTtlHandler( client, p );
-	}
-	else if( op == OP_MSET ){
-		return gbQueryMultiSetHandler( client, p );
-	}
-	else if( op == OP_MTTL ){
-		return gbQueryMultiTtlHandler( client, p );
-	}
-	else if( op == OP_MGET ){
-		return gbQueryMultiGetHandler( client, p );
-	}
-	else if( op == OP_DEL ){
-		return gbQueryDelHandler( client, p );
-	}
-	else if( op == OP_MDEL ){
-		return gbQueryMultiDelHandler( client, p );
-	}
-	else if( op == OP_INC || op == OP_DEC ){
-		return gbQueryIncDecHandler( client, p, op == OP_INC ? +1 : -1 );
-	}
-	else if( op == OP_MINC || op == OP_MDEC ){
-		return gbQueryMultiIncDecHandler( client, p, op == OP_MINC ? +1 : -1 );
-	}
-	else if( op == OP_LOCK ){
-		return gbQueryLockHandler( client, p );
-	}
-	else if( op == OP_MLOCK ){
-		return gbQueryMultiLockHandler( client, p );
-	}
-	else if( op == OP_UNLOCK ){
-		return gbQueryUnlockHandler( client, p );
-	}
-	else if( op == OP_MUNLOCK ){
-		return gbQueryMultiUnlockHandler( client, p );
-	}
-	else if( op == OP_COUNT ){
-		return gbQueryCountHandler( client, p );
-	}
-	else if( op == OP_STATS ){
-		return gbQueryStatsHandler( client, p );
+			if( gbParseBatchEntry( server, op, p, p + size, &entry ) ){
+				*k	  = entry.key;
+				*klen = entry.klen;
+
+				return GB_QUERY_BATCH;
+			}
+		}
+		break;
+
+		case GB_ARGS_PAGE:
+		{
+			uint32_t limit;
+			byte_t *cursor;
+			size_t clen;
+
+			if( gbParsePage( server, p, size, &limit, k, klen, &cursor, &clen ) )
+				return GB_QUERY_PREFIX;
+		}
+		break;
 	}
-	else if( op == OP_PING ){
-		return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 0 );
+
+	return GB_QUERY_NONE;
+}
+
+/*
+ * Shard executing the request: the one owning its key, the one owning its
+ * prefix if long enough to choose a single shard, GB_SHARD_ALL otherwise.
+ * Requests without a key and malformed ones are executed here.
+ */
+static int gbQueryShard( gbClient *client ){
+	gbServer *server = client->server;
+	short  op = *(short *)&client->buffer[0];
+	const gbQueryOp *query = gbQueryOpOf( op );
+	byte_t *k = NULL;
+	size_t klen = 0;
+
+	if( query && query->everyshard )
+		return GB_SHARD_ALL;
+
+	switch( gbQueryKey( client, &k, &klen ) ){
+		case GB_QUERY_KEY:
+			return gbShardOf( server, k, klen );
+
+		case GB_QUERY_PREFIX:
+			return klen >= server->shardprefix ? gbShardOf( server, k, klen ) : GB_SHARD_ALL;
+
+		// a single shard if it owns every key, otherwise every shard
+		// executes the keys it owns
+		case GB_QUERY_BATCH:
+		{
+			gbBatchEntry entry;
+			byte_t *p	= client->buffer + sizeof(short),
+				   *end = client->buffer + client->buffer_size;
+			int shard = GB_SHARD_ALL, owner;
+
+			while( p < end ){
+				if( ( p = gbParseBatchEntry( server, op, p, end, &entry ) ) == NULL )
+					return server->shard;
+
+				owner = gbShardOf( server, entry.key, entry.klen );
+				if( shard == GB_SHARD_ALL )
+					shard = owner;
+
+				else if( shard != owner )
+					return GB_SHARD_ALL;
+			}
+
+			return shard;
+		}
 	}
-	else if( op == OP_SIZEOF ){
-		return gbQuerySizeOfHandler( client, p );
+
+	return server->shard;
+}
+
+// attempts to read a version of the tree not being changed before giving up
+#define SHARED_READ_RETRIES 16
+
+// what gbQuerySharedGet found
+#define SHARED_READ_FORWARD  0
+#define SHARED_READ_HIT		 1
+#define SHARED_READ_MISS	 2
+
+/*
+ * Serve a GET for a key of another shard from its tree while its thread
+ * could be changing it: the node and the item are used only once checked
+ * against the version of the tree, the value is copied before checking it
+ * again. Values which can't be sent as they are, compressed ones the client
+ * can't handle and the ones big enough to be sent without copying them,
+ * are left to the owner, as well as the reads of a tree which keeps changing
+ * and the removal of expired items.
+ *
+ * Returns 0 if the request has to be forwarded, otherwise 1 and the result
+ * of the reply in 'ret'.
+ */
+static int gbQuerySharedGet( gbClient *client, gbServer *owner, int *ret ){
+	gbServer *server = client->server;
+	byte_t value[GBNET_ZERO_COPY_SIZE];
+	byte_t *k = NULL, *data = NULL;
+	size_t klen = 0;
+	unsigned long version;
+	gbItemEncoding encoding = GB_ENC_PLAIN;
+	gbItem *item = NULL, copy;
+	int tries, found = SHARED_READ_FORWARD;
+
+	// malformed requests get their error from the owner
+	if( gbParseKey( server, client->buffer + sizeof(short), client->buffer_size - sizeof(short), &k, &klen ) == 0 )
+		return 0;
+
+	gbEpochEnter( server );
+
+	for( tries = 0; tries < SHARED_READ_RETRIES && found == SHARED_READ_FORWARD; ++tries ){
+		if( ( version = gbEpochVersion( owner ) ) & 1 )
+			continue;
+
+		item = at_find_shared( &owner->tree, k, klen, &owner->epoch->version, version );
+		if( item == AT_RETRY )
+			continue;
+
+		else if( item == NULL ){
+			found = SHARED_READ_MISS;
+			break;
+		}
+
+		memcpy( &copy, item, sizeof(gbItem) );
+		if( gbEpochChanged( owner, version ) )
+			continue;
+
+		if( copy.ttl > 0 && server->stats.time - copy.time >= copy.ttl ){
+			found = SHARED_READ_MISS;
+			break;
+		}
+		else if( copy.encoding == GB_ENC_NUMBER ){
+			encoding = GB_ENC_NUMBER;
+			memcpy( value, &copy.data, sizeof(long) );
+		}
+		else if( copy.size >= GBNET_ZERO_COPY_SIZE || ( gbItemIsCompressed( &copy ) && gbItemPassthrough( &copy, client->caps ) == 0 ) )
+			break;
+
+		else {
+			encoding = gbItemPublicEncoding( &copy );
+			data	 = copy.encoding == GB_ENC_INLINE ? item->value : copy.data;
+
+			memcpy( value, data, copy.size );
+		}
+
+		if( gbEpochChanged( owner, version ) == 0 ){
+			// racing with the owner doing the same is harmless
+			item->last_access_time = server->stats.time;
+			found = SHARED_READ_HIT;
+		}
 	}
-	else if( op == OP_MSIZEOF ){
-		return gbQueryMultiSizeOfHandler( client, p );
+
+	gbEpochExit( server );
+
+	if( found == SHARED_READ_FORWARD )
+		return 0;
+
+	++server->stats.nsharedreads;
+
+	if( found == SHARED_READ_HIT ){
+		if( copy.prefix )
+			++gbAccountingOfItem( server, &copy )->hits;
+
+		*ret = gbClientEnqueueData( client, REPL_VAL, encoding, value, copy.size, gbWriteReplyHandler, 0 );
 	}
-	else if( op == OP_ENCOF ){
-		return gbQueryEncOfHandler( client, p );
+	else {
+		gbAccountMiss( server, k, klen );
+
+		*ret = gbClientEnqueueCode( client, REPL_ERR_NOT_FOUND, gbWriteReplyHandler, 0 );
 	}
-	else if( op == OP_END ){
-		return gbClientEnqueueCode( client, REPL_OK, gbWriteReplyHandler, 1 );
+
+	return 1;
+}
+
+int gbProcessQuery( gbClient *client ) {
+	gbServer *server = client->server;
+	gbMetrics *metrics = server->metrics;
+	short op = *(short *)&client->buffer[0];
+	unsigned long long start = 0, elapsed, replied = client->replied;
+	byte_t *k = NULL;
+	size_t klen = 0;
+	int shard, ret, timed;
+
+	// proxies execute what the other shards already routed here
+	if( server->nshards > 1 && client->proxy == 0 ){
+		shard = gbQueryShard( client );
+
+		// GETs can be served from the tree of the shard without forwarding them
+		if( shard != server->shard && ( op != OP_GET || server->epoch == NULL ) )
+			return gbShardForward( client, shard );
 	}
 	else
-		return GB_ERR;
+		shard = server->shard;
+
+	if( ( timed = gbMetricsTimed( metrics, op ) ) )
+		start = gbMetricsClock();
+
+	if( shard == server->shard )
+		ret = gbExecuteQuery( client );
+
+	else if( gbQuerySharedGet( client, server->shards[shard], &ret ) == 0 )
+		return gbShardForward( client, shard );
+
+	gbMetricsCount( metrics, op, sizeof(int) + client->buffer_size, client->replied - replied );
+
+	if( timed ){
+		elapsed = gbMetricsClock() - start;
+
+		gbMetricsRecord( server, op, elapsed );
+
+		if( elapsed >= metrics->slowthreshold ){
+			gbQueryKey( client, &k, &klen );
+			gbMetricsSlowlog( server, op, elapsed, k, klen );
+		}
+	}
+
+	return ret;
 }
@@ -57,6 +57,17 @@
 #define OP_SIZEOF  20
 #define OP_MSIZEOF 21
 #define OP_ENCOF   22
+// capabilities of the client, the value is a bitmask of GB_CAP_* flags
+#define OP_CAPS    23
+// batch, explicit lists of keys or of ttl/key/value triples with 32 bits
+// lengths, see gbParseBatchEntry
+#define OP_BGET    24
+#define OP_BSET    25
+// paginated prefix scans with a resume cursor, see gbParsePage
+#define OP_PMGET   26
+#define OP_PMDEL   27
+// counters of the tracked key prefixes
+#define OP_PSTATS  28
 
 #define OP_END    0xFF
 
@@ -74,6 +85,41 @@
 #define REPL_KVAL		   7
 
 void gbDestroyItem( gbServer *server, gbItem *item );
+/*
+ * Create an item with a copy of the value of 'size' bytes as it was stored
+ * with the given encoding, NULL if this build can't read it.
+ */
+gbItem *gbLoadItem( gbServer *server, byte_t *data, size_t size, gbItemEncoding encoding, int ttl );
+/*
+ * Insert an item in the tree, destroying the one the key had, and account
+ * it to the tracked prefix of the key.
+ */
+void gbInsertItem( gbServer *server, byte_t *key, size_t klen, gbItem *item );
+/*
+ * Drop a reference to the item, freeing it with the last one. Items stay
+ * alive after being removed from the tree until pending replies have sent
+ * their data.
+ */
+void gbReleaseItem( gbServer *server, gbItem *item );
+/*
+ * Schedule the item with the given key for expiration according to its
+ * time and TTL, or unschedule it if it has no TTL anymore.
+ */
+void gbScheduleItem( gbServer *server, gbItem *item, byte_t *key, size_t klen );
+/*
+ * Evict the least recently used items, among random samples, until
+ * 'target' bytes are freed or the monotonic 'deadline' is reached.
+ *
+ * Returns the number of bytes freed.
+ */
+size_t gbEvictItems( gbServer *server, size_t target, long long deadline );
+/*
+ * Compress the plain values not accessed in the last 'compressage' seconds,
+ * resuming the pass in progress until the monotonic 'deadline' is reached.
+ *
+ * Returns 1 once the whole tree was scanned.
+ */
+int gbCompressItems( gbServer *server, long long deadline );
 int  gbProcessQuery( gbClient *client );
 
 #endif
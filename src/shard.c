@@ -0,0 +1,568 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "shard.h"
+#include "query.h"
+#include "epoch.h"
+#include "log.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+extern void gbWriteReplyHandler( gbEventLoop *el, int fd, void *privdata, int mask );
+extern int  gbClientProcessInput( gbClient *client );
+
+// size of the opcode, encoding and length of a serialized reply
+#define GB_SHARD_REPLY_HEADER ( sizeof(short) + sizeof(gbItemEncoding) + sizeof(size_t) )
+
+#define gbShardReplyData( job ) ( (job)->reply + GB_SHARD_REPLY_HEADER )
+#define gbShardReplySize( job ) ( (job)->rsize - GB_SHARD_REPLY_HEADER )
+
+static void gbShardInboxHandler( gbEventLoop *el, int fd, void *privdata, int mask );
+
+void gbShardsCreate( gbServer *server ){
+	gbServer *shard = NULL;
+	int i;
+
+	server->shards = zcalloc( server->nshards * sizeof(gbServer *) );
+
+	for( i = 0; i < server->nshards; ++i ){
+		if( i == 0 )
+			shard = server;
+		else {
+			shard = zmalloc( sizeof(gbServer) );
+			memcpy( shard, server, sizeof(gbServer) );
+		}
+
+		shard->shard = i;
+		shard->inbox = NULL;
+		shard->proxy = NULL;
+		shard->epoch = NULL;
+
+		if( server->sharedreads )
+			gbEpochCreate( shard );
+
+		if( pipe( shard->wakeup ) == -1 ){
+			gbLog( ERROR, "Error creating the inbox of shard %d : %s", i, strerror(errno) );
+			exit(1);
+		}
+
+		gbNetNonBlock( NULL, shard->wakeup[0] );
+		gbNetNonBlock( NULL, shard->wakeup[1] );
+
+		server->shards[i] = shard;
+	}
+}
+
+int gbShardInit( gbServer *server ){
+	server->proxy = gbClientCreateProxy( server );
+
+	if( gbCreateFileEvent( server->events, server->wakeup[0], GB_READABLE, gbShardInboxHandler, server ) == GB_ERR )
+		return GB_ERR;
+
+	// the tree is loaded, the other shards can read it
+	gbEpochOpen( server );
+
+	return GB_OK;
+}
+
+void gbShardDestroy( gbServer *server ){
+	gbDeleteFileEvent( server->events, server->wakeup[0], GB_READABLE );
+
+	if( server->proxy ){
+		gbClientDestroy( server->proxy );
+		server->proxy = NULL;
+	}
+}
+
+void gbShardsFree( gbServer *server ){
+	gbServer *shard = NULL;
+	gbShardJob *job = NULL;
+	int i;
+
+	for( i = 0; i < server->nshards; ++i ){
+		shard = server->shards[i];
+
+		close( shard->wakeup[0] );
+		close( shard->wakeup[1] );
+
+		// calls still around are gone with the process, just drop their replies
+		for( job = shard->inbox; job; job = job->next ){
+			if( job->reply )
+				free( job->reply );
+		}
+
+		gbEpochDestroy( shard );
+
+		if( i > 0 )
+			zfree( shard );
+	}
+
+	zfree( server->shards );
+	server->shards = NULL;
+}
+
+/*
+ * FNV-1a of the first shard_prefix bytes of the key, so every key starting
+ * with a given prefix of that size lives in the same shard.
+ */
+int gbShardOf( gbServer *server, byte_t *key, size_t klen ){
+	unsigned int hash = 2166136261U;
+	size_t i, n = klen < server->shardprefix ? klen : server->shardprefix;
+
+	for( i = 0; i < n; ++i ){
+		hash ^= key[i];
+		hash *= 16777619U;
+	}
+
+	return hash % server->nshards;
+}
+
+/*
+ * Push the job on the inbox of the shard, the shard takes the whole inbox at
+ * once so it has to be woken up only by the first job.
+ */
+static void gbShardPost( gbServer *shard, gbShardJob *job ){
+	gbShardJob *head = __atomic_load_n( &shard->inbox, __ATOMIC_RELAXED );
+	byte_t wakeup = 0x00;
+
+	do {
+		job->next = head;
+	}
+	while( !__atomic_compare_exchange_n( &shard->inbox, &head, job, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED ) );
+
+	if( head == NULL && write( shard->wakeup[1], &wakeup, 1 ) == -1 && errno != EAGAIN )
+		gbLog( WARNING, "Error waking up shard %d : %s", shard->shard, strerror(errno) );
+}
+
+/*
+ * Execute the request of the job on the shard proxy client and keep a copy
+ * of its reply for the origin.
+ */
+static void gbShardExecute( gbServer *server, gbShardJob *job ){
+	gbClient *proxy = server->proxy;
+
+	proxy->buffer	   = job->call->request;
+	proxy->buffer_size = job->call->size;
+	proxy->caps		   = job->call->caps;
+
+	job->status = gbProcessQuery( proxy );
+
+	// not accounted, it's freed by the origin thread
+	if( job->status == GB_OK && ( job->reply = malloc( proxy->output.size ) ) ){
+		memcpy( job->reply, proxy->output.data, proxy->output.size );
+
+		job->rsize = proxy->output.size;
+	}
+
+	gbClientReset( proxy );
+}
+
+static short gbShardReplyCode( gbShardJob *job ){
+	short code = REPL_ERR_MEM;
+
+	if( job->reply )
+		memcpy( &code, job->reply, sizeof(short) );
+
+	return code;
+}
+
+// a serialized pair of a REPL_KVAL reply
+typedef struct
+{
+	byte_t *data;
+	size_t	size;
+	byte_t *key;
+	size_t	klen;
+	byte_t *value;
+	size_t	vlen;
+}
+gbShardPair;
+
+static byte_t *gbShardParsePair( byte_t *p, gbShardPair *pair ){
+	pair->data = p;
+
+	memcpy( &pair->klen, p, sizeof(size_t) );
+	pair->key = p + sizeof(size_t);
+
+	memcpy( &pair->vlen, pair->key + pair->klen + sizeof(gbItemEncoding), sizeof(size_t) );
+	pair->value = pair->key + pair->klen + sizeof(gbItemEncoding) + sizeof(size_t);
+
+	pair->size = pair->value + pair->vlen - p;
+
+	return p + pair->size;
+}
+
+static int gbShardCompareBytes( byte_t *a, size_t alen, byte_t *b, size_t blen ){
+	int cmp = memcmp( a, b, alen < blen ? alen : blen );
+
+	if( cmp == 0 )
+		cmp = alen == blen ? 0 : ( alen < blen ? -1 : 1 );
+
+	return cmp;
+}
+
+static int gbShardPairCompare( const void *a, const void *b ){
+	const gbShardPair *pa = a, *pb = b;
+
+	return gbShardCompareBytes( pa->key, pa->klen, pb->key, pb->klen );
+}
+
+/*
+ * Merge the pages of every shard in key order, resuming from the smallest
+ * of their cursors, the pairs of OP_PMGET after it are left to the next
+ * page so none is skipped or repeated, the ones of OP_PMDEL are already
+ * deleted and all replied.
+ */
+static int gbShardPageReply( gbClient *client, gbShardCall *call ){
+	gbShardJob *job = NULL;
+	gbShardPair *pairs = NULL, pair;
+	size_t elements = 0, n = 0, bytes = 0, i, j, count, clen = 0, empty = 0;
+	byte_t *payload = NULL, *p = NULL, *cursor = NULL;
+	gbItemEncoding encoding = GB_ENC_PLAIN;
+	uint32_t limit = 0;
+	int ret, cut = 0;
+
+	memcpy( &limit, call->request + sizeof(short), sizeof(uint32_t) );
+
+	for( i = 0; i < call->nparts; ++i ){
+		job = &call->parts[i];
+
+		if( gbShardReplyCode( job ) == REPL_KVAL ){
+			memcpy( &count, gbShardReplyData( job ), sizeof(size_t) );
+			elements += count;
+		}
+	}
+
+	pairs = zmalloc( sizeof(gbShardPair) * elements );
+
+	for( i = 0; i < call->nparts; ++i ){
+		job = &call->parts[i];
+
+		if( gbShardReplyCode( job ) != REPL_KVAL )
+			continue;
+
+		memcpy( &count, gbShardReplyData( job ), sizeof(size_t) );
+		p = gbShardReplyData( job ) + sizeof(size_t);
+
+		for( j = 0; j < count; ++j ){
+			p = gbShardParsePair( p, &pair );
+
+			if( pair.klen )
+				pairs[n++] = pair;
+
+			else if( cut == 0 || gbShardCompareBytes( pair.value, pair.vlen, cursor, clen ) < 0 ){
+				cursor = pair.value;
+				clen   = pair.vlen;
+				cut	   = 1;
+			}
+		}
+	}
+
+	qsort( pairs, n, sizeof(gbShardPair), gbShardPairCompare );
+
+	if( call->op == OP_PMGET ){
+		while( cut && n && gbShardCompareBytes( pairs[n - 1].key, pairs[n - 1].klen, cursor, clen ) > 0 )
+			--n;
+
+		// the shards that are done could still fill more than a page
+		if( n > limit ){
+			n	   = limit;
+			cursor = pairs[n - 1].key;
+			clen   = pairs[n - 1].klen;
+			cut	   = 1;
+		}
+	}
+
+	for( i = 0; i < n; ++i ){
+		bytes += pairs[i].size;
+	}
+
+	elements = n + cut;
+	bytes	+= cut ? 2 * sizeof(size_t) + sizeof(gbItemEncoding) + clen : 0;
+	payload	 = p = zmalloc( sizeof(size_t) + bytes );
+
+	memcpy( p, &elements, sizeof(size_t) );
+	p += sizeof(size_t);
+
+	for( i = 0; i < n; ++i ){
+		memcpy( p, pairs[i].data, pairs[i].size );
+		p += pairs[i].size;
+	}
+
+	if( cut ){
+		memcpy( p, &empty, sizeof(size_t) );				p += sizeof(size_t);
+		memcpy( p, &encoding, sizeof(gbItemEncoding) );	p += sizeof(gbItemEncoding);
+		memcpy( p, &clen, sizeof(size_t) );				p += sizeof(size_t);
+		memcpy( p, cursor, clen );
+	}
+
+	ret = gbClientEnqueueData( client, REPL_KVAL, GB_ENC_PLAIN, payload, sizeof(size_t) + bytes, gbWriteReplyHandler, 0 );
+
+	zfree( payload );
+	zfree( pairs );
+
+	return ret;
+}
+
+/*
+ * Sum up the counters of OP_PSTATS, every shard tracks the same prefixes
+ * so their pairs come in the same order.
+ */
+static int gbShardStatsReply( gbClient *client, gbShardCall *call ){
+	gbShardJob *job = NULL, *first = NULL;
+	gbShardPair pair, other;
+	gbItemEncoding encoding;
+	size_t count = 0, j;
+	byte_t *payload = NULL, *p = NULL, *q = NULL;
+	long value, add;
+	int i, ret;
+
+	for( i = 0; i < call->nparts; ++i ){
+		job = &call->parts[i];
+
+		if( gbShardReplyCode( job ) != REPL_KVAL )
+			continue;
+
+		else if( first == NULL ){
+			first	= job;
+			payload = zmalloc( gbShardReplySize( job ) );
+
+			memcpy( payload, gbShardReplyData( job ), gbShardReplySize( job ) );
+			memcpy( &count, payload, sizeof(size_t) );
+		}
+		else if( gbShardReplySize( job ) == gbShardReplySize( first ) ){
+			p = payload + sizeof(size_t);
+			q = gbShardReplyData( job ) + sizeof(size_t);
+
+			for( j = 0; j < count; ++j ){
+				p = gbShardParsePair( p, &pair );
+				q = gbShardParsePair( q, &other );
+
+				memcpy( &encoding, pair.key + pair.klen, sizeof(gbItemEncoding) );
+
+				if( encoding == GB_ENC_NUMBER && pair.vlen == sizeof(long) && other.vlen == sizeof(long) ){
+					memcpy( &value, pair.value, sizeof(long) );
+					memcpy( &add, other.value, sizeof(long) );
+
+					value += add;
+					memcpy( pair.value, &value, sizeof(long) );
+				}
+			}
+		}
+	}
+
+	ret = gbClientEnqueueData( client, REPL_KVAL, GB_ENC_PLAIN, payload, gbShardReplySize( first ), gbWriteReplyHandler, 0 );
+
+	zfree( payload );
+
+	return ret;
+}
+
+/*
+ * Enqueue the replies of every part as a single one: values are summed up,
+ * pairs are joined together, otherwise the first error other than
+ * REPL_ERR_NOT_FOUND is sent.
+ */
+static int gbShardReply( gbClient *client, gbShardCall *call ){
+	gbShardJob *job = NULL;
+	short code = 0, fallback = REPL_ERR_NOT_FOUND;
+	size_t value = 0, sum = 0, elements = 0, bytes = 0, nvalues = 0;
+	byte_t *payload = NULL, *p = NULL;
+	int i, ret;
+
+	for( i = 0; i < call->nparts; ++i ){
+		if( call->parts[i].status != GB_OK )
+			return GB_ERR;
+	}
+
+	// a single shard replied, send it as it is
+	if( call->nparts == 1 ){
+		job = &call->parts[0];
+
+		if( job->reply )
+			return gbClientEnqueueReply( client, job->reply, job->rsize, gbWriteReplyHandler, 0 );
+		else
+			return gbClientEnqueueCode( client, REPL_ERR_MEM, gbWriteReplyHandler, 0 );
+	}
+
+	for( i = 0; i < call->nparts; ++i ){
+		job  = &call->parts[i];
+		code = gbShardReplyCode( job );
+
+		if( code == REPL_VAL || code == REPL_KVAL ){
+			// number of pairs of the REPL_KVAL replies
+			memcpy( &value, gbShardReplyData( job ), sizeof(size_t) );
+
+			if( code == REPL_KVAL ){
+				elements += value;
+				bytes	 += gbShardReplySize( job ) - sizeof(size_t);
+			}
+			else
+				sum += value;
+
+			++nvalues;
+		}
+		else if( fallback == REPL_ERR_NOT_FOUND )
+			fallback = code;
+	}
+
+	if( nvalues == 0 )
+		return gbClientEnqueueCode( client, fallback, gbWriteReplyHandler, 0 );
+
+	else if( call->op == OP_PMGET || call->op == OP_PMDEL )
+		return gbShardPageReply( client, call );
+
+	else if( call->op == OP_PSTATS )
+		return gbShardStatsReply( client, call );
+
+	else if( call->op == OP_MGET || call->op == OP_BGET ){
+		payload = p = zmalloc( sizeof(size_t) + bytes );
+
+		memcpy( p, &elements, sizeof(size_t) );
+		p += sizeof(size_t);
+
+		for( i = 0; i < call->nparts; ++i ){
+			job = &call->parts[i];
+
+			if( gbShardReplyCode( job ) == REPL_KVAL ){
+				memcpy( p, gbShardReplyData( job ) + sizeof(size_t), gbShardReplySize( job ) - sizeof(size_t) );
+				p += gbShardReplySize( job ) - sizeof(size_t);
+			}
+		}
+
+		ret = gbClientEnqueueData( client, REPL_KVAL, GB_ENC_PLAIN, payload, sizeof(size_t) + bytes, gbWriteReplyHandler, 0 );
+
+		zfree( payload );
+
+		return ret;
+	}
+	else
+		return gbClientEnqueueData( client, REPL_VAL, GB_ENC_NUMBER, (byte_t *)&sum, sizeof(size_t), gbWriteReplyHandler, 0 );
+}
+
+/*
+ * Every part is back, reply and go on with the next requests of the client.
+ */
+static void gbShardComplete( gbShardCall *call ){
+	gbClient *client = call->client;
+	int i, status = GB_OK;
+
+	if( client ){
+		client->call = NULL;
+		status = gbShardReply( client, call );
+	}
+
+	for( i = 0; i < call->nparts; ++i ){
+		if( call->parts[i].reply )
+			free( call->parts[i].reply );
+	}
+
+	zfree( call );
+
+	if( client ){
+		if( status != GB_OK ){
+			gbLog( WARNING, "Malformed query, dropping client." );
+			gbClientDestroy( client );
+		}
+		else
+			gbClientProcessInput( client );
+	}
+}
+
+int gbShardForward( gbClient *client, int shard ){
+	gbServer *server = client->server;
+	int i, nparts = shard == GB_SHARD_ALL ? server->nshards : 1;
+	gbShardCall *call = zmalloc( sizeof(gbShardCall) + nparts * sizeof(gbShardJob) + client->buffer_size );
+	gbShardJob *job = NULL;
+
+	call->client  = client;
+	call->op	  = *(short *)&client->buffer[0];
+	call->request = (byte_t *)&call->parts[nparts];
+	call->size	  = client->buffer_size;
+	call->caps	  = client->caps;
+	call->pending = 0;
+	call->nparts  = nparts;
+
+	memcpy( call->request, client->buffer, client->buffer_size );
+
+	client->call = call;
+
+	for( i = 0; i < nparts; ++i ){
+		job = &call->parts[i];
+
+		job->call	= call;
+		job->origin = server;
+		job->target = server->shards[ shard == GB_SHARD_ALL ? i : shard ];
+		job->reply	= NULL;
+		job->rsize	= 0;
+		job->status = GB_OK;
+
+		// replies are handled by this thread, so the count can't drop to zero meanwhile
+		if( job->target == server )
+			gbShardExecute( server, job );
+		else {
+			++call->pending;
+			gbShardPost( job->target, job );
+		}
+	}
+
+	return GB_OK;
+}
+
+static void gbShardInboxHandler( gbEventLoop *el, int fd, void *privdata, int mask ){
+	gbServer *server = privdata;
+	gbShardJob *job = NULL, *next = NULL, *jobs = NULL;
+	byte_t drain[64];
+
+	while( read( fd, drain, sizeof(drain) ) > 0 );
+
+	job = __atomic_exchange_n( &server->inbox, NULL, __ATOMIC_ACQUIRE );
+
+	// the last job posted is on top, run them in order
+	for( ; job; job = next ){
+		next	  = job->next;
+		job->next = jobs;
+		jobs	  = job;
+	}
+
+	for( job = jobs; job; job = next ){
+		next = job->next;
+
+		// a part of a call of our clients is back
+		if( job->origin == server ){
+			if( --job->call->pending == 0 )
+				gbShardComplete( job->call );
+		}
+		else {
+			gbShardExecute( server, job );
+			gbShardPost( job->origin, job );
+		}
+	}
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __SHARD_H__
+#define __SHARD_H__
+
+#include "net.h"
+
+/*
+ * With worker_threads > 1 every thread runs its own shard, with its own event
+ * loop, listening socket, clients and tree, and owns the keys whose first
+ * shard_prefix bytes hash to it. A request for a key of another shard is
+ * forwarded to it and executed there, requests on a prefix shorter than
+ * shard_prefix are executed by every shard and their replies are merged.
+ *
+ * Shards never share memory but the requests and the replies they post to
+ * each other, and with shared_reads the trees the GETs of the other shards
+ * read without forwarding them (see epoch.h).
+ */
+
+// the request is executed by every shard
+#define GB_SHARD_ALL -1
+
+/*
+ * Part of a call executed by a single shard, posted to its target and then
+ * back to the origin with the reply.
+ */
+typedef struct gbShardJob
+{
+	struct gbShardJob *next;
+	struct gbShardCall *call;
+	// shard of the client and shard executing the request
+	gbServer *origin;
+	gbServer *target;
+	// serialized reply, NULL if the target ran out of memory
+	byte_t *reply;
+	size_t  rsize;
+	// GB_ERR if the request was malformed
+	int		status;
+}
+gbShardJob;
+
+/*
+ * Request of a client executed by other shards.
+ */
+typedef struct gbShardCall
+{
+	// NULL if the client went away in the meanwhile
+	gbClient *client;
+	short	  op;
+	// copy of the request, the client input is reused meanwhile
+	byte_t	 *request;
+	size_t	  size;
+	// capabilities of the client, the replies are built for them
+	byte_t	  caps;
+	// parts whose reply is not back yet
+	int		  pending;
+	int		  nparts;
+	gbShardJob parts[];
+}
+gbShardCall;
+
+/*
+ * Allocate the other shards of the server as copies of it and their inboxes,
+ * every shard then initializes its own state in its own thread.
+ */
+void gbShardsCreate( gbServer *server );
+/*
+ * Start receiving the jobs of the other shards, to be called by the thread
+ * running the shard.
+ */
+int  gbShardInit( gbServer *server );
+/*
+ * Stop receiving jobs and free the thread local state of the shard.
+ */
+void gbShardDestroy( gbServer *server );
+/*
+ * Free the inboxes and the shards other than the first one, once all the
+ * threads are gone.
+ */
+void gbShardsFree( gbServer *server );
+/*
+ * Shard owning the keys starting with the first klen bytes of key.
+ */
+int  gbShardOf( gbServer *server, byte_t *key, size_t klen );
+/*
+ * Forward the current request of the client to the given shard or to all of
+ * them with GB_SHARD_ALL, no more requests of the client are executed until
+ * the reply is enqueued.
+ */
+int  gbShardForward( gbClient *client, int shard );
+
+#endif
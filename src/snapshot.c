@@ -0,0 +1,564 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "snapshot.h"
+#include "query.h"
+#include "codec.h"
+#include "shard.h"
+#include "log.h"
+
+// size of the writes to the snapshot file, a multiple of the checksum word
+#define GB_SNAPSHOT_BUFFER  65536
+// magic, version, shard, number of shards, shard prefix and time
+#define GB_SNAPSHOT_HEADER  ( 8 + 4 + 4 + 4 + 4 + 8 )
+// the two checksum sums
+#define GB_SNAPSHOT_TRAILER ( 8 + 8 )
+
+typedef struct
+{
+	int		 fd;
+	byte_t	*buffer;
+	size_t	 used;
+	// checksum of the data written so far
+	uint64_t sum1;
+	uint64_t sum2;
+	// errno of the first failed write, 0 if none
+	int		 error;
+}
+gbSnapshotWriter;
+
+typedef struct
+{
+	byte_t *p;
+	byte_t *end;
+}
+gbSnapshotReader;
+
+/*
+ * Two running sums of the data in 32 bits words, the last word zero padded.
+ * Data must be fed in chunks which are a multiple of the word size, but the
+ * last one.
+ */
+static void gbSnapshotChecksum( uint64_t *sum1, uint64_t *sum2, const byte_t *p, size_t n ){
+	uint64_t s1 = *sum1, s2 = *sum2;
+	uint32_t word;
+
+	for( ; n >= sizeof(word); n -= sizeof(word), p += sizeof(word) ){
+		memcpy( &word, p, sizeof(word) );
+		s1 += word;
+		s2 += s1;
+	}
+
+	if( n ){
+		word = 0;
+		memcpy( &word, p, n );
+		s1 += word;
+		s2 += s1;
+	}
+
+	*sum1 = s1;
+	*sum2 = s2;
+}
+
+static void gbSnapshotFileName( gbServer *server, int shard, char *name, size_t size ){
+	if( shard == 0 )
+		snprintf( name, size, "%s", server->snapshotfile );
+	else
+		snprintf( name, size, "%s.%d", server->snapshotfile, shard );
+}
+
+static int gbSnapshotWriteAll( int fd, const byte_t *p, size_t n ){
+	ssize_t wrote;
+
+	while( n ){
+		if( ( wrote = write( fd, p, n ) ) < 0 ){
+			if( errno == EINTR )
+				continue;
+
+			return errno;
+		}
+
+		p += wrote;
+		n -= wrote;
+	}
+
+	return 0;
+}
+
+static void gbSnapshotFlush( gbSnapshotWriter *w ){
+	if( w->used && w->error == 0 ){
+		gbSnapshotChecksum( &w->sum1, &w->sum2, w->buffer, w->used );
+
+		w->error = gbSnapshotWriteAll( w->fd, w->buffer, w->used );
+	}
+
+	w->used = 0;
+}
+
+static void gbSnapshotPut( gbSnapshotWriter *w, const void *data, size_t n ){
+	const byte_t *p = data;
+	size_t chunk;
+
+	while( n ){
+		chunk = GB_SNAPSHOT_BUFFER - w->used;
+		if( chunk > n )
+			chunk = n;
+
+		memcpy( w->buffer + w->used, p, chunk );
+
+		w->used += chunk;
+		p		+= chunk;
+		n		-= chunk;
+
+		if( w->used == GB_SNAPSHOT_BUFFER )
+			gbSnapshotFlush( w );
+	}
+}
+
+#define gbSnapshotPutField( w, type, value ) do { type __v = (type)(value); gbSnapshotPut( w, &__v, sizeof(type) ); } while(0)
+
+static void gbSnapshotPutItem( gbSnapshotWriter *w, unsigned char *key, size_t klen, gbItem *item ){
+	long num = (long)item->data;
+
+	gbSnapshotPutField( w, uint8_t,  GB_SNAPSHOT_ITEM );
+	gbSnapshotPutField( w, uint8_t,  item->encoding );
+	gbSnapshotPutField( w, int16_t,  item->ttl );
+	gbSnapshotPutField( w, uint32_t, klen );
+	gbSnapshotPutField( w, int64_t,  item->time );
+	gbSnapshotPutField( w, int64_t,  item->last_access_time );
+	gbSnapshotPutField( w, int64_t,  item->lock );
+	gbSnapshotPutField( w, uint64_t, item->encoding == GB_ENC_NUMBER ? sizeof(int64_t) : item->size );
+
+	gbSnapshotPut( w, key, klen );
+
+	if( item->encoding == GB_ENC_NUMBER )
+		gbSnapshotPutField( w, int64_t, num );
+
+	else if( item->encoding == GB_ENC_INLINE )
+		gbSnapshotPut( w, item->value, item->size );
+
+	else
+		gbSnapshotPut( w, item->data, item->size );
+}
+
+/*
+ * Write the tree of the shard to a temporary file and move it over the
+ * snapshot once it's safely on disk. Returns 0 or the errno of the failure.
+ */
+static int gbSnapshotWrite( gbServer *server, const char *filename ){
+	gbSnapshotWriter w;
+	at_iterator_t it;
+	anode_t *node = NULL;
+	gbItem *item = NULL;
+	char tmpname[0xFFF] = {0};
+	uint64_t trailer[2];
+	int i;
+
+	snprintf( tmpname, sizeof(tmpname), "%s.tmp", filename );
+
+	if( ( w.fd = open( tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644 ) ) < 0 )
+		return errno;
+
+	w.buffer = zmalloc( GB_SNAPSHOT_BUFFER );
+	w.used	 = 0;
+	w.sum1	 =
+	w.sum2	 = 0;
+	w.error	 = 0;
+
+	gbSnapshotPut( &w, GB_SNAPSHOT_MAGIC, 8 );
+	gbSnapshotPutField( &w, uint32_t, GB_SNAPSHOT_VERSION );
+	gbSnapshotPutField( &w, uint32_t, server->shard );
+	gbSnapshotPutField( &w, uint32_t, server->nshards );
+	gbSnapshotPutField( &w, uint32_t, server->shardprefix );
+	gbSnapshotPutField( &w, int64_t,  server->stats.time );
+
+	// compressed items can't be read without the dictionaries they used
+	for( i = 0; i < server->codecs->ndicts; ++i ){
+		gbCodecDict *d = &server->codecs->dicts[i];
+
+		gbSnapshotPutField( &w, uint8_t,  GB_SNAPSHOT_DICT );
+		gbSnapshotPutField( &w, uint32_t, d->plen );
+		gbSnapshotPutField( &w, uint32_t, d->size );
+		gbSnapshotPut( &w, d->prefix, d->plen );
+		gbSnapshotPut( &w, d->data, d->size );
+	}
+
+	at_init_iterator( it );
+
+	if( at_iterator_seek( &it, &server->tree, NULL, 0 ) ){
+		while( ( node = at_iterator_next( &it ) ) && w.error == 0 ){
+			item = node->marker;
+
+			// no need to save what is already expired
+			if( item->ttl > 0 && server->stats.time - item->time >= item->ttl )
+				continue;
+
+			gbSnapshotPutItem( &w, it.key, it.klen, item );
+		}
+	}
+
+	at_iterator_free( &it );
+
+	gbSnapshotPutField( &w, uint8_t, GB_SNAPSHOT_END );
+	gbSnapshotFlush( &w );
+
+	trailer[0] = w.sum1;
+	trailer[1] = w.sum2;
+
+	if( w.error == 0 )
+		w.error = gbSnapshotWriteAll( w.fd, (byte_t *)trailer, sizeof(trailer) );
+
+	if( w.error == 0 && fsync( w.fd ) != 0 )
+		w.error = errno;
+
+	close( w.fd );
+	zfree( w.buffer );
+
+	if( w.error == 0 && rename( tmpname, filename ) != 0 )
+		w.error = errno;
+
+	if( w.error )
+		unlink( tmpname );
+
+	return w.error;
+}
+
+int gbSnapshotSave( gbServer *server ){
+	char filename[0xFFF] = {0};
+	pid_t pid;
+
+	if( server->snapshotfile == NULL || server->snapshotpid > 0 )
+		return GB_ERR;
+
+	gbSnapshotFileName( server, server->shard, filename, sizeof(filename) );
+
+	if( ( pid = fork() ) < 0 ){
+		gbLog( WARNING, "Unable to fork the snapshot of shard %d : %s", server->shard, strerror(errno) );
+		return GB_ERR;
+	}
+	/*
+	 * The child only has this thread and a copy of the memory as it was at
+	 * the fork, it must not log nor flush the buffered streams of the parent,
+	 * the result is reported back by the exit status.
+	 */
+	else if( pid == 0 ){
+		signal( SIGTERM, SIG_DFL );
+		signal( SIGINT,  SIG_DFL );
+
+		_exit( gbSnapshotWrite( server, filename ) );
+	}
+
+	gbLog( DEBUG, "Saving the snapshot of shard %d in background with pid %d.", server->shard, pid );
+
+	server->snapshotpid	  = pid;
+	server->snapshotstart = server->stats.time;
+
+	return GB_OK;
+}
+
+void gbSnapshotCron( gbServer *server ){
+	int status = 0;
+
+	if( server->snapshotfile == NULL )
+		return;
+
+	else if( server->snapshotpid > 0 ){
+		if( waitpid( server->snapshotpid, &status, WNOHANG ) != server->snapshotpid )
+			return;
+
+		if( WIFEXITED( status ) && WEXITSTATUS( status ) == 0 ){
+			server->snapshotlast = server->snapshotstart;
+
+			gbLog( INFO, "Snapshot of shard %d saved in %lds.", server->shard, (long)( server->stats.time - server->snapshotstart ) );
+		}
+		else if( WIFEXITED( status ) )
+			gbLog( WARNING, "Snapshot of shard %d failed : %s", server->shard, strerror( WEXITSTATUS( status ) ) );
+
+		else
+			gbLog( WARNING, "Snapshot of shard %d killed by signal %d.", server->shard, WTERMSIG( status ) );
+
+		server->snapshotpid = 0;
+	}
+	else if( server->snapshotperiod > 0 && server->stats.time - server->snapshotstart >= server->snapshotperiod )
+		gbSnapshotSave( server );
+}
+
+void gbSnapshotShutdown( gbServer *server ){
+	char filename[0xFFF] = {0};
+	long long start = gbMonotonicTime();
+	int error;
+
+	if( server->snapshotfile == NULL )
+		return;
+
+	// the tree is saved as it is now anyway
+	if( server->snapshotpid > 0 ){
+		kill( server->snapshotpid, SIGKILL );
+		waitpid( server->snapshotpid, NULL, 0 );
+
+		server->snapshotpid = 0;
+	}
+
+	gbSnapshotFileName( server, server->shard, filename, sizeof(filename) );
+
+	if( ( error = gbSnapshotWrite( server, filename ) ) != 0 )
+		gbLog( ERROR, "Unable to save the snapshot of shard %d to '%s' : %s", server->shard, filename, strerror(error) );
+	else
+		gbLog( INFO, "Saved %d items of shard %d to '%s' in %lldms.", server->stats.nitems, server->shard, filename, ( gbMonotonicTime() - start ) / 1000 );
+}
+
+static byte_t *gbSnapshotGet( gbSnapshotReader *r, size_t n ){
+	byte_t *p = r->p;
+
+	if( (size_t)( r->end - r->p ) < n )
+		return NULL;
+
+	r->p += n;
+
+	return p;
+}
+
+#define gbSnapshotGetField( r, type, dst ) do { \
+		type __v; byte_t *__p = gbSnapshotGet( r, sizeof(type) ); \
+		if( __p == NULL ) goto truncated; \
+		memcpy( &__v, __p, sizeof(type) ); (dst) = __v; \
+	} while(0)
+
+/*
+ * Map the snapshot file, checking its header and its checksum. Returns NULL
+ * if there's no such file or it can't be used.
+ */
+static byte_t *gbSnapshotMap( const char *filename, size_t *size ){
+	struct stat st;
+	byte_t *map = NULL;
+	uint64_t sum1 = 0, sum2 = 0, trailer[2];
+	uint32_t version;
+	int fd;
+
+	if( ( fd = open( filename, O_RDONLY ) ) < 0 ){
+		if( errno != ENOENT )
+			gbLog( WARNING, "Unable to open the snapshot '%s' : %s", filename, strerror(errno) );
+
+		return NULL;
+	}
+
+	if( fstat( fd, &st ) != 0 || st.st_size < GB_SNAPSHOT_HEADER + 1 + GB_SNAPSHOT_TRAILER ){
+		gbLog( WARNING, "Snapshot '%s' is empty or truncated, ignoring it.", filename );
+		close( fd );
+		return NULL;
+	}
+
+	map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+
+	if( map == MAP_FAILED ){
+		gbLog( WARNING, "Unable to map the snapshot '%s' : %s", filename, strerror(errno) );
+		return NULL;
+	}
+
+	// it's read once from start to end
+	madvise( map, st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED );
+
+	*size = st.st_size;
+
+	memcpy( &version, map + 8, sizeof(version) );
+	memcpy( trailer, map + *size - GB_SNAPSHOT_TRAILER, sizeof(trailer) );
+
+	if( memcmp( map, GB_SNAPSHOT_MAGIC, 8 ) != 0 || version != GB_SNAPSHOT_VERSION ){
+		gbLog( WARNING, "'%s' is not a snapshot of this version, ignoring it.", filename );
+		munmap( map, *size );
+		return NULL;
+	}
+
+	gbSnapshotChecksum( &sum1, &sum2, map, *size - GB_SNAPSHOT_TRAILER );
+
+	if( sum1 != trailer[0] || sum2 != trailer[1] ){
+		gbLog( WARNING, "Checksum of the snapshot '%s' doesn't match, ignoring it.", filename );
+		munmap( map, *size );
+		return NULL;
+	}
+
+	return map;
+}
+
+typedef struct
+{
+	unsigned long loaded;
+	unsigned long expired;
+	unsigned long dropped;
+}
+gbSnapshotCounters;
+
+/*
+ * Load the items of a mapped snapshot, only the ones of this shard if
+ * 'filter' is set. Returns GB_ERR if the memory limit was reached.
+ */
+static int gbSnapshotLoadItems( gbServer *server, const char *filename, byte_t *map, size_t size, int filter, gbSnapshotCounters *counters ){
+	gbSnapshotReader r;
+	gbItem *item = NULL;
+	byte_t *key = NULL, *value = NULL, *prefix = NULL;
+	uint8_t type, encoding;
+	int16_t ttl;
+	uint32_t klen, plen;
+	int64_t time, access, lock;
+	uint64_t vlen;
+
+	r.p	  = map + GB_SNAPSHOT_HEADER;
+	r.end = map + size - GB_SNAPSHOT_TRAILER;
+
+	while( 1 ){
+		gbSnapshotGetField( &r, uint8_t, type );
+
+		if( type == GB_SNAPSHOT_END )
+			return GB_OK;
+
+		else if( type == GB_SNAPSHOT_DICT ){
+			gbSnapshotGetField( &r, uint32_t, plen );
+			gbSnapshotGetField( &r, uint32_t, vlen );
+
+			if( ( prefix = gbSnapshotGet( &r, plen ) ) == NULL || ( value = gbSnapshotGet( &r, vlen ) ) == NULL )
+				goto truncated;
+
+			// its items will be dropped
+			if( gbCodecDictLoad( server, prefix, plen, value, vlen ) != GB_OK )
+				gbLog( WARNING, "Unable to load a zstd dictionary from the snapshot '%s'.", filename );
+		}
+		else if( type == GB_SNAPSHOT_ITEM ){
+			gbSnapshotGetField( &r, uint8_t,  encoding );
+			gbSnapshotGetField( &r, int16_t,  ttl );
+			gbSnapshotGetField( &r, uint32_t, klen );
+			gbSnapshotGetField( &r, int64_t,  time );
+			gbSnapshotGetField( &r, int64_t,  access );
+			gbSnapshotGetField( &r, int64_t,  lock );
+			gbSnapshotGetField( &r, uint64_t, vlen );
+
+			if( ( key = gbSnapshotGet( &r, klen ) ) == NULL || ( value = gbSnapshotGet( &r, vlen ) ) == NULL )
+				goto truncated;
+
+			if( filter && gbShardOf( server, key, klen ) != server->shard )
+				continue;
+
+			// expired while the server was down
+			else if( ttl > 0 && server->stats.time - time >= ttl ){
+				++counters->expired;
+				continue;
+			}
+
+			else if( server->stats.memused > server->limits.maxmem ){
+				gbLog( WARNING, "Max memory reached while loading the snapshot '%s', skipping the remaining items.", filename );
+				return GB_ERR;
+			}
+
+			// encoding not supported by this build or its dictionary is missing
+			if( ( item = gbLoadItem( server, value, vlen, encoding, ttl ) ) == NULL ){
+				++counters->dropped;
+				continue;
+			}
+
+			item->time			   = time;
+			item->last_access_time = access;
+			item->lock			   = lock;
+
+			gbInsertItem( server, key, klen, item );
+
+			gbScheduleItem( server, item, key, klen );
+
+			++counters->loaded;
+		}
+		else {
+			gbLog( WARNING, "Unknown record 0x%02X in the snapshot '%s', skipping the remaining items.", type, filename );
+			return GB_OK;
+		}
+	}
+
+truncated:
+
+	gbLog( WARNING, "Snapshot '%s' is truncated, skipping the remaining items.", filename );
+
+	return GB_OK;
+}
+
+int gbSnapshotLoad( gbServer *server ){
+	gbSnapshotCounters counters = { 0, 0, 0 };
+	long long start = gbMonotonicTime();
+	char filename[0xFFF] = {0};
+	byte_t *map = NULL;
+	size_t size = 0;
+	uint32_t nshards, shardprefix;
+	int i, reshard, loaded;
+
+	server->snapshotstart = server->stats.time;
+
+	if( server->snapshotfile == NULL )
+		return GB_OK;
+
+	// the first snapshot tells how many shards saved theirs
+	gbSnapshotFileName( server, 0, filename, sizeof(filename) );
+	if( ( map = gbSnapshotMap( filename, &size ) ) == NULL )
+		return GB_OK;
+
+	memcpy( &nshards,	  map + 16, sizeof(nshards) );
+	memcpy( &shardprefix, map + 20, sizeof(shardprefix) );
+
+	munmap( map, size );
+
+	// keys were routed otherwise, every snapshot can have keys of this shard
+	reshard = nshards != server->nshards || shardprefix != server->shardprefix;
+
+	for( i = 0; i < (int)nshards; ++i ){
+		if( reshard == 0 && i != server->shard )
+			continue;
+
+		gbSnapshotFileName( server, i, filename, sizeof(filename) );
+		if( ( map = gbSnapshotMap( filename, &size ) ) == NULL )
+			continue;
+
+		loaded = gbSnapshotLoadItems( server, filename, map, size, reshard, &counters );
+
+		munmap( map, size );
+
+		// out of memory
+		if( loaded != GB_OK )
+			break;
+	}
+
+	gbLog( INFO, "Loaded %lu items of shard %d from the snapshots in %lldms ( %lu expired, %lu dropped ).",
+		   counters.loaded, server->shard, ( gbMonotonicTime() - start ) / 1000, counters.expired, counters.dropped );
+
+	return GB_OK;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include "net.h"
+
+/*
+ * Every shard saves its tree to its own snapshot file, the configured one for
+ * the first shard and the same name followed by '.<shard>' for the others.
+ * Background snapshots are written by a forked child, which sees the tree as
+ * it was at the fork, the last one is written by the shard itself on
+ * shutdown.
+ *
+ * A snapshot is a sequential file with a header, the zstd dictionaries of the
+ * shard, the items with their encoding, times, TTL and lock, and a trailing
+ * checksum of everything before it.
+ */
+
+#define GB_SNAPSHOT_MAGIC   "GBSNAP\r\n"
+#define GB_SNAPSHOT_VERSION 1
+
+#define GB_SNAPSHOT_END  0x00
+#define GB_SNAPSHOT_DICT 0x01
+#define GB_SNAPSHOT_ITEM 0x02
+
+/*
+ * Fork a child saving the snapshot of the shard, GB_ERR if the fork failed
+ * or a snapshot is already in progress.
+ */
+int  gbSnapshotSave( gbServer *server );
+/*
+ * Called by the cron, reap the child saving the snapshot once it's done
+ * and start a new one every snapshot_period seconds.
+ */
+void gbSnapshotCron( gbServer *server );
+/*
+ * Stop the background snapshot in progress and save the tree of the shard
+ * before it's destroyed.
+ */
+void gbSnapshotShutdown( gbServer *server );
+/*
+ * Load the items of the shard from the snapshots, dropping the expired ones.
+ * If the snapshots were saved with another number of shards every one of
+ * them is read and only the keys of this shard are loaded.
+ */
+int  gbSnapshotLoad( gbServer *server );
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "twheel.h"
+
+#include <string.h>
+
+void tw_init( tw_wheel_t *tw, time_t now ){
+	memset( tw, 0x00, sizeof(tw_wheel_t) );
+
+	tw->time = now;
+}
+
+static void tw_link( tw_wheel_t *tw, tw_entry_t *entry ){
+	time_t delta = entry->expire - tw->time,
+		   expire = entry->expire;
+	tw_entry_t **slot;
+	int level = 0;
+
+	// already due, pop it with the current second
+	if( delta < 0 ){
+		expire = tw->time;
+	}
+	// too far in the future, it will be moved down when the last level turns
+	else if( delta > TW_RANGE ){
+		expire = tw->time + TW_RANGE;
+	}
+
+	delta = expire - tw->time;
+	while( level < TW_LEVELS - 1 && delta >= ( 1L << ( TW_BITS * ( level + 1 ) ) ) ){
+		++level;
+	}
+
+	slot = &tw->slots[level][ ( expire >> ( TW_BITS * level ) ) & TW_MASK ];
+
+	entry->next  = *slot;
+	entry->pprev = slot;
+
+	if( *slot )
+		(*slot)->pprev = &entry->next;
+
+	*slot = entry;
+}
+
+static void tw_unlink( tw_entry_t *entry ){
+	*entry->pprev = entry->next;
+
+	if( entry->next )
+		entry->next->pprev = entry->pprev;
+
+	entry->next  = NULL;
+	entry->pprev = NULL;
+}
+
+void tw_add( tw_wheel_t *tw, tw_entry_t *entry, time_t expire ){
+	tw_del( tw, entry );
+
+	entry->expire = expire;
+
+	tw_link( tw, entry );
+
+	++tw->size;
+}
+
+void tw_del( tw_wheel_t *tw, tw_entry_t *entry ){
+	if( tw_scheduled( entry ) ){
+		tw_unlink( entry );
+
+		--tw->size;
+	}
+}
+
+// Move the entries of the given slot to the lower levels.
+static int tw_cascade( tw_wheel_t *tw, int level ){
+	int i = ( tw->time >> ( TW_BITS * level ) ) & TW_MASK;
+	tw_entry_t *entry = tw->slots[level][i], *next;
+
+	tw->slots[level][i] = NULL;
+
+	for( ; entry; entry = next ){
+		next = entry->next;
+		tw_link( tw, entry );
+	}
+
+	return i;
+}
+
+tw_entry_t *tw_pop( tw_wheel_t *tw, time_t now ){
+	tw_entry_t **slot, *entry;
+	int level;
+
+	while( 1 ){
+		slot = &tw->slots[0][ tw->time & TW_MASK ];
+
+		if( *slot != NULL && tw->time <= now ){
+			entry = *slot;
+
+			tw_del( tw, entry );
+
+			return entry;
+		}
+		else if( tw->time >= now || tw->size == 0 ){
+			// nothing due, just catch up with the clock
+			if( tw->time < now )
+				tw->time = now;
+
+			return NULL;
+		}
+
+		++tw->time;
+
+		// a lower level completed a turn, bring the next slot of the one above down
+		for( level = 1; level < TW_LEVELS && ( tw->time & ( ( 1L << ( TW_BITS * level ) ) - 1 ) ) == 0; ++level ){
+			if( tw_cascade( tw, level ) != 0 )
+				break;
+		}
+	}
+}
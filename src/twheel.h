@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2013, Simone Margaritelli <evilsocket at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Gibson nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __TWHEEL_H__
+#define __TWHEEL_H__
+
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Hierarchical timing wheel with a resolution of one second, every level
+ * has TW_SLOTS slots and each slot of a level spans a whole turn of the
+ * level below it, so TW_LEVELS levels cover TW_SLOTS ^ TW_LEVELS seconds.
+ */
+#define TW_BITS   6
+#define TW_SLOTS  ( 1 << TW_BITS )
+#define TW_MASK   ( TW_SLOTS - 1 )
+#define TW_LEVELS 4
+#define TW_RANGE  ( ( 1L << ( TW_BITS * TW_LEVELS ) ) - 1 )
+
+/*
+ * A timer, to be embedded as the first member of the structure to expire.
+ */
+typedef struct tw_entry {
+	struct tw_entry  *next;
+	// pointer to the slot or entry pointing to this one, NULL if not scheduled
+	struct tw_entry **pprev;
+	// time this entry is due
+	time_t 			  expire;
+}
+tw_entry_t;
+
+#define tw_init_entry( e ) (e)->next   = NULL; \
+						   (e)->pprev  = NULL; \
+						   (e)->expire = 0
+
+#define tw_scheduled( e ) ( (e)->pprev != NULL )
+
+typedef struct {
+	// every entry due before this time was already popped
+	time_t 		time;
+	// number of scheduled entries
+	size_t 		size;
+	tw_entry_t *slots[TW_LEVELS][TW_SLOTS];
+}
+tw_wheel_t;
+
+void tw_init( tw_wheel_t *tw, time_t now );
+/*
+ * Schedule the entry to be popped at 'expire', an entry already
+ * scheduled is moved.
+ */
+void tw_add( tw_wheel_t *tw, tw_entry_t *entry, time_t expire );
+void tw_del( tw_wheel_t *tw, tw_entry_t *entry );
+/*
+ * Unschedule and return an entry which is due at 'now', or NULL if
+ * there are none, in which case the wheel is at 'now'.
+ */
+tw_entry_t *tw_pop( tw_wheel_t *tw, time_t now );
+
+#endif
@@ -147,7 +147,8 @@ size_t zmem_available(){
 	#endif
 }
 
-static size_t used_memory = 0;
+// every shard thread accounts and limits its own memory
+static __thread size_t used_memory = 0;
 
 static void zmalloc_default_oom(size_t size) {
     fprintf(stderr, "zmalloc: Out of memory trying to allocate %zu bytes\n",size);
@@ -237,6 +238,175 @@ void *zmemdup(void *ptr, size_t size){
 	return dup;
 }
 
+typedef struct zslab_page {
+    struct zslab_page *prev;
+    struct zslab_page *next;
+    // list of the chunks freed so far
+    void              *free;
+    // chunks in use
+    unsigned int       used;
+    // chunks never used, taken in order after the freed ones
+    unsigned int       fresh;
+    zslab_class_t     *cls;
+}
+zslab_page_t;
+
+// keep chunks aligned to 16 bytes after the page header
+#define ZSLAB_HEADER_SIZE ( ( sizeof(zslab_page_t) + 15 ) & ~15 )
+// page of a chunk, pages are aligned to their size
+#define zslab_page_of(p) ((zslab_page_t *)((size_t)(p) & ~((size_t)ZSLAB_PAGE_SIZE - 1)))
+#define zslab_chunk(page,i) ((char *)(page) + ZSLAB_HEADER_SIZE + (i) * (page)->cls->size)
+
+// slabs are per thread, chunks must be freed by the thread allocating them
+static __thread zslab_class_t zslab_classes[ZSLAB_CLASSES] = {
+    { 16 }, { 24 }, { 32 }, { 40 }, { 48 }, { 56 }, { 64 }, { 80 },
+    { 96 }, { 112 }, { 128 }, { 160 }, { 192 }, { 224 }, { 256 }
+};
+
+static zslab_class_t *zslab_class_of(size_t size) {
+    int i;
+
+    if (size == 0) size = 1;
+
+    for (i = 0; i < ZSLAB_CLASSES; ++i) {
+        if (size <= zslab_classes[i].size) return zslab_classes + i;
+    }
+
+    return NULL;
+}
+
+static void zslab_unlink(zslab_class_t *cls, zslab_page_t *page) {
+    if (page->prev) page->prev->next = page->next;
+    else cls->partial = page->next;
+
+    if (page->next) page->next->prev = page->prev;
+
+    page->prev = page->next = NULL;
+}
+
+static void zslab_link(zslab_class_t *cls, zslab_page_t *page) {
+    page->prev = NULL;
+    page->next = cls->partial;
+
+    if (page->next) page->next->prev = page;
+
+    cls->partial = page;
+}
+
+void *zslab_alloc(size_t size) {
+    zslab_class_t *cls = zslab_class_of(size);
+    zslab_page_t *page;
+    void *ptr;
+
+    if (cls == NULL) return zmalloc(size);
+
+    page = cls->partial;
+    if (page == NULL) {
+        if (posix_memalign((void **)&page, ZSLAB_PAGE_SIZE, ZSLAB_PAGE_SIZE) != 0) zmalloc_oom_handler(size);
+
+        if (cls->capacity == 0) cls->capacity = (ZSLAB_PAGE_SIZE - ZSLAB_HEADER_SIZE) / cls->size;
+
+        page->free  = NULL;
+        page->used  =
+        page->fresh = 0;
+        page->cls   = cls;
+
+        zslab_link(cls, page);
+
+        ++cls->pages;
+        ++cls->empty;
+    }
+
+    if (page->used == 0) --cls->empty;
+
+    if (page->free) {
+        ptr = page->free;
+        page->free = *(void **)ptr;
+    }
+    else {
+        ptr = zslab_chunk(page, page->fresh++);
+    }
+
+    ++page->used;
+    ++cls->used;
+
+    // full, nothing to take from it until a chunk is freed
+    if (page->used == cls->capacity) zslab_unlink(cls, page);
+
+    zmem_incr_mem(cls->size);
+
+    return ptr;
+}
+
+void zslab_free(void *ptr, size_t size) {
+    zslab_class_t *cls = zslab_class_of(size);
+    zslab_page_t *page;
+
+    if (ptr == NULL) return;
+    else if (cls == NULL) {
+        zfree(ptr);
+        return;
+    }
+
+    page = zslab_page_of(ptr);
+
+    if (page->used == cls->capacity) zslab_link(cls, page);
+
+    *(void **)ptr = page->free;
+    page->free = ptr;
+
+    --page->used;
+    --cls->used;
+
+    zmem_decr_mem(cls->size);
+
+    if (page->used == 0) {
+        // keep a single empty page per class around to avoid trashing
+        if (cls->empty) {
+            zslab_unlink(cls, page);
+            free(page);
+            --cls->pages;
+        }
+        else ++cls->empty;
+    }
+}
+
+void *zslab_memdup(void *ptr, size_t size) {
+    void *dup = zslab_alloc(size);
+
+    memcpy(dup, ptr, size);
+
+    return dup;
+}
+
+size_t zslab_size(void *ptr, size_t size) {
+    zslab_class_t *cls = zslab_class_of(size);
+
+    return cls ? cls->size : zmalloc_size(ptr);
+}
+
+const zslab_class_t *zslab_class(int i) {
+    return i >= 0 && i < ZSLAB_CLASSES ? zslab_classes + i : NULL;
+}
+
+void zslab_release(void) {
+    zslab_page_t *page, *next;
+    int i;
+
+    for (i = 0; i < ZSLAB_CLASSES; ++i) {
+        for (page = zslab_classes[i].partial; page; page = next) {
+            next = page->next;
+
+            if (page->used == 0) {
+                zslab_unlink(zslab_classes + i, page);
+                free(page);
+                --zslab_classes[i].pages;
+                --zslab_classes[i].empty;
+            }
+        }
+    }
+}
+
 void zfree(void *ptr) {
 #ifndef HAVE_MALLOC_SIZE
     void *realptr;
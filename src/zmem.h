@@ -60,6 +60,11 @@ size_t zmem_rss(void);
 // get private dirty memory field
 size_t zmem_private_dirty(void);
 
+#ifndef HAVE_MALLOC_SIZE
+// get the real size of a zmalloc'd pointer
+size_t zmalloc_size(void *ptr);
+#endif
+
 void *zmalloc(size_t size);
 void *zcalloc(size_t size);
 void *zrealloc(void *ptr, size_t size);
@@ -67,4 +72,43 @@ void  zfree(void *ptr);
 void *zmemdup(void *ptr, size_t size);
 char *zstrdup(const char *s);
 
+/*
+ * Slab allocator for small objects, chunks of the same size class are
+ * carved out of ZSLAB_PAGE_SIZE pages without any per allocation header.
+ * Since there's no header the caller has to provide the size of the object
+ * when freeing it, objects bigger than ZSLAB_MAX_SIZE are zmalloc'd.
+ *
+ * Chunks are accounted by zmem_used() with the size of their class.
+ */
+#define ZSLAB_PAGE_SIZE ( 64 * 1024 )
+#define ZSLAB_MAX_SIZE  256
+#define ZSLAB_CLASSES   15
+
+typedef struct
+{
+	// size of the chunks of this class
+	size_t size;
+	// number of chunks per page
+	size_t capacity;
+	// number of pages currently allocated
+	size_t pages;
+	// number of chunks in use
+	size_t used;
+	// number of pages without chunks in use
+	size_t empty;
+	// pages with at least a free chunk
+	void  *partial;
+}
+zslab_class_t;
+
+void  *zslab_alloc(size_t size);
+void   zslab_free(void *ptr, size_t size);
+void  *zslab_memdup(void *ptr, size_t size);
+// get the real size of an object allocated with zslab_alloc(size)
+size_t zslab_size(void *ptr, size_t size);
+// get the statistics of the i-th size class
+const zslab_class_t *zslab_class(int i);
+// free the empty pages kept by the calling thread, before it exits
+void   zslab_release(void);
+
 #endif
@@ -0,0 +1,47 @@
+<?php 
+
+require_once 'testlib.php';
+
+function bset_entry( $key, $value, $ttl = 0 ){
+	return pack( 'VVV', $ttl, strlen($key), strlen($value) ).$key.$value;
+}
+
+function bget_entry( $key ){
+	return pack( 'V', strlen($key) ).$key;
+}
+
+$s = raw_connect();
+
+// the same key twice, the last one wins
+raw_send( $s, raw_query( OP_BSET, bset_entry( "bzz", "1" ).bset_entry( "baa", "2" ).bset_entry( "bmm", "3" ).bset_entry( "bzz", "4" ) ) );
+
+list( $code, $encoding, $data ) = raw_reply( $s );
+$set = unpack( 'Pn', $data );
+
+fail_if( $code != REPL_VAL, "Unexpected BSET reply" );
+fail_if( $set['n'] != 4, "Unexpected BSET count" );
+
+// duplicate and missing keys, the pairs come back once and in key order
+raw_send( $s, raw_query( OP_BGET, bget_entry( "bzz" ).bget_entry( "bnope" ).bget_entry( "baa" ).bget_entry( "bzz" ).bget_entry( "bmm" ) ) );
+
+list( $code, $encoding, $data ) = raw_reply( $s );
+
+fail_if( $code != REPL_KVAL, "Unexpected BGET reply" );
+fail_if( raw_pairs( $data ) != array( array( "baa", "2" ), array( "bmm", "3" ), array( "bzz", "4" ) ), "Unexpected BGET pairs" );
+
+// nothing found
+raw_send( $s, raw_query( OP_BGET, bget_entry( "bnope" ).bget_entry( "bnope" ) ) );
+
+list( $code, $encoding, $data ) = raw_reply( $s );
+
+fail_if( $code != REPL_ERR_NOT_FOUND, "Unexpected BGET reply for missing keys" );
+
+fclose( $s );
+
+$g = new Gibson();
+
+fail_if( $g->pconnect(GIBSON_SOCKET) == FALSE, "Could not connect to test instance" );
+fail_if( $g->get( "bzz" ) != "4", "Unexpected GET reply after BSET" );
+fail_if( $g->mdel( "b" ) == FALSE, "Unexpected MDEL reply" );
+
+?>
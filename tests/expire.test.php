@@ -0,0 +1,17 @@
+<?php 
+
+require_once 'testlib.php';
+
+$g = new Gibson();
+
+fail_if( $g->pconnect(GIBSON_SOCKET) == FALSE, "Could not connect to test instance" );
+fail_if( $g->set( "expire:foo", "bar", 1 ) == FALSE, "Unexpected SET reply" );
+fail_if( $g->set( "expire:bar", "bar" )    == FALSE, "Unexpected SET reply" );
+fail_if( $g->ttl( "expire:bar", 1 )        == FALSE, "Unexpected TTL reply" );
+
+sleep(2);
+
+// nobody accessed the items, so the cron must have removed them
+fail_if( $g->count( "expire:" ) != 0, "Items should be expired by the cron" );
+
+?>
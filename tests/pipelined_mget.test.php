@@ -0,0 +1,38 @@
+<?php
+
+// Regression test: every pipelined MGET reply used to take a 16 bits
+// reference to its items, which wrapped and freed items still in the tree.
+
+require_once 'testlib.php';
+
+$value = str_repeat( 'A', 16 );
+$n	   = 80000;
+
+$g = new Gibson();
+
+fail_if( $g->pconnect(GIBSON_SOCKET) == FALSE, "Could not connect to test instance" );
+fail_if( $g->set( "refs", $value ) == FALSE, "Unexpected SET reply" );
+
+// all the requests first, replies are read only once they're sent
+$s = raw_connect();
+
+raw_send( $s, str_repeat( raw_query( OP_MGET, "refs" ), $n ) );
+
+for( $i = 0; $i < $n; $i++ ){
+	list( $code, $encoding, $data ) = raw_reply( $s );
+
+	fail_if( $code != REPL_KVAL, "Unexpected MGET reply" );
+	fail_if( raw_pairs( $data ) != array( array( "refs", $value ) ), "Unexpected MGET reply" );
+}
+
+fclose( $s );
+
+// a freed item would have its memory reused by these
+for( $i = 0; $i < 50; $i++ )
+	fail_if( $g->set( "refs_other$i", str_repeat( 'B', 16 ) ) == FALSE, "Unexpected SET reply" );
+
+fail_if( $g->get( "refs" ) != $value, "Item freed while still in the tree" );
+
+fail_if( $g->mdel( "refs" ) == FALSE, "Unexpected MDEL reply" );
+
+?>
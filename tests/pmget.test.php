@@ -0,0 +1,103 @@
+<?php 
+
+require_once 'testlib.php';
+
+/*
+ * Page through the prefix 'limit' keys at a time, failing unless the cursor
+ * pair is the last of every page but the final one, returns the keys.
+ */
+function page_keys( $s, $op, $prefix, $limit ){
+	$keys   = array();
+	$cursor = '';
+
+	do {
+		raw_send( $s, raw_query( $op, pack( 'VV', $limit, strlen($prefix) ).$prefix.$cursor ) );
+
+		list( $code, $encoding, $data ) = raw_reply( $s );
+		if( $code == REPL_ERR_NOT_FOUND )
+			break;
+
+		fail_if( $code != REPL_KVAL, "Unexpected page reply" );
+
+		$pairs  = raw_pairs( $data );
+		$cursor = NULL;
+
+		foreach( $pairs as $i => $pair ){
+			if( $pair[0] === '' ){
+				fail_if( $i != count($pairs) - 1, "Cursor should be the last pair of the page" );
+				$cursor = $pair[1];
+			}
+			else
+				$keys[] = $pair[0];
+		}
+	}
+	while( $cursor !== NULL );
+
+	return $keys;
+}
+
+$g = new Gibson();
+$s = raw_connect();
+
+fail_if( $g->pconnect(GIBSON_SOCKET) == FALSE, "Could not connect to test instance" );
+
+$all = array();
+for( $i = 0; $i < 50; $i++ ){
+	$all[] = sprintf( "pg:%03d", $i );
+	fail_if( $g->set( end($all), "v$i" ) == FALSE, "Unexpected SET reply" );
+}
+
+// every key exactly once and in order, whatever the page size, the last
+// page being exactly full with 5 and 10
+foreach( array( 1, 5, 7, 10, 100 ) as $limit )
+	fail_if( page_keys( $s, OP_PMGET, "pg:", $limit ) !== $all, "Unexpected PMGET pages with a limit of $limit" );
+
+// a node with more than 16 children indexes them by byte, resume from the
+// middle of them
+$wide = array();
+foreach( range( 'a', 't' ) as $c ){
+	$wide[] = "pw:$c";
+	fail_if( $g->set( end($wide), $c ) == FALSE, "Unexpected SET reply" );
+}
+
+fail_if( page_keys( $s, OP_PMGET, "pw:", 3 ) !== $wide, "Unexpected PMGET pages under a wide node" );
+
+raw_send( $s, raw_query( OP_PMGET, pack( 'VV', 100, 3 )."pw:pw:c" ) );
+
+list( $code, $encoding, $data ) = raw_reply( $s );
+
+fail_if( $code != REPL_KVAL, "Unexpected PMGET reply" );
+fail_if( array_map( 'current', raw_pairs( $data ) ) !== array_slice( $wide, 3 ), "Unexpected PMGET page after a cursor under a wide node" );
+
+// pages where every key is expired
+for( $i = 0; $i < 10; $i++ )
+	fail_if( $g->set( sprintf( "pe:%03d", $i ), "gone", 1 ) == FALSE, "Unexpected SET reply" );
+
+fail_if( $g->set( "pe:100", "kept" ) == FALSE, "Unexpected SET reply" );
+
+sleep(2);
+
+fail_if( page_keys( $s, OP_PMGET, "pe:", 3 ) !== array( "pe:100" ), "Expired keys should not be paged" );
+
+// locked keys are paged by PMGET but neither deleted nor replied by PMDEL
+$deleted = array();
+for( $i = 0; $i < 20; $i++ ){
+	$k = sprintf( "pd:%03d", $i );
+
+	fail_if( $g->set( $k, "v$i" ) == FALSE, "Unexpected SET reply" );
+	if( $i < 6 || $i % 4 == 0 )
+		fail_if( $g->lock( $k, 10 ) == FALSE, "Unexpected LOCK reply" );
+	else
+		$deleted[] = $k;
+}
+
+fail_if( count( page_keys( $s, OP_PMGET, "pd:", 4 ) ) != 20, "Locked keys should be paged by PMGET" );
+fail_if( page_keys( $s, OP_PMDEL, "pd:", 3 ) !== $deleted, "Unexpected PMDEL pages" );
+fail_if( $g->count( "pd:" ) != 20 - count($deleted), "Locked keys should not be deleted" );
+
+fclose( $s );
+
+fail_if( $g->munlock( "pd:" ) == FALSE, "Unexpected MUNLOCK reply" );
+fail_if( $g->mdel( "p" ) == FALSE, "Unexpected MDEL reply" );
+
+?>
@@ -0,0 +1,24 @@
+<?php 
+
+require_once 'testlib.php';
+
+$g = new Gibson();
+
+fail_if( $g->pconnect(GIBSON_SOCKET) == FALSE, "Could not connect to test instance" );
+
+$stats  = $g->stats();
+$before = $stats['memory_tree'];
+
+for( $i = 0; $i < 1000; $i++ ){
+	fail_if( $g->set( "prune:session:$i:data", "bar" ) == FALSE, "Unexpected SET reply" );
+}
+
+for( $i = 0; $i < 1000; $i++ ){
+	fail_if( $g->del( "prune:session:$i:data" ) == FALSE, "Unexpected DEL reply" );
+}
+
+$stats = $g->stats();
+
+fail_if( $stats['memory_tree'] > $before, "Deleted branches should be pruned from the tree" );
+
+?>
@@ -7,4 +7,9 @@ $g = new Gibson();
 fail_if( $g->pconnect(GIBSON_SOCKET) == FALSE, "Could not connect to test instance" );
 fail_if( is_array( $g->stats() )     == FALSE, "Unexpected STATS reply" );
 
+$stats = $g->stats();
+
+fail_if( !isset($stats['memory_tree']) || !isset($stats['memory_values']), "STATS should report tree and values memory" );
+fail_if( !isset($stats['total_evicted_items']) || !isset($stats['memory_evicted']), "STATS should report evictions" );
+
 ?>
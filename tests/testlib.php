@@ -1,6 +1,17 @@
 <?php 
 
-define( 'GIBSON_SOCKET', realpath( dirname(__FILE__).'/../gibson.sock' ) );
+define( 'GIBSON_SOCKET', realpath( dirname(__FILE__).'/../gibson.sock' ) );
+
+// opcodes and replies the PHP extension doesn't know
+define( 'OP_MGET',   11 );
+define( 'OP_BGET',   24 );
+define( 'OP_BSET',   25 );
+define( 'OP_PMGET',  26 );
+define( 'OP_PMDEL',  27 );
+
+define( 'REPL_ERR_NOT_FOUND', 1 );
+define( 'REPL_VAL',  6 );
+define( 'REPL_KVAL', 7 );
 
 function fail_if( $cond, $mess ){
 	global $g;
@@ -10,4 +21,65 @@ function fail_if( $cond, $mess ){
 }
 
 
+// raw protocol, to pipeline requests and to use the newer opcodes
+function raw_connect(){
+	$s = stream_socket_client( "unix://".GIBSON_SOCKET );
+
+	fail_if( $s == FALSE, "Could not connect to test instance" );
+
+	return $s;
+}
+
+function raw_query( $op, $payload ){
+	return pack( 'V', 2 + strlen($payload) ).pack( 'v', $op ).$payload;
+}
+
+function raw_send( $s, $data ){
+	while( strlen($data) ){
+		$n = fwrite( $s, $data );
+		fail_if( $n === FALSE || $n == 0, "Could not write to test instance" );
+
+		$data = substr( $data, $n );
+	}
+}
+
+function raw_read( $s, $size ){
+	$data = '';
+
+	while( strlen($data) < $size ){
+		$chunk = fread( $s, $size - strlen($data) );
+		fail_if( $chunk === FALSE || $chunk === '', "Could not read from test instance" );
+
+		$data .= $chunk;
+	}
+
+	return $data;
+}
+
+// array( code, encoding, data ) of the next reply
+function raw_reply( $s ){
+	$h = unpack( 'vcode/Cencoding/Psize', raw_read( $s, 11 ) );
+
+	return array( $h['code'], $h['encoding'], $h['size'] ? raw_read( $s, $h['size'] ) : '' );
+}
+
+// pairs of a REPL_KVAL reply in the order they were sent
+function raw_pairs( $data ){
+	$pairs = array();
+	$h = unpack( 'Pcount', substr( $data, 0, 8 ) );
+	$p = 8;
+
+	for( $i = 0; $i < $h['count']; $i++ ){
+		$k = unpack( 'Psize', substr( $data, $p, 8 ) );
+		$key = substr( $data, $p + 8, $k['size'] );
+		$p += 8 + $k['size'] + 1;
+
+		$v = unpack( 'Psize', substr( $data, $p, 8 ) );
+		$pairs[] = array( $key, substr( $data, $p + 8, $v['size'] ) );
+		$p += 8 + $v['size'];
+	}
+
+	return $pairs;
+}
+
 ?>